@@ -15,11 +15,19 @@
    @ref compreg @n
    @ref ifacereg @n
    @ref cmdreg @n
+   @ref regbench @n
    @ref cmdline @n
+   @ref cmd_stats @n
+   @ref cmd_cfg @n
+   @ref cmd_uuid @n
    @ref mcomp @n
    @ref mcomplib @n
+   @ref mbench @n
    @ref scomp @n
+   @ref sockbench @n
+   @ref stallwatch @n
    @ref ccomp @n
+   @ref promcomp @n
    @ref envvars @n
    @ref legal @n
 
@@ -227,6 +235,22 @@
     the work. Also, a help string is provided.
     </p>
 
+    @subsection regbench 2.7 Registry Benchmark
+
+    <p>
+    <i>bench_registry</i> in the <i>bench</i> directory times lookups of
+    instances and interfaces, creation and destruction of instances, and
+    calls through an interface, with 10, 1000 and 100000 instances in the
+    <b>Registry</b>. The registry is linked into the program, so no
+    CompFrame process is needed:
+    </p>
+    @verbatim
+    cd bench
+    ./bench_registry --filter=getIface --min-time=0.5
+    @endverbatim
+    <p>
+    The result is the time per operation in nanoseconds.
+    </p>
 
 
     @section cmdline 3 Command Line
@@ -238,6 +262,12 @@
     compframe -d <componentdir> 
              [-c <configuration>] 
              [-t <level>]
+             [-p <backend>]
+             [-w <num>]
+             [-b <us>]
+             [-a <cpu>]
+             [-s <ms> [-B]]
+             [-P]
     @endverbatim
     
     <p><b>-d</b> is used to point out the directory where the component 
@@ -249,6 +279,43 @@
     <p>
     <b>-t</b> is used to specify trace level (0-3)
       </p>
+    <p>
+    <b>-p</b> is used to select how sockets are polled: <i>uring</i>
+    (io_uring), <i>epoll</i> or <i>poll</i>. By default the first one
+    that works on the running kernel is used, in that order.
+    </p>
+    <p>
+    <b>-w</b> is used to start worker threads, that components made actors
+    with ISchedulerServer::addActor() can run on. Actors only talk to each
+    other with messages posted through ISchedulerServer::post(). Without
+    it, all actors run in the main loop.
+    </p>
+    <p>
+    <b>-b</b> turns on busy polling for latency critical use. After
+    something has happened, the sockets are polled without timeout for the
+    given number of microseconds before the main loop blocks in the kernel
+    again, and sockets get SO_BUSY_POLL where the kernel allows it. Use it
+    with <b>-a</b>, that pins the main loop to a CPU core. The command
+    <i>s -p</i> shows how often the loop blocked and how late the timers
+    were run, <i>s -z</i> clears it.
+    </p>
+    <p>
+    <b>-s</b> reports main loop stalls longer than the given number of
+    milliseconds, and <b>-B</b> prints the stack of the main loop with
+    them. See @ref stallwatch.
+    </p>
+    <p>
+    <b>-P</b> creates the components of the configuration file in
+    parallel, on the threads of E, for components that take long to set
+    up. A component is created when the components it is connected to
+    above it in the file have been, components that are not connected are
+    created at the same time. Then the <i>connect</i> and <i>config</i>
+    commands are run in file order, as without <b>-P</b>. A component that
+    needs another one when it is set up must be connected to it. Set up
+    functions may use the registry, S, C, M and the metrics, but must not
+    wait for tasks of E. Sockets and timers must be added from the main
+    loop, e.g. on the first execution, as Prom does.
+    </p>
     
     @subsection cmd_create 3.1 create
     
@@ -321,6 +388,66 @@
       Shows the help text for the create command.
     </p>
 
+    @subsection cmd_stats 3.5 stats
+
+    <p>
+       Prints the metrics of all instances, or of one. S, M and the
+       socket polling keep theirs from start, and a component adds its
+       own with cf_metric_add() (compframe_metrics.h). Counters and
+       histograms are kept per thread, so updating them costs about as
+       much as incrementing a variable.
+    </p>
+
+    @verbatim
+    CompFrame 0.4.0 (c)2007 Peter R. Torpman
+    >> stats S
+    Instance   Metric           Labels                           Value
+    S          actor_msgs                                        0
+    S          execute_ns       client="M"                       n=10 mean=935 p50=463 p99=2057 max=2057
+    S          loop_turns                                        10
+    @endverbatim
+
+    <p>
+      Histograms, such as the time each component spends in execute(),
+      are shown as number of samples, mean, median, 99th percentile and
+      highest value.
+    </p>
+
+    @subsection cmd_cfg 3.6 cfg
+
+    <p>
+       Compiles a configuration file. The compiled form holds the commands already split into
+       arguments, and is written next to the file with <i>.bin</i>
+       added, or to the name given:
+    </p>
+
+    @verbatim
+    >> cfg -c big.cfg
+    *** INFO # Compiled big.cfg to big.cfg.bin.
+    @endverbatim
+
+    <p>
+      When CompFrame is started with <i>-f big.cfg</i> and
+      <i>big.cfg.bin</i> was compiled from it as it is now (same size and
+      modification time), the compiled one is run instead. A compiled
+      file can also be given directly. It is only meant for the host that
+      made it. Text configurations are read through mmap() and split in
+      place, so neither form copies the lines.
+    </p>
+
+    @subsection cmd_uuid 3.7 uuid
+
+    <p>
+       Prints new random (version 4) UUIDs, e.g. for the ID of a new
+       interface:
+    </p>
+
+    @verbatim
+    >> uuid 2
+    6f1c0a4e-2d7b-4c55-8e0a-93b1d47f2c68
+    0d9e8b13-57a2-4f6e-b1c4-2a7e5f903d1b
+    @endverbatim
+
    @section scomp 4 S - Scheduler
    
    <p>
@@ -389,6 +516,68 @@
      If we do not set <i>sliceRemain</i> to zero, we will get the remainder
      of the slice, plus the ordinary time slice, when we are called upon again.
    </p>
+   <p>
+     By default a component is executed once per time slice (10 ms). With
+     <i>setTick</i> it can choose another rate, every turn of the loop
+     (<i>CF_S_TICK_EVERY_TURN</i>), or no ticks at all
+     (<i>CF_S_TICK_NONE</i>). A component without ticks is only executed
+     when <i>signal</i> is called for it, e.g. from a socket callback or a
+     timer. When no component is due, <b>S</b> sleeps until a socket, a
+     timer or a mailbox wakes it up, so an idle CompFrame uses no CPU.
+   </p>
+   @verbatim
+   sIface->add(this);
+   sIface->setTick(this, CF_S_TICK_NONE);
+   ::
+   // In a socket callback
+   sIface->signal(this);
+   @endverbatim
+
+   @subsection sockbench 4.1 Socket Polling Benchmark
+
+   <p>
+     Sockets and timers are polled by <i>cf_sockets_poll</i> in the main
+     loop. <i>bench_sockets</i> in the <i>bench</i> directory registers
+     eventfds (or socketpairs with <i>-s</i>), makes a part of them
+     readable in each turn, and reports the time in
+     <i>cf_sockets_poll</i> per callback. It also reports the time to
+     deregister and register a descriptor again. Each backend is run in
+     a process of its own:
+   </p>
+   @verbatim
+   cd bench
+   ./bench_sockets -p uring,epoll,poll -n 100,1000,10000,50000 -r 1,10,100
+   @endverbatim
+   <p>
+     <i>-n</i> is the number of registered descriptors and <i>-r</i> the
+     percent of them that are readable per turn. Many descriptors may
+     need a higher <i>ulimit -n</i>.
+   </p>
+
+   @subsection stallwatch 4.2 Stall Watchdog
+
+   <p>
+     Everything in the main loop shares one thread, so a component that
+     blocks or computes for long delays all others. With <i>-s</i> a
+     watchdog thread looks at the main loop four times per threshold. The
+     loop tells what it is doing, an execution, a socket or timer
+     callback, or a delivery to an actor, with a few stores to memory.
+     When one of them has taken longer than the threshold, it is reported
+     with the instance and the callback, and again with the total time
+     when it ends:
+   </p>
+   @verbatim
+   compframe -d . -f my.cfg -s 50
+   *** ERROR ... # Main loop stalled for 51 ms in socket callback of m1 (m_handle_socket)!
+   *** ERROR ... # Main loop stall in socket callback of m1 (m_handle_socket) ended after 240 ms.
+   @endverbatim
+   <p>
+     A turn of the loop that takes too long without a single culprit is
+     reported too. Stalls are counted in the metric <i>stalls</i> of
+     <i>watchdog</i>. With <i>-B</i> the main loop is signalled to print
+     its stack when a stall is found. The signal interrupts a blocking
+     system call in the stalled code, so use it for finding the culprit.
+   </p>
 
    @section mcomp 5 M - Message Handler
 
@@ -461,6 +650,30 @@
    >>  m -l
    M server located at hammer:35545
    @endverbatim
+   <p>
+     To see where the time goes between a client and its receiver, M can
+     sample 1 in <i>n</i> received frames with <i>m -s n</i> (0 turns it
+     off). A sampled frame gets timestamps when its first byte is read,
+     when it is complete, and before and after it is handed to the
+     receiver or the control handling. The last 1024 are kept and shown
+     with <i>m -t</i>, in microseconds per hop and with the mean of each.
+     <i>m -z</i> forgets them. Frames that are not sampled cost a counter.
+   </p>
+   @verbatim
+   >>  m -s 100
+   M samples 1 in 100 frames.
+   >>  m -t
+   M samples 1 in 100 frames, 2 of 2 sampled frames kept.
+      Age(ms)  Sock       Chan    Len Kind  Parse(us)  Queue(us)   Exec(us)  Total(us)
+       2402.0     9          7     42    m        0.2        0.1        3.9        4.1
+       1201.3     9          7     42    m        0.1        0.0        3.7        3.8
+         Mean                                     0.1        0.0        3.8        3.9
+   @endverbatim
+   <p>
+     <i>Kind</i> is <i>c</i> for control messages, <i>m</i> for messages
+     to receivers and <i>s</i> for streamed messages. For a streamed
+     message <i>Exec</i> lasts until the last chunk is handed over.
+   </p>
    
    <b>Connections and Channels</b>
    <p>
@@ -468,7 +681,10 @@
     definition, a connection is a socket connection between a CompFrame 
     internal component and an external entity. And, a channel is a logical
     path on that connection. <b>M</b> allows for 255 channels for each 
-    connection.
+    connection. A client that selects protocol version 2 (see
+    CF_M_VERSION) gets 32-bit channel numbers and up to 1048576 channels
+    on each connection. Version 3 is version 2 with the interface UUID
+    sent as 16 binary bytes when opening a channel.
    </p>
    <p>
      <b>Protocols</b>
@@ -630,13 +846,104 @@
 
    <p> Coming Soon! </p>
 
+   @section mbench 5.2 M Benchmark
+
+   <p>
+     The <i>bench</i> directory has a load generator for <b>M</b>,
+     <i>bench_m</i>, and a component with an echo receiver for it to talk
+     to, <i>bench_echo.so</i>. <i>run_m.sh</i> starts CompFrame with the
+     echo receiver and runs <i>bench_m</i> against it:
+   </p>
+   @verbatim
+   cd bench
+   ./run_m.sh -c 4 -n 16 -s 256 -r 100000
+   @endverbatim
+   <p>
+     This opens 4 connections with 16 channels each, and sends 100000
+     messages of 256 bytes per second in total. Without <i>-r</i>, every
+     channel keeps <i>-w</i> messages outstanding and sends a new one for
+     each answer. The result is messages per second, MB/s and the 50th,
+     99th and 99.9th percentile of the round trip time. With <i>-r</i>,
+     the round trip time is counted from when a message should have been
+     sent, so a server that falls behind shows up in the latency.
+     Options to CompFrame itself can be given in <i>CF_ARGS</i>.
+   </p>
 
    @section ccomp 6 C - Command Handler
 
    <p> Coming Soon! </p>
 
 
-   @section envvars 7 Environment Variables
+   @section ecomp 7 E - Executor
+
+   <p>
+     <b>E</b> runs CPU heavy work, like compression or parsing, on a pool
+     of threads instead of in the main loop. Each thread has a deque of
+     tasks of its own, and a thread without tasks steals from the others.
+     By default there is one thread per CPU.
+   </p>
+   <p>
+     A task is a <i>CFTask</i> with a <i>run()</i> method. It is submitted
+     through the <i>IExecutor</i> interface, together with the component
+     that wants it back. When the task has run, it is posted to that
+     component, which must be an actor, and its thread gets it as a message.
+   </p>
+   @verbatim
+   IExecutor* e = CFRegistry::instance()->getIface<IExecutor>(
+       CFRegistry::instance()->getCompObject("E"));
+
+   e->submit(new ParseTask(buf, len), this);
+   @endverbatim
+
+   @subsection promcomp 7.1 Prom - Metrics Exporter
+
+   <p>
+     <b>Prom</b> is an optional component that serves the metrics (see
+     @ref cmd_stats) over HTTP, in the Prometheus text format. It also
+     tells how many log lines have been written, and how many could not
+     be. It listens on 127.0.0.1:9464 unless configured otherwise:
+   </p>
+   @verbatim
+   create Prom prom
+   config prom port 9464
+   config prom addr 127.0.0.1
+   config prom max_age 1000
+   @endverbatim
+   <p>
+     A metric is named <i>cf_&lt;instance&gt;_&lt;name&gt;</i>, with
+     <i>_total</i> added to counters. The page is rendered by <b>E</b>, so
+     a scrape never holds up the main loop. A page is served again for
+     <i>max_age</i> milliseconds, so several scrapers share one rendering.
+     Port 0 turns the exporter off.
+   </p>
+
+   @section coro 8 Coroutines
+
+   <p>
+     Components may write their logic as C++20 coroutines (CFCoro.hh)
+     instead of as state machines driven by callbacks. A <i>CFCoro</i>
+     can wait for a socket to become readable (<i>CFReadable</i>), for a
+     while (<i>CFSleep</i>), and for M channels and messages, if the
+     component's IMClient is a <i>CFMCoroClient</i>. Waiting is done in
+     the main loop, which keeps running other components meanwhile.
+   </p>
+   @verbatim
+   CFCoro
+   MyComp::session(CFMChannel ch)
+   {
+       CFMMessage m;
+
+       while ((m = co_await receive(ch)).mLen >= 0) {
+           co_await CFSleep(10);
+           mServer->sendToReceiver(ch.mConn, ch.mChan, m.mLen, m.mMsg);
+       }
+   }
+   @endverbatim
+   <p>
+     Sleeps use the timers of the main loop, see cf_timer_add().
+   </p>
+
+   @section envvars 9 Environment Variables
 
    <b>CF_COMP_DIR</b> - Can be used to point out the directory where 
    components are stored.
@@ -644,7 +951,7 @@
      setenv CF_COMP_DIR dir1:dir2:dir3
    @endverbatim
 
-   @section legal 8 Legal 
+   @section legal 10 Legal 
 
    Permission is granted to copy, distribute and/or modify this document
    under the terms of the GNU Free Documentation License (GFDL), Version 1.1 
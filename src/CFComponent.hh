@@ -18,10 +18,13 @@
    along with this program.  If not, see <http://www.gnu.or/licenses/>.
 */
 #include <string>
+#include <atomic>
 using namespace std;
 
 #include "compframe_types.h"
 
+class CFMailbox;
+
 
 // This class can be used as a base class for any implemented component.
 
@@ -32,15 +35,27 @@ public:
 		@param className     Class name of component
 	*/
 	CFComponent(string className) :
-		mName(className) {
+		mName(className), mMailbox(NULL) {
 	}
 	
 	// Returns the class name
     string getClassName() { return mName; }
+
+	// Returns the mailbox if the component is an actor, else NULL
+    CFMailbox* getMailbox() {
+        return mMailbox.load(memory_order_acquire);
+    }
+
+	// Sets the mailbox (done by S)
+    void setMailbox(CFMailbox* mb) {
+        mMailbox.store(mb, memory_order_release);
+    }
 	
 private:
 	// Component class name
 	string mName;
+	// Mailbox, read by any thread that posts to the component
+	atomic<CFMailbox*> mMailbox;
 };
 
 
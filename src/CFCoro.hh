@@ -0,0 +1,498 @@
+#ifndef CFCORO_HH
+#define CFCORO_HH
+
+/* Copyright (c) 2007-2011  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+#include <coroutine>
+#include <exception>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compframe_types.h"
+#include "compframe_sockets.h"
+#include "IMClient.hh"
+
+/** @addtogroup Interfaces
+ *  These are the public interfaces of CompFrame
+ *  @{
+ */
+
+/** A coroutine started by a component. It runs at once, until its first
+    co_await, and then goes on in the main loop each time what it waits
+    for has happened. The awaiters below live in the frame, so waiting
+    allocates nothing.
+
+    The returned CFCoro owns the frame, and the component keeps it for as
+    long as the coroutine may run. Destroying it, or reset(), frees the
+    frame, also when the coroutine is waiting. The awaiter it waits in
+    then cancels its timer or socket registration, so nothing resumes the
+    freed frame.
+    @code
+    CFCoro
+    MyComp::poller(int sd)
+    {
+        while (co_await CFReadable(sd) == CF_SOCKET_STUFF_TO_READ) {
+            // read from sd
+            co_await CFSleep(100);
+        }
+    }
+
+    mPoller = poller(sd);    // stopped when the component is destroyed
+    @endcode
+    @note Sockets and timers belong to the main loop, so coroutines must
+          only be started, awaited and destroyed there. A coroutine must
+          not destroy its own CFCoro.
+*/
+class [[nodiscard]] CFCoro
+{
+public:
+    struct promise_type {
+        CFCoro get_return_object() {
+            return CFCoro(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        // Kept until the owner frees it, so that done() can be asked
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    /** Constructor, of a handle that owns no coroutine */
+    CFCoro() {}
+    /** Takes over the coroutine of another handle */
+    CFCoro(CFCoro&& other) noexcept : mHandle(other.mHandle) {
+        other.mHandle = nullptr;
+    }
+    /** Frees the coroutine */
+    ~CFCoro() { reset(); }
+
+    /** Frees the own coroutine, and takes over the one of another handle */
+    CFCoro& operator=(CFCoro&& other) noexcept {
+        if (this != &other) {
+            reset();
+            mHandle = other.mHandle;
+            other.mHandle = nullptr;
+        }
+        return *this;
+    }
+
+    CFCoro(const CFCoro&) = delete;
+    CFCoro& operator=(const CFCoro&) = delete;
+
+    /** Returns true if the coroutine has returned, or there is none */
+    bool done() const { return !mHandle || mHandle.done(); }
+
+    /** Frees the coroutine, stopping it if it is still waiting */
+    void reset() {
+        if (mHandle) {
+            mHandle.destroy();
+            mHandle = nullptr;
+        }
+    }
+
+private:
+    explicit CFCoro(std::coroutine_handle<promise_type> h) : mHandle(h) {}
+
+    std::coroutine_handle<promise_type> mHandle;
+};
+
+/** Waits until there is something to read on a descriptor. The
+    descriptor is registered in the main loop while waiting, and must not
+    be registered by anyone else meanwhile.
+    @return CF_SOCKET_STUFF_TO_READ, or CF_SOCKET_CLOSED if it is closed or
+            could not be waited for
+*/
+class CFReadable
+{
+public:
+    /** Constructor
+        @param sd  Socket descriptor
+    */
+    explicit CFReadable(int sd) :
+        mSd(sd), mEvent(CF_SOCKET_CLOSED), mRegistered(false) {}
+
+    /** Destructor, deregisters the descriptor if the frame is freed while
+        waiting */
+    ~CFReadable() {
+        if (mRegistered) {
+            cf_socket_deregister(mSd);
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        mHandle = h;
+
+        // Not suspended if it cannot be registered
+        mRegistered = cf_socket_register(NULL, mSd, ready, this) == 1;
+
+        return mRegistered;
+    }
+
+    cf_sock_event_t await_resume() const noexcept { return mEvent; }
+
+private:
+    static int ready(void *comp, int sd, void *userData, cf_sock_event_t ev) {
+        CFReadable* self = (CFReadable*) userData;
+
+        (void) comp;
+
+        // One event per wait
+        cf_socket_deregister(sd);
+
+        self->mRegistered = false;
+        self->mEvent = ev;
+        self->mHandle.resume();
+
+        return 1;
+    }
+
+    int mSd;
+    cf_sock_event_t mEvent;
+    bool mRegistered;
+    std::coroutine_handle<> mHandle;
+};
+
+/** Waits for a number of milliseconds, without blocking the main loop */
+class CFSleep
+{
+public:
+    /** Constructor
+        @param ms  Milliseconds to sleep
+    */
+    explicit CFSleep(int ms) : mMs(ms), mTimer(0) {}
+
+    /** Destructor, cancels the timer if the frame is freed while
+        sleeping */
+    ~CFSleep() {
+        if (mTimer) {
+            cf_timer_cancel(mTimer);
+        }
+    }
+
+    bool await_ready() const noexcept { return mMs <= 0; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        mHandle = h;
+
+        // Not suspended if no timer could be started
+        mTimer = cf_timer_add(mMs, expired, this);
+
+        return mTimer != 0;
+    }
+
+    void await_resume() const noexcept {}
+
+private:
+    static void expired(void *userData) {
+        CFSleep* self = (CFSleep*) userData;
+
+        self->mTimer = 0;
+        self->mHandle.resume();
+    }
+
+    int mMs;
+    uint64_t mTimer;
+    std::coroutine_handle<> mHandle;
+};
+
+/** A channel opened to an M message receiver */
+struct CFMChannel
+{
+    /** Connection context */
+    void *mConn;
+    /** Channel number */
+    uint32_t mChan;
+    /** User data given to IMServer::addReceiver() */
+    void *mUserData;
+};
+
+/** A message received on an M channel */
+struct CFMMessage
+{
+    /** Length of message, -1 if the channel was closed */
+    int mLen;
+    /** Message, valid until the coroutine next suspends, in a co_await
+        on anything. It may point into the read buffer of M, so it must
+        be copied to be kept longer. */
+    unsigned char *mMsg;
+};
+
+/** IMClient for components that handle their M receivers in coroutines.
+    A component inherits it instead of IMClient, registers it as its
+    IMClient interface, and then awaits channels and messages:
+    @code
+    CFCoro
+    MyComp::server()
+    {
+        for (;;) {
+            CFMChannel ch = co_await accept();
+
+            mSessions.push_back(session(ch));
+        }
+    }
+
+    CFCoro
+    MyComp::session(CFMChannel ch)
+    {
+        CFMMessage m;
+
+        while ((m = co_await receive(ch)).mLen >= 0) {
+            mServer->sendToReceiver(ch.mConn, ch.mChan, m.mLen, m.mMsg);
+        }
+    }
+    @endcode
+    Channels and messages that arrive while nobody waits for them are
+    queued until they are awaited. A message is handed over without
+    copying when a coroutine waits for it, so it must be used or copied
+    before the coroutine waits for anything else. The coroutines must be freed before
+    the CFMCoroClient is destroyed, e.g. by keeping their CFCoro in the
+    component.
+*/
+class CFMCoroClient : public IMClient
+{
+public:
+    virtual ~CFMCoroClient() {}
+
+private:
+    typedef std::pair<void*, uint32_t> Key;
+    struct Channel;
+
+public:
+    /** Awaiter returned by accept() */
+    class Accept {
+    public:
+        Accept(CFMCoroClient* c) : mClient(c) {}
+
+        // Stops waiting if the frame is freed meanwhile
+        ~Accept() {
+            if (mHandle) {
+                std::deque<std::coroutine_handle<> >& a = mClient->mAccepting;
+
+                a.erase(std::remove(a.begin(), a.end(), mHandle), a.end());
+            }
+        }
+
+        bool await_ready() const noexcept {
+            return !mClient->mOpened.empty();
+        }
+        void await_suspend(std::coroutine_handle<> h) {
+            mHandle = h;
+            mClient->mAccepting.push_back(h);
+        }
+        CFMChannel await_resume() {
+            CFMChannel ch = mClient->mOpened.front();
+
+            mClient->mOpened.pop_front();
+            return ch;
+        }
+
+    private:
+        CFMCoroClient* mClient;
+        std::coroutine_handle<> mHandle;
+    };
+
+    /** Awaiter returned by receive() */
+    class Receive {
+    public:
+        Receive(CFMCoroClient* c, const CFMChannel& ch) :
+            mClient(c), mKey(ch.mConn, ch.mChan) {}
+
+        // Stops waiting if the frame is freed meanwhile
+        ~Receive() {
+            std::map<Key, Channel>::iterator i = mClient->mChannels.find(mKey);
+
+            if (mHandle && i != mClient->mChannels.end() &&
+                i->second.mWaiting == mHandle) {
+                i->second.mWaiting = nullptr;
+            }
+        }
+
+        bool await_ready() {
+            std::map<Key, Channel>::iterator i = mClient->mChannels.find(mKey);
+
+            if (i == mClient->mChannels.end()) {
+                // Closed and done with
+                return true;
+            }
+
+            Channel& c = i->second;
+
+            // The message handed over last time is done with
+            if (c.mDelivered) {
+                c.mQueued.pop_front();
+                c.mDelivered = false;
+            }
+
+            return !c.mQueued.empty() || c.mClosed;
+        }
+        void await_suspend(std::coroutine_handle<> h) {
+            mHandle = h;
+            mClient->mChannels[mKey].mWaiting = h;
+        }
+        CFMMessage await_resume() {
+            std::map<Key, Channel>::iterator i = mClient->mChannels.find(mKey);
+            CFMMessage m;
+
+            if (i == mClient->mChannels.end()) {
+                m.mLen = -1;
+                m.mMsg = NULL;
+                return m;
+            }
+
+            Channel& c = i->second;
+
+            if (c.mDirect.mMsg) {
+                // Handed over by message() without copying
+                m = c.mDirect;
+                c.mDirect.mMsg = NULL;
+            }
+            else if (!c.mQueued.empty()) {
+                m.mLen = (int) c.mQueued.front().size();
+                m.mMsg = (unsigned char*) &c.mQueued.front()[0];
+                c.mDelivered = true;
+            }
+            else {
+                m.mLen = -1;
+                m.mMsg = NULL;
+                mClient->mChannels.erase(i);
+            }
+
+            return m;
+        }
+
+    private:
+        CFMCoroClient* mClient;
+        Key mKey;
+        std::coroutine_handle<> mHandle;
+    };
+
+    /** Waits for a channel to be opened to one of the receivers */
+    Accept accept() { return Accept(this); }
+
+    /** Waits for a message on a channel
+        @param ch  Channel from accept()
+    */
+    Receive receive(const CFMChannel& ch) { return Receive(this, ch); }
+
+    //
+    // IMClient methods
+    int connected(void *conn, uint32_t chan, void *userData) {
+        CFMChannel ch = { conn, chan, userData };
+
+        mChannels[Key(conn, chan)];
+        mOpened.push_back(ch);
+
+        if (!mAccepting.empty()) {
+            std::coroutine_handle<> h = mAccepting.front();
+
+            mAccepting.pop_front();
+            h.resume();
+        }
+
+        return 1;
+    }
+
+    int disconnected(void *conn, uint32_t chan, void *userData) {
+        std::map<Key, Channel>::iterator i = mChannels.find(Key(conn, chan));
+
+        (void) userData;
+
+        if (i == mChannels.end()) {
+            return 1;
+        }
+
+        i->second.mClosed = true;
+        wakeup(i->second);
+
+        return 1;
+    }
+
+    int message(void *conn, uint32_t chan, int len,
+                unsigned char *msg, void *userData) {
+        std::map<Key, Channel>::iterator i = mChannels.find(Key(conn, chan));
+
+        (void) userData;
+
+        if (i == mChannels.end()) {
+            return 0;
+        }
+
+        Channel& c = i->second;
+
+        if (c.mWaiting && c.mQueued.empty()) {
+            // The coroutine runs until it suspends again before message()
+            // returns, so the message need not be copied
+            c.mDirect.mLen = len;
+            c.mDirect.mMsg = msg;
+        }
+        else {
+            c.mQueued.push_back(std::string((char*) msg, len));
+        }
+
+        wakeup(c);
+
+        return 1;
+    }
+
+private:
+    struct Channel {
+        Channel() : mDelivered(false), mClosed(false) {
+            mDirect.mLen = 0;
+            mDirect.mMsg = NULL;
+        }
+
+        /** Coroutine waiting in receive() */
+        std::coroutine_handle<> mWaiting;
+        /** Message from message() for the waiting coroutine */
+        CFMMessage mDirect;
+        /** Messages nobody waited for */
+        std::deque<std::string> mQueued;
+        /** True if the first queued message has been handed over */
+        bool mDelivered;
+        /** True when the channel is closed */
+        bool mClosed;
+    };
+
+    void wakeup(Channel& c) {
+        std::coroutine_handle<> h = c.mWaiting;
+
+        if (h) {
+            c.mWaiting = nullptr;
+            h.resume();
+        }
+    }
+
+    /** Channels opened but not yet accepted */
+    std::deque<CFMChannel> mOpened;
+    /** Coroutines waiting in accept() */
+    std::deque<std::coroutine_handle<> > mAccepting;
+    /** Open channels */
+    std::map<Key, Channel> mChannels;
+};
+
+/** @} */
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef CFMAILBOX_HH
+#define CFMAILBOX_HH
+
+/* Copyright (c) 2007-2011  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+
+class IActor;
+class CFComponent;
+
+/** Link of an object that can be put in a CFMpscQueue */
+class CFMpscNode
+{
+public:
+    CFMpscNode() : mNext(NULL) {}
+
+    /** Next object in the queue */
+    std::atomic<CFMpscNode*> mNext;
+};
+
+/** Lock-free queue with many producers and a single consumer. The objects
+    are linked through their CFMpscNode, so pushing never allocates.
+    Any thread may push, but only one thread at a time may pop.
+*/
+template <class T>
+class CFMpscQueue
+{
+public:
+    CFMpscQueue() : mHead(&mStub), mTail(&mStub) {}
+
+    /** Puts an object last in the queue. Can be called from any thread. */
+    void push(T* obj) {
+        pushNode(obj);
+    }
+
+    /** Takes the first object from the queue. Consumer only.
+        @return The object, or NULL if the queue is empty or the only
+                object is still being pushed by another thread
+    */
+    T* pop() {
+        CFMpscNode* tail = mTail;
+        CFMpscNode* next = tail->mNext.load(std::memory_order_acquire);
+
+        if (tail == &mStub) {
+            if (!next) {
+                return NULL;
+            }
+            mTail = next;
+            tail = next;
+            next = next->mNext.load(std::memory_order_acquire);
+        }
+
+        if (next) {
+            mTail = next;
+            return static_cast<T*>(tail);
+        }
+
+        if (tail != mHead.load(std::memory_order_acquire)) {
+            return NULL;
+        }
+
+        /* Last object: put the stub behind it so it can be unlinked */
+        pushNode(&mStub);
+
+        next = tail->mNext.load(std::memory_order_acquire);
+
+        if (next) {
+            mTail = next;
+            return static_cast<T*>(tail);
+        }
+
+        return NULL;
+    }
+
+    /** Returns true if nothing is queued, or being queued. Consumer only. */
+    bool empty() {
+        return mTail == &mStub &&
+            mHead.load(std::memory_order_seq_cst) == &mStub;
+    }
+
+private:
+    void pushNode(CFMpscNode* node) {
+        node->mNext.store(NULL, std::memory_order_relaxed);
+
+        CFMpscNode* prev = mHead.exchange(node, std::memory_order_seq_cst);
+
+        prev->mNext.store(node, std::memory_order_release);
+    }
+
+    /** Last pushed node */
+    std::atomic<CFMpscNode*> mHead;
+    /** Next node to pop (consumer side) */
+    CFMpscNode* mTail;
+    /** Placeholder that keeps the queue from ever being unlinked */
+    CFMpscNode mStub;
+};
+
+
+/** Message types from here on are used by CompFrame itself */
+#define CF_MSG_SYSTEM 0xff000000
+/** Type of a CFTask that is posted back when done (see IExecutor) */
+#define CF_MSG_TASK   (CF_MSG_SYSTEM + 1)
+
+/** A message that can be posted to an actor, see ISchedulerServer::post().
+    Messages are told apart by their type, so a message class is declared
+    with a TYPE constant of its own:
+    @code
+    class TickMsg : public CFMessage {
+    public:
+        static const uint32_t TYPE = 1;
+        TickMsg(int n) : CFMessage(TYPE), mCount(n) {}
+        int mCount;
+    };
+    ...
+    if (TickMsg* t = msg->as<TickMsg>()) { ... }
+    @endcode
+*/
+class CFMessage : public CFMpscNode
+{
+public:
+    /** Constructor
+        @param type  Type of message
+    */
+    CFMessage(uint32_t type) : mType(type) {}
+    /** Destructor */
+    virtual ~CFMessage() {}
+
+    /** Returns the message as a T, or NULL if it is of another type */
+    template <class T> T* as() {
+        return mType == T::TYPE ? static_cast<T*>(this) : NULL;
+    }
+
+    /** Type of message */
+    uint32_t mType;
+};
+
+
+/** The mailbox of an actor component. Created by S when the component is
+    made an actor, and reached through CFComponent::getMailbox().
+*/
+class CFMailbox : public CFMpscNode
+{
+public:
+    /** Constructor
+        @param actor   Interface that messages are delivered to
+        @param owner   Component of the actor
+        @param worker  Thread that delivers the messages
+    */
+    CFMailbox(IActor* actor, CFComponent* owner, int worker) :
+        mActor(actor), mOwner(owner), mWorker(worker), mScheduled(false),
+        mClosed(false) {}
+
+    /** Deletes messages that were never delivered */
+    ~CFMailbox() {
+        CFMessage* msg;
+
+        while ((msg = mQueue.pop()) != NULL) {
+            delete msg;
+        }
+    }
+
+    /** Posted messages */
+    CFMpscQueue<CFMessage> mQueue;
+    /** Receiver of the messages */
+    IActor* mActor;
+    /** Component of the actor */
+    CFComponent* mOwner;
+    /** Thread that delivers the messages, 0 is the main loop */
+    int mWorker;
+    /** True while the mailbox is waiting to be serviced */
+    std::atomic<bool> mScheduled;
+    /** True when the actor is removed, messages are then just deleted */
+    std::atomic<bool> mClosed;
+};
+
+#endif
@@ -25,10 +25,13 @@
 #include <string.h>
 #include "compframe.h"
 #include "compframe_i.h"
+#include "compframe_sockets.h"
+#include "compframe_watchdog.h"
 #include <dlfcn.h>              /* dlopen() */
 #include <errno.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <sched.h>
 #include "IScheduler.hh"
 #include "IConfig.hh"
 #include "CFRegistry.hh"
@@ -43,6 +46,8 @@ static void
 print_usage(void);
 static void
 print_version(void);
+static const char*
+cf_comp_name(void* comp);
 
 /*============================================================================*/
 /* VARIABLES                                                                  */
@@ -52,6 +57,11 @@ static CFComponent* sCompObj = NULL;
 static ISchedulerControl* sIface = NULL;
 static CFComponent* cfgObj = NULL;
 static char* cfgFile = NULL;
+static int workers = 0;
+static int mainCpu = -1;
+static int stallMs = 0;
+static int stallStack = 0;
+static int parallelCfg = 0;
 
 /*============================================================================*/
 /* FUNCTION DEFINITIONS                                                       */
@@ -109,6 +119,17 @@ print_usage(void)
             " -d <dirlist>       Use component directory list a-la LD_LIBRARY_PATH\n"
             " -f <file>          Use Configuration file 'file'\n"
             " -t <level>         Use debug trace (levels 0 to 3)\n"
+            " -p <backend>       Poll sockets with 'uring', 'epoll' or 'poll'\n"
+            " -w <num>           Run 'num' worker threads for actors\n"
+            " -b <us>            Busy poll sockets for 'us' microseconds before\n"
+            "                    blocking, for low latency\n"
+            " -a <cpu>           Pin the main loop to CPU core 'cpu'\n"
+            " -s <ms>            Report main loop stalls longer than 'ms'\n"
+            "                    milliseconds\n"
+            " -B                 Print the stack of the main loop when it\n"
+            "                    stalls (with -s)\n"
+            " -P                 Create the components of the configuration\n"
+            "                    file in parallel, on the threads of E\n"
             " -h, --help         Display this information.\n"
             " -v, --version      Display version information\n\n"
             "For bug reporting and suggestions, mail peter@torpman.se\n");
@@ -127,6 +148,13 @@ print_version(void)
             CF_VERSION);
 }
 
+/* Names components in stall reports */
+static const char*
+cf_comp_name(void* comp)
+{
+    return CFRegistry::instance()->getCompName((CFComponent*) comp);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -206,6 +234,102 @@ main(int argc, char **argv)
 
             i += 2;
         }
+
+        /* Socket polling backend  */
+        else if (!strcmp(argv[i], "-p")) {
+
+            if (argv[i + 1] == NULL) {
+                print_usage();
+                return 1;
+            }
+
+            if (!cf_sockets_backend_set(argv[i + 1])) {
+                return 1;
+            }
+
+            i += 2;
+        }
+
+        /* Worker threads  */
+        else if (!strcmp(argv[i], "-w")) {
+
+            if (argv[i + 1] == NULL) {
+                print_usage();
+                return 1;
+            }
+
+            if (sscanf(argv[i + 1], "%d", &workers) != 1 || workers < 0) {
+                cf_error_log(__FILE__, __LINE__,
+                             "Bad number of workers! (%s)\n", argv[i + 1]);
+                return 1;
+            }
+
+            i += 2;
+        }
+
+        /* Busy polling  */
+        else if (!strcmp(argv[i], "-b")) {
+            int us;
+
+            if (argv[i + 1] == NULL) {
+                print_usage();
+                return 1;
+            }
+
+            if (sscanf(argv[i + 1], "%d", &us) != 1 ||
+                !cf_sockets_busy_poll_set(us)) {
+                cf_error_log(__FILE__, __LINE__,
+                             "Bad busy poll time! (%s)\n", argv[i + 1]);
+                return 1;
+            }
+
+            i += 2;
+        }
+
+        /* CPU core of main loop  */
+        else if (!strcmp(argv[i], "-a")) {
+
+            if (argv[i + 1] == NULL) {
+                print_usage();
+                return 1;
+            }
+
+            if (sscanf(argv[i + 1], "%d", &mainCpu) != 1 || mainCpu < 0 ||
+                mainCpu >= CPU_SETSIZE) {
+                cf_error_log(__FILE__, __LINE__,
+                             "Bad CPU core! (%s)\n", argv[i + 1]);
+                return 1;
+            }
+
+            i += 2;
+        }
+
+        /* Stall reporting  */
+        else if (!strcmp(argv[i], "-s")) {
+
+            if (argv[i + 1] == NULL) {
+                print_usage();
+                return 1;
+            }
+
+            if (sscanf(argv[i + 1], "%d", &stallMs) != 1 || stallMs <= 0) {
+                cf_error_log(__FILE__, __LINE__,
+                             "Bad stall time! (%s)\n", argv[i + 1]);
+                return 1;
+            }
+
+            i += 2;
+        }
+        else if (!strcmp(argv[i], "-B")) {
+            stallStack = 1;
+            i++;
+        }
+
+        /* Parallel creation of configured components  */
+        else if (!strcmp(argv[i], "-P")) {
+            parallelCfg = 1;
+            i++;
+        }
         else {
             cf_error_log(__FILE__, __LINE__, "Bad parameter! (%s)\n", argv[i]);
             print_usage();
@@ -265,6 +389,9 @@ main(int argc, char **argv)
     /* Create our scheduler */
     sCompObj = CFRegistry::instance()->createComp("S", "S");
 
+    /* Create our executor */
+    CFRegistry::instance()->createComp("E", "E");
+
     /* Create our command handler */
     CFRegistry::instance()->createComp("C", "C");
 
@@ -278,13 +405,21 @@ main(int argc, char **argv)
     sIface = (ISchedulerControl*) 
         CFRegistry::instance()->getCompIface("S", "ISchedulerControl");
 
+    if (workers > 0 && !sIface->setWorkers(workers)) {
+        return 1;
+    }
+
     /* If configuration file was specified, let Cfg handle it */
     if (cfgFile) {
         int res;
 
         cfgObj = CFRegistry::instance()->getCompObject("Cfg");
         IConfig* cfgIface = 
-            (IConfig*) CFRegistry::instance()->getIface(cfgObj, "IConfig");
+            CFRegistry::instance()->getIface<IConfig>(cfgObj);
+
+        if (parallelCfg) {
+            cfgIface->setParallel(1);
+        }
 
         res = cfgIface->parse(cfgFile);
 
@@ -294,6 +429,31 @@ main(int argc, char **argv)
         }
     }
 
+    /* Watch the main loop, before it is pinned so the watchdog thread
+       is not */
+    if (stallMs > 0) {
+        cf_watchdog_namer_set(cf_comp_name);
+
+        if (!cf_watchdog_start(stallMs, stallStack)) {
+            return 1;
+        }
+    }
+
+    /* Pin the main loop last, so that the threads started until now may
+       run on any core */
+    if (mainCpu >= 0) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(mainCpu, &cpus);
+
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            cf_error_log(__FILE__, __LINE__, "Could not pin to CPU %d! (%s)\n",
+                         mainCpu, strerror(errno));
+            return 1;
+        }
+    }
+
     /* Start scheduler loop (eternal loop) */
     sIface->loop();
 
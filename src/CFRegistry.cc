@@ -20,6 +20,61 @@
 #include "CFComponentLib.hh"
 #include "compframe_log.h"
 
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/membarrier.h>
+#endif
+
+// Reader entry of the calling thread
+static __thread CFRegistryReader* tReader = NULL;
+
+// True if writers can make all readers execute a memory barrier. Readers
+// then only need to keep the compiler from reordering.
+static bool sMembarrier = false;
+
+// Gives the reader entry of a thread back when the thread exits
+struct CFRegistryReaderRelease
+{
+  ~CFRegistryReaderRelease() {
+    if (tReader) {
+      tReader->mInUse.store(false, memory_order_release);
+      tReader = NULL;
+    }
+  }
+};
+
+static thread_local CFRegistryReaderRelease tRelease;
+
+// Barrier on the read side, paired with heavyFence()
+static inline void
+lightFence()
+{
+  if (sMembarrier) {
+    atomic_signal_fence(memory_order_seq_cst);
+  }
+  else {
+    atomic_thread_fence(memory_order_seq_cst);
+  }
+}
+
+// Barrier on the write side, also executed by all running readers
+static void
+heavyFence()
+{
+#ifdef __linux__
+  if (sMembarrier &&
+      syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0) {
+    return;
+  }
+#endif
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
 // Singleton
 static CFRegistry inst;
 
@@ -29,28 +84,160 @@ CFRegistry::instance()
   return (IRegistry*) &inst;
 }
 
-CFRegistry::CFRegistry()
+CFRegistry::CFRegistry() :
+  mSnap(new CFRegistrySnapshot()),
+  mReaders(NULL)
 {
+  CFRegistrySnapshot* snap = mSnap.load();
+
+  for (size_t i = 0; i < CF_REGISTRY_SHARDS; i++) {
+    snap->mShards[i] = new CFRegistryShard();
+  }
+
+#ifdef __linux__
+  sMembarrier =
+    syscall(__NR_membarrier,
+            MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+#endif
 }
 
 CFRegistry::~CFRegistry()
 {
+  CFRegistrySnapshot* snap = mSnap.load();
+
+  for (size_t i = 0; i < CF_REGISTRY_SHARDS; i++) {
+    delete snap->mShards[i];
+  }
+
+  delete snap;
+}
+
+CFRegistry::ReadGuard::ReadGuard(CFRegistry* reg)
+{
+  mReader = tReader ? tReader : reg->reader();
+
+  // An odd sequence number means this thread is already reading
+  assert((mReader->mSeq.load(memory_order_relaxed) & 1) == 0);
+
+  // Only this thread writes its sequence number
+  mReader->mSeq.store(mReader->mSeq.load(memory_order_relaxed) + 1,
+                      memory_order_relaxed);
+  lightFence();
+
+  mSnap = reg->mSnap.load(memory_order_acquire);
+}
+
+CFRegistry::ReadGuard::~ReadGuard()
+{
+  mReader->mSeq.store(mReader->mSeq.load(memory_order_relaxed) + 1,
+                      memory_order_release);
+}
+
+// Returns the reader entry of the calling thread
+CFRegistryReader*
+CFRegistry::reader()
+{
+  lock_guard<mutex> lock(mReaderLock);
+  CFRegistryReader* r = mReaders.load(memory_order_acquire);
+
+  // Reuse the entry of an exited thread
+  for ( ; r != NULL; r = r->mNext) {
+    bool inUse = false;
+
+    if (r->mInUse.compare_exchange_strong(inUse, true)) {
+      break;
+    }
+  }
+
+  if (!r) {
+    r = new CFRegistryReader();
+    r->mSeq.store(0);
+    r->mInUse.store(true);
+    r->mNext = mReaders.load(memory_order_relaxed);
+    mReaders.store(r, memory_order_release);
+  }
+
+  tReader = r;
+  (void) &tRelease;
+
+  return r;
+}
+
+// Returns a shard of a copy of the current snapshot, to change
+CFRegistryShard*
+CFRegistry::change(CFRegistrySnapshot* snap, size_t shard)
+{
+  const CFRegistryShard* cur =
+    mSnap.load(memory_order_relaxed)->mShards[shard];
+
+  // Already copied in this change?
+  if (snap->mShards[shard] != cur) {
+    return (CFRegistryShard*) snap->mShards[shard];
+  }
+
+  CFRegistryShard* s = new CFRegistryShard(*cur);
+
+  snap->mShards[shard] = s;
+
+  return s;
+}
+
+// Publishes a changed copy of the snapshot
+void
+CFRegistry::publish(CFRegistrySnapshot* snap)
+{
+  CFRegistrySnapshot* old = mSnap.exchange(snap, memory_order_acq_rel);
+
+  synchronize();
+
+  // The shards that were copied are not used anymore, the rest are shared
+  for (size_t i = 0; i < CF_REGISTRY_SHARDS; i++) {
+    if (old->mShards[i] != snap->mShards[i]) {
+      delete old->mShards[i];
+    }
+  }
+
+  delete old;
+}
+
+// Waits until all reads that may use a replaced snapshot are done
+void
+CFRegistry::synchronize()
+{
+  heavyFence();
+
+  CFRegistryReader* r = mReaders.load(memory_order_acquire);
+
+  for ( ; r != NULL; r = r->mNext) {
+    uint64_t seq = r->mSeq.load(memory_order_acquire);
+
+    // A read in progress is done when the number changes
+    if (seq & 1) {
+      while (r->mSeq.load(memory_order_acquire) == seq) {
+        this_thread::yield();
+      }
+    }
+  }
 }
 
 int
 CFRegistry::registerLibrary(CFComponentLib* lib)
 {
+  lock_guard<mutex> lock(mWriteLock);
+  CFRegistrySnapshot* cur = mSnap.load(memory_order_relaxed);
   string name = lib->getName();
-  map<string,CFComponentLib*>::iterator i = mCompLibraries.find(name);
 
-  if (i != mCompLibraries.end()) {
+  if (cur->mCompLibraries.find(name) != cur->mCompLibraries.end()) {
     cf_error_log(__FILE__, __LINE__,
 		 "Component name already used (%s)\n", name.c_str());
     return 1;
   }
 
   // Add to map
-  mCompLibraries[name] = lib;
+  CFRegistrySnapshot* snap = new CFRegistrySnapshot(*cur);
+
+  snap->mCompLibraries[name] = lib;
+  publish(snap);
 	
   cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
 	       "Component library- %s - registered!\n", name.c_str());
@@ -61,28 +248,28 @@ CFRegistry::registerLibrary(CFComponentLib* lib)
 int
 CFRegistry::deregisterLibrary(const char* name)
 {
-  string cName(name);
-
-  map<string,CFComponent*>::iterator i = mInstances.find(cName);
+  lock_guard<mutex> lock(mWriteLock);
+  CFRegistrySnapshot* cur = mSnap.load(memory_order_relaxed);
 
-  if (i != mInstances.end()) {
+  if (cur->byName(name)->mInstances.count(name)) {
     cf_error_log(__FILE__, __LINE__,
 		 "Cannot deregister class when instance exist! (%s)\n",
 		 name);
     return 1;
   }
 
-  map<string,CFComponentLib*>::iterator ii = mCompLibraries.find(cName);
-
-  if (ii != mCompLibraries.end()) {
+  if (cur->mCompLibraries.find(name) == cur->mCompLibraries.end()) {
     cf_error_log(__FILE__, __LINE__,
 		 "Cannot deregister class. No such class! (%s)\n",
 		 name);
     return 1;
   }
-	
-  delete ii->second;
-  mCompLibraries.erase(ii);
+
+  // The library object itself is owned by the component library
+  CFRegistrySnapshot* snap = new CFRegistrySnapshot(*cur);
+
+  snap->mCompLibraries.erase(snap->mCompLibraries.find(name));
+  publish(snap);
 
   return 0;
 }
@@ -90,11 +277,13 @@ CFRegistry::deregisterLibrary(const char* name)
 CFComponent*
 CFRegistry::getCompObject(const char* inst_name)
 {
-  string iName(inst_name);
+  ReadGuard snap(this);
 
-  map<string,CFComponent*>::iterator i = mInstances.find(iName);
+  const CFRegistryShard* s = snap->byName(inst_name);
+  map<string,CFComponent*,less<>>::const_iterator i =
+    s->mInstances.find(inst_name);
 
-  if (i == mInstances.end()) {
+  if (i == s->mInstances.end()) {
     return NULL;
   }
 								   
@@ -104,52 +293,79 @@ CFRegistry::getCompObject(const char* inst_name)
 char*
 CFRegistry::getCompName(CFComponent* c)
 {
-  map<CFComponent*,string>::iterator i = mInstancesReverse.find(c);
+  ReadGuard snap(this);
 
-  if (i == mInstancesReverse.end()) {
+  const CFRegistryShard* s = snap->byComp(c);
+  map<CFComponent*,const string*>::const_iterator i =
+    s->mInstancesReverse.find(c);
+
+  if (i == s->mInstancesReverse.end()) {
     return NULL;
   }
 
-  return (char*) i->second.c_str();
+  // The name lives as long as the instance
+  return (char*) i->second->c_str();
 }
 
 CFComponent*
 CFRegistry::createComp(const char *name, const char *inst_name)
 {
-  map<string, CFComponentLib*>::iterator i = mCompLibraries.find(name);
-  map<string, CFComponent*>::iterator ii = mInstances.find(inst_name);
+  CFComponentLib* lib;
 
-  // Class registered?
-  if (i == mCompLibraries.end()) {
-    cf_error_log(__FILE__, __LINE__, "Class not registered! (%s)\n", name);
-    return NULL;
-  }
+  {
+    lock_guard<mutex> lock(mWriteLock);
+    CFRegistrySnapshot* cur = mSnap.load(memory_order_relaxed);
+
+    map<string, CFComponentLib*, less<>>::iterator i =
+      cur->mCompLibraries.find(name);
+
+    // Class registered?
+    if (i == cur->mCompLibraries.end()) {
+      cf_error_log(__FILE__, __LINE__, "Class not registered! (%s)\n", name);
+      return NULL;
+    }
 	
-  // Instance created?
-  if (ii != mInstances.end()) {
-    cf_error_log(__FILE__, __LINE__, "Instance name already used (%s)\n",
-		 inst_name);
-    return NULL;
+    // Instance created, or being created?
+    if (cur->byName(inst_name)->mInstances.count(inst_name) ||
+        mPending.find(inst_name) != mPending.end()) {
+      cf_error_log(__FILE__, __LINE__, "Instance name already used (%s)\n",
+		   inst_name);
+      return NULL;
+    }
+
+    lib = i->second;
+    mPending.insert(inst_name);
   }
 
-  // Create component
-  CFComponent* c = i->second->getCreateFunc()(inst_name);
+  // Create component. Creation and setup are done without the lock, so
+  // components can be created in parallel and use the registry meanwhile.
+  CFComponent* c = lib->getCreateFunc()(inst_name);
 
-  if (!c) {
-    cf_error_log(__FILE__, __LINE__,
-		 "Could not create (%s - %s)\n", name, inst_name);
-    return NULL;
-  }
+  {
+    lock_guard<mutex> lock(mWriteLock);
+
+    mPending.erase(inst_name);
 
-  // Add to maps
-  string iName(inst_name);
-  mInstances[iName] = c;
-  mInstancesReverse[c] = iName;
+    if (!c) {
+      cf_error_log(__FILE__, __LINE__,
+		   "Could not create (%s - %s)\n", name, inst_name);
+      return NULL;
+    }
+
+    // Add to maps
+    CFRegistrySnapshot* snap =
+      new CFRegistrySnapshot(*mSnap.load(memory_order_relaxed));
+    string* iName = new string(inst_name);
+
+    change(snap, CFRegistrySnapshot::shardOf(*iName))->mInstances[*iName] = c;
+    change(snap, CFRegistrySnapshot::shardOf(c))->mInstancesReverse[c] = iName;
+    publish(snap);
+  }
 	
   // Setup the instance
   cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
 	       "Setting up component %s !\n", name);
-  i->second->getSetupFunc()(c);
+  lib->getSetupFunc()(c);
 	
   return c;
 }
@@ -157,28 +373,41 @@ CFRegistry::createComp(const char *name, const char *inst_name)
 int
 CFRegistry::destroyComp(const char *inst_name)
 {
-  string iName(inst_name);
+  lock_guard<mutex> lock(mWriteLock);
+  CFRegistrySnapshot* cur = mSnap.load(memory_order_relaxed);
 
-  map<string, CFComponent*>::iterator i = mInstances.find(inst_name);
+  const CFRegistryShard* s = cur->byName(inst_name);
+  map<string, CFComponent*, less<>>::const_iterator i =
+    s->mInstances.find(inst_name);
 
-  if (i == mInstances.end()) {
+  if (i == s->mInstances.end()) {
     cf_error_log(__FILE__, __LINE__,
 		 "Could not destroy (%s). Not found!\n", inst_name);
     return 1;
   }
 
-  map<CFComponent*, string>::iterator ii = mInstancesReverse.find(i->second);
+  CFComponent* c = i->second;
+  const CFRegistryShard* rs = cur->byComp(c);
+  map<CFComponent*, const string*>::const_iterator ii =
+    rs->mInstancesReverse.find(c);
 
-  if (ii == mInstancesReverse.end()) {
+  if (ii == rs->mInstancesReverse.end()) {
     cf_error_log(__FILE__, __LINE__,
 		 "Could not destroy (%s). Not found!\n", inst_name);
     return 1;
   }
 
+  const string* iName = ii->second;
 
   // Clean up maps
-  mInstances.erase(i);
-  mInstancesReverse.erase(ii);
+  CFRegistrySnapshot* snap = new CFRegistrySnapshot(*cur);
+
+  change(snap, CFRegistrySnapshot::shardOf(c))->mInstancesReverse.erase(c);
+  change(snap, CFRegistrySnapshot::shardOf(inst_name))->mInstances.erase(*iName);
+  publish(snap);
+
+  // No reader can see the name anymore
+  delete iName;
 	
   return 0;
 }
@@ -186,7 +415,13 @@ CFRegistry::destroyComp(const char *inst_name)
 int
 CFRegistry::registerIface(CFComponent* comp, IBase* iface)
 {  
-  mCompInterfaces.insert(pair<CFComponent*, IBase*>(comp, iface));
+  lock_guard<mutex> lock(mWriteLock);
+  CFRegistrySnapshot* snap =
+    new CFRegistrySnapshot(*mSnap.load(memory_order_relaxed));
+
+  change(snap, CFRegistrySnapshot::shardOf(comp))->mCompInterfaces.insert(
+    pair<CFComponent*, IBase*>(comp, iface));
+  publish(snap);
 
   return 0;
 }
@@ -194,11 +429,12 @@ CFRegistry::registerIface(CFComponent* comp, IBase* iface)
 int
 CFRegistry::deregisterIfaces(CFComponent* comp)
 {
-  multimap<CFComponent*, IBase*>::iterator i;
+  lock_guard<mutex> lock(mWriteLock);
+  CFRegistrySnapshot* snap =
+    new CFRegistrySnapshot(*mSnap.load(memory_order_relaxed));
 
-  i = mCompInterfaces.find(comp);
-
-  mCompInterfaces.erase(i);
+  change(snap, CFRegistrySnapshot::shardOf(comp))->mCompInterfaces.erase(comp);
+  publish(snap);
 
   return 0;
 }
@@ -206,16 +442,14 @@ CFRegistry::deregisterIfaces(CFComponent* comp)
 IBase*
 CFRegistry::getIface(CFComponent* comp, const char* iface_name)
 {
-  string iStr;
-  iStr.assign(iface_name);
-
-  multimap<CFComponent*, IBase*>::iterator it;
-  pair<multimap<CFComponent*, IBase*>::iterator,multimap<CFComponent*, IBase*>::iterator> ret;
+  ReadGuard snap(this);
+  multimap<CFComponent*, IBase*>::const_iterator it;
+  pair<multimap<CFComponent*, IBase*>::const_iterator,multimap<CFComponent*, IBase*>::const_iterator> ret;
     
-  ret = mCompInterfaces.equal_range(comp);
+  ret = snap->byComp(comp)->mCompInterfaces.equal_range(comp);
 
   for (it = ret.first; it != ret.second; ++it) {
-    if ((*it).second->getName() == iStr) {
+    if ((*it).second->getName() == iface_name) {
       return (IBase*)(*it).second;
     }
   }
@@ -225,16 +459,52 @@ CFRegistry::getIface(CFComponent* comp, const char* iface_name)
   return NULL;
 }
 
+IBase*
+CFRegistry::getIface(CFComponent* comp, const CFIfaceIdent& ident)
+{
+  ReadGuard snap(this);
+  multimap<CFComponent*, IBase*>::const_iterator it;
+  pair<multimap<CFComponent*, IBase*>::const_iterator,multimap<CFComponent*, IBase*>::const_iterator> ret;
+    
+  ret = snap->byComp(comp)->mCompInterfaces.equal_range(comp);
+
+  for (it = ret.first; it != ret.second; ++it) {
+    if ((*it).second->getId() == ident.mId) {
+      return (IBase*)(*it).second;
+    }
+  }
+    
+  // Could not find it
+  fprintf(stderr, "ERROR: Did not find interface - %.*s!!\n",
+          (int) ident.mName.size(), ident.mName.data());
+  return NULL;
+}
+
 void 
 CFRegistry::listInstances(void)
 {
+  ReadGuard snap(this);
+
   fprintf(stdout, "%-32s %s\n", "Instance", "Class");
   fprintf(stdout, "------------------------------------------------------\n");
     
-  map<string, CFComponent*>::iterator i = mInstances.begin();
+  // Sorted on name, as if there was one map
+  vector<const string*> names;
+
+  for (size_t s = 0; s < CF_REGISTRY_SHARDS; s++) {
+    map<string, CFComponent*, less<>>::const_iterator i =
+      snap->mShards[s]->mInstances.begin();
+
+    for (; i != snap->mShards[s]->mInstances.end(); ++i) {
+      names.push_back(&i->first);
+    }
+  }
+
+  sort(names.begin(), names.end(),
+       [](const string* a, const string* b) { return *a < *b; });
 
-  for (; i != mInstances.end(); ++i) {
-    fprintf(stdout, "%-32s \n", i->first.c_str() /*tmp->className*/);
+  for (size_t i = 0; i < names.size(); i++) {
+    fprintf(stdout, "%-32s \n", names[i]->c_str() /*tmp->className*/);
   }
 
 }
@@ -242,11 +512,13 @@ CFRegistry::listInstances(void)
 void 
 CFRegistry::listClasses(void)
 {
-  map<string, CFComponentLib*>::iterator i = mCompLibraries.begin();
+  ReadGuard snap(this);
+  map<string, CFComponentLib*, less<>>::const_iterator i =
+    snap->mCompLibraries.begin();
 
   fprintf(stdout, "%-32s %s\n", "Library", "Class");
   fprintf(stdout, "------------------------------------------------------\n");
-  for (; i != mCompLibraries.end(); ++i) {
+  for (; i != snap->mCompLibraries.end(); ++i) {
     fprintf(stdout, "%-32s %s\n", 
 	    i->first.c_str(),
 	    i->second->getName().c_str());
@@ -256,14 +528,21 @@ CFRegistry::listClasses(void)
 void 
 CFRegistry::listInterfaces(void)
 {
-  map<CFComponent*,IBase*>::iterator i = mCompInterfaces.begin();
-  
+  ReadGuard snap(this);
   fprintf(stdout, "%-32s %s\n", "Instance", "Interface");
   fprintf(stdout, "------------------------------------------------------\n");
-  for (; i != mCompInterfaces.end(); ++i) {
-    fprintf(stdout, "%-32s %s\n", 
-	    i->first->getClassName().c_str(),
-	    i->second->getName().c_str());
+
+  for (size_t s = 0; s < CF_REGISTRY_SHARDS; s++) {
+    multimap<CFComponent*,IBase*>::const_iterator i =
+      snap->mShards[s]->mCompInterfaces.begin();
+
+    for (; i != snap->mShards[s]->mCompInterfaces.end(); ++i) {
+      string_view name = i->second->getName();
+
+      fprintf(stdout, "%-32s %.*s\n", 
+	      i->first->getClassName().c_str(),
+	      (int) name.size(), name.data());
+    }
   }
 
 
@@ -291,6 +570,3 @@ cfGetRegistry()
 {
   return CFRegistry::instance();
 }
-
-
-
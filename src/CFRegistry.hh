@@ -18,7 +18,11 @@
    along with this program.  If not, see <http://www.gnu.or/licenses/>.
 */
 #include <map>
+#include <set>
 #include <string>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
 using namespace std;
 
 // INCLUDES
@@ -31,7 +35,68 @@ class CFComponent;
 
 // CLASS DECLARATION
 
-// This class is the CompFrame Registry
+// Number of shards of the instance and interface maps
+#define CF_REGISTRY_SHARDS 4096
+
+// Part of the instances and interfaces, chosen by a hash of the instance
+// name or object. Never changed once published, like the snapshot.
+struct CFRegistryShard
+{
+  // Map of instantiated components (indexed on instance name)
+  map<string, CFComponent*, less<>> mInstances;
+
+  // Map of instantiated components (indexed on object)
+  map<CFComponent*, const string*> mInstancesReverse;
+
+  // Map of interfaces implemented by modules
+  multimap<CFComponent*, IBase*> mCompInterfaces;
+};
+
+// Contents of the registry. A published snapshot is never changed;
+// writers change a copy and publish that instead. The copy shares the
+// shards it does not change, so a write costs the same no matter how
+// many instances there are.
+struct CFRegistrySnapshot
+{
+  // Map of registered components (indexed on name)
+  map<string, CFComponentLib*, less<>> mCompLibraries;
+
+  // Instances and interfaces
+  const CFRegistryShard* mShards[CF_REGISTRY_SHARDS];
+
+  // Returns the shard index of an instance name
+  static size_t shardOf(string_view name) {
+    return hash<string_view>()(name) % CF_REGISTRY_SHARDS;
+  }
+  // Returns the shard index of an instance object
+  static size_t shardOf(const CFComponent* comp) {
+    return (((uintptr_t) comp >> 4) * 0x9E3779B97F4A7C15ULL >> 32) %
+      CF_REGISTRY_SHARDS;
+  }
+  // Returns the shard with an instance name
+  const CFRegistryShard* byName(string_view name) const {
+    return mShards[shardOf(name)];
+  }
+  // Returns the shard with an instance object
+  const CFRegistryShard* byComp(const CFComponent* comp) const {
+    return mShards[shardOf(comp)];
+  }
+};
+
+// A thread that has read the registry
+struct CFRegistryReader
+{
+  // Odd while the thread reads a snapshot
+  atomic<uint64_t> mSeq;
+  // False when the thread has exited, and the entry may be reused
+  atomic<bool> mInUse;
+  // Next reader
+  CFRegistryReader* mNext;
+};
+
+// This class is the CompFrame Registry. Reads never lock: they use the
+// current snapshot, and a replaced snapshot is only freed when no thread
+// reads it anymore (like RCU). Writes are serialized.
 class CFRegistry : public IRegistry
 {
 public:
@@ -53,6 +118,7 @@ public:
   int registerIface(CFComponent* comp, IBase* iface);
   int deregisterIfaces(CFComponent* comp);
   IBase* getIface(CFComponent* comp, const char* iface_name);
+  IBase* getIface(CFComponent* comp, const CFIfaceIdent& ident);
   void listInstances(void);
   void listClasses(void);
   void listInterfaces(void);
@@ -60,22 +126,45 @@ public:
 
 	
 private:
-
-  // Map of registered components (indexed on name)
-  map<string, CFComponentLib*> mCompLibraries;
-
-  // Map of instantiated components (indexed on instance name)
-  map<string, CFComponent*> mInstances;
-
-  // Map of instantiated components (indexed on object)
-  map<CFComponent*, string> mInstancesReverse;
-
-  // Map of registered interfaces (indexed by interface)
-  map<IBase*, void*> mInterfacesByName;
-    
-  // Map of interfaces implemented by modules
-  multimap<CFComponent*, IBase*> mCompInterfaces;
-	
+  // Keeps the current snapshot from being freed while in scope. It must
+  // not be nested: the inner guard would end the read of the outer one,
+  // so a method holding one may not call another method that takes one.
+  class ReadGuard
+  {
+  public:
+    ReadGuard(CFRegistry* reg);
+    ~ReadGuard();
+    const CFRegistrySnapshot* operator->() const { return mSnap; }
+
+  private:
+    CFRegistryReader* mReader;
+    const CFRegistrySnapshot* mSnap;
+  };
+
+  // Returns the reader entry of the calling thread
+  CFRegistryReader* reader();
+  // Returns a shard of a copy of the current snapshot, that may be
+  // changed before the copy is published (write lock held)
+  CFRegistryShard* change(CFRegistrySnapshot* snap, size_t shard);
+  // Publishes a changed copy of the snapshot (write lock held)
+  void publish(CFRegistrySnapshot* snap);
+  // Waits until all reads that may use a replaced snapshot are done
+  void synchronize();
+
+  // Current snapshot
+  atomic<CFRegistrySnapshot*> mSnap;
+
+  // Serializes writers
+  mutex mWriteLock;
+
+  // Instance names of components being created (write lock held)
+  set<string> mPending;
+
+  // Threads that have read the registry
+  atomic<CFRegistryReader*> mReaders;
+
+  // Serializes adding of readers
+  mutex mReaderLock;
 };
 
 
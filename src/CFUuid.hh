@@ -0,0 +1,356 @@
+#ifndef CFUUID_HH
+#define CFUUID_HH
+
+/* Copyright (c) 2007-2011  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef __linux__
+#include <sys/random.h>
+#endif
+
+/* The SSE2 paths load the 64-bit halves with a byte swap */
+#if defined(__SSE2__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <emmintrin.h>
+#define CF_UUID_SSE2 1
+#endif
+
+/** A UUID kept as 128 bits instead of as a 36 character string. Cheap to
+    copy, compare and hash. It is trivially copyable, and the *_ID
+    strings of the interfaces can be parsed at compile time:
+    @code
+    constexpr CFUuid id = CFUuid::fromLiteral(IMCLIENT_ID);
+    @endcode
+*/
+class CFUuid
+{
+public:
+    constexpr CFUuid() : mHi(0), mLo(0) {}
+    constexpr CFUuid(uint64_t hi, uint64_t lo) : mHi(hi), mLo(lo) {}
+
+    /** Parses a UUID on the form xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx
+        @param str  UUID string (at least 36 characters)
+        @return true if OK, false if not a valid UUID
+    */
+    constexpr bool parse(const char* str) {
+#ifdef CF_UUID_SSE2
+        if (!__builtin_is_constant_evaluated()) {
+            return parseSSE2(str);
+        }
+#endif
+        return parseScalar(str);
+    }
+
+    /** Returns the UUID of a string literal. Meant for compile time use
+        with the *_ID macros, where a literal that is not a valid UUID
+        does not compile. At run time it throws. */
+    static constexpr CFUuid fromLiteral(const char* str) {
+        CFUuid u;
+
+        if (!u.parseScalar(str)) {
+            throw "CFUuid::fromLiteral: not a valid UUID";
+        }
+
+        return u;
+    }
+
+    /** Makes a new random (version 4) UUID
+        @param u  Set to the UUID
+        @return true if OK, false if no random bytes could be had
+    */
+    static bool generate(CFUuid& u) {
+        /* Random bytes are fetched for many UUIDs at a time */
+        static __thread uint64_t pool[32];
+        static __thread unsigned left = 0;
+
+        if (left == 0) {
+            if (!fillRandom(pool, sizeof(pool))) {
+                return false;
+            }
+            left = sizeof(pool) / sizeof(pool[0]);
+        }
+
+        left -= 2;
+
+        u.mHi = (pool[left] & ~0xF000ULL) | 0x4000ULL;
+        u.mLo = (pool[left + 1] & ~(3ULL << 62)) | (2ULL << 62);
+
+        return true;
+    }
+
+    /** Sets the UUID from its binary form
+        @param b  16 bytes, most significant byte first
+    */
+    constexpr void fromBytes(const unsigned char *b) {
+        mHi = 0;
+        mLo = 0;
+
+        for (int i = 0; i < 8; i++) {
+            mHi = (mHi << 8) | b[i];
+            mLo = (mLo << 8) | b[i + 8];
+        }
+    }
+
+    /** Writes the binary form of the UUID
+        @param b  Buffer of 16 bytes
+    */
+    constexpr void toBytes(unsigned char *b) const {
+        for (int i = 0; i < 8; i++) {
+            b[i] = (unsigned char) (mHi >> (56 - 8 * i));
+            b[i + 8] = (unsigned char) (mLo >> (56 - 8 * i));
+        }
+    }
+
+    /** Writes the UUID on the form xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx
+        @param str  Buffer of at least 37 characters
+    */
+    void format(char *str) const {
+#ifdef CF_UUID_SSE2
+        char hex[32];
+        __m128i b = _mm_set_epi64x((long long) __builtin_bswap64(mLo),
+                                   (long long) __builtin_bswap64(mHi));
+        __m128i mask = _mm_set1_epi8(0x0f);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), mask);
+        __m128i lo = _mm_and_si128(b, mask);
+
+        _mm_storeu_si128((__m128i*) &hex[0],
+                         toHexSSE2(_mm_unpacklo_epi8(hi, lo)));
+        _mm_storeu_si128((__m128i*) &hex[16],
+                         toHexSSE2(_mm_unpackhi_epi8(hi, lo)));
+
+        memcpy(&str[0], &hex[0], 8);
+        str[8] = '-';
+        memcpy(&str[9], &hex[8], 4);
+        str[13] = '-';
+        memcpy(&str[14], &hex[12], 4);
+        str[18] = '-';
+        memcpy(&str[19], &hex[16], 4);
+        str[23] = '-';
+        memcpy(&str[24], &hex[20], 12);
+        str[36] = 0;
+#else
+        static const char hex[] = "0123456789abcdef";
+        int n = 0;
+
+        for (int i = 0; i < 36; i++) {
+            if (i == 8 || i == 13 || i == 18 || i == 23) {
+                str[i] = '-';
+                continue;
+            }
+
+            uint64_t v = n < 16 ? mHi : mLo;
+
+            str[i] = hex[(v >> (60 - 4 * (n % 16))) & 0xf];
+            n++;
+        }
+        str[36] = 0;
+#endif
+    }
+
+    /** Returns true for the nil UUID */
+    constexpr bool isNil() const { return mHi == 0 && mLo == 0; }
+
+    constexpr bool operator==(const CFUuid& x) const {
+        return mHi == x.mHi && mLo == x.mLo;
+    }
+    constexpr bool operator!=(const CFUuid& x) const { return !(*this == x); }
+    constexpr bool operator<(const CFUuid& x) const {
+        return mHi < x.mHi || (mHi == x.mHi && mLo < x.mLo);
+    }
+
+    /** Returns a hash value. UUIDs are mostly random already, so the
+        halves are just mixed together. */
+    constexpr size_t hash() const {
+        uint64_t h = mHi ^ (mLo * 0x9E3779B97F4A7C15ULL);
+
+        return (size_t) (h ^ (h >> 32));
+    }
+
+    /** High 64 bits */
+    uint64_t mHi;
+    /** Low 64 bits */
+    uint64_t mLo;
+
+private:
+    /** One character at a time, usable at compile time */
+    constexpr bool parseScalar(const char* str) {
+        uint64_t v[2] = { 0, 0 };
+        int n = 0;
+
+        if (!str) {
+            return false;
+        }
+
+        for (int i = 0; i < 36; i++) {
+            char c = str[i];
+
+            if (i == 8 || i == 13 || i == 18 || i == 23) {
+                if (c != '-') {
+                    return false;
+                }
+                continue;
+            }
+
+            int d = 0;
+
+            if (c >= '0' && c <= '9')      d = c - '0';
+            else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') d = c - 'A' + 10;
+            else return false;
+
+            v[n / 16] = (v[n / 16] << 4) | d;
+            n++;
+        }
+
+        mHi = v[0];
+        mLo = v[1];
+
+        return true;
+    }
+
+#ifdef CF_UUID_SSE2
+    /** 16 hex digits at a time */
+    bool parseSSE2(const char* str) {
+        char hex[32];
+
+        /* Never read beyond the end of a short string */
+        if (!str || strnlen(str, 36) != 36) {
+            return false;
+        }
+
+        if (str[8] != '-' || str[13] != '-' || str[18] != '-' ||
+            str[23] != '-') {
+            return false;
+        }
+
+        memcpy(&hex[0], &str[0], 8);
+        memcpy(&hex[8], &str[9], 4);
+        memcpy(&hex[12], &str[14], 4);
+        memcpy(&hex[16], &str[19], 4);
+        memcpy(&hex[20], &str[24], 12);
+
+        __m128i b0, b1;
+
+        if (!fromHexSSE2(_mm_loadu_si128((const __m128i*) &hex[0]), b0) ||
+            !fromHexSSE2(_mm_loadu_si128((const __m128i*) &hex[16]), b1)) {
+            return false;
+        }
+
+        unsigned char bytes[16];
+
+        _mm_storeu_si128((__m128i*) bytes, _mm_packus_epi16(b0, b1));
+
+        uint64_t hi, lo;
+
+        memcpy(&hi, &bytes[0], 8);
+        memcpy(&lo, &bytes[8], 8);
+        mHi = __builtin_bswap64(hi);
+        mLo = __builtin_bswap64(lo);
+
+        return true;
+    }
+
+    /** Converts 16 hex digits to 8 bytes, one in each 16-bit lane
+        @return false if a character is not a hex digit */
+    static bool fromHexSSE2(__m128i c, __m128i& out) {
+        __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+        __m128i isDigit =
+            _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                          _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+        __m128i isAlpha =
+            _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                          _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+        if (_mm_movemask_epi8(_mm_or_si128(isDigit, isAlpha)) != 0xffff) {
+            return false;
+        }
+
+        __m128i nib =
+            _mm_or_si128(_mm_and_si128(isDigit,
+                                       _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                         _mm_and_si128(isAlpha,
+                                       _mm_sub_epi8(lower,
+                                                    _mm_set1_epi8('a' - 10))));
+
+        /* Even characters are the high nibbles */
+        __m128i even = _mm_and_si128(nib, _mm_set1_epi16(0x00ff));
+        __m128i odd = _mm_srli_epi16(nib, 8);
+
+        out = _mm_or_si128(_mm_slli_epi16(even, 4), odd);
+
+        return true;
+    }
+
+    /** Converts 16 values 0-15 to hex digits */
+    static __m128i toHexSSE2(__m128i n) {
+        __m128i letter = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+
+        return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')),
+                            _mm_and_si128(letter,
+                                          _mm_set1_epi8('a' - '0' - 10)));
+    }
+#endif
+
+    /** Fills a buffer with random bytes from the kernel
+        @return true if OK, false if not all of it could be filled */
+    static bool fillRandom(void *buf, size_t len) {
+        size_t got = 0;
+
+#ifdef __linux__
+        while (got < len) {
+            ssize_t n = getrandom((char*) buf + got, len - got, 0);
+
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+#endif
+        if (got < len) {
+            int fd = open("/dev/urandom", O_RDONLY);
+
+            while (fd != -1 && got < len) {
+                ssize_t n = read(fd, (char*) buf + got, len - got);
+
+                if (n <= 0) {
+                    break;
+                }
+                got += n;
+            }
+
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+
+        return got == len;
+    }
+};
+
+/** Hash functor for use with unordered containers */
+struct CFUuidHash
+{
+    size_t operator()(const CFUuid& u) const { return u.hash(); }
+};
+
+#endif
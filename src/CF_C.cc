@@ -28,6 +28,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include "IConnect.hh"
+#include "compframe_metrics.h"
+#include "CFUuid.hh"
 #include <unistd.h>
 
 //=============================================================================
@@ -51,8 +53,10 @@ static int destroy_me(CFComponent *comp);
 static int create_cmd(int argc, char **argv);
 static int remove_cmd(int argc, char **argv);
 static int list_cmd(int argc, char **argv);
+static int stats_cmd(int argc, char **argv);
 static int help_cmd(int argc, char **argv);
 static int connect_cmd(int argc, char **argv);
+static int uuid_cmd(int argc, char **argv);
 
 // The library container
 static CFComponentLib theLib("C", create_me, set_me_up, destroy_me);
@@ -122,12 +126,18 @@ set_me_up(CFComponent *comp)
                                                                 
   sIface->add(cmdH);
 
+  /* Only executed once, to show the banner and start reading stdin */
+  sIface->setTick(cmdH, CF_S_TICK_NONE);
+  sIface->signal(cmdH);
+
   cmdH->add(comp, "list", list_cmd, "Usage: list [-c | -i <name>]\n");
+  cmdH->add(comp, "stats", stats_cmd, "Usage: stats [<instname>]\n");
   cmdH->add(comp,"create", create_cmd, "Usage: create <class> <instname>\n");
   cmdH->add(comp, "remove", remove_cmd, "Usage: remove <instname>\n");
   cmdH->add(comp,"connect",connect_cmd,
 	    "Usage: connect <inst> <inst> IFACE <param1 param2 ...>\n");
   cmdH->add(comp, "help", help_cmd, "Usage: help <command>\n");
+  cmdH->add(comp, "uuid", uuid_cmd, "Usage: uuid [<num>]\n");
 }
 
 
@@ -151,6 +161,7 @@ int
 CF_CmdHandler::add(CFComponent* obj, const char* name, cfc_func_t func,
 		   char* usage)
 {
+  lock_guard<mutex> lock(mLock);
   Command_t* c = new Command_t;
 
   c->mName.assign(name);
@@ -167,6 +178,7 @@ CF_CmdHandler::add(CFComponent* obj, const char* name, cfc_func_t func,
 int 
 CF_CmdHandler::remove(const char* name)
 {
+  lock_guard<mutex> lock(mLock);
   map<string, Command_t*>::iterator i = mCommands.find(name);
 
   if (i == mCommands.end()) {
@@ -193,7 +205,7 @@ CF_CmdHandler::handle(char* cmdStr)
 
   if (!cmd) {
     cf_error_log(__FILE__, __LINE__, "Bad command! 1\n");
-    return 1;
+    return 0;
   }
 
 
@@ -203,7 +215,7 @@ CF_CmdHandler::handle(char* cmdStr)
   }
 
   if (strlen(cmd) == 0) {
-    return 0;
+    return 1;
   }
 
 #ifdef WANT_TCL_COMMANDS
@@ -213,8 +225,9 @@ CF_CmdHandler::handle(char* cmdStr)
 
       fprintf(stderr, "Tcl Error (%d): %s\n",
 	      res, Tcl_GetStringResult(mTclInterp));
+      return 0;
     }
-    return 0;
+    return 1;
   }
 #endif
 
@@ -238,12 +251,18 @@ CF_CmdHandler::handle(char* cmdStr)
     argv[argc++] = strdup(tmp);
   }
 
+  /* Only white space */
+  if (argc == 0) {
+    return 1;
+  }
+
   /* Supported command? */
   map<string, Command_t*>::iterator i = mCommands.find(argv[0]);
 
   if (i == mCommands.end()) {
     cf_info_log("Invalid command.\n");
-    return 1;
+    free_argv(argc, argv);
+    return 0;
   }
 
   // Execute command
@@ -252,6 +271,24 @@ CF_CmdHandler::handle(char* cmdStr)
   return res;
 }
 
+int 
+CF_CmdHandler::handle(int argc, char** argv)
+{
+  if (argc < 1) {
+    cf_error_log(__FILE__, __LINE__, "Bad command!\n");
+    return 0;
+  }
+
+  map<string, Command_t*>::iterator i = mCommands.find(argv[0]);
+
+  if (i == mCommands.end()) {
+    cf_error_log(__FILE__, __LINE__, "Invalid command (%s)!\n", argv[0]);
+    return 0;
+  }
+
+  return i->second->mFunc(argc, argv);
+}
+
 void 
 CF_CmdHandler::execute(uint32_t slice)
 {
@@ -294,7 +331,7 @@ stdin_handle(void *comp, int sd, void *userData, cf_sock_event_t ev)
     exit(0);
   }
 
-  ICommand* iface = (ICommand*)CFRegistry::instance()->getIface(c, "ICommand");
+  ICommand* iface = CFRegistry::instance()->getIface<ICommand>(c);
 
   iface->handle(readBuff);
 
@@ -364,6 +401,48 @@ list_cmd(int argc, char **argv)
   return 0;
 }
 
+/** Prints one metric for the stats command */
+static void
+stats_print(const cf_metric_value_t *v, void *userData)
+{
+  (void) userData;            /* Avoid warnings */
+
+  fprintf(stdout, "%-10s %-16s %-32s ", v->comp, v->name, v->labels);
+
+  switch (v->type) {
+  case CF_METRIC_COUNTER:
+    fprintf(stdout, "%llu\n", (unsigned long long) v->count);
+    break;
+  case CF_METRIC_GAUGE:
+    fprintf(stdout, "%lld\n", (long long) v->value);
+    break;
+  case CF_METRIC_HISTOGRAM:
+    fprintf(stdout, "n=%llu mean=%llu p50=%llu p99=%llu max=%llu\n",
+            (unsigned long long) v->count,
+            (unsigned long long) (v->count ? v->sum / v->count : 0),
+            (unsigned long long) cf_metric_percentile(v, 500),
+            (unsigned long long) cf_metric_percentile(v, 990),
+            (unsigned long long) v->max);
+    break;
+  }
+}
+
+static int
+stats_cmd(int argc, char **argv)
+{
+  if (argc > 2) {
+    cf_error_log(__FILE__, __LINE__, "Usage: stats [<instname>]\n");
+    return 0;
+  }
+
+  fprintf(stdout, "%-10s %-16s %-32s %s\n",
+          "Instance", "Metric", "Labels", "Value");
+
+  cf_metrics_foreach(argc == 2 ? argv[1] : NULL, stats_print, NULL);
+
+  return 1;
+}
+
 static int
 help_cmd(int argc, char **argv)
 {
@@ -381,6 +460,34 @@ help_cmd(int argc, char **argv)
   return 0;
 }
 
+/** Prints new random UUIDs, e.g. for the ID of a new interface */
+static int
+uuid_cmd(int argc, char **argv)
+{
+  int num = 1;
+
+  if (argc > 2 || (argc == 2 && (sscanf(argv[1], "%d", &num) != 1 ||
+				 num < 1))) {
+    cf_error_log(__FILE__, __LINE__, "Usage: uuid [<num>]\n");
+    return 0;
+  }
+
+  for (int i = 0; i < num; i++) {
+    CFUuid u;
+    char str[37];
+
+    if (!CFUuid::generate(u)) {
+      cf_error_log(__FILE__, __LINE__, "Could not get random bytes!\n");
+      return 0;
+    }
+
+    u.format(str);
+    fprintf(stdout, "%s\n", str);
+  }
+
+  return 1;
+}
+
 static int
 connect_cmd(int argc, char **argv)
 {
@@ -407,7 +514,7 @@ connect_cmd(int argc, char **argv)
   }
 
   /* Get cfi_connect on first component */
-  IConnect *cfi = (IConnect*) CFRegistry::instance()->getIface(comp1, "IConnect");
+  IConnect *cfi = CFRegistry::instance()->getIface<IConnect>(comp1);
 
   if (!cfi) {
     cf_error_log(__FILE__, __LINE__,
@@ -34,6 +34,7 @@
 #include "IScheduler.hh"
 #include <map>
 #include <vector>
+#include <mutex>
 using namespace std;
 
 #ifdef WANT_TCL_COMMANDS
@@ -89,6 +90,7 @@ public:
     int add(CFComponent* obj, const char* name, cfc_func_t func, char* usage);
     int remove(const char* name);
     int handle(char* cmdStr);
+    int handle(int argc, char** argv);
 
     // ISchedulerClient methods
     void execute(uint32_t slice);
@@ -111,6 +113,8 @@ private:
     int mSlice;
     // Map of commands (indexed on command name)
     map<string, Command_t*> mCommands;
+    // Protects mCommands when components are set up in parallel
+    mutex mLock;
 
 
 #ifdef WANT_TCL_COMMANDS
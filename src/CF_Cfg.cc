@@ -28,6 +28,11 @@
 #include <string.h>
 #include <stdlib.h>
 #include "ICommand.hh"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 //=============================================================================
 //                      G L O B A L  V A R I A B L E S
@@ -36,6 +41,8 @@
 #define CFG_CMD_USAGE							\
   "\nUsage: config -i <inst> -n <varnum> -t <type> -v <value>\n"
 
+#define CFGC_CMD_USAGE "Usage: cfg -c <file> [<compiled file>]\n"
+
 //=============================================================================
 //                        H E L P E R   C L A S S E S
 //=============================================================================
@@ -51,6 +58,12 @@ static CFComponent *create_me(const char *inst_name);
 static void set_me_up(CFComponent *comp);
 static int destroy_me(CFComponent *comp);
 static int cfg_cmd(int argc, char **argv);
+static int cfgc_cmd(int argc, char **argv);
+static int map_file(const char* file, char** data, size_t* size);
+static int split_line(char* s, char** argv);
+static int write_record(FILE* fp, uint32_t line, int argc, char** argv);
+static bool is_compiled(const char* file);
+static uint64_t now_ms();
 
 // The library container
 static CFComponentLib theLib("Cfg", create_me, set_me_up, destroy_me);
@@ -99,11 +112,14 @@ set_me_up(CFComponent *comp)
     CFRegistry::instance()->getCompIface("C", "ICommand");
 
   ifC->add(comp, "config", cfg_cmd, CFG_CMD_USAGE);
+  ifC->add(comp, "cfg", cfgc_cmd, CFGC_CMD_USAGE);
 }
 
 CF_Cfg::CF_Cfg(const char *inst_name) :
   CFComponent("Cfg"),
-  mName(inst_name)
+  mName(inst_name),
+  mCmd(NULL),
+  mParallel(false)
 {
 }
 
@@ -111,98 +127,634 @@ CF_Cfg::~CF_Cfg()
 {
 }
 
+/* A configuration is mapped and split into arguments in place, and the
+   commands are run with the arguments as they are, so nothing is copied
+   per line. A compiled configuration holds the arguments already split,
+   and is used instead of the text when it is newer. */
+
 int
 CF_Cfg::parse(char* cfgFile)
 {
-  FILE *fp = fopen(cfgFile, "r");
-  char line[1024];
-  int length;
-  int res;
   cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
 	       "CFG config file: %s\n", cfgFile);
 
-  if (!fp) {
+  mCmd = (ICommand*) CFRegistry::instance()->getCompIface("C", "ICommand");
+
+  if (!mCmd) {
+    cf_error_log(__FILE__, __LINE__, "No command handler!\n");
+    return 0;
+  }
+
+  if (is_compiled(cfgFile)) {
+    return replay(cfgFile);
+  }
+
+  string compiled = string(cfgFile) + CFG_COMPILED_SUFFIX;
+
+  if (isFresh(cfgFile, compiled)) {
+    cf_trace_log(__FILE__, __LINE__, CF_TRACE_INFO,
+		 "CFG using compiled %s\n", compiled.c_str());
+    return replay(compiled.c_str());
+  }
+
+  return parseText(cfgFile, NULL);
+}
+
+int
+CF_Cfg::setParallel(int on)
+{
+  mParallel = on != 0;
+  return 1;
+}
+
+int
+CF_Cfg::compile(const char* cfgFile, const char* outFile)
+{
+  struct stat st;
+  CFCfgHeader hdr;
+
+  /* Taken before reading, so a change while compiling makes it stale */
+  if (stat(cfgFile, &st) != 0) {
     cf_error_log(__FILE__, __LINE__, "Could not open file (%s)!\n",
 		 cfgFile);
     return 0;
   }
 
-  ICommand* ic = (ICommand*)
-    CFRegistry::instance()->getCompIface("C", "ICommand");
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.mMagic, CFG_COMPILED_MAGIC, sizeof(hdr.mMagic));
+  hdr.mSize = st.st_size;
+  hdr.mSec = st.st_mtim.tv_sec;
+  hdr.mNsec = st.st_mtim.tv_nsec;
 
-	
-  length = 1024;
-
-  while (getLine(fp, line, &length) != -1) {
-    if (length != 0) {
-      cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
-		   "CFG config line: (%s)\n", line);
-
-      if (!memcmp("create ", line, 7) ||
-	  !memcmp("connect ", line, 8) ||
-	  !memcmp("config ", line, 7)) {
-	/* Let the C component handle the command... */
-	res = ic->handle(line);
-
-	if (!res) {
-	  cf_error_log(__FILE__, __LINE__,
-		       "Command failed (%s)!\n", line);
-	  return 0;
-	}
+  /* Written aside and renamed, so a half written one is never used */
+  string tmp = string(outFile) + ".tmp";
+  FILE* fp = fopen(tmp.c_str(), "wb");
+
+  if (!fp) {
+    cf_error_log(__FILE__, __LINE__, "Could not create file (%s)!\n",
+		 tmp.c_str());
+    return 0;
+  }
+
+  int res = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 && parseText(cfgFile, fp);
+
+  if (fclose(fp) != 0) {
+    res = 0;
+  }
+
+  if (!res || rename(tmp.c_str(), outFile) != 0) {
+    cf_error_log(__FILE__, __LINE__, "Could not compile %s to %s!\n",
+		 cfgFile, outFile);
+    unlink(tmp.c_str());
+    return 0;
+  }
+
+  cf_info_log("Compiled %s to %s.\n", cfgFile, outFile);
+
+  return 1;
+}
+
+int
+CF_Cfg::parseText(const char* cfgFile, FILE* out)
+{
+  char* data;
+  size_t size;
+
+  if (!map_file(cfgFile, &data, &size)) {
+    return 0;
+  }
+
+  char* p = data;
+  char* end = data + size;
+  char* argv[CFG_MAX_ARGS];
+  uint32_t line = 0;
+  string last;
+  int res = 1;
+
+  while (res && p < end) {
+    char* eol = (char*) memchr(p, '\n', end - p);
+    char* text = p;
+
+    line++;
+
+    if (eol) {
+      *eol = 0;
+      p = eol + 1;
+    }
+    else {
+      /* The last line has no newline to end it with, copy it */
+      last.assign(p, end - p);
+      text = &last[0];
+      p = end;
+    }
+
+    int argc = split_line(text, argv);
+
+    if (argc == 0 || argv[0][0] == '#') {
+      continue;
+    }
+
+    if (argc < 0) {
+      cf_error_log(__FILE__, __LINE__,
+		   "Too many arguments (%s:%u)!\n", cfgFile, line);
+      res = 0;
+    }
+    else if (strcmp(argv[0], "create") &&
+	     strcmp(argv[0], "connect") &&
+	     strcmp(argv[0], "config")) {
+      /* Unknown command */
+      cf_error_log(__FILE__, __LINE__,
+		   "Unknown command (%s:%u: %s)!\n", cfgFile, line, argv[0]);
+      res = 0;
+    }
+    else if (out) {
+      res = write_record(out, line, argc, argv);
+    }
+    else {
+      res = run(cfgFile, line, argc, argv);
+    }
+  }
+
+  /* The kept arguments point into the mapping and into last */
+  if (mParallel && !out) {
+    if (res) {
+      res = build(cfgFile);
+    }
+    mCmds.clear();
+    mArgs.clear();
+  }
+
+  if (data) {
+    munmap(data, size);
+  }
+
+  return res;
+}
+
+int
+CF_Cfg::replay(const char* file)
+{
+  char* data;
+  size_t size;
+
+  if (!map_file(file, &data, &size)) {
+    return 0;
+  }
+
+  size_t off = sizeof(CFCfgHeader);
+  char* argv[CFG_MAX_ARGS];
+  bool broken = size < off;
+  int res = 1;
+
+  while (res && !broken && off < size) {
+    uint32_t line;
+    uint32_t argc;
+
+    if (size - off < 8) {
+      broken = true;
+      break;
+    }
+
+    memcpy(&line, data + off, 4);
+    memcpy(&argc, data + off + 4, 4);
+    off += 8;
+
+    if (argc == 0 || argc > CFG_MAX_ARGS) {
+      broken = true;
+      break;
+    }
+
+    for (uint32_t i = 0; i < argc && !broken; i++) {
+      uint32_t len;
+
+      if (size - off < 4) {
+        broken = true;
+        break;
       }
-      else {
-	/* Unknown command */
-	cf_error_log(__FILE__, __LINE__,
-		     "Unknown command (%s)!\n", line);
-	return 0;
+
+      memcpy(&len, data + off, 4);
+      off += 4;
+
+      /* The argument and its terminating 0 must be there */
+      if (size - off <= len || data[off + len] != 0) {
+        broken = true;
+        break;
       }
+
+      argv[i] = data + off;
+      off += len + 1;
+    }
+
+    if (!broken) {
+      res = run(file, line, argc, argv);
+    }
+  }
+
+  if (broken) {
+    cf_error_log(__FILE__, __LINE__,
+		 "Broken compiled configuration (%s)!\n", file);
+    res = 0;
+  }
+
+  if (mParallel) {
+    if (res) {
+      res = build(file);
     }
+    mCmds.clear();
+    mArgs.clear();
+  }
+
+  if (data) {
+    munmap(data, size);
+  }
+
+  return res;
+}
 
-    length = 1024;
+bool
+CF_Cfg::isFresh(const char* cfgFile, const string& compiled)
+{
+  struct stat st;
+  CFCfgHeader hdr;
+
+  if (stat(cfgFile, &st) != 0) {
+    return false;
+  }
+
+  FILE* fp = fopen(compiled.c_str(), "rb");
+
+  if (!fp) {
+    return false;
+  }
+
+  bool fresh = fread(&hdr, sizeof(hdr), 1, fp) == 1 &&
+    !memcmp(hdr.mMagic, CFG_COMPILED_MAGIC, sizeof(hdr.mMagic)) &&
+    hdr.mSize == (uint64_t) st.st_size &&
+    hdr.mSec == (int64_t) st.st_mtim.tv_sec &&
+    hdr.mNsec == (int64_t) st.st_mtim.tv_nsec;
+
+  fclose(fp);
+
+  return fresh;
+}
+
+int
+CF_Cfg::run(const char* file, uint32_t line, int argc, char** argv)
+{
+  if (!mParallel) {
+    return exec(file, line, argc, argv);
   }
 
+  CFCfgCmd cmd;
+
+  cmd.mLine = line;
+  cmd.mArgc = argc;
+  cmd.mArg = mArgs.size();
+
+  mCmds.push_back(cmd);
+  mArgs.insert(mArgs.end(), argv, argv + argc);
+
   return 1;
 }
 
+int
+CF_Cfg::exec(const char* file, uint32_t line, int argc, char** argv)
+{
+  int res = mCmd->handle(argc, argv);
+
+  if (!res) {
+    string cmd = argv[0];
+
+    for (int i = 1; i < argc; i++) {
+      cmd += " ";
+      cmd += argv[i];
+    }
+
+    cf_error_log(__FILE__, __LINE__,
+		 "Command failed (%s:%u: %s)!\n", file, line, cmd.c_str());
+  }
+
+  return res;
+}
+
+/* When creating in parallel, a create is a node, and a connect between
+   two components created in the file is an edge from the one created
+   first. So a component is created when all components it is connected
+   to above it have been, and components that have nothing to do with
+   each other are created at the same time. Connect and config commands
+   are then run in file order, as they would have been. */
 
 int
-CF_Cfg::getLine(FILE * fp, char *buffer, int *length)
+CF_Cfg::build(const char* file)
 {
-  char *line;
-  char *tmp;
-  char *lineCopy = (char*) malloc(*length);
+  uint64_t start = now_ms();
+  IExecutor* e = (IExecutor*)
+    CFRegistry::instance()->getCompIface("E", "IExecutor");
+  CF_CfgBuild b(file, e);
+  map<string, int> nodes;
+
+  for (size_t i = 0; i < mCmds.size(); i++) {
+    CFCfgCmd& c = mCmds[i];
+    char** argv = &mArgs[c.mArg];
+
+    if (strcmp(argv[0], "create") || c.mArgc != 3) {
+      continue;
+    }
+
+    CFCfgNode n;
+
+    n.mLine = c.mLine;
+    n.mClass = argv[1];
+    n.mInst = argv[2];
+    n.mWaiting = 0;
+
+    int id = b.mNodes.size();
+    map<string, int>::iterator it = nodes.find(n.mInst);
 
-  line = fgets(buffer, *length, fp);
+    b.mNodes.push_back(n);
 
-  if (!line) {
-    *length = 0;
-    free(lineCopy);
-    return -1;
+    /* A second create of the same instance fails after the first */
+    if (it != nodes.end()) {
+      b.mNodes[it->second].mNext.push_back(id);
+      b.mNodes[id].mWaiting++;
+      it->second = id;
+    }
+    else {
+      nodes[n.mInst] = id;
+    }
+  }
+
+  for (size_t i = 0; i < mCmds.size(); i++) {
+    CFCfgCmd& c = mCmds[i];
+    char** argv = &mArgs[c.mArg];
+
+    if (strcmp(argv[0], "connect") || c.mArgc < 3) {
+      continue;
+    }
+
+    map<string, int>::iterator a = nodes.find(argv[1]);
+    map<string, int>::iterator z = nodes.find(argv[2]);
+
+    if (a == nodes.end() || z == nodes.end() || a->second == z->second) {
+      continue;
+    }
+
+    int from = min(a->second, z->second);
+    int to = max(a->second, z->second);
+
+    b.mNodes[from].mNext.push_back(to);
+    b.mNodes[to].mWaiting++;
+  }
+
+  if (!b.run()) {
+    return 0;
+  }
+
+  uint64_t created = now_ms();
+
+  for (size_t i = 0; i < mCmds.size(); i++) {
+    CFCfgCmd& c = mCmds[i];
+    char** argv = &mArgs[c.mArg];
+
+    if (!strcmp(argv[0], "create") && c.mArgc == 3) {
+      continue;
+    }
+
+    if (!exec(file, c.mLine, c.mArgc, argv)) {
+      return 0;
+    }
+  }
+
+  cf_trace_log(__FILE__, __LINE__, CF_TRACE_INFO,
+	       "CFG created %u components in %llu ms, configured them in "
+	       "%llu ms\n", (unsigned) b.mNodes.size(),
+	       (unsigned long long) (created - start),
+	       (unsigned long long) (now_ms() - created));
+
+  return 1;
+}
+
+int
+CF_CfgBuild::run()
+{
+  unique_lock<mutex> lock(mLock);
+  vector<int> ready;
+
+  for (size_t i = mNodes.size(); i-- > 0; ) {
+    if (mNodes[i].mWaiting == 0) {
+      ready.push_back(i);
+    }
+  }
+
+  start(ready);
+
+  mIdle.wait(lock, [this] { return mRunning == 0; });
+
+  return !mFailed && mCreated == (int) mNodes.size();
+}
+
+void
+CF_CfgBuild::start(vector<int>& ready)
+{
+  /* A list instead of recursion, a chain of connects may be long */
+  while (!ready.empty()) {
+    int node = ready.back();
+    CF_CfgCreate* t = new CF_CfgCreate(this, node);
+
+    ready.pop_back();
+    mRunning++;
+
+    if (mExecutor && mExecutor->submit(t, NULL)) {
+      continue;
+    }
+
+    /* Without E, one at a time on this thread */
+    delete t;
+
+    CFCfgNode& n = mNodes[node];
+
+    mLock.unlock();
+    bool ok = CFRegistry::instance()->createComp(n.mClass, n.mInst) != NULL;
+    mLock.lock();
+
+    done(node, ok, ready);
+  }
+}
+
+void
+CF_CfgBuild::finished(int node, bool ok)
+{
+  lock_guard<mutex> lock(mLock);
+  vector<int> ready;
+
+  done(node, ok, ready);
+  start(ready);
+
+  if (mRunning == 0) {
+    mIdle.notify_one();
+  }
+}
+
+void
+CF_CfgBuild::done(int node, bool ok, vector<int>& ready)
+{
+  CFCfgNode& n = mNodes[node];
+
+  mRunning--;
+
+  if (!ok) {
+    cf_error_log(__FILE__, __LINE__,
+		 "Command failed (%s:%u: create %s %s)!\n",
+		 mFile, n.mLine, n.mClass, n.mInst);
+    mFailed = true;
+    return;
+  }
+
+  mCreated++;
+
+  /* After a failure, nothing more is created */
+  if (mFailed) {
+    return;
+  }
+
+  for (size_t i = n.mNext.size(); i-- > 0; ) {
+    if (--mNodes[n.mNext[i]].mWaiting == 0) {
+      ready.push_back(n.mNext[i]);
+    }
   }
+}
+
+void
+CF_CfgCreate::run()
+{
+  CFCfgNode& n = mBuild->mNodes[mNode];
+
+  mBuild->finished(mNode,
+		   CFRegistry::instance()->createComp(n.mClass, n.mInst) != NULL);
+}
+
+/** Maps a file for reading, privately writable so that it can be split
+    in place
+    @param file File name
+    @param data Set to the contents, NULL if the file is empty
+    @param size Set to the size
+    @return 1 if OK, 0 if failure
+*/
+static int
+map_file(const char* file, char** data, size_t* size)
+{
+  struct stat st;
+  int fd = open(file, O_RDONLY);
 
-  if (line[0] == '#') {
-    *length = 0;
-    free(lineCopy);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    cf_error_log(__FILE__, __LINE__, "Could not open file (%s)!\n", file);
+    if (fd >= 0) {
+      close(fd);
+    }
     return 0;
   }
 
-  strcpy(lineCopy, line);
+  *size = st.st_size;
+  *data = NULL;
+
+  if (*size > 0) {
+    void* m = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    if (m == MAP_FAILED) {
+      cf_error_log(__FILE__, __LINE__, "Could not map file (%s)!\n", file);
+      close(fd);
+      return 0;
+    }
+
+    madvise(m, *size, MADV_SEQUENTIAL);
+    *data = (char*) m;
+  }
+
+  close(fd);
+
+  return 1;
+}
+
+/** Splits a line into arguments in place
+    @param s    Line, ended by 0
+    @param argv Set to the arguments
+    @return Number of arguments, -1 if more than CFG_MAX_ARGS
+*/
+static int
+split_line(char* s, char** argv)
+{
+  int argc = 0;
+
+  while (1) {
+    while (*s == ' ' || *s == '\t' || *s == '\r') {
+      s++;
+    }
+
+    if (*s == 0) {
+      return argc;
+    }
+
+    if (argc == CFG_MAX_ARGS) {
+      return -1;
+    }
+
+    argv[argc++] = s;
+
+    while (*s && *s != ' ' && *s != '\t' && *s != '\r') {
+      s++;
+    }
+
+    if (*s == 0) {
+      return argc;
+    }
+
+    *s++ = 0;
+  }
+}
 
-  tmp = strtok(lineCopy, " \r\t\n");
+/** Writes a command to a compiled configuration
+    @return 1 if OK, 0 if failure
+*/
+static int
+write_record(FILE* fp, uint32_t line, int argc, char** argv)
+{
+  uint32_t n = argc;
 
-  if (!tmp) {
-    *length = 0;
-    free(lineCopy);
+  if (fwrite(&line, 4, 1, fp) != 1 || fwrite(&n, 4, 1, fp) != 1) {
     return 0;
   }
 
-  *length = strlen(line);
+  for (int i = 0; i < argc; i++) {
+    uint32_t len = strlen(argv[i]);
 
-  free(lineCopy);
+    if (fwrite(&len, 4, 1, fp) != 1 ||
+	fwrite(argv[i], len + 1, 1, fp) != 1) {
+      return 0;
+    }
+  }
 
   return 1;
 }
 
+/** Returns true if a file is a compiled configuration */
+static bool
+is_compiled(const char* file)
+{
+  char magic[8];
+  FILE* fp = fopen(file, "rb");
+
+  if (!fp) {
+    return false;
+  }
+
+  bool res = fread(magic, sizeof(magic), 1, fp) == 1 &&
+    !memcmp(magic, CFG_COMPILED_MAGIC, sizeof(magic));
+
+  fclose(fp);
+
+  return res;
+}
+
 /** The main 'Cfg' command.*/
 static int
 cfg_cmd(int argc, char **argv)
@@ -227,3 +779,30 @@ cfg_cmd(int argc, char **argv)
   return ifc->set(argv[2], argv[3]);
 }
 
+
+/** The 'cfg' command, that compiles a configuration file */
+static int
+cfgc_cmd(int argc, char **argv)
+{
+  if ((argc != 3 && argc != 4) || strcmp(argv[1], "-c")) {
+    cf_error_log(__FILE__, __LINE__, CFGC_CMD_USAGE);
+    return 0;
+  }
+
+  CF_Cfg* c = (CF_Cfg*) CFRegistry::instance()->getCompObject("Cfg");
+  string out = argc == 4 ? string(argv[3])
+                         : string(argv[2]) + CFG_COMPILED_SUFFIX;
+
+  return c->compile(argv[2], out.c_str());
+}
+
+/** Returns monotonic milliseconds */
+static uint64_t
+now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
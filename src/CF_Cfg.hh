@@ -31,20 +31,130 @@
 #include "compframe.h"
 #include "compframe_sockets.h"
 #include <map>
+#include <string>
 using namespace std;
 
 #include "IConfig.hh"
+#include "ICommand.hh"
+#include "IExecutor.hh"
 #include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
 
 
 //=============================================================================
 //                          M A C R O S 
 //=============================================================================
 
+// Most arguments of a configuration line
+#define CFG_MAX_ARGS 64
+
+// Added to the name of a configuration file to get its compiled form
+#define CFG_COMPILED_SUFFIX ".bin"
+
+// First bytes of a compiled configuration
+#define CFG_COMPILED_MAGIC "CFCFGB1\n"
+
 //=============================================================================
 //                           T Y P E S
 //=============================================================================
 
+// Start of a compiled configuration. It is followed by one record per
+// command: the line number (uint32_t), the number of arguments
+// (uint32_t), and each argument as its length (uint32_t) and its bytes
+// with a terminating 0. Numbers are in host order, so a compiled
+// configuration is only used on the host that made it.
+struct CFCfgHeader
+{
+  // CFG_COMPILED_MAGIC
+  char mMagic[8];
+  // Size and modification time of the text it was compiled from
+  uint64_t mSize;
+  int64_t mSec;
+  int64_t mNsec;
+};
+
+// A command of a configuration, kept until all are read when creating
+// in parallel
+struct CFCfgCmd
+{
+  // Line number
+  uint32_t mLine;
+  // Number of arguments
+  int mArgc;
+  // Index of the first argument in CF_Cfg::mArgs
+  size_t mArg;
+};
+
+// A component to create in parallel
+struct CFCfgNode
+{
+  // Line, class and instance name
+  uint32_t mLine;
+  char* mClass;
+  char* mInst;
+  // Number of components to create before this one
+  int mWaiting;
+  // Components waiting for this one
+  vector<int> mNext;
+};
+
+// Creates components on the threads of E, each one as soon as the
+// components it is connected to earlier in the file have been created
+class CF_CfgBuild
+{
+public:
+  CF_CfgBuild(const char* file, IExecutor* e) :
+    mFile(file), mExecutor(e), mRunning(0), mCreated(0), mFailed(false) {}
+
+  // Creates all nodes, returns 1 if OK, 0 if failure
+  int run();
+  // Called by a task when its component is created, or could not be
+  void finished(int node, bool ok);
+
+  // Configuration file, for error messages
+  const char* mFile;
+  // Components to create
+  vector<CFCfgNode> mNodes;
+
+private:
+  // Submits the nodes that are not waiting for any, or creates them on
+  // this thread without E, until none is left (lock held)
+  void start(vector<int>& ready);
+  // Adds the nodes no longer waiting for a created one to ready (lock
+  // held)
+  void done(int node, bool ok, vector<int>& ready);
+
+  // Runs the tasks
+  IExecutor* mExecutor;
+  // Protects the below
+  mutex mLock;
+  // Signalled when no task is running
+  condition_variable mIdle;
+  // Number of tasks submitted and not finished
+  int mRunning;
+  // Number of components created
+  int mCreated;
+  // True when a component could not be created
+  bool mFailed;
+};
+
+// Creates a component on a thread of E
+class CF_CfgCreate : public CFTask
+{
+public:
+  CF_CfgCreate(CF_CfgBuild* b, int node) : mBuild(b), mNode(node) {}
+
+  void run();
+
+  // The build it is part of
+  CF_CfgBuild* mBuild;
+  // Node to create
+  int mNode;
+};
+
 //=============================================================================
 //                     E N U M E R A T I O N S
 //=============================================================================
@@ -67,12 +177,34 @@ public:
 
   // IConfig methods
   int parse(char* cfgFile);
+  int setParallel(int on);
+
+  // Writes the compiled form of a configuration file
+  int compile(const char* cfgFile, const char* outFile);
 	
 private:
   // Instance name
   string mName;
-
-  int getLine(FILE * fp, char *buffer, int *length);
+  // Used for running the commands
+  ICommand* mCmd;
+  // True if components are created in parallel
+  bool mParallel;
+  // Commands read, and their arguments, when creating in parallel
+  vector<CFCfgCmd> mCmds;
+  vector<char*> mArgs;
+
+  // Parses a text configuration, and runs or compiles its commands
+  int parseText(const char* cfgFile, FILE* out);
+  // Runs the commands of a compiled configuration
+  int replay(const char* file);
+  // Returns true if a compiled configuration is made from the text one
+  bool isFresh(const char* cfgFile, const string& compiled);
+  // Runs a command, or keeps it when creating in parallel
+  int run(const char* file, uint32_t line, int argc, char** argv);
+  // Runs a command now
+  int exec(const char* file, uint32_t line, int argc, char** argv);
+  // Runs the kept commands, the create commands in parallel
+  int build(const char* file);
 
 };
 
@@ -0,0 +1,472 @@
+/* Copyright (c) 2007-2011  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+#define _POSIX_SOURCE 1                           /* POSIX compliant */
+
+//=============================================================================
+//                              I N C L U D E S
+//=============================================================================
+#include "CF_E.hh"
+#include "CFRegistry.hh"
+#include "compframe_log.h"
+#include "CFComponentLib.hh"
+#include <assert.h>
+
+//=============================================================================
+//                      G L O B A L  V A R I A B L E S
+//=============================================================================
+
+// Pool thread that is running, if any
+static __thread CF_E_Worker* tWorker = NULL;
+
+//=============================================================================
+//                        H E L P E R   C L A S S E S
+//=============================================================================
+
+CF_E_Deque::CF_E_Deque() :
+    mTop(0),
+    mBottom(0),
+    mRing(new Ring(CF_E_DEQUE_SIZE))
+{
+}
+
+CF_E_Deque::~CF_E_Deque()
+{
+    delete mRing.load();
+
+    for (size_t i = 0; i < mOldRings.size(); i++) {
+        delete mOldRings[i];
+    }
+}
+
+// Puts a task at the bottom (owner only)
+void
+CF_E_Deque::push(CFTask* task)
+{
+    int64_t b = mBottom.load(memory_order_relaxed);
+    int64_t t = mTop.load(memory_order_acquire);
+    Ring* r = mRing.load(memory_order_relaxed);
+
+    if (b - t > r->mSize - 1) {
+        Ring* bigger = new Ring(r->mSize * 2);
+
+        for (int64_t i = t; i < b; i++) {
+            bigger->put(i, r->get(i));
+        }
+
+        mOldRings.push_back(r);
+        mRing.store(bigger, memory_order_release);
+        r = bigger;
+    }
+
+    r->put(b, task);
+    mBottom.store(b + 1, memory_order_release);
+}
+
+// Takes the last pushed task, or NULL (owner only)
+CFTask*
+CF_E_Deque::take()
+{
+    int64_t b = mBottom.load(memory_order_relaxed) - 1;
+    Ring* r = mRing.load(memory_order_relaxed);
+
+    mBottom.store(b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    int64_t t = mTop.load(memory_order_relaxed);
+
+    if (t > b) {
+        // Empty
+        mBottom.store(b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    CFTask* task = r->get(b);
+
+    if (t == b) {
+        // Last task, race the thieves for it
+        if (!mTop.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                          memory_order_relaxed)) {
+            task = NULL;
+        }
+        mBottom.store(b + 1, memory_order_relaxed);
+    }
+
+    return task;
+}
+
+// Steals the first pushed task, or NULL (any thread)
+CFTask*
+CF_E_Deque::steal()
+{
+    int64_t t = mTop.load(memory_order_acquire);
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    int64_t b = mBottom.load(memory_order_acquire);
+
+    if (t >= b) {
+        return NULL;
+    }
+
+    Ring* r = mRing.load(memory_order_acquire);
+    CFTask* task = r->get(t);
+
+    if (!mTop.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                      memory_order_relaxed)) {
+        // Lost it to the owner or another thief
+        return NULL;
+    }
+
+    return task;
+}
+
+// Returns true if there seems to be nothing to take
+bool
+CF_E_Deque::empty()
+{
+    return mBottom.load(memory_order_relaxed) <=
+        mTop.load(memory_order_relaxed);
+}
+
+//=============================================================================
+//                        P U B L I C   M E T H O D S
+//=============================================================================
+
+//=============================================================================
+//                       P R I V A T E   M E T H O D S
+//=============================================================================
+static CFComponent *create_me(const char *inst_name);
+static void set_me_up(CFComponent *comp);
+static int destroy_me(CFComponent *comp);
+
+static CFComponentLib theLib("E", create_me, set_me_up, destroy_me);
+
+
+CF_Executor::CF_Executor(const char *inst_name) :
+	CFComponent("E"),
+	mName(inst_name),
+	mNumThreads(thread::hardware_concurrency()),
+	mScheduler(NULL),
+	mInjectedCount(0),
+	mSleepers(0),
+	mWakeups(0),
+	mStop(false)
+{
+    if (mNumThreads < 1) {
+        mNumThreads = 1;
+    }
+
+    // The pool starts later, possibly after the main loop has been pinned
+    // to a core, and must not inherit that
+    if (sched_getaffinity(0, sizeof(mCpus), &mCpus) != 0) {
+        CPU_ZERO(&mCpus);
+    }
+}
+
+// Destructor
+CF_Executor::~CF_Executor()
+{
+    {
+        lock_guard<mutex> lock(mLock);
+
+        mStop.store(true);
+        mWakeups++;
+        mCond.notify_all();
+    }
+
+    for (size_t i = 0; i < mWorkers.size(); i++) {
+        mWorkers[i]->mThread.join();
+
+        // Tasks that never ran
+        CFTask* task;
+
+        while ((task = mWorkers[i]->mDeque.take()) != NULL) {
+            delete task;
+        }
+
+        delete mWorkers[i];
+    }
+
+    for (size_t i = 0; i < mInjected.size(); i++) {
+        delete mInjected[i];
+    }
+
+    CFRegistry::instance()->deregisterIfaces(this);
+}
+
+//
+// IExecutor methods
+int
+CF_Executor::submit(CFTask *task, CFComponent *comp)
+{
+    if (!task) {
+        return 0;
+    }
+
+    call_once(mStarted, &CF_Executor::start, this);
+
+    task->mOwner = comp;
+
+    // A task of a task stays on the same thread, unless stolen
+    if (tWorker && tWorker->mIndex < (int) mWorkers.size() &&
+        mWorkers[tWorker->mIndex] == tWorker) {
+        tWorker->mDeque.push(task);
+        signal();
+        return 1;
+    }
+
+    lock_guard<mutex> lock(mLock);
+
+    mInjected.push_back(task);
+    mInjectedCount.store(mInjected.size());
+
+    if (mSleepers.load() > 0) {
+        mWakeups++;
+        mCond.notify_one();
+    }
+
+    return 1;
+}
+
+int
+CF_Executor::setThreads(int num)
+{
+    lock_guard<mutex> lock(mLock);
+
+    if (num < 1 || !mWorkers.empty()) {
+        cf_error_log(__FILE__, __LINE__,
+                     "Executor threads can only be set before first task!\n");
+        return 0;
+    }
+
+    mNumThreads = num;
+
+    return 1;
+}
+
+// Starts the pool threads
+void
+CF_Executor::start()
+{
+    lock_guard<mutex> lock(mLock);
+
+    for (int i = 0; i < mNumThreads; i++) {
+        mWorkers.push_back(new CF_E_Worker(i));
+    }
+
+    // All workers exist before any thread looks for victims
+    for (int i = 0; i < mNumThreads; i++) {
+        mWorkers[i]->mThread = thread(&CF_Executor::work, this, mWorkers[i]);
+    }
+
+    cf_info_log("E executing tasks on %d threads.\n", mNumThreads);
+}
+
+// Body of a pool thread
+void
+CF_Executor::work(CF_E_Worker* w)
+{
+    tWorker = w;
+
+    if (CPU_COUNT(&mCpus) > 0) {
+        pthread_setaffinity_np(pthread_self(), sizeof(mCpus), &mCpus);
+    }
+
+    while (!mStop.load()) {
+        CFTask* task = find(w);
+
+        if (task) {
+            task->run();
+            complete(task);
+            continue;
+        }
+
+        unique_lock<mutex> lock(mLock);
+
+        mSleepers.fetch_add(1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        // Tasks pushed before we were counted as sleeping
+        if (mStop.load() || hasWork()) {
+            mSleepers.fetch_sub(1);
+            continue;
+        }
+
+        uint64_t wakeups = mWakeups;
+
+        mCond.wait(lock, [&] { return mWakeups != wakeups; });
+        mSleepers.fetch_sub(1);
+    }
+
+    tWorker = NULL;
+}
+
+// Finds a task for a pool thread, or NULL
+CFTask*
+CF_Executor::find(CF_E_Worker* w)
+{
+    CFTask* task = w->mDeque.take();
+
+    if (task) {
+        return task;
+    }
+
+    if (mInjectedCount.load(memory_order_relaxed) > 0) {
+        lock_guard<mutex> lock(mLock);
+
+        if (!mInjected.empty()) {
+            task = mInjected.front();
+            mInjected.pop_front();
+            mInjectedCount.store(mInjected.size());
+
+            // Pass the rest on to another thread
+            if (!mInjected.empty() && mSleepers.load() > 0) {
+                mWakeups++;
+                mCond.notify_one();
+            }
+            return task;
+        }
+    }
+
+    // Steal from random victims, each is tried about twice
+    int n = (int) mWorkers.size();
+
+    for (int i = 0; i < 2 * n && n > 1; i++) {
+        w->mRand ^= w->mRand << 13;
+        w->mRand ^= w->mRand >> 17;
+        w->mRand ^= w->mRand << 5;
+
+        CF_E_Worker* victim = mWorkers[w->mRand % n];
+
+        if (victim == w) {
+            continue;
+        }
+
+        if ((task = victim->mDeque.steal()) != NULL) {
+            // The victim may have more for others
+            if (!victim->mDeque.empty()) {
+                signal();
+            }
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns true if any task is waiting (lock held)
+bool
+CF_Executor::hasWork()
+{
+    if (!mInjected.empty()) {
+        return true;
+    }
+
+    for (size_t i = 0; i < mWorkers.size(); i++) {
+        if (!mWorkers[i]->mDeque.empty()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Wakes up a sleeping pool thread, if any
+void
+CF_Executor::signal()
+{
+    // Pairs with the fence of a thread going to sleep
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (mSleepers.load(memory_order_relaxed) == 0) {
+        return;
+    }
+
+    lock_guard<mutex> lock(mLock);
+
+    mWakeups++;
+    mCond.notify_one();
+}
+
+// Hands a task that has run back to its owner
+void
+CF_Executor::complete(CFTask* task)
+{
+    if (!task->mOwner) {
+        delete task;
+        return;
+    }
+
+    if (!mScheduler || !mScheduler->post(task->mOwner, task)) {
+        cf_error_log(__FILE__, __LINE__,
+                     "Could not post task back to %s! Not an actor?\n",
+                     task->mOwner->getClassName().c_str());
+        delete task;
+    }
+}
+
+
+/** This function must reside in all component libraries.
+    Here the component instance is 
+*/
+extern "C" void
+dlopen_this(void)
+{
+    /* Use this function to get E into the Registry  */
+	CFRegistry::instance()->registerLibrary(&theLib);
+}
+
+/** This function is used to create and initate a component. 
+    @return Pointer to created instance or NULL 
+*/
+static CFComponent *
+create_me(const char *inst_name)
+{
+    assert(inst_name != NULL);
+
+    CF_Executor* e = new CF_Executor(inst_name);
+
+    return e;
+}
+
+static int
+destroy_me(CFComponent *comp)
+{
+    if (!comp) {
+        return 1;
+    }
+
+    CF_Executor *e = (CF_Executor*) comp;
+
+    delete e;
+
+    return 0;
+}
+
+/** Function called after E has been created */
+static void
+set_me_up(CFComponent *comp)
+{
+	CF_Executor* e = (CF_Executor*) comp;
+
+	CFRegistry::instance()->registerIface(comp,(IExecutor*)e);
+
+    e->setScheduler((ISchedulerServer*)
+                    CFRegistry::instance()->getCompIface("S",
+                                                         "ISchedulerServer"));
+}
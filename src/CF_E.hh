@@ -0,0 +1,183 @@
+#ifndef CF_E_HH
+#define CF_E_HH
+
+/* Copyright (c) 2007-2011  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+//=============================================================================
+//                        I N C L U D E S
+//=============================================================================
+#include "CFComponent.hh"
+#include "IExecutor.hh"
+#include "IScheduler.hh"
+
+#include <deque>
+#include <vector>
+#include <sched.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+using namespace std;
+
+//=============================================================================
+//                          M A C R O S 
+//=============================================================================
+
+// Initial number of tasks in the deque of a pool thread
+#define CF_E_DEQUE_SIZE 256
+
+//=============================================================================
+//                           T Y P E S
+//=============================================================================
+
+// Deque of tasks of a pool thread (Chase-Lev). The owner pushes and takes
+// at the bottom, the others steal at the top.
+class CF_E_Deque
+{
+public:
+    CF_E_Deque();
+    ~CF_E_Deque();
+
+    // Puts a task at the bottom (owner only)
+    void push(CFTask* task);
+    // Takes the last pushed task, or NULL (owner only)
+    CFTask* take();
+    // Steals the first pushed task, or NULL (any thread)
+    CFTask* steal();
+    // Returns true if there seems to be nothing to take
+    bool empty();
+
+private:
+    // Ring of tasks, replaced by a bigger one when full
+    struct Ring {
+        Ring(int64_t size) : mSize(size), mTasks(new atomic<CFTask*>[size]) {}
+        ~Ring() { delete [] mTasks; }
+
+        CFTask* get(int64_t i) {
+            return mTasks[i & (mSize - 1)].load(memory_order_relaxed);
+        }
+        void put(int64_t i, CFTask* t) {
+            mTasks[i & (mSize - 1)].store(t, memory_order_relaxed);
+        }
+
+        int64_t mSize;
+        atomic<CFTask*>* mTasks;
+    };
+
+    // Next task to steal
+    atomic<int64_t> mTop;
+    // Next free slot
+    atomic<int64_t> mBottom;
+    // Current ring
+    atomic<Ring*> mRing;
+    // Replaced rings, kept since thieves may still read them
+    vector<Ring*> mOldRings;
+};
+
+// A thread of the pool
+class CF_E_Worker
+{
+public:
+    CF_E_Worker(int index) : mIndex(index), mRand(index * 2654435761U + 1) {}
+
+    // Tasks of this thread
+    CF_E_Deque mDeque;
+    // Index in the pool
+    int mIndex;
+    // State of the victim picker
+    uint32_t mRand;
+    // The thread
+    thread mThread;
+};
+
+//=============================================================================
+//                     E N U M E R A T I O N S
+//=============================================================================
+
+//=============================================================================
+//                   G L O B A L  V A R I A B L E S
+//=============================================================================
+
+//=============================================================================
+//                       C O N S T A N T S 
+//=============================================================================
+
+
+/** This class implements the E (Executor) component of CompFrame */
+class CF_Executor :
+	public CFComponent,
+    public IExecutor
+{
+public:
+    // Constructor
+    CF_Executor(const char *inst_name);
+    // Destructor
+    virtual ~CF_Executor();
+
+    //
+    // IExecutor methods
+    int submit(CFTask *task, CFComponent *comp);
+    int setThreads(int num);
+
+    // Sets S, used for posting tasks back to their owners
+    void setScheduler(ISchedulerServer* s) { mScheduler = s; }
+
+private:
+    // Starts the pool threads
+    void start();
+    // Body of a pool thread
+    void work(CF_E_Worker* w);
+    // Finds a task for a pool thread, or NULL
+    CFTask* find(CF_E_Worker* w);
+    // Returns true if any task is waiting (lock held)
+    bool hasWork();
+    // Wakes up a sleeping pool thread, if any
+    void signal();
+    // Hands a task that has run back to its owner
+    void complete(CFTask* task);
+
+    // Instance name
+    string mName;
+    // Number of pool threads
+    int mNumThreads;
+    // CPU cores of the pool, as they were before the main loop was pinned
+    cpu_set_t mCpus;
+    // Pool threads
+    vector<CF_E_Worker*> mWorkers;
+    // Makes sure the pool is started once
+    once_flag mStarted;
+    // Used for getting tasks back to their owners
+    ISchedulerServer* mScheduler;
+    // Protects the tasks submitted from outside the pool, and sleeping
+    mutex mLock;
+    // Tasks submitted from outside the pool
+    deque<CFTask*> mInjected;
+    // Number of tasks in mInjected, read without the lock
+    atomic<size_t> mInjectedCount;
+    // Sleeping pool threads wait here
+    condition_variable mCond;
+    // Number of sleeping pool threads
+    atomic<int> mSleepers;
+    // Bumped for each wakeup (lock held)
+    uint64_t mWakeups;
+    // Tells the pool threads to exit
+    atomic<bool> mStop;
+};
+
+
+#endif
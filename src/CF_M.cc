@@ -29,22 +29,329 @@
 #include "ICommand.hh"
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <algorithm>
 //=============================================================================
 //                      G L O B A L  V A R I A B L E S
 //=============================================================================
 /** Number of bytes in a UUID */
 #define CF_UUID_LEN 36
 
+/** Number of I/O vectors used per write when flushing a connection
+    (two per message) */
+#define CFM_IOV_MAX 64
+
+/** Number of bytes queued on a connection that makes M write them at once
+    instead of waiting for the end of the scheduling turn */
+#define CFM_FLUSH_THRESHOLD 65536
+
+/** Milliseconds between attempts to write to a client that does not keep
+    up */
+#define CFM_RETRY 10
+
 /** Usage string from 'm' command */
-#define M_CMD_USAGE "Usage: m [-r | -l]\n"
+#define M_CMD_USAGE "Usage: m [-r | -l | -s <n> | -t | -z]\n"
 
 //=============================================================================
 //                        H E L P E R   C L A S S E S
 //=============================================================================
 
+/** Adds a piece of a message to an I/O vector, unless it has already
+    been written.
+    @param iov  I/O vector
+    @param cnt  Number of vectors used, increased if added
+    @param base Start of the piece
+    @param len  Length of the piece
+    @param skip Bytes already written, decreased by what is skipped
+*/
+static void
+addVec(struct iovec *iov, int *cnt, void *base, size_t len, size_t *skip)
+{
+    if (*skip >= len) {
+        *skip -= len;
+        return;
+    }
+
+    iov[*cnt].iov_base = (char *) base + *skip;
+    iov[(*cnt)++].iov_len = len - *skip;
+    *skip = 0;
+}
+
+/** Returns the monotonic time in nanoseconds */
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+MPeerTable::insertLowest(MPeer* p, uint32_t limit)
+{
+    uint32_t i;
+
+    for (i = 0; i < mSlots.size() && i < limit; i++) {
+        if (mSlots[i] == NULL) {
+            mSlots[i] = p;
+            mCount++;
+            return i;
+        }
+    }
+
+    if (i >= limit) {
+        return -1;
+    }
+
+    mSlots.push_back(p);
+    mCount++;
+
+    return i;
+}
+
+int
+MPeerTable::insert(MPeer* p, uint32_t limit)
+{
+    /* Reuse a closed channel. Entries may be stale if the channel
+       has been taken by insertLowest() since. */
+    while (!mFree.empty()) {
+        uint32_t c = mFree.back();
+
+        mFree.pop_back();
+
+        if (c < limit && mSlots[c] == NULL) {
+            mSlots[c] = p;
+            mCount++;
+            return c;
+        }
+    }
+
+    if (mSlots.size() >= limit) {
+        return -1;
+    }
+
+    mSlots.push_back(p);
+    mCount++;
+
+    return mSlots.size() - 1;
+}
+
+MConn::~MConn()
+{
+    drop();
+
+    free(mMsgBuff);
+
+    cf_metric_remove(mBytesIn);
+    cf_metric_remove(mBytesOut);
+    cf_metric_remove(mMsgsIn);
+    cf_metric_remove(mMsgsOut);
+}
+
+void
+MConn::addMetrics(const char *comp, const char *peer)
+{
+    char labels[128];
+
+    snprintf(labels, sizeof(labels), "conn=\"%d\",peer=\"%s\"",
+             mSocket, peer);
+
+    mBytesIn = cf_metric_add(CF_METRIC_COUNTER, comp, "bytes_in", labels,
+                             "Bytes received on the connection");
+    mBytesOut = cf_metric_add(CF_METRIC_COUNTER, comp, "bytes_out", labels,
+                              "Bytes sent on the connection");
+    mMsgsIn = cf_metric_add(CF_METRIC_COUNTER, comp, "msgs_in", labels,
+                            "Messages received on the connection");
+    mMsgsOut = cf_metric_add(CF_METRIC_COUNTER, comp, "msgs_out", labels,
+                             "Messages sent on the connection");
+}
+
+int
+MConn::buildHeader(unsigned char *hdr, uint32_t chan, int len)
+{
+    int tot_len = mHdrLen + len;
+    int i = 0;
+
+    hdr[i++] = chan & 0xFF;
+
+    if (mVersion != CF_M_VERSION_1) {
+        hdr[i++] = (chan >> 8) & 0xFF;
+        hdr[i++] = (chan >> 16) & 0xFF;
+        hdr[i++] = (chan >> 24) & 0xFF;
+    }
+
+    hdr[i++] = tot_len & 0xFF;
+    hdr[i++] = (tot_len >> 8) & 0xFF;
+
+    return i;
+}
+
+void
+MConn::queue(uint32_t chan, MBuffer *buf)
+{
+    MOut o;
+
+    o.mHdrLen = buildHeader(o.mHdr, chan, buf->mLen);
+    o.mBuf = buf;
+    o.mOff = 0;
+    o.mLen = 0;
+    buf->ref();
+
+    mOut.push_back(o);
+    mOutBytes += o.mHdrLen + buf->mLen;
+    cf_metric_inc(mMsgsOut, 1);
+}
+
+void
+MConn::append(const unsigned char *hdr, int hdrLen,
+              const unsigned char *body, int len)
+{
+    size_t off = mPending.size();
+
+    mPending.insert(mPending.end(), hdr, hdr + hdrLen);
+    mPending.insert(mPending.end(), body, body + len);
+    mOutBytes += hdrLen + len;
+    cf_metric_inc(mMsgsOut, 1);
+
+    if (!mOut.empty() && mOut.back().mBuf == NULL) {
+        /* Coalesce with the previous copied message */
+        mOut.back().mLen += hdrLen + len;
+        return;
+    }
+
+    MOut o;
+
+    o.mHdrLen = 0;
+    o.mBuf = NULL;
+    o.mOff = off;
+    o.mLen = hdrLen + len;
+
+    mOut.push_back(o);
+}
+
+int
+MConn::flush()
+{
+    struct iovec iov[CFM_IOV_MAX];
+
+    while (!mOut.empty()) {
+        size_t skip = mSent;
+        int cnt = 0;
+
+        /* One vector per copied entry, two per buffer entry */
+        for (size_t i = 0; i < mOut.size(); i++) {
+            MOut& o = mOut[i];
+
+            if (cnt + (o.mBuf ? 2 : 1) > CFM_IOV_MAX) {
+                break;
+            }
+
+            if (o.mBuf == NULL) {
+                addVec(iov, &cnt, &mPending[o.mOff], o.mLen, &skip);
+                continue;
+            }
+
+            addVec(iov, &cnt, o.mHdr, o.mHdrLen, &skip);
+            addVec(iov, &cnt, o.mBuf->mData, o.mBuf->mLen, &skip);
+        }
+
+        struct msghdr mh;
+
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = cnt;
+
+        /* Do not die from SIGPIPE if the other side is gone, and do not
+           let a slow client block the main loop */
+        ssize_t res = sendmsg(mSocket, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* The rest is written when the client has caught up */
+                return 1;
+            }
+
+            cf_error_log(__FILE__, __LINE__,
+                         "Write error on socket %d (errno=%d)!\n",
+                         mSocket, errno);
+            drop();
+            return 0;
+        }
+
+        cf_metric_inc(mBytesOut, res);
+        mOutBytes -= res;
+
+        /* Forget the messages that were written */
+        size_t done = 0;
+        size_t left = mSent + res;
+
+        for ( ; done < mOut.size(); done++) {
+            MOut& o = mOut[done];
+            size_t len = o.mBuf ? o.mHdrLen + o.mBuf->mLen : o.mLen;
+
+            if (left < len) {
+                break;
+            }
+
+            left -= len;
+
+            if (o.mBuf) {
+                o.mBuf->unref();
+            }
+        }
+
+        mOut.erase(mOut.begin(), mOut.begin() + done);
+        mSent = left;
+    }
+
+    mPending.clear();
+    mSent = 0;
+
+    return 1;
+}
+
+void
+MConn::drop()
+{
+    for (size_t i = 0; i < mOut.size(); i++) {
+        if (mOut[i].mBuf) {
+            mOut[i].mBuf->unref();
+        }
+    }
+
+    mOut.clear();
+    mPending.clear();
+    mSent = 0;
+    mOutBytes = 0;
+}
+
+MPeer*
+MPeerTable::remove(uint32_t chan)
+{
+    MPeer* p = get(chan);
+
+    if (!p) {
+        return NULL;
+    }
+
+    mSlots[chan] = NULL;
+    mFree.push_back(chan);
+    mCount--;
+
+    return p;
+}
+
 //=============================================================================
 //                        P U B L I C   M E T H O D S
 //=============================================================================
@@ -95,6 +402,13 @@ destroy_me(CFComponent* comp)
         return 1;
     }
 
+    ISchedulerServer* sIface = (ISchedulerServer*)
+        CFRegistry::instance()->getCompIface("S", "ISchedulerServer");
+
+    if (sIface) {
+        sIface->remove(comp);
+    }
+
     delete ((CF_M*) comp);
 
     return 0;
@@ -107,6 +421,7 @@ set_me_up(CFComponent* comp)
     CF_M* m = (CF_M*) comp;
 
     CFRegistry::instance()->registerIface(comp, (IMServer*) m);
+    CFRegistry::instance()->registerIface(comp, (ISchedulerClient*) m);
 
     /* Get host name */
     char* hostName = getenv("HOST");
@@ -128,6 +443,15 @@ set_me_up(CFComponent* comp)
 
 	ifC->add(comp, "m", m_cmd, M_CMD_USAGE);
 
+    /* Let S call us after the other components, to write what they
+       have sent */
+    ISchedulerServer* sIface = (ISchedulerServer*)
+        CFRegistry::instance()->getCompIface("S", "ISchedulerServer");
+
+    if (sIface) {
+        sIface->addPost(comp);
+    }
+
     /* Start up the server socket */
     if (!m->initServerSocket()) {
         cf_error_log(__FILE__, __LINE__, "Could not start M server socket!\n");
@@ -137,13 +461,31 @@ set_me_up(CFComponent* comp)
 
 CF_M::CF_M(const char *inst_name) :
         CFComponent("M"),
-        mName(inst_name)
+        mName(inst_name),
+        mRetryTimer(0),
+        mTraceEvery(0),
+        mTraceCount(0),
+        mTraceNext(0),
+        mTraceTotal(0)
 {
+    mConnMetric = cf_metric_add(CF_METRIC_GAUGE, inst_name, "connections",
+                                NULL, "Open client connections");
+    mOpenMetric = cf_metric_add(CF_METRIC_COUNTER, inst_name, "channel_opens",
+                                NULL, "Channels opened");
+    mErrorMetric = cf_metric_add(CF_METRIC_COUNTER, inst_name, "errors",
+                                 NULL, "Failed orders and broken messages");
 }
 
 
 CF_M::~CF_M()
 {
+    if (mRetryTimer) {
+        cf_timer_cancel(mRetryTimer);
+    }
+
+    cf_metric_remove(mConnMetric);
+    cf_metric_remove(mOpenMetric);
+    cf_metric_remove(mErrorMetric);
 }
 
 
@@ -157,29 +499,32 @@ CF_M::~CF_M()
 MReceiver *
 CF_M::getReceiver(const char *uuid, char *name)
 {
-    string uid(uuid);
+    CFUuid uid;
 
-    map<string, MIface*>::iterator i =  mInterfaces.find(uuid);
-
-    if (i == mInterfaces.end()) {
-        cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
-                     "Found receiver name %s with IID %s \n",
-                     name, uuid);
+    if (!name || !uid.parse(uuid)) {
         return NULL;
     }
 
-    vector<MReceiver*> v = i->second->mReceivers;
-    vector<MReceiver*>::iterator ii = v.begin();
+    return getReceiver(uid, name);
+}
+
+MReceiver *
+CF_M::getReceiver(const CFUuid& uuid, const char *name)
+{
+    unordered_map<MReceiverKey, MReceiver*, MReceiverKeyHash>::iterator i =
+        mReceiverIndex.find(MReceiverKey(uuid, name));
 
-    string tmp(name);
+    if (i == mReceiverIndex.end()) {
+        char str[CF_UUID_LEN + 1];
 
-    for (; ii != v.end(); ++ii) {
-        if ((*ii)->mName == tmp) {
-            return (*ii);
-        }
+        uuid.format(str);
+        cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
+                     "Receiver name %s with IID %s not found\n",
+                     name, str);
+        return NULL;
     }
 
-    return NULL;
+    return i->second;
 }
 
 /** Adds an interface to our list of interfaces */
@@ -200,9 +545,13 @@ CF_M::addInterface(const char *uuid, char *name)
     }
 
     /* Create and add the interface */
-    MIface* i = new MIface(uuid, name);
+    CFUuid uid;
+
+    uid.parse(uuid);
 
-    mInterfaces[i->mUuid] = i;
+    MIface* i = new MIface(uid, uuid, name);
+
+    mInterfaces[uid] = i;
 
     return i;
 }
@@ -210,7 +559,20 @@ CF_M::addInterface(const char *uuid, char *name)
 MIface* 
 CF_M::getInterface(const char* uuid)
 {
-    map<string, MIface*>::iterator i = mInterfaces.find(uuid);
+    CFUuid uid;
+
+    if (!uid.parse(uuid)) {
+        return NULL;
+    }
+
+    return getInterface(uid);
+}
+
+MIface* 
+CF_M::getInterface(const CFUuid& uuid)
+{
+    unordered_map<CFUuid, MIface*, CFUuidHash>::iterator i =
+        mInterfaces.find(uuid);
     
     if (i == mInterfaces.end()) {
         return NULL;
@@ -225,6 +587,26 @@ int
 CF_M::addReceiver(CFComponent *comp, const char *uuid, char *name, 
                   void *userData)
 {
+    return addReceiverCommon(comp, uuid, name, userData, false);
+}
+
+/** Adds a streaming receiver to our list of receivers */
+int
+CF_M::addStreamReceiver(CFComponent *comp, const char *uuid, char *name, 
+                        void *userData)
+{
+    return addReceiverCommon(comp, uuid, name, userData, true);
+}
+
+/** Adds a receiver to our list of receivers
+    @param stream If true, messages are streamed via IMStreamClient
+*/
+int
+CF_M::addReceiverCommon(CFComponent *comp, const char *uuid, char *name, 
+                        void *userData, bool stream)
+{
+    lock_guard<mutex> lock(mRegLock);
+
     /* Sanity checks */
     if (!if_ok(uuid)) {
         return 0;
@@ -251,8 +633,7 @@ CF_M::addReceiver(CFComponent *comp, const char *uuid, char *name,
         return 0;
     }
 
-    IMClient *iface = (IMClient*)
-        CFRegistry::instance()->getIface(comp, "IMClient");
+    IMClient *iface = CFRegistry::instance()->getIface<IMClient>(comp);
 
     if (!iface) {
         cf_error_log(__FILE__, __LINE__,
@@ -261,15 +642,32 @@ CF_M::addReceiver(CFComponent *comp, const char *uuid, char *name,
         return 0;
     }
 
+    IMStreamClient *sIface = NULL;
+
+    if (stream) {
+        sIface = CFRegistry::instance()->getIface<IMStreamClient>(comp);
+
+        if (!sIface) {
+            cf_error_log(__FILE__, __LINE__,
+                         "Component (%s %s) does not implement the %s "
+                         "interface!\n", uuid, name, "IMStreamClient");
+            return 0;
+        }
+    }
+
     /* Create the new receiver */
     r = new MReceiver();
     r->mVisible = true;
     r->mName.assign(name);
     r->mClient = iface;
+    r->mStream = sIface;
     r->mUserData = userData;
+    r->mIface = i;
 
     // Add receiver to interface
     i->mReceivers.push_back(r);
+    mNameIndex.insert(make_pair(r->mName, r));
+    mReceiverIndex[MReceiverKey(i->mId, name)] = r;
 
     cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
                  "Added receiver %s %s...\n", uuid, name);
@@ -281,6 +679,8 @@ CF_M::addReceiver(CFComponent *comp, const char *uuid, char *name,
 int
 CF_M::enableReceiver(const char *uuid, char *name)
 {
+    lock_guard<mutex> lock(mRegLock);
+
     /* Sanity checks */
     if (!if_ok(uuid)) {
         return 1;
@@ -307,6 +707,8 @@ CF_M::enableReceiver(const char *uuid, char *name)
 int
 CF_M::disableReceiver(const char *uuid, char *name)
 {
+    lock_guard<mutex> lock(mRegLock);
+
     /* Sanity checks */
     if (!if_ok(uuid)) {
         return 1;
@@ -333,6 +735,8 @@ CF_M::disableReceiver(const char *uuid, char *name)
 int
 CF_M::rmReceiver(const char *uuid, char *name)
 {
+    lock_guard<mutex> lock(mRegLock);
+
     /* Sanity checks */
     if (!if_ok(uuid)) {
         return 1;
@@ -353,9 +757,26 @@ CF_M::rmReceiver(const char *uuid, char *name)
 
     /** @todo We need to close down any open connections to this receiver */
 
+    CFUuid uid;
+
+    uid.parse(uuid);
+    mReceiverIndex.erase(MReceiverKey(uid, name));
+
+    pair<multimap<string, MReceiver*>::iterator,
+         multimap<string, MReceiver*>::iterator> range =
+        mNameIndex.equal_range(r->mName);
+
+    for (multimap<string, MReceiver*>::iterator n = range.first;
+         n != range.second; ++n) {
+        if (n->second == r) {
+            mNameIndex.erase(n);
+            break;
+        }
+    }
+
     vector<MReceiver*>::iterator it = i->mReceivers.begin();
     
-    for ( ; it != i->mReceivers.end(); ++i) {
+    for ( ; it != i->mReceivers.end(); ++it) {
         if (*it != r) {
             continue;
         }
@@ -364,9 +785,7 @@ CF_M::rmReceiver(const char *uuid, char *name)
         delete r;
 
         if (i->mReceivers.size() == 0) {
-            map<string, MIface*>::iterator it2 = mInterfaces.find(i->mName);
-
-            mInterfaces.erase(it2);
+            mInterfaces.erase(i->mId);
             delete i;
         }
 
@@ -376,13 +795,65 @@ CF_M::rmReceiver(const char *uuid, char *name)
     return 1;
 }
 
+/** Orders interfaces on UUID */
+static bool
+ifaceLess(const MIface* a, const MIface* b)
+{
+    return a->mId < b->mId;
+}
+
+/** Orders receivers on interface */
+static bool
+receiverIfaceLess(const MReceiver* a, const MReceiver* b)
+{
+    return a->mIface->mId < b->mIface->mId;
+}
+
+/** Formats a list of receivers as "UUID:NAME1,NAME2;UUID2:NAME3;"
+    @param recs   Receivers, sorted on interface
+    @param result String to fill in
+    @return Number of receivers
+*/
+int
+CF_M::formatReceivers(vector<MReceiver*>& recs, string& result)
+{
+    MIface *last = NULL;
+
+    result.clear();
+
+    for (size_t i = 0; i < recs.size(); i++) {
+        MReceiver *r = recs[i];
+
+        if (r->mIface != last) {
+            if (last) {
+                /* Overwrite the trailing comma */
+                result[result.size() - 1] = ';';
+            }
+
+            result.append(r->mIface->mUuid);
+            result.push_back(':');
+            last = r->mIface;
+        }
+
+        result.append(r->mName);
+        result.push_back(',');
+    }
+
+    if (last) {
+        result[result.size() - 1] = ';';
+    }
+
+    return recs.size();
+}
+
 /** Returns a list of receivers that begins with a certain name */
-char *
-CF_M::searchByName(char *name)
+int
+CF_M::searchByName(const char *name, string& result)
 {
     if (!name) {
         cf_error_log(__FILE__, __LINE__, "Name missing!\n");
-        return NULL;
+        result.clear();
+        return 0;
     }
 
     /*
@@ -398,71 +869,65 @@ CF_M::searchByName(char *name)
      * f2f0d34e-0191-47b9-817a-76f03d89e666:TEMP,TEMP2;
      */
 
-    char *tmp = NULL;
-    int pos = 0;
-    int idAdded = 0;
-    int posBefore = 0;
-    int posAfter = 0;
+    size_t len = strlen(name);
 
-    map<string, MIface*>::iterator ii =  mInterfaces.begin();
+    mMatches.clear();
 
-    for ( ; ii != mInterfaces.end(); ++ii) {
-        posBefore = pos;
+    /* All names with the prefix are next to each other in the index */
+    multimap<string, MReceiver*>::iterator i = mNameIndex.lower_bound(name);
 
-        vector<MReceiver*>::iterator ir = ii->second->mReceivers.begin();
-
-        for ( ; ir != ii->second->mReceivers.end(); ++ir) {
-            const char* recName = (*ir)->mName.c_str();
-
-            if (!strncmp(recName, name, strlen(name))) {
-                /* Found a winner */
-                if (idAdded == 0) {
-                    /* Add UUID first */
-                    tmp = (char*) realloc(tmp, pos + CF_UUID_LEN + 1);
+    for ( ; i != mNameIndex.end(); ++i) {
+        if (i->first.compare(0, len, name) != 0) {
+            break;
+        }
 
-                    if (pos == 0) {
-                        sprintf(tmp, "%s:", ii->first.c_str());
-                    }
-                    else {
-                        sprintf(&tmp[pos], "%s%s:", tmp, ii->first.c_str());
-                    }
+        mMatches.push_back(i->second);
+    }
 
-                    pos += CF_UUID_LEN + 1;
+    stable_sort(mMatches.begin(), mMatches.end(), receiverIfaceLess);
 
-                    idAdded = 1;
-                }
+    return formatReceivers(mMatches, result);
+}
 
-                /* Add the name of the receiver */
-                tmp = (char*) realloc(tmp, pos + strlen(recName) + 1);
+/** Returns a list of receivers that begins with a certain name */
+char *
+CF_M::searchByName(char *name)
+{
+    string tmp;
 
-                sprintf(&tmp[pos], "%s%s,", tmp, recName);
+    if (searchByName(name, tmp) == 0) {
+        return NULL;
+    }
 
-                pos += strlen(name) + 1;
-            }
+    return strdup(tmp.c_str());
+}
 
-        }
+/** Returns a list of receivers of an interface */
+int
+CF_M::searchByIface(const char *uuid, string& result)
+{
+    MIface *i = uuid ? getInterface(uuid) : NULL;
 
-        if (posAfter > posBefore) {
-            /* Added some stuff.. Add the trailing semi-colon
-             * (and overwrite any trailing comma) */
-            tmp[pos] = ';';
-        }
+    mMatches.clear();
 
-        /* Take next UUID */
-        idAdded = 0;
+    if (i) {
+        mMatches.assign(i->mReceivers.begin(), i->mReceivers.end());
     }
 
-    return tmp;
+    return formatReceivers(mMatches, result);
 }
 
-/** Returns a list of receivers with a specific UUID (i.e interface) */
+/** Returns a list of receivers of an interface */
 char *
 CF_M::searchByIface(const char *uuid)
 {
-    /* FIXME! */
-    (void) uuid;
+    string tmp;
 
-    return NULL;
+    if (searchByIface(uuid, tmp) == 0) {
+        return NULL;
+    }
+
+    return strdup(tmp.c_str());
 }
 
 void
@@ -474,15 +939,24 @@ CF_M::printIfacesAndReceivers()
     fprintf(stdout,
             "------------------------------------------------------\n");
     
-    map<string, MIface*>::iterator ii =  mInterfaces.begin();
+    vector<MIface*> ifaces;
+    unordered_map<CFUuid, MIface*, CFUuidHash>::iterator it =
+        mInterfaces.begin();
+
+    for ( ; it != mInterfaces.end(); ++it) {
+        ifaces.push_back(it->second);
+    }
+    sort(ifaces.begin(), ifaces.end(), ifaceLess);
+
+    vector<MIface*>::iterator ii = ifaces.begin();
 
     int x = 0;
-    for ( ; ii != mInterfaces.end(); ++ii) {
-        fprintf(stdout, "%s\n\t", ii->first.c_str());
+    for ( ; ii != ifaces.end(); ++ii) {
+        fprintf(stdout, "%s\n\t", (*ii)->mUuid.c_str());
 
-        vector<MReceiver*>::iterator ir = ii->second->mReceivers.begin();
+        vector<MReceiver*>::iterator ir = (*ii)->mReceivers.begin();
 
-        for ( ; ir != ii->second->mReceivers.end(); ++ir) {
+        for ( ; ir != (*ii)->mReceivers.end(); ++ir) {
             const char* recName = (*ir)->mName.c_str();
             fprintf(stdout, "%s (enabled=%d)  ", recName, (*ir)->mVisible);
             x++;
@@ -496,25 +970,125 @@ CF_M::printIfacesAndReceivers()
     }
 }
 
-/** The main 'M' command.*/
-static int
-m_cmd(int argc, char **argv)
+void
+CF_M::setTraceSampling(uint32_t every)
 {
-    CF_M *m = (CF_M*) CFRegistry::instance()->getCompObject("M");
+    mTraceEvery = every;
+    mTraceCount = 0;
 
-    switch (argc) {
-    case 2:
-        /* -r */
+    if (every && mTraces.empty()) {
+        mTraces.reserve(CFM_TRACE_RING);
+    }
 
-        if (!strcmp(argv[1], "-r")) {
-            m->printIfacesAndReceivers();
-            return 0;
-        }
-        else if (!strcmp(argv[1], "-l")) {
+    if (every) {
+        fprintf(stdout, "M samples 1 in %u frames.\n", every);
+    }
+    else {
+        fprintf(stdout, "M does not sample frames.\n");
+    }
+}
+
+void
+CF_M::printTraces()
+{
+    uint64_t now = now_ns();
+    uint64_t sum[4] = { 0, 0, 0, 0 };
+    size_t num = mTraces.size();
+
+    if (mTraceEvery) {
+        fprintf(stdout, "M samples 1 in %u frames, ", mTraceEvery);
+    }
+    else {
+        fprintf(stdout, "M does not sample frames, ");
+    }
+    fprintf(stdout, "%zu of %llu sampled frames kept.\n", num,
+            (unsigned long long) mTraceTotal);
+
+    if (num == 0) {
+        return;
+    }
+
+    /* Times from the read, in microseconds */
+    fprintf(stdout, "%10s %5s %10s %6s %4s %10s %10s %10s %10s\n",
+            "Age(ms)", "Sock", "Chan", "Len", "Kind",
+            "Parse(us)", "Queue(us)", "Exec(us)", "Total(us)");
+
+    /* Oldest first */
+    for (size_t n = 0; n < num; n++) {
+        const MTrace& t = mTraces[(mTraceNext + n) % num];
+        uint64_t hop[4] = {
+            t.mParsed - t.mRecv, t.mStart - t.mParsed,
+            t.mEnd - t.mStart, t.mEnd - t.mRecv
+        };
+
+        fprintf(stdout, "%10.1f %5d %10u %6d %4c %10.1f %10.1f %10.1f %10.1f\n",
+                (now - t.mRecv) / 1e6, t.mSocket, t.mChannel, t.mLen,
+                t.mKind, hop[0] / 1e3, hop[1] / 1e3, hop[2] / 1e3,
+                hop[3] / 1e3);
+
+        for (int i = 0; i < 4; i++) {
+            sum[i] += hop[i];
+        }
+    }
+
+    fprintf(stdout, "%10s %5s %10s %6s %4s %10.1f %10.1f %10.1f %10.1f\n",
+            "Mean", "", "", "", "", sum[0] / 1e3 / num, sum[1] / 1e3 / num,
+            sum[2] / 1e3 / num, sum[3] / 1e3 / num);
+}
+
+void
+CF_M::clearTraces()
+{
+    mTraces.clear();
+    mTraceNext = 0;
+    mTraceTotal = 0;
+}
+
+/** The main 'M' command.*/
+static int
+m_cmd(int argc, char **argv)
+{
+    CF_M *m = (CF_M*) CFRegistry::instance()->getCompObject("M");
+
+    switch (argc) {
+    case 2:
+        /* -r */
+
+        if (!strcmp(argv[1], "-r")) {
+            m->printIfacesAndReceivers();
+            return 0;
+        }
+        else if (!strcmp(argv[1], "-l")) {
             fprintf(stdout, "M server located at %s:%d\n",
                     m->getHostName().c_str(), m->getServerPort());
             return 0;
         }
+        else if (!strcmp(argv[1], "-t")) {
+            m->printTraces();
+            return 0;
+        }
+        else if (!strcmp(argv[1], "-z")) {
+            m->clearTraces();
+            return 0;
+        }
+        else {
+            cf_error_log(__FILE__, __LINE__, M_CMD_USAGE);
+            return 1;
+        }
+
+    case 3:
+        /* -s <n> */
+        if (!strcmp(argv[1], "-s")) {
+            unsigned int every;
+
+            if (sscanf(argv[2], "%u", &every) != 1) {
+                cf_error_log(__FILE__, __LINE__, M_CMD_USAGE);
+                return 1;
+            }
+
+            m->setTraceSampling(every);
+            return 0;
+        }
         else {
             cf_error_log(__FILE__, __LINE__, M_CMD_USAGE);
             return 1;
@@ -613,6 +1187,12 @@ handleServerSocketCallback(void *comp, int sd, void *userData,
     return ((CF_M*) comp)->handleServerSocket(sd, userData, ev);
 }
 
+static void
+retryCallback(void *userData)
+{
+    ((CF_M*) userData)->retry();
+}
+
 
 
 /** Handle all our sockets
@@ -660,6 +1240,13 @@ CF_M::handleServerSocket(int sd, void *userData, cf_sock_event_t ev)
         MConn* conn = new MConn();
         conn->mSocket = remote;
 
+        char peer[INET_ADDRSTRLEN + 8];
+
+        snprintf(peer, sizeof(peer), "%s:%d",
+                 inet_ntoa(remote_addr.sin_addr), ntohs(remote_addr.sin_port));
+        conn->addMetrics(mName.c_str(), peer);
+        cf_metric_add_to(mConnMetric, 1);
+
         mConnections[remote] = conn;
 
         /* a new connection has been established. Make sure we poll it. */
@@ -680,99 +1267,148 @@ CF_M::handleServerSocket(int sd, void *userData, cf_sock_event_t ev)
     cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
                  "Read %d bytes from socket %d.\n", n, sd);
 
-    if (n < 0) {
-        /* Fault! */
-        cf_error_log(__FILE__, __LINE__, "Read error (%d)!\n", n);
+    MConn *conn = getConnection(sd);
+
+    if (!conn) {
+        cf_error_log(__FILE__, __LINE__,
+                     "Socket %d not in lists! Fatal!\n", sd);
         return 0;
     }
 
-    MConn *conn = getConnection(sd);
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return 1;
+        }
+
+        /* Fault! Treat it as if the connection went down */
+        cf_error_log(__FILE__, __LINE__, "Read error (%d)!\n", errno);
+        cf_metric_inc(mErrorMetric, 1);
+        closeConnection(conn);
+        return 0;
+    }
 
     if (n == 0) {
         cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
                      "Closed down socket %d.\n", sd);
 
-        for (int i = 0; i < CFM_MAX_PEERS; i++) {
-            if (conn->mPeer[i] == NULL) {
-                continue;
-            }
-
-            cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
-                         "Informing peer/chan %d about disconnection...\n", i);
-            MReceiver *rec = conn->mPeer[i]->mLocalReceiver;
-
-            rec->mClient->disconnected(conn, i, rec->mUserData);
-            delete conn->mPeer[i];
-            conn->mPeer[i] = NULL;
-        }
-
-        /* The socket is closed down. Remove it from polling */
-        cf_socket_deregister(sd);
-        close(sd);
-
-        /* Go through all connections and see if someone was connected over this
-         * socket. */
-
-        if (!conn) {
-            cf_error_log(__FILE__, __LINE__,
-                         "Socket closed but not in lists! Fatal!\n", n);
-            return 0;
-        }
+        closeConnection(conn);
 
         return 1;
     }
 
+    cf_metric_inc(conn->mBytesIn, n);
+
+    /* Only read the clock if frames are sampled */
+    uint64_t readTime = mTraceEvery ? now_ns() : 0;
     int handled = 0;
 
     while (handled < n) {
         switch (conn->mState) {
         case CFM_CONN_INIT:
-            conn->mChannel = readBuff[handled++];
-            conn->mState = CFM_CONN_CHANNEL;
+            /* Collect the frame header */
+            if (conn->mHdrPos == 0) {
+                conn->mRecvTime = readTime;
+            }
+            conn->mHdr[conn->mHdrPos++] = readBuff[handled++];
 
-            cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
-                         "M message: Channel=%d (%x)\n",
-                         conn->mChannel, readBuff[0]);
+            if (conn->mHdrPos < conn->mHdrLen) {
+                break;
+            }
 
-            break;
-        case CFM_CONN_CHANNEL:
-            conn->mMsgLen = readBuff[handled++];
-            conn->mState = CFM_CONN_LENGTH1;
+            conn->mHdrPos = 0;
+            cf_metric_inc(conn->mMsgsIn, 1);
 
-            cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
-                         "M message: Length=%d (1)\n", conn->mMsgLen);
+            if (conn->mVersion == CF_M_VERSION_1) {
+                conn->mChannel = conn->mHdr[0];
+            }
+            else {
+                conn->mChannel = conn->mHdr[0] | (conn->mHdr[1] << 8) |
+                    (conn->mHdr[2] << 16) | ((uint32_t) conn->mHdr[3] << 24);
+            }
 
-            break;
-        case CFM_CONN_LENGTH1:
-            conn->mMsgLen = (readBuff[handled++] << 8) + conn->mMsgLen;
-            conn->mState = CFM_CONN_LENGTH2;
+            conn->mMsgLen = conn->mHdr[conn->mHdrLen - 2] |
+                (conn->mHdr[conn->mHdrLen - 1] << 8);
 
             cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
-                         "M message: Length=%d (2)\n", conn->mMsgLen);
+                         "M message: Channel=%u Length=%d\n",
+                         conn->mChannel, conn->mMsgLen);
+
+            if (conn->bodyLen() < 0) {
+                cf_error_log(__FILE__, __LINE__,
+                             "Bad message length (%d)!\n", conn->mMsgLen);
+                cf_metric_inc(mErrorMetric, 1);
+                conn->mMsgLen = conn->mHdrLen;
+            }
+
+            if (mTraceEvery) {
+                traceBegin(conn);
+            }
+
+            if (beginStreamToClient(conn)) {
+                /* Body goes straight to the receiver */
+                break;
+            }
 
-            break;
-        case CFM_CONN_LENGTH2:
             /* Allocate message buffer */
-            conn->mMsgBuff = (unsigned char*) malloc(conn->mMsgLen * 
-                                                     sizeof(unsigned char));
+            conn->mMsgBuff = (unsigned char*) malloc(conn->bodyLen() + 1);
             /* NULL terminate just to be safe */
             conn->mMsgBuff[0] = 0;
             conn->mMsgPos = 0;
-            conn->mState = CFM_CONN_MSGBODY;
+            conn->mState = conn->bodyLen() == 0 ?
+                CFM_CONN_MSGREADY : CFM_CONN_MSGBODY;
 
             break;
         case CFM_CONN_MSGBODY:
-            conn->mMsgBuff[conn->mMsgPos++] = readBuff[handled++];
+        {
+            /* Copy as much of the body as we have got */
+            int left = conn->bodyLen() - conn->mMsgPos;
+            int part = n - handled;
+
+            if (part > left) {
+                part = left;
+            }
 
-            if ((conn->mMsgPos + 3) == conn->mMsgLen) {
+            memcpy(&conn->mMsgBuff[conn->mMsgPos], &readBuff[handled], part);
+
+            handled += part;
+            conn->mMsgPos += part;
+
+            if (conn->mMsgPos == conn->bodyLen()) {
                 /* All bytes are in there! */
                 cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
                              "M message: All bytes there\n");
 
+                conn->mMsgBuff[conn->mMsgPos] = 0;
                 conn->mState = CFM_CONN_MSGREADY;
             }
 
             break;
+        }
+        case CFM_CONN_STREAMBODY:
+        {
+            /* Hand over as much of the body as we have got */
+            MReceiver *rec = conn->mPeers.get(conn->mChannel)->mLocalReceiver;
+            int left = conn->bodyLen() - conn->mMsgPos;
+            int part = n - handled;
+
+            if (part > left) {
+                part = left;
+            }
+
+            rec->mStream->chunk(conn, conn->mChannel, part,
+                                &readBuff[handled], rec->mUserData);
+
+            handled += part;
+            conn->mMsgPos += part;
+
+            if (conn->mMsgPos == conn->bodyLen()) {
+                rec->mStream->end(conn, conn->mChannel, 1, rec->mUserData);
+                conn->mState = CFM_CONN_INIT;
+                traceEnd(conn);
+            }
+
+            break;
+        }
         default:
             cf_error_log(__FILE__, __LINE__, "Error in message handling!\n");
             break;
@@ -783,10 +1419,16 @@ CF_M::handleServerSocket(int sd, void *userData, cf_sock_event_t ev)
             cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
                          "M message ready.\n");
 
-            if (conn->mChannel == CFM_M_CHANNEL) {
+            if (conn->mTraced) {
+                conn->mTrace.mParsed = now_ns();
+            }
+
+            if (conn->mChannel == conn->controlChannel()) {
                 cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
                              "M control message.\n");
 
+                traceStart(conn, 'c');
+
                 if (conn->mIsM) {
                     /* A remote M component is connected */
                     handleRemoteMsg(conn, sd);
@@ -801,9 +1443,12 @@ CF_M::handleServerSocket(int sd, void *userData, cf_sock_event_t ev)
             else {
                 cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
                              "Passing message to client.\n");
+                traceStart(conn, 'm');
                 passMessageToClient(conn);
             }
 
+            traceEnd(conn);
+
             free(conn->mMsgBuff);
             conn->mMsgBuff = NULL;
             conn->mState = CFM_CONN_INIT;
@@ -839,64 +1484,89 @@ CF_M::handleRemoteMsg(MConn* conn, int sd)
 int
 CF_M::handleClientMessage(MConn * conn, int sd)
 {
-    unsigned char iid[CF_UUID_LEN + 1];
+    char iid[CF_UUID_LEN + 1];
     unsigned char *msg = conn->mMsgBuff;
+    int len = conn->bodyLen();
     char *name = NULL;
     MReceiver *rec = NULL;
 
+    (void) sd;
+
+    if (len < 1) {
+        cf_error_log(__FILE__, __LINE__, "Empty M control message!\n");
+        return 0;
+    }
+
     switch (msg[0]) {
     case CF_M_CHANNEL_OPEN:
     {
-        memcpy(&iid[0], &msg[1], CF_UUID_LEN);
+        /* The UUID is parsed once, only version 1 and 2 send it as text */
+        CFUuid uid;
+        int idLen = (conn->mVersion == CF_M_VERSION_3) ?
+            CFM_UUID_BIN_LEN : CF_UUID_LEN;
+
+        if (len < 1 + idLen + 1 || msg[len - 1] != 0 ||
+            (idLen == CF_UUID_LEN && !uid.parse((char *) &msg[1]))) {
+            sendResponse(conn,
+                         CF_M_CHANNEL_OPEN,
+                         CF_M_CHANNEL_OPEN_FAIL,
+                         CF_M_COMP_NOT_FOUND, 0, "Bad request!\n");
+            return 0;
+        }
 
-        iid[CF_UUID_LEN] = 0;
+        if (idLen == CFM_UUID_BIN_LEN) {
+            uid.fromBytes(&msg[1]);
+        }
+
+        /* Only traced, so only formatted when traced */
+        if (cf_trace_level_get() >= CF_TRACE_DEBUG) {
+            uid.format(iid);
+        }
 
-        name = (char *) &msg[37];
+        name = (char *) &msg[1 + idLen];
 
-        rec = getReceiver((char *) iid, name);
+        rec = getReceiver(uid, name);
 
         if (!rec) {
             cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
                          "CF_M_CHANNEL_OPEN to %s %s FAILED!\n", iid, name);
 
-            sendResponse(sd,
+            sendResponse(conn,
                          CF_M_CHANNEL_OPEN,
                          CF_M_CHANNEL_OPEN_FAIL,
-                         CF_M_COMP_NOT_FOUND, "Component not found!\n");
+                         CF_M_COMP_NOT_FOUND, 0, "Component not found!\n");
             return 0;
         }
 
-        int newChan = -1;
-
         /* Component there.. get free channel */
-        for (int i = 0; i < CFM_MAX_CHANNELS; i++) {
-            if (conn->mPeer[i] == NULL) {
-                /* Found empty slot */
-                newChan = i;
-                break;
-            }
+        MPeer *newPeer = new MPeer();
+        int newChan;
+
+        if (conn->mVersion == CF_M_VERSION_1) {
+            newChan = conn->mPeers.insertLowest(newPeer, CFM_MAX_CHANNELS);
+        }
+        else {
+            newChan = conn->mPeers.insert(newPeer, CFM_MAX_CHANNELS_V2);
         }
 
         if (newChan == -1) {
             /* No new channel to be found */
+            delete newPeer;
 
             cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
                          "CF_M_CHANNEL_OPEN to %s %s FAILED...\n", iid, name);
 
-            sendResponse(sd,
+            sendResponse(conn,
                          CF_M_CHANNEL_OPEN,
                          CF_M_CHANNEL_OPEN_FAIL,
-                         CF_M_OUT_OF_CHANNELS, "Out of channels!\n");
+                         CF_M_OUT_OF_CHANNELS, 0, "Out of channels!\n");
             return 0;
         }
 
-        /* Create new peer and insert it. */
-        MPeer *newPeer = new MPeer();
-
-        conn->mPeer[newChan] = newPeer;
         newPeer->mChannel = newChan;
-        newPeer->mSocket = sd;
+        newPeer->mSocket = conn->mSocket;
         newPeer->mLocalReceiver = rec;
+        newPeer->mConn = conn;
 
         /* Call open callback on receiver */
         int res = rec->mClient->connected(conn, newChan, rec->mUserData);
@@ -907,14 +1577,13 @@ CF_M::handleClientMessage(MConn * conn, int sd)
             cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
                          "CF_M_CHANNEL_OPEN to %s %s FAILED...\n", iid, name);
 
-            sendResponse(sd,
+            sendResponse(conn,
                          CF_M_CHANNEL_OPEN,
                          CF_M_CHANNEL_OPEN_FAIL,
-                         CF_M_COULD_NOT_CONNECT, "Connection failed!\n");
+                         CF_M_COULD_NOT_CONNECT, 0, "Connection failed!\n");
 
             /* Remove the newly installed peer */
-            conn->mPeer[newChan] = NULL;
-            delete newPeer;
+            delete conn->mPeers.remove(newChan);
         }
         else {
             /* Managed to open channel */
@@ -923,29 +1592,49 @@ CF_M::handleClientMessage(MConn * conn, int sd)
                          "CF_M_CHANNEL_OPEN to %s %s SUCCEEDED...\n", iid,
                          name);
 
-            sendResponse(sd,
+            sendResponse(conn,
                          CF_M_CHANNEL_OPEN,
                          CF_M_CHANNEL_OPEN_OK,
-                         CF_M_CHANNEL_OPEN_OK, "Channel open OK!!\n");
+                         CF_M_CHANNEL_OPEN_OK, newChan, "Channel open OK!!\n");
         }
 
         break;
     }
     case CF_M_CHANNEL_CLOSE:
     {
-        int chan = msg[1];
+        uint32_t chan;
 
-        if (conn->mPeer[chan] == NULL) {
-            sendResponse(sd,
+        if (conn->mVersion == CF_M_VERSION_1) {
+            chan = len > 1 ? msg[1] : CFM_M_CHANNEL;
+        }
+        else {
+            chan = len > 4 ? (msg[1] | (msg[2] << 8) | (msg[3] << 16) |
+                              ((uint32_t) msg[4] << 24)) : CFM_M_CHANNEL_V2;
+        }
+
+        if (conn->mPeers.get(chan) == NULL) {
+            sendResponse(conn,
                          CF_M_CHANNEL_CLOSE,
                          CF_M_CHANNEL_CLOSE_FAIL,
-                         CF_M_COMP_NOT_FOUND,
+                         CF_M_COMP_NOT_FOUND, chan,
                          "Component not found!!\n");
 
             return 0;
         }
 
-        rec = (MReceiver *) conn->mPeer[chan]->mLocalReceiver;
+        if (conn->mPeers.get(chan)->mTopic) {
+            /* End of subscription */
+            unsubscribe(conn->mPeers.get(chan));
+
+            sendResponse(conn,
+                         CF_M_CHANNEL_CLOSE,
+                         CF_M_CHANNEL_CLOSE_OK,
+                         CF_M_CHANNEL_CLOSE_OK, chan,
+                         "Channel closed OK!!\n");
+            break;
+        }
+
+        rec = (MReceiver *) conn->mPeers.get(chan)->mLocalReceiver;
 
         cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
                      "CF_M_CHANNEL_CLOSE to %s...\n", rec->mName.c_str());
@@ -955,39 +1644,146 @@ CF_M::handleClientMessage(MConn * conn, int sd)
 
         if (res == 0) {
             /* Failed to close */
-            sendResponse(sd,
+            sendResponse(conn,
                          CF_M_CHANNEL_CLOSE,
                          CF_M_CHANNEL_CLOSE_FAIL,
-                         CF_M_CHANNEL_CLOSE_FAIL,
+                         CF_M_CHANNEL_CLOSE_FAIL, chan,
                          "Could not close!!\n");
 
         }
         else {
-            sendResponse(sd,
+            sendResponse(conn,
                          CF_M_CHANNEL_CLOSE,
                          CF_M_CHANNEL_CLOSE_OK,
-                         CF_M_CHANNEL_CLOSE_OK,
+                         CF_M_CHANNEL_CLOSE_OK, chan,
                          "Channel closed OK!!\n");
         }
 
         /* Remove the peer!  */
-        delete conn->mPeer[chan];
-        conn->mPeer[chan] = NULL;
+        delete conn->mPeers.remove(chan);
 
         break;
     }
+    case CF_M_SUBSCRIBE:
+    {
+        if (len < 2 || msg[len - 1] != 0) {
+            sendResponse(conn,
+                         CF_M_SUBSCRIBE,
+                         CF_M_SUBSCRIBE_FAIL,
+                         CF_M_COMP_NOT_FOUND, 0, "Bad request!\n");
+            return 0;
+        }
+
+        return subscribe(conn, (const char *) &msg[1]);
+    }
+    case CF_M_VERSION:
+    {
+        int version = len > 1 ? msg[1] : 0;
+
+        if (version != CF_M_VERSION_1 && version != CF_M_VERSION_2 &&
+            version != CF_M_VERSION_3) {
+            sendResponse(conn,
+                         CF_M_VERSION,
+                         CF_M_VERSION_FAIL,
+                         conn->mVersion, 0, "Version not supported!!\n");
+            return 0;
+        }
+
+        /* Open channels were numbered with the framing in use */
+        if (conn->mPeers.count() != 0) {
+            sendResponse(conn,
+                         CF_M_VERSION,
+                         CF_M_VERSION_FAIL,
+                         conn->mVersion, 0, "Channels are open!!\n");
+            return 0;
+        }
+
+        /* The response goes out with the old framing */
+        sendResponse(conn,
+                     CF_M_VERSION,
+                     CF_M_VERSION_OK,
+                     version, 0, "Version OK!!\n");
+
+        cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
+                     "Connection %d now uses M protocol version %d\n",
+                     conn->mSocket, version);
+
+        conn->mVersion = version;
+        conn->mHdrLen = (version == CF_M_VERSION_1) ?
+            CFM_HDR_LEN_V1 : CFM_HDR_LEN_V2;
+        break;
+    }
     default:
         /* Unknown message */
-        sendResponse(sd,
+        sendResponse(conn,
                      CF_M_CHANNEL_ORDER_UNKNOWN,
                      CF_M_CHANNEL_ORDER_UNKNOWN,
-                     CF_M_CHANNEL_ORDER_UNKNOWN, "Unknown command!!\n");
+                     CF_M_CHANNEL_ORDER_UNKNOWN, 0, "Unknown command!!\n");
         break;
     }
 
     return 1;
 }
 
+/** Samples the frame whose header was just read, if it is its turn
+    @param conn  Connection of the frame
+*/
+void
+CF_M::traceBegin(MConn * conn)
+{
+    if (++mTraceCount < mTraceEvery) {
+        return;
+    }
+
+    mTraceCount = 0;
+
+    conn->mTraced = true;
+    conn->mTrace = MTrace();
+    /* Sampling may have been turned on after the first byte was read */
+    conn->mTrace.mRecv = conn->mRecvTime ? conn->mRecvTime : now_ns();
+    conn->mTrace.mSocket = conn->mSocket;
+    conn->mTrace.mChannel = conn->mChannel;
+    conn->mTrace.mLen = conn->bodyLen();
+}
+
+/** Marks a sampled frame as handed over
+    @param conn  Connection of the frame
+    @param kind  Kind of frame, see MTrace
+*/
+void
+CF_M::traceStart(MConn * conn, char kind)
+{
+    if (!conn->mTraced) {
+        return;
+    }
+
+    conn->mTrace.mKind = kind;
+    conn->mTrace.mStart = now_ns();
+}
+
+/** Marks a sampled frame as done, and keeps it in the ring
+    @param conn  Connection of the frame
+*/
+void
+CF_M::traceEnd(MConn * conn)
+{
+    if (!conn->mTraced) {
+        return;
+    }
+
+    conn->mTraced = false;
+    conn->mTrace.mEnd = now_ns();
+    mTraceTotal++;
+
+    if (mTraces.size() < CFM_TRACE_RING) {
+        mTraces.push_back(conn->mTrace);
+        return;
+    }
+
+    mTraces[mTraceNext] = conn->mTrace;
+    mTraceNext = (mTraceNext + 1) % CFM_TRACE_RING;
+}
+
 /** Handles messages meant for registered message receivers
     @param this  This context
     @param conn  Connection to handle
@@ -997,51 +1793,287 @@ CF_M::handleClientMessage(MConn * conn, int sd)
 int
 CF_M::passMessageToClient(MConn * conn)
 {
-    MReceiver *rec = conn->mPeer[conn->mChannel]->mLocalReceiver;
+    MPeer *p = conn->mPeers.get(conn->mChannel);
+
+    if (!p || !p->mLocalReceiver) {
+        cf_error_log(__FILE__, __LINE__,
+                     "Message on closed or subscribed channel %u!\n",
+                     conn->mChannel);
+        cf_metric_inc(mErrorMetric, 1);
+        return 0;
+    }
+
+    MReceiver *rec = p->mLocalReceiver;
 
     return rec->mClient->message(conn, conn->mChannel,
-                                 conn->mMsgLen, conn->mMsgBuff, rec->mUserData);
+                                 conn->bodyLen(), conn->mMsgBuff,
+                                 rec->mUserData);
 }
 
-/** Send a message to the other side */
+/** Starts delivery of a message body to a streaming receiver. Called when
+    the frame header has been read.
+    @param conn  Connection to handle
+    @return 1 if the body will be streamed, 0 if it should be assembled
+*/
 int
-CF_M::sendResponse(int sd, int order, int result, int response,
-                   char *responseText)
+CF_M::beginStreamToClient(MConn * conn)
 {
-    unsigned char header[6];
-    int len = 5;
-    struct iovec iov[2];
+    MPeer *p = conn->mPeers.get(conn->mChannel);
 
-    if (responseText) {
-        len += strlen(responseText) + 1;
+    if (!p || !p->mLocalReceiver || !p->mLocalReceiver->mStream) {
+        return 0;
     }
 
-    header[0] = CFM_M_CHANNEL;
-    header[1] = (len & 0xFF);
-    header[2] = (len >> 8) & 0xFF;
-    header[3] = order;
-    header[4] = result;
-    header[5] = response;
+    MReceiver *rec = p->mLocalReceiver;
 
-    int wSize = 0;
+    cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
+                 "Streaming %d bytes to %s.\n", conn->bodyLen(),
+                 rec->mName.c_str());
 
-    if (len == 6) {
-        wSize = write(sd, header, 5);
+    if (conn->mTraced) {
+        conn->mTrace.mParsed = now_ns();
+    }
+    traceStart(conn, 's');
+
+    rec->mStream->begin(conn, conn->mChannel, conn->bodyLen(),
+                        rec->mUserData);
+
+    conn->mMsgPos = 0;
+
+    if (conn->bodyLen() == 0) {
+        /* Nothing more to come */
+        rec->mStream->end(conn, conn->mChannel, 1, rec->mUserData);
+        conn->mState = CFM_CONN_INIT;
+        traceEnd(conn);
     }
     else {
-        iov[0].iov_base = header;
-        iov[0].iov_len = 6;
-        iov[1].iov_base = responseText;
-        iov[1].iov_len = strlen(responseText) + 1;
+        conn->mState = CFM_CONN_STREAMBODY;
+    }
+
+    return 1;
+}
+
+/** Adds a subscription to a topic on a new channel and responds to
+    the subscriber
+    @param conn  Connection of subscriber
+    @param topic Name of topic
+    @return 1 if OK, 0 if failure
+*/
+int
+CF_M::subscribe(MConn * conn, const char *topic)
+{
+    MPeer *p = new MPeer();
+    int chan;
+
+    if (conn->mVersion == CF_M_VERSION_1) {
+        chan = conn->mPeers.insertLowest(p, CFM_MAX_CHANNELS);
+    }
+    else {
+        chan = conn->mPeers.insert(p, CFM_MAX_CHANNELS_V2);
+    }
+
+    if (chan == -1) {
+        delete p;
+
+        sendResponse(conn,
+                     CF_M_SUBSCRIBE,
+                     CF_M_SUBSCRIBE_FAIL,
+                     CF_M_OUT_OF_CHANNELS, 0, "Out of channels!\n");
+        return 0;
+    }
+
+    MTopic *t;
+    unordered_map<string, MTopic*>::iterator i = mTopics.find(topic);
+
+    if (i == mTopics.end()) {
+        t = new MTopic(topic);
+        mTopics[t->mName] = t;
+    }
+    else {
+        t = i->second;
+    }
 
-        wSize = writev(sd, iov, 2);
+    p->mChannel = chan;
+    p->mSocket = conn->mSocket;
+    p->mConn = conn;
+    p->mTopic = t;
+    p->mTopicPos = t->mSubscribers.size();
+
+    t->mSubscribers.push_back(p);
+
+    cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
+                 "Subscription to %s on channel %d (%u subscribers)\n",
+                 topic, chan, (unsigned) t->mSubscribers.size());
+
+    sendResponse(conn,
+                 CF_M_SUBSCRIBE,
+                 CF_M_SUBSCRIBE_OK,
+                 CF_M_SUBSCRIBE_OK, chan, "Subscription OK!!\n");
+
+    return 1;
+}
+
+/** Removes a subscription. The peer is removed from its connection and
+    deleted. */
+void
+CF_M::unsubscribe(MPeer * p)
+{
+    MTopic *t = p->mTopic;
+
+    /* Move the last subscriber into the hole */
+    MPeer *last = t->mSubscribers.back();
+
+    t->mSubscribers[p->mTopicPos] = last;
+    last->mTopicPos = p->mTopicPos;
+    t->mSubscribers.pop_back();
+
+    if (t->mSubscribers.empty()) {
+        mTopics.erase(t->mName);
+        delete t;
+    }
+
+    delete p->mConn->mPeers.remove(p->mChannel);
+}
+
+int
+CF_M::publish(const char *topic, int len, unsigned char *msg)
+{
+    if (!topic || len < 0 || (len > 0 && !msg)) {
+        cf_error_log(__FILE__, __LINE__, "Bad parameters!\n");
+        return -1;
+    }
+
+    if (len + CFM_HDR_LEN_V2 > 0xFFFF) {
+        cf_error_log(__FILE__, __LINE__, "Bad message length (%d)!\n", len);
+        return -1;
+    }
+
+    unordered_map<string, MTopic*>::iterator i = mTopics.find(topic);
+
+    if (i == mTopics.end()) {
+        return 0;
+    }
+
+    vector<MPeer*>& subs = i->second->mSubscribers;
+
+    /* One copy of the body for everyone */
+    MBuffer *buf = new MBuffer(len, msg);
+
+    for (size_t s = 0; s < subs.size(); s++) {
+        MConn *conn = subs[s]->mConn;
+
+        conn->queue(subs[s]->mChannel, buf);
+        flushLater(conn, false);
+    }
+
+    buf->unref();
+
+    return subs.size();
+}
+
+/** Cleans up after a connection that has gone down. Receivers are told
+    about their closed channels and subscriptions are removed.
+    @param conn Connection, deleted when done
+*/
+void
+CF_M::closeConnection(MConn * conn)
+{
+    int sd = conn->mSocket;
+
+    if (conn->mState == CFM_CONN_STREAMBODY) {
+        /* Went down in the middle of a streamed message */
+        MReceiver *rec = conn->mPeers.get(conn->mChannel)->mLocalReceiver;
+
+        rec->mStream->end(conn, conn->mChannel, 0, rec->mUserData);
+    }
+
+    for (uint32_t i = 0; i < conn->mPeers.slots(); i++) {
+        MPeer *p = conn->mPeers.get(i);
+
+        if (p == NULL) {
+            continue;
+        }
+
+        if (p->mTopic) {
+            unsubscribe(p);
+            continue;
+        }
+
+        cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
+                     "Informing peer/chan %u about disconnection...\n", i);
+        MReceiver *rec = p->mLocalReceiver;
+
+        rec->mClient->disconnected(conn, i, rec->mUserData);
+        delete conn->mPeers.remove(i);
+    }
+
+    /* The socket is closed down. Remove it from polling */
+    cf_socket_deregister(sd);
+    close(sd);
+
+    if (conn->mDirty) {
+        mDirty.erase(find(mDirty.begin(), mDirty.end(), conn));
+    }
+
+    mConnections.erase(sd);
+    delete conn;
+    cf_metric_add_to(mConnMetric, -1);
+}
+
+/** Send a response to a control message to the other side */
+int
+CF_M::sendResponse(MConn * conn, int order, int result, int response,
+                   uint32_t chan, const char *responseText)
+{
+    unsigned char header[CFM_HDR_LEN_V2 + 7];
+    int len = 3;
+
+    if (conn->mVersion != CF_M_VERSION_1) {
+        /* Tell which channel it was about */
+        len += 4;
+    }
+
+    int textLen = responseText ? strlen(responseText) + 1 : 0;
+    int pos = conn->buildHeader(header, conn->controlChannel(), len + textLen);
+
+    header[pos++] = order;
+    header[pos++] = result;
+    header[pos++] = response;
+
+    switch (result) {
+    case CF_M_CHANNEL_OPEN_OK:
+        cf_metric_inc(mOpenMetric, 1);
+        break;
+    case CF_M_CHANNEL_OPEN_FAIL:
+    case CF_M_CHANNEL_CLOSE_FAIL:
+    case CF_M_VERSION_FAIL:
+    case CF_M_SUBSCRIBE_FAIL:
+        cf_metric_inc(mErrorMetric, 1);
+        break;
+    default:
+        break;
+    }
+
+    if (conn->mVersion != CF_M_VERSION_1) {
+        header[pos++] = chan & 0xFF;
+        header[pos++] = (chan >> 8) & 0xFF;
+        header[pos++] = (chan >> 16) & 0xFF;
+        header[pos++] = (chan >> 24) & 0xFF;
+    }
+
+    /* Goes out after anything already queued */
+    conn->append(header, pos, (const unsigned char *) responseText, textLen);
+
+    if (!flushLater(conn, true)) {
+        cf_error_log(__FILE__, __LINE__, "Failed to send response!\n");
+        return 1;
     }
 
     return 0;
 }
 
 int 
-CF_M::sendToReceiver(void* c, uint8_t chan, int len, unsigned char *msg)
+CF_M::sendToReceiver(void* c, uint32_t chan, int len, unsigned char *msg)
 {
     MConn* conn = (MConn*) c;
 
@@ -1050,32 +2082,129 @@ CF_M::sendToReceiver(void* c, uint8_t chan, int len, unsigned char *msg)
         return 0;
     }
 
-    MPeer *p = conn->mPeer[chan];
-    unsigned char newMsg[3];
-    int tot_len = 3 + len;
+    MPeer *p = conn->mPeers.get(chan);
+
+    if (p == NULL) {
+        cf_error_log(__FILE__, __LINE__, "Channel %u is not open!\n", chan);
+        return 0;
+    }
+
+    if (len < 0 || len + conn->mHdrLen > 0xFFFF) {
+        cf_error_log(__FILE__, __LINE__, "Bad message length (%d)!\n", len);
+        return 0;
+    }
+
+    unsigned char newMsg[CFM_HDR_LEN_V2];
 
     cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
                  "Sending on channel %u\n", chan);
 
-    newMsg[0] = chan;
-    newMsg[1] = tot_len & 0xFF;
-    newMsg[2] = (tot_len >> 8) & 0xFF;
+    conn->append(newMsg, conn->buildHeader(newMsg, chan, len), msg, len);
 
-    struct iovec io[2];
+    bool now = p->mLocalReceiver && !p->mLocalReceiver->mBatch;
 
-    io[0].iov_base = newMsg;
-    io[0].iov_len = 3;
+    if (!flushLater(conn, now)) {
+        cf_error_log(__FILE__, __LINE__, "Failed to send message to client!\n");
+        return 0;
+    }
 
-    io[1].iov_base = msg;
-    io[1].iov_len = len;
+    return 1;
 
-    if (writev(p->mSocket, io, 2) < 0) {
-        cf_error_log(__FILE__, __LINE__, "Failed to send message to client!\n");
+}
+
+/** Makes sure queued data on a connection is written. Unless told to
+    write at once, it is left for flush() until enough has been queued.
+    @param conn Connection
+    @param now  True if data shall be written at once
+    @return 1 if OK, 0 if failure
+*/
+int
+CF_M::flushLater(MConn * conn, bool now)
+{
+    if (now || conn->mOutBytes >= CFM_FLUSH_THRESHOLD) {
+        if (!conn->flush()) {
+            return 0;
+        }
+
+        if (conn->mOut.empty()) {
+            return 1;
+        }
+
+        /* The client does not keep up, retry with the others */
+    }
+
+    if (!conn->mDirty) {
+        conn->mDirty = true;
+        mDirty.push_back(conn);
+    }
+
+    return 1;
+}
+
+int
+CF_M::flush()
+{
+    int result = 1;
+    size_t left = 0;
+
+    for (size_t i = 0; i < mDirty.size(); i++) {
+        MConn* conn = mDirty[i];
+
+        if (!conn->flush()) {
+            result = 0;
+        }
+
+        /* Keep the ones with data the client did not take */
+        if (conn->mOut.empty()) {
+            conn->mDirty = false;
+        }
+        else {
+            mDirty[left++] = conn;
+        }
+    }
+
+    mDirty.resize(left);
+
+    /* The loop may sleep, make sure it wakes up to retry */
+    if (left > 0 && !mRetryTimer) {
+        mRetryTimer = cf_timer_add(CFM_RETRY, retryCallback, this);
+    }
+
+    return result;
+}
+
+void
+CF_M::retry()
+{
+    mRetryTimer = 0;
+    flush();
+}
+
+int
+CF_M::setBatching(const char *uuid, char *name, int on)
+{
+    lock_guard<mutex> lock(mRegLock);
+
+    MReceiver *r = getReceiver(uuid, name);
+
+    if (!r) {
+        cf_error_log(__FILE__, __LINE__, "Receiver not found!\n");
         return 0;
     }
 
+    r->mBatch = on ? true : false;
+
     return 1;
+}
 
+/** Called by S after all other components have executed. Writes what
+    they have sent. */
+void
+CF_M::execute(uint32_t slice)
+{
+    (void) slice;
+
+    flush();
 }
 
 /** Performs some checks to see if an interface and a name seems 
@@ -1090,7 +2219,9 @@ if_ok(const char *uuid)
         cf_error_log(__FILE__, __LINE__, "Interface UUID missing!\n");
         return 0;
     }
-    if (strlen(uuid) != CF_UUID_LEN) {
+    CFUuid tmp;
+
+    if (strlen(uuid) != CF_UUID_LEN || !tmp.parse(uuid)) {
         cf_error_log(__FILE__, __LINE__, "Bad UUID! (%s)\n", uuid);
         return 0;
     }
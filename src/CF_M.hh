@@ -21,22 +21,37 @@
 
 #include "IMServer.hh"
 #include "IMClient.hh"
+#include "IMStreamClient.hh"
+#include "IScheduler.hh"
 #include "CFComponent.hh"
 #include "compframe.h"
 #include "compframe_sockets.h"
+#include "compframe_metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include "CFUuid.hh"
 #include <map>
 #include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
 using namespace std;
 
 /** @addtogroup m M - Message Transport
  *  @{
  */
 
+class MIface;
+
+/** Number of traced frames kept */
+#define CFM_TRACE_RING 1024
+
 // Used for storing receivers
 class MReceiver 
 {
 public:
-    MReceiver() : mVisible(false), mName(""), mUserData(NULL), mClient(NULL) {}
+    MReceiver() : mVisible(false), mName(""), mUserData(NULL), mClient(NULL),
+                  mStream(NULL), mIface(NULL), mBatch(true) {}
    // Flag if visible
     bool mVisible;
     // Name
@@ -45,6 +60,37 @@ public:
     void* mUserData;
     // Pointer to client
     IMClient* mClient;
+    // Pointer to streaming client (NULL if messages are assembled)
+    IMStreamClient* mStream;
+    // Interface the receiver belongs to
+    MIface* mIface;
+    // Flag if messages to the receiver's peers may be batched
+    bool mBatch;
+};
+
+// Key used for looking up a receiver
+class MReceiverKey
+{
+public:
+    MReceiverKey(const CFUuid& uuid, const char *name) :
+        mUuid(uuid), mName(name) {}
+
+    bool operator==(const MReceiverKey& x) const {
+        return mUuid == x.mUuid && mName == x.mName;
+    }
+
+    // Interface UUID
+    CFUuid mUuid;
+    // Receiver name
+    string mName;
+};
+
+// Hash functor for MReceiverKey
+struct MReceiverKeyHash
+{
+    size_t operator()(const MReceiverKey& k) const {
+        return k.mUuid.hash() ^ (hash<string>()(k.mName) * 31);
+    }
 };
 
 // Type used for storing an interface 
@@ -52,8 +98,11 @@ class MIface
 {
 public:
     // Constructor
-    MIface(const char *uuid, char *name) : mUuid(uuid), mName(name) { }
+    MIface(const CFUuid& id, const char *uuid, char *name) :
+        mId(id), mUuid(uuid), mName(name) { }
     // UUID of interface
+    CFUuid mId;
+    // UUID of interface, as registered (for printing)
     string mUuid;
     // Name
     string mName;
@@ -62,20 +111,52 @@ public:
 
 };
 
+class MTopic;
+class MConn;
+
+/** Reference counted message buffer. Used when the same message is sent
+    on many channels. */
+class MBuffer
+{
+public:
+    MBuffer(int len, const unsigned char *data) : mRef(1), mLen(len) {
+        mData = (unsigned char*) malloc(len > 0 ? len : 1);
+        memcpy(mData, data, len);
+    }
+    ~MBuffer() { free(mData); }
+
+    /** Adds a reference */
+    void ref() { mRef++; }
+    /** Drops a reference, deletes the buffer when the last one is gone */
+    void unref() {
+        if (--mRef == 0) {
+            delete this;
+        }
+    }
+
+    /** Number of references */
+    int mRef;
+    /** Length of data */
+    int mLen;
+    /** The data */
+    unsigned char *mData;
+};
+
 /** Used for keeping track of users of a specified connection */
 class MPeer 
 {
 public:
-    MPeer() : mSocket(-1), mChannel(-1),
+    MPeer() : mSocket(-1), mChannel(0),
               mLocalReceiver(NULL), mOpen(NULL),
               mClose(NULL), mError(NULL), mMsg(NULL),
-              mUserData(NULL) {
+              mUserData(NULL), mConn(NULL), mTopic(NULL),
+              mTopicPos(0) {
     }
 
     /** Socket descriptor */
     int mSocket;
     /**  Channel used */
-    int mChannel;
+    uint32_t mChannel;
     /** Pointer to locally connected receiver  */
     MReceiver *mLocalReceiver;
     /** Will be called when connection is opened */
@@ -88,17 +169,111 @@ public:
     cfm_callback_msg_t mMsg;
     /** Will be returned to user in callbacks */
     void *mUserData;
+    /** Connection of the peer */
+    MConn *mConn;
+    /** Topic, if the channel is a subscription */
+    MTopic *mTopic;
+    /** Position in the topic's list of subscribers */
+    uint32_t mTopicPos;
+};
+
+/** Timestamps of a sampled frame, in monotonic nanoseconds */
+class MTrace
+{
+public:
+    MTrace() : mRecv(0), mParsed(0), mStart(0), mEnd(0), mSocket(-1),
+               mChannel(0), mLen(0), mKind(0) {}
+
+    /** When the first byte of the frame was read */
+    uint64_t mRecv;
+    /** When the frame was complete (the header, if streamed) */
+    uint64_t mParsed;
+    /** When it was handed to the receiver, or to the control handling */
+    uint64_t mStart;
+    /** When that returned (when the last chunk was handed, if streamed) */
+    uint64_t mEnd;
+    /** Socket descriptor */
+    int mSocket;
+    /** Channel */
+    uint32_t mChannel;
+    /** Length of message body */
+    int mLen;
+    /** 'c' for control, 'm' for message, 's' for streamed message */
+    char mKind;
+};
+
+/** A topic that messages can be published on */
+class MTopic
+{
+public:
+    MTopic(const char *name) : mName(name) {}
+
+    /** Name */
+    string mName;
+    /** Subscribing channels */
+    vector<MPeer*> mSubscribers;
+};
+
+/** Data waiting to be written on a connection. Either a frame header
+    with a shared body, or a range of the connection's pending bytes. */
+class MOut
+{
+public:
+    /** Frame header */
+    unsigned char mHdr[CFM_HDR_LEN_V2];
+    /** Length of frame header */
+    int mHdrLen;
+    /** Shared message body, or NULL */
+    MBuffer *mBuf;
+    /** Offset in pending bytes (if mBuf is NULL) */
+    size_t mOff;
+    /** Number of pending bytes (if mBuf is NULL) */
+    size_t mLen;
+};
+
+/** Peers of a connection, indexed on channel number. Channels that are
+    closed are recycled through a free list, so the table never grows
+    beyond the highest number of channels open at the same time. */
+class MPeerTable
+{
+public:
+    MPeerTable() : mCount(0) {}
+
+    /** Returns the peer on a channel, or NULL */
+    MPeer* get(uint32_t chan) {
+        return chan < mSlots.size() ? mSlots[chan] : NULL;
+    }
+    /** Returns the number of slots, i.e highest channel used + 1 */
+    uint32_t slots() { return mSlots.size(); }
+    /** Returns the number of open channels */
+    uint32_t count() { return mCount; }
+
+    /** Puts a peer on the lowest free channel below 'limit'. This is the
+        channel that a version 1 client expects to get.
+        @return The channel or -1 if all are used */
+    int insertLowest(MPeer* p, uint32_t limit);
+    /** Puts a peer on any free channel below 'limit'
+        @return The channel or -1 if all are used */
+    int insert(MPeer* p, uint32_t limit);
+    /** Removes the peer on a channel and returns it (or NULL) */
+    MPeer* remove(uint32_t chan);
+
+private:
+    // Peers indexed on channel
+    vector<MPeer*> mSlots;
+    // Channels that have been closed
+    vector<uint32_t> mFree;
+    // Number of open channels
+    uint32_t mCount;
 };
 
 /** Type used for keeping track of the stuff going on for a specific
     connection */
 typedef enum {
     CFM_CONN_INIT = 0,
-    CFM_CONN_CHANNEL = 1,
-    CFM_CONN_LENGTH1 = 2,
-    CFM_CONN_LENGTH2 = 3,
-    CFM_CONN_MSGBODY = 4,
-    CFM_CONN_MSGREADY = 5
+    CFM_CONN_MSGBODY = 1,
+    CFM_CONN_MSGREADY = 2,
+    CFM_CONN_STREAMBODY = 3
 } cfm_conn_state_t;
 
 /** Used for M connections */
@@ -106,11 +281,47 @@ class MConn
 {
 public:
     MConn() : mHost(NULL), mPort(-1),
-              mSocket(-1), mNumUsed(0),
-              mIsM(false), mChannel(-1),
+              mSocket(-1), mVersion(CF_M_VERSION_1),
+              mHdrLen(CFM_HDR_LEN_V1), mHdrPos(0),
+              mIsM(false), mChannel(0),
               mMsgLen(0), mMsgBuff(NULL),
-              mMsgPos(0), mState(CFM_CONN_INIT) {
+              mMsgPos(0), mState(CFM_CONN_INIT),
+              mSent(0), mOutBytes(0), mDirty(false),
+              mBytesIn(NULL), mBytesOut(NULL),
+              mMsgsIn(NULL), mMsgsOut(NULL),
+              mRecvTime(0), mTraced(false) {
+    }
+    ~MConn();
+
+    /** Writes the frame header for a message
+        @param hdr  Buffer of at least CFM_HDR_LEN_V2 bytes
+        @param chan Channel number
+        @param len  Length of message body
+        @return Header length
+    */
+    int buildHeader(unsigned char *hdr, uint32_t chan, int len);
+    /** Queues a message for sending. Takes a reference to the buffer. */
+    void queue(uint32_t chan, MBuffer *buf);
+    /** Queues a message for sending. The header and body are copied. */
+    void append(const unsigned char *hdr, int hdrLen,
+                const unsigned char *body, int len);
+    /** Writes the queued messages that the socket takes. What is left
+        is written by a later call.
+        @return 1 if OK, 0 if failure (and all is dropped) */
+    int flush();
+    /** Drops all queued messages */
+    void drop();
+    /** Adds the metrics of the connection
+        @param comp Instance name of M
+        @param peer Address of the other side */
+    void addMetrics(const char *comp, const char *peer);
+
+    /** Returns the M command channel for the protocol version used */
+    uint32_t controlChannel() {
+        return mVersion == CF_M_VERSION_1 ? CFM_M_CHANNEL : CFM_M_CHANNEL_V2;
     }
+    /** Returns the length of the message body being received */
+    int bodyLen() { return mMsgLen - mHdrLen; }
 
     /** Host name*/
     char* mHost;
@@ -118,13 +329,19 @@ public:
     int mPort;
     /** Socket descriptor  */
     int mSocket;
-    /** Number of used channels (Range 0..255) */
-    uint8_t mNumUsed;
+    /** Protocol version used on this connection */
+    int mVersion;
+    /** Frame header length for the protocol version */
+    int mHdrLen;
+    /** Header bytes received so far */
+    unsigned char mHdr[CFM_HDR_LEN_V2];
+    /** Number of header bytes received */
+    int mHdrPos;
     /** Flag if remote connection is a M compoent  */
     bool mIsM;
     /** Current channel handled  */
-    int mChannel;
-    /** message length */
+    uint32_t mChannel;
+    /** message length (including header) */
     int mMsgLen;
     /** Message buffer  */
     unsigned char *mMsgBuff;
@@ -133,7 +350,28 @@ public:
     /** State of buffer  */
     cfm_conn_state_t mState;
     /** Peers on this connection  */
-    MPeer* mPeer[CFM_MAX_PEERS];
+    MPeerTable mPeers;
+    /** Messages waiting to be written */
+    vector<MOut> mOut;
+    /** Copied messages waiting to be written */
+    vector<unsigned char> mPending;
+    /** Bytes of the first message waiting that have been written */
+    size_t mSent;
+    /** Number of bytes waiting to be written */
+    size_t mOutBytes;
+    /** Flag if in M's list of connections to flush */
+    bool mDirty;
+    /** Metrics: bytes and messages received and sent */
+    cf_metric_t *mBytesIn;
+    cf_metric_t *mBytesOut;
+    cf_metric_t *mMsgsIn;
+    cf_metric_t *mMsgsOut;
+    /** When the first byte of the current frame was read, if tracing */
+    uint64_t mRecvTime;
+    /** Flag if the current frame is sampled */
+    bool mTraced;
+    /** Timestamps of the current frame, if sampled */
+    MTrace mTrace;
 };
 
 
@@ -142,7 +380,8 @@ public:
 
 class CF_M :
 	public CFComponent,
-    public IMServer
+    public IMServer,
+    public ISchedulerClient
 {
 public:
     /** Constructor */
@@ -153,14 +392,27 @@ public:
     // IMServer methods
     int addReceiver(CFComponent *comp, const char *uuid,
                char *name, void *userData);
+    int addStreamReceiver(CFComponent *comp, const char *uuid,
+                          char *name, void *userData);
     int enableReceiver(const char *uuid, char *name);
     int disableReceiver(const char *uuid, char *name);
 	int rmReceiver(const char *uuid, char *name);
     int getServerPort() { return mPort; }
     char* searchByName(char *name);
     char *searchByIface(const char *uuid);
-    int sendToReceiver(void *conn, uint8_t chan, int len,
+    int searchByName(const char *name, string& result);
+    int searchByIface(const char *uuid, string& result);
+    int sendToReceiver(void *conn, uint32_t chan, int len,
              unsigned char *msg);
+    int publish(const char *topic, int len, unsigned char *msg);
+    int flush();
+    int setBatching(const char *uuid, char *name, int on);
+
+    // Retries writing to clients that did not keep up
+    void retry();
+
+    // ISchedulerClient methods
+    void execute(uint32_t slice);
 
 
     // Set host name
@@ -173,6 +425,12 @@ public:
 
     // Prints registered interfaces and receivers
     void printIfacesAndReceivers();
+    // Samples 1 in 'every' frames received, 0 turns it off
+    void setTraceSampling(uint32_t every);
+    // Prints the sampled frames
+    void printTraces();
+    // Forgets the sampled frames
+    void clearTraces();
     // Handles stuff on the server socket
     int handleServerSocket(int sd, void *userData, cf_sock_event_t ev);
 
@@ -186,16 +444,48 @@ private:
     // Server socket
     int mSocket;
     // Map of interfaces
-    map<string, MIface*> mInterfaces;
+    unordered_map<CFUuid, MIface*, CFUuidHash> mInterfaces;
+    // All receivers indexed on interface UUID and name
+    unordered_map<MReceiverKey, MReceiver*, MReceiverKeyHash> mReceiverIndex;
+    // All receivers sorted on name, for prefix searches
+    multimap<string, MReceiver*> mNameIndex;
+    // Scratch list used when searching
+    vector<MReceiver*> mMatches;
+    // Topics
+    unordered_map<string, MTopic*> mTopics;
+    // Connections with queued data
+    vector<MConn*> mDirty;
+    // Timer for retrying connections that did not take all, or 0
+    uint64_t mRetryTimer;
     // Map of connections
     map<int,MConn*> mConnections;
+    // Protects the receivers when components are set up in parallel
+    mutex mRegLock;
+    // Metrics: open connections, channels opened and failures
+    cf_metric_t *mConnMetric;
+    cf_metric_t *mOpenMetric;
+    cf_metric_t *mErrorMetric;
+    // Frames between samples, 0 if not tracing
+    uint32_t mTraceEvery;
+    // Frames received since the last sample
+    uint32_t mTraceCount;
+    // Ring of sampled frames, the oldest at mTraceNext when full
+    vector<MTrace> mTraces;
+    size_t mTraceNext;
+    // Number of frames sampled
+    uint64_t mTraceTotal;
 
     // Returns a message receiver
     MReceiver* getReceiver(const char *uuid, char *name);
+    MReceiver* getReceiver(const CFUuid& uuid, const char *name);
+    // Adds a receiver, assembled or streaming
+    int addReceiverCommon(CFComponent *comp, const char *uuid,
+                          char *name, void *userData, bool stream);
     // Add an interface
     MIface * addInterface(const char *uuid, char *name);
     // Returns an interface
     MIface* getInterface(const char* uuid);
+    MIface* getInterface(const CFUuid& uuid);
     // Returns connection pointer for socket
     MConn* getConnection(int sd);
     // Handle remote message
@@ -204,9 +494,27 @@ private:
     int handleClientMessage(MConn * conn, int sd);
     // Send message to client
     int passMessageToClient(MConn * conn);
+    // Starts streaming a message to a client, returns 1 if streamed
+    int beginStreamToClient(MConn * conn);
+    // Adds a subscription on a new channel
+    int subscribe(MConn *conn, const char *topic);
+    // Removes a subscription
+    void unsubscribe(MPeer *p);
+    // Writes queued data on a connection now or later
+    int flushLater(MConn *conn, bool now);
+    // Handles a closed connection
+    void closeConnection(MConn *conn);
+    // Formats a search result
+    int formatReceivers(vector<MReceiver*>& recs, string& result);
+    // Samples the frame whose header was just read, if it is its turn
+    void traceBegin(MConn *conn);
+    // Marks a sampled frame as handed over
+    void traceStart(MConn *conn, char kind);
+    // Marks a sampled frame as done and keeps it
+    void traceEnd(MConn *conn);
     // Send response to peer
-    int sendResponse(int sd, int order, int result, int response,
-                     char *responseText);
+    int sendResponse(MConn * conn, int order, int result, int response,
+                     uint32_t chan, const char *responseText);
 
 
 
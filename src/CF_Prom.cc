@@ -0,0 +1,804 @@
+/* Copyright (c) 2007-2014  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+//=============================================================================
+//                              I N C L U D E S
+//=============================================================================
+#include "CF_Prom.hh"
+#include "CFRegistry.hh"
+#include "CFComponentLib.hh"
+#include "compframe_log.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+
+//=============================================================================
+//                      G L O B A L  V A R I A B L E S
+//=============================================================================
+
+// Header of a response, with status, reason, content type and length
+#define PROM_HEAD "HTTP/1.1 %d %s\r\n" \
+    "Content-Type: %s\r\n" \
+    "Content-Length: %zu\r\n" \
+    "Connection: close\r\n\r\n"
+
+// Content type of the metrics page
+#define PROM_CONTENT_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+//=============================================================================
+//                        H E L P E R   C L A S S E S
+//=============================================================================
+
+// Returns the monotonic time in milliseconds
+static uint64_t
+now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Returns the monotonic time in nanoseconds
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Appends text where anything but letters, digits and '_' is made '_',
+// as metric names allow
+static void
+append_name(string& out, const char* text)
+{
+    for (const char* p = text; *p; p++) {
+        char ch = *p;
+
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+            (ch >= '0' && ch <= '9') || ch == '_') {
+            out += ch;
+        }
+        else {
+            out += '_';
+        }
+    }
+}
+
+// Appends a help text, escaped as the text format wants it
+static void
+append_help(string& out, const char* text)
+{
+    for (const char* p = text; *p; p++) {
+        if (*p == '\\') {
+            out += "\\\\";
+        }
+        else if (*p == '\n') {
+            out += "\\n";
+        }
+        else {
+            out += *p;
+        }
+    }
+}
+
+// Appends one sample line
+static void
+append_sample(string& out, const string& name, const char* suffix,
+              const char* labels, const char* extra, const char* value)
+{
+    out += name;
+    out += suffix;
+
+    if (*labels || *extra) {
+        out += '{';
+        out += labels;
+
+        if (*labels && *extra) {
+            out += ',';
+        }
+
+        out += extra;
+        out += '}';
+    }
+
+    out += ' ';
+    out += value;
+    out += '\n';
+}
+
+// Where the metrics are rendered, and the family of the last one
+struct PromPage
+{
+    string* mOut;
+    string mFamily;
+};
+
+// Renders one metric. Metrics come sorted, so all of a family (same
+// instance and name, different labels) come after each other.
+static void
+render_metric(const cf_metric_value_t *v, void *userData)
+{
+    PromPage* page = (PromPage*) userData;
+    string& out = *page->mOut;
+    string name = "cf_";
+    char value[32];
+
+    append_name(name, v->comp);
+    name += '_';
+    append_name(name, v->name);
+
+    if (v->type == CF_METRIC_COUNTER) {
+        name += "_total";
+    }
+
+    if (name != page->mFamily) {
+        static const char* types[] = { "counter", "gauge", "histogram" };
+
+        if (*v->help) {
+            out += "# HELP " + name + " ";
+            append_help(out, v->help);
+            out += '\n';
+        }
+
+        out += "# TYPE " + name + " " + types[v->type] + "\n";
+        page->mFamily = name;
+    }
+
+    switch (v->type) {
+    case CF_METRIC_COUNTER:
+        snprintf(value, sizeof(value), "%llu", (unsigned long long) v->count);
+        append_sample(out, name, "", v->labels, "", value);
+        break;
+    case CF_METRIC_GAUGE:
+        snprintf(value, sizeof(value), "%lld", (long long) v->value);
+        append_sample(out, name, "", v->labels, "", value);
+        break;
+    case CF_METRIC_HISTOGRAM:
+    {
+        // One bucket per power of two is plenty for a scraper. The last
+        // bucket has no upper limit, and is counted in +Inf.
+        uint64_t sum = 0;
+        char le[48];
+
+        for (int i = 0; i < v->numBuckets - 1; i++) {
+            sum += v->buckets[i];
+
+            if ((i + 1) % 16 != 0) {
+                continue;
+            }
+
+            snprintf(le, sizeof(le), "le=\"%llu\"",
+                     (unsigned long long) cf_metric_bucket_limit(i));
+            snprintf(value, sizeof(value), "%llu", (unsigned long long) sum);
+            append_sample(out, name, "_bucket", v->labels, le, value);
+        }
+
+        snprintf(value, sizeof(value), "%llu", (unsigned long long) v->count);
+        append_sample(out, name, "_bucket", v->labels, "le=\"+Inf\"", value);
+        snprintf(value, sizeof(value), "%llu", (unsigned long long) v->sum);
+        append_sample(out, name, "_sum", v->labels, "", value);
+        snprintf(value, sizeof(value), "%llu", (unsigned long long) v->count);
+        append_sample(out, name, "_count", v->labels, "", value);
+        break;
+    }
+    }
+}
+
+void
+CF_PromRender::run()
+{
+    CF_PromPage* page = new CF_PromPage();
+    uint64_t start = now_ns();
+
+    CF_Prom::render(page->mPage);
+
+    mProm->rendered(page, now_ns() - start);
+}
+
+//=============================================================================
+//                        P U B L I C   M E T H O D S
+//=============================================================================
+
+//=============================================================================
+//                       P R I V A T E   M E T H O D S
+//=============================================================================
+static CFComponent *create_me(const char *inst_name);
+static void set_me_up(CFComponent *comp);
+static int destroy_me(CFComponent *comp);
+static int handleSocketCallback(void *comp, int sd, void *userData,
+                                cf_sock_event_t ev);
+
+// The library container
+static CFComponentLib theLib("Prom", create_me, set_me_up, destroy_me);
+
+
+/** This function must reside in all component libraries.
+    Here the component instance is
+*/
+extern "C" void
+dlopen_this(void)
+{
+    /* Use this function to get Prom into the Registry  */
+    CFRegistry::instance()->registerLibrary(&theLib);
+}
+
+/** This function is used to create and initate a component.
+    @return Pointer to created instance or NULL
+*/
+static CFComponent *
+create_me(const char *inst_name)
+{
+    assert(inst_name != NULL);
+
+    return new CF_Prom(inst_name);
+}
+
+static int
+destroy_me(CFComponent *comp)
+{
+    if (!comp) {
+        return 1;
+    }
+
+    delete (CF_Prom*) comp;
+
+    return 0;
+}
+
+/** Function called after Prom has been created */
+static void
+set_me_up(CFComponent *comp)
+{
+    CF_Prom* p = (CF_Prom*) comp;
+
+    CFRegistry::instance()->registerIface(comp, (IConfigClient*) p);
+    CFRegistry::instance()->registerIface(comp, (ISchedulerClient*) p);
+    CFRegistry::instance()->registerIface(comp, (IActor*) p);
+
+    p->setUp((ISchedulerServer*)
+             CFRegistry::instance()->getCompIface("S", "ISchedulerServer"),
+             (IExecutor*)
+             CFRegistry::instance()->getCompIface("E", "IExecutor"));
+}
+
+static int
+handleSocketCallback(void *comp, int sd, void *userData, cf_sock_event_t ev)
+{
+    (void) comp;
+
+    return ((CF_Prom*) userData)->handleSocket(sd, ev);
+}
+
+
+CF_Prom::CF_Prom(const char *inst_name) :
+    CFComponent("Prom"),
+    mName(inst_name),
+    mAddr(CF_PROM_ADDR),
+    mPort(CF_PROM_PORT),
+    mMaxAge(CF_PROM_MAX_AGE),
+    mSocket(-1),
+    mStarted(false),
+    mWriting(0),
+    mPageTime(0),
+    mRendering(false),
+    mInFlight(false),
+    mScheduler(NULL),
+    mExecutor(NULL)
+{
+    mScrapes = cf_metric_add(CF_METRIC_COUNTER, inst_name, "scrapes", NULL,
+                             "Metrics pages served");
+    mRenderTime = cf_metric_add(CF_METRIC_HISTOGRAM, inst_name, "render_ns",
+                                NULL, "Time spent rendering a page");
+}
+
+// Destructor
+CF_Prom::~CF_Prom()
+{
+    // A render in flight posts to us and uses our metrics. Wait for it,
+    // the page it posts is thrown away when we are removed from S.
+    {
+        unique_lock<mutex> lock(mRenderLock);
+
+        mRenderDone.wait(lock, [this] { return !mInFlight; });
+    }
+
+    if (mScheduler) {
+        mScheduler->remove(this);
+        mScheduler = NULL;
+    }
+
+    while (!mConns.empty()) {
+        closeConn(mConns.begin()->second);
+    }
+
+    stopListening();
+
+    cf_metric_remove(mScrapes);
+    cf_metric_remove(mRenderTime);
+
+    CFRegistry::instance()->deregisterIfaces(this);
+}
+
+void
+CF_Prom::setUp(ISchedulerServer* s, IExecutor* e)
+{
+    mScheduler = s;
+    mExecutor = e;
+
+    if (!mScheduler) {
+        cf_error_log(__FILE__, __LINE__, "Prom needs S!\n");
+        return;
+    }
+
+    mScheduler->add(this);
+    mScheduler->addActor(this, 0);
+
+    // Starts listening in the first turn of the loop, when the
+    // configuration has been read
+    mScheduler->setTick(this, CF_S_TICK_NONE);
+    mScheduler->signal(this);
+}
+
+//
+// IConfigClient methods
+int
+CF_Prom::set(char* varName, char* varValue)
+{
+    if (!varName || !varValue) {
+        return 0;
+    }
+
+    if (!strcmp(varName, "max_age")) {
+        mMaxAge = atoi(varValue);
+        return 1;
+    }
+
+    if (!strcmp(varName, "port")) {
+        mPort = atoi(varValue);
+    }
+    else if (!strcmp(varName, "addr")) {
+        mAddr.assign(varValue);
+    }
+    else {
+        cf_error_log(__FILE__, __LINE__,
+                     "Unknown variable (%s) for %s!\n", varName,
+                     mName.c_str());
+        return 0;
+    }
+
+    if (!mStarted) {
+        return 1;
+    }
+
+    stopListening();
+
+    return startListening();
+}
+
+//
+// ISchedulerClient methods
+void
+CF_Prom::execute(uint32_t slice)
+{
+    (void) slice;
+
+    if (!mStarted) {
+        mStarted = true;
+        startListening();
+        return;
+    }
+
+    // Retry scrapers that did not take all of their response
+    map<int, CF_PromConn*>::iterator i = mConns.begin();
+
+    while (i != mConns.end()) {
+        CF_PromConn* c = (i++)->second;
+
+        if (!c->mHead.empty()) {
+            writeConn(c);
+        }
+    }
+}
+
+//
+// IActor methods
+void
+CF_Prom::receive(CFMessage *msg)
+{
+    CF_PromPage* p = msg->as<CF_PromPage>();
+
+    if (!p) {
+        return;
+    }
+
+    mPage = make_shared<const string>(std::move(p->mPage));
+    mPageTime = now_ms();
+    mRendering = false;
+
+    vector<CF_PromConn*> waiting;
+
+    waiting.swap(mWaiting);
+
+    for (size_t i = 0; i < waiting.size(); i++) {
+        waiting[i]->mWaiting = false;
+        respond(waiting[i], 200, "OK", mPage);
+    }
+}
+
+void
+CF_Prom::render(string& page)
+{
+    PromPage p;
+    cf_log_stats_t log;
+    char line[256];
+
+    p.mOut = &page;
+
+    cf_metrics_foreach(NULL, render_metric, &p);
+
+    cf_log_stats_get(&log);
+
+    snprintf(line, sizeof(line),
+             "# HELP cf_log_lines_total Lines logged\n"
+             "# TYPE cf_log_lines_total counter\n"
+             "cf_log_lines_total{level=\"info\"} %llu\n"
+             "cf_log_lines_total{level=\"error\"} %llu\n"
+             "cf_log_lines_total{level=\"trace\"} %llu\n",
+             (unsigned long long) log.infos,
+             (unsigned long long) log.errors,
+             (unsigned long long) log.traces);
+    page += line;
+
+    snprintf(line, sizeof(line),
+             "# HELP cf_log_dropped_total Lines that could not be written\n"
+             "# TYPE cf_log_dropped_total counter\n"
+             "cf_log_dropped_total %llu\n",
+             (unsigned long long) log.dropped);
+    page += line;
+}
+
+void
+CF_Prom::rendered(CF_PromPage* page, uint64_t ns)
+{
+    cf_metric_observe(mRenderTime, ns);
+
+    if (!mScheduler || !mScheduler->post(this, page)) {
+        delete page;
+    }
+
+    // Nothing of ours is used after this
+    lock_guard<mutex> lock(mRenderLock);
+
+    mInFlight = false;
+    mRenderDone.notify_all();
+}
+
+int
+CF_Prom::handleSocket(int sd, cf_sock_event_t ev)
+{
+    if (sd == mSocket) {
+        if (ev == CF_SOCKET_STUFF_TO_READ) {
+            acceptConn();
+        }
+        return 0;
+    }
+
+    map<int, CF_PromConn*>::iterator i = mConns.find(sd);
+
+    if (i == mConns.end()) {
+        return 0;
+    }
+
+    if (ev != CF_SOCKET_STUFF_TO_READ) {
+        closeConn(i->second);
+        return 0;
+    }
+
+    readRequest(i->second);
+
+    return 0;
+}
+
+/** Opens the server socket, unless the port is 0
+    @return 1 if OK, 0 if failure
+*/
+int
+CF_Prom::startListening()
+{
+    struct sockaddr_in addr;
+    int reuse = 1;
+
+    if (mPort == 0) {
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(mPort);
+
+    if (inet_pton(AF_INET, mAddr.c_str(), &addr.sin_addr) != 1) {
+        cf_error_log(__FILE__, __LINE__, "Bad address (%s)!\n",
+                     mAddr.c_str());
+        return 0;
+    }
+
+    mSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (mSocket == -1) {
+        cf_error_log(__FILE__, __LINE__, "Failed to open socket!\n");
+        return 0;
+    }
+
+    setsockopt(mSocket, SOL_SOCKET, SO_REUSEADDR, (char *) &reuse,
+               sizeof(reuse));
+
+    if (bind(mSocket, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(mSocket, 16) == -1 ||
+        !cf_socket_register(this, mSocket, handleSocketCallback, this)) {
+        cf_error_log(__FILE__, __LINE__,
+                     "Could not serve metrics on %s:%d! (%s)\n",
+                     mAddr.c_str(), mPort, strerror(errno));
+        close(mSocket);
+        mSocket = -1;
+        return 0;
+    }
+
+    cf_info_log("%s serving metrics on http://%s:%d/metrics\n",
+                mName.c_str(), mAddr.c_str(), mPort);
+
+    return 1;
+}
+
+// Closes the server socket
+void
+CF_Prom::stopListening()
+{
+    if (mSocket == -1) {
+        return;
+    }
+
+    cf_socket_deregister(mSocket);
+    close(mSocket);
+    mSocket = -1;
+}
+
+// Takes in a new scraper
+void
+CF_Prom::acceptConn()
+{
+    int sd = accept4(mSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (sd == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            cf_error_log(__FILE__, __LINE__,
+                         "Could not accept scraper! (%s)\n", strerror(errno));
+        }
+        return;
+    }
+
+    if (!cf_socket_register(this, sd, handleSocketCallback, this)) {
+        close(sd);
+        return;
+    }
+
+    mConns[sd] = new CF_PromConn(sd);
+}
+
+// Reads from a scraper, and responds when the request is complete
+void
+CF_Prom::readRequest(CF_PromConn* c)
+{
+    char buf[1024];
+    ssize_t n = read(c->mSocket, buf, sizeof(buf));
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    if (n <= 0) {
+        closeConn(c);
+        return;
+    }
+
+    if (c->mWaiting || !c->mHead.empty()) {
+        // Only one request per connection, the rest is ignored
+        return;
+    }
+
+    c->mRequest.append(buf, n);
+
+    if (c->mRequest.find("\r\n\r\n") == string::npos &&
+        c->mRequest.find("\n\n") == string::npos) {
+        if (c->mRequest.size() > CF_PROM_MAX_REQUEST) {
+            respond(c, 431, "Request Header Fields Too Large", NULL);
+        }
+        return;
+    }
+
+    const string& r = c->mRequest;
+
+    if (r.compare(0, 4, "GET ") != 0) {
+        respond(c, 405, "Method Not Allowed", NULL);
+        return;
+    }
+
+    size_t end = r.find_first_of(" ?\r\n", 4);
+    string path = r.substr(4, end == string::npos ? string::npos : end - 4);
+
+    if (path != "/metrics" && path != "/") {
+        respond(c, 404, "Not Found", NULL);
+        return;
+    }
+
+    sendPage(c);
+}
+
+// Sends the page, or starts rendering one
+void
+CF_Prom::sendPage(CF_PromConn* c)
+{
+    cf_metric_inc(mScrapes, 1);
+
+    if (mPage && now_ms() - mPageTime < (uint64_t) mMaxAge) {
+        respond(c, 200, "OK", mPage);
+        return;
+    }
+
+    if (!mRendering && mExecutor) {
+        {
+            lock_guard<mutex> lock(mRenderLock);
+
+            mInFlight = true;
+        }
+
+        mRendering = mExecutor->submit(new CF_PromRender(this), NULL) == 1;
+
+        if (!mRendering) {
+            lock_guard<mutex> lock(mRenderLock);
+
+            mInFlight = false;
+        }
+    }
+
+    if (mRendering) {
+        c->mWaiting = true;
+        mWaiting.push_back(c);
+        return;
+    }
+
+    // Without E, there is nowhere else to do it
+    string page;
+    uint64_t start = now_ns();
+
+    render(page);
+    cf_metric_observe(mRenderTime, now_ns() - start);
+
+    mPage = make_shared<const string>(std::move(page));
+    mPageTime = now_ms();
+    respond(c, 200, "OK", mPage);
+}
+
+// Queues a response and writes what the socket takes
+void
+CF_Prom::respond(CF_PromConn* c, int status, const char* reason,
+                 shared_ptr<const string> body)
+{
+    char head[256];
+
+    if (!body) {
+        body = make_shared<const string>(string(reason) + "\n");
+    }
+
+    snprintf(head, sizeof(head), PROM_HEAD, status, reason,
+             status == 200 ? PROM_CONTENT_TYPE : "text/plain", body->size());
+
+    c->mHead.assign(head);
+    c->mBody = body;
+    c->mOff = 0;
+    mWriting++;
+
+    writeConn(c);
+}
+
+// Writes what is left of a response. The connection is closed when all
+// is written, or if writing fails.
+// @return false if something is left
+bool
+CF_Prom::writeConn(CF_PromConn* c)
+{
+    size_t total = c->mHead.size() + c->mBody->size();
+
+    while (c->mOff < total) {
+        struct iovec iov[2];
+        struct msghdr mh;
+        int cnt = 0;
+
+        if (c->mOff < c->mHead.size()) {
+            iov[cnt].iov_base = (void*) (c->mHead.data() + c->mOff);
+            iov[cnt++].iov_len = c->mHead.size() - c->mOff;
+            iov[cnt].iov_base = (void*) c->mBody->data();
+            iov[cnt++].iov_len = c->mBody->size();
+        }
+        else {
+            size_t off = c->mOff - c->mHead.size();
+
+            iov[cnt].iov_base = (void*) (c->mBody->data() + off);
+            iov[cnt++].iov_len = c->mBody->size() - off;
+        }
+
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = cnt;
+
+        ssize_t n = sendmsg(c->mSocket, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Try again in a while, the main loop must not wait
+                mScheduler->setTick(this, CF_PROM_RETRY);
+                return false;
+            }
+
+            closeConn(c);
+            return true;
+        }
+
+        c->mOff += n;
+    }
+
+    closeConn(c);
+
+    return true;
+}
+
+// Closes a connection
+void
+CF_Prom::closeConn(CF_PromConn* c)
+{
+    if (c->mWaiting) {
+        mWaiting.erase(find(mWaiting.begin(), mWaiting.end(), c));
+    }
+
+    if (!c->mHead.empty() && --mWriting == 0 && mScheduler) {
+        mScheduler->setTick(this, CF_S_TICK_NONE);
+    }
+
+    cf_socket_deregister(c->mSocket);
+    shutdown(c->mSocket, SHUT_WR);
+    close(c->mSocket);
+
+    mConns.erase(c->mSocket);
+    delete c;
+}
@@ -0,0 +1,208 @@
+#ifndef CF_PROM_HH
+#define CF_PROM_HH
+
+/* Copyright (c) 2007-2014  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+//=============================================================================
+//                        I N C L U D E S
+//=============================================================================
+#include "CFComponent.hh"
+#include "IConfig.hh"
+#include "IScheduler.hh"
+#include "IExecutor.hh"
+#include "compframe.h"
+#include "compframe_sockets.h"
+#include "compframe_metrics.h"
+
+#include <map>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+using namespace std;
+
+//=============================================================================
+//                          M A C R O S
+//=============================================================================
+
+// Default port, the one commonly used by exporters of this kind
+#define CF_PROM_PORT 9464
+
+// Default address, only reachable from the own host
+#define CF_PROM_ADDR "127.0.0.1"
+
+// Default number of milliseconds a rendered page is served again,
+// instead of rendering a new one
+#define CF_PROM_MAX_AGE 1000
+
+// Longest HTTP request taken
+#define CF_PROM_MAX_REQUEST 8192
+
+// Milliseconds between attempts to write to a scraper that does not
+// keep up
+#define CF_PROM_RETRY 10
+
+// Message type of a rendered page
+#define CF_PROM_MSG_PAGE (CF_MSG_SYSTEM + 0x100)
+
+//=============================================================================
+//                           T Y P E S
+//=============================================================================
+
+// A connection of a scraper
+class CF_PromConn
+{
+public:
+    CF_PromConn(int sd) : mSocket(sd), mOff(0), mWaiting(false) {}
+
+    // Socket descriptor
+    int mSocket;
+    // Request received so far
+    string mRequest;
+    // Header of the response
+    string mHead;
+    // Body of the response, shared with other scrapers
+    shared_ptr<const string> mBody;
+    // Bytes of the response written
+    size_t mOff;
+    // True while waiting for a page to be rendered
+    bool mWaiting;
+};
+
+class CF_Prom;
+
+// A page rendered on a thread of E, posted to Prom
+class CF_PromPage : public CFMessage
+{
+public:
+    static const uint32_t TYPE = CF_PROM_MSG_PAGE;
+
+    CF_PromPage() : CFMessage(TYPE) {}
+
+    // The page
+    string mPage;
+};
+
+// Renders the metrics page on a thread of E. It is submitted without an
+// owner, so that E does not post it to a Prom that is gone.
+class CF_PromRender : public CFTask
+{
+public:
+    CF_PromRender(CF_Prom* prom) : mProm(prom) {}
+
+    void run();
+
+    // Prom, which waits for the render before it is destroyed
+    CF_Prom* mProm;
+};
+
+
+/** This class implements Prom, which serves the metrics over HTTP in the
+    Prometheus text format */
+class CF_Prom :
+    public CFComponent,
+    public IConfigClient,
+    public ISchedulerClient,
+    public IActor
+{
+public:
+    // Constructor
+    CF_Prom(const char *inst_name);
+    // Destructor
+    virtual ~CF_Prom();
+
+    //
+    // IConfigClient methods
+    int set(char* varName, char* varValue);
+
+    //
+    // ISchedulerClient methods
+    void execute(uint32_t slice);
+
+    //
+    // IActor methods
+    void receive(CFMessage *msg);
+
+    // Sets the components used for scheduling and rendering
+    void setUp(ISchedulerServer* s, IExecutor* e);
+    // Handles the server socket and the connections of scrapers
+    int handleSocket(int sd, cf_sock_event_t ev);
+    // Renders all metrics in the Prometheus text format
+    static void render(string& page);
+    // Posts a page rendered by E, which is then done with us (any thread)
+    void rendered(CF_PromPage* page, uint64_t ns);
+
+private:
+    // Opens the server socket, unless the port is 0
+    int startListening();
+    // Closes the server socket
+    void stopListening();
+    // Takes in a new scraper
+    void acceptConn();
+    // Reads from a scraper, and responds when the request is complete
+    void readRequest(CF_PromConn* c);
+    // Sends the page, or starts rendering one
+    void sendPage(CF_PromConn* c);
+    // Queues a response and writes what the socket takes
+    void respond(CF_PromConn* c, int status, const char* reason,
+                 shared_ptr<const string> body);
+    // Writes what is left of a response, returns false if not all of it
+    bool writeConn(CF_PromConn* c);
+    // Closes a connection
+    void closeConn(CF_PromConn* c);
+
+    // Instance name
+    string mName;
+    // Address and port to listen on
+    string mAddr;
+    int mPort;
+    // Milliseconds a page is served again
+    int mMaxAge;
+    // Server socket
+    int mSocket;
+    // True after the first execution, when the configuration is read
+    bool mStarted;
+    // Connections of scrapers
+    map<int, CF_PromConn*> mConns;
+    // Connections waiting for a page
+    vector<CF_PromConn*> mWaiting;
+    // Number of connections with a response not fully written
+    int mWriting;
+    // Last rendered page, and when (monotonic milliseconds)
+    shared_ptr<const string> mPage;
+    uint64_t mPageTime;
+    // True while waiting for a page from E
+    bool mRendering;
+    // True until E is done with us after submitting a render, and
+    // signalled when it is
+    bool mInFlight;
+    mutex mRenderLock;
+    condition_variable mRenderDone;
+    // Used for ticks and for getting rendered pages back
+    ISchedulerServer* mScheduler;
+    // Renders pages, if there is one
+    IExecutor* mExecutor;
+    // Metrics: scrapes served, and time spent rendering
+    cf_metric_t* mScrapes;
+    cf_metric_t* mRenderTime;
+};
+
+
+#endif
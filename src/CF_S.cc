@@ -24,8 +24,15 @@
 #include "CFRegistry.hh"
 #include "compframe_log.h"
 #include "compframe_sockets.h"
+#include "compframe_watchdog.h"
 #include "CFComponentLib.hh"
+#include "ICommand.hh"
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <time.h>
 //=============================================================================
 //                      G L O B A L  V A R I A B L E S
 //=============================================================================
@@ -48,24 +55,101 @@ static int destroy_me(CFComponent *comp);
 
 static CFComponentLib theLib("S", create_me, set_me_up, destroy_me);
 
+static int
+wakeup_handle(void *comp, int sd, void *userData, cf_sock_event_t ev);
+
+static int s_cmd(int argc, char **argv);
+
+#define S_CMD_USAGE "Usage: s [-p | -z]\n"
+
+// Returns the monotonic time in milliseconds
+static uint64_t
+now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Returns the monotonic time in nanoseconds
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 
 CF_Scheduler::CF_Scheduler(const char *inst_name) :
 	CFComponent("S"),
 	mName(inst_name),
 	mState(CF_S_IDLE),
-	mSlice(10)
+	mSlice(10),
+	mWakeupPolled(false)
 {
-	
+    CF_S_Worker* w = new CF_S_Worker();
+
+    // The main loop is woken up through a socket poll
+    w->mEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (w->mEventFd == -1) {
+        cf_error_log(__FILE__, __LINE__,
+                     "Could not create wakeup event! (%s)\n",
+                     strerror(errno));
+    }
+
+    mWorkers.push_back(w);
+
+    mLoopMetric = cf_metric_add(CF_METRIC_COUNTER, inst_name, "loop_turns",
+                                NULL, "Turns of the main loop");
+    mActorMetric = cf_metric_add(CF_METRIC_COUNTER, inst_name, "actor_msgs",
+                                 NULL, "Messages delivered to actors");
 }
 
 // Destructor
 CF_Scheduler::~CF_Scheduler()
 {
-    if (mClients.size() != 0) {
+    if (mClients.size() != 0 || mPostClients.size() != 0) {
         cf_error_log(__FILE__, __LINE__,
                      "Scheduled components still active!\n");
     }
 
+    for (size_t i = 1; i < mWorkers.size(); i++) {
+        mWorkers[i]->mStop.store(true);
+        wake(mWorkers[i]);
+        mWorkers[i]->mThread.join();
+    }
+
+    if (mWakeupPolled) {
+        cf_socket_deregister(mWorkers[0]->mEventFd);
+    }
+
+    for (size_t i = 0; i < mWorkers.size(); i++) {
+        if (mWorkers[i]->mEventFd != -1) {
+            close(mWorkers[i]->mEventFd);
+        }
+        delete mWorkers[i];
+    }
+
+    map<CFComponent*,CFMailbox*>::iterator a = mActors.begin();
+
+    for ( ; a != mActors.end(); ++a) {
+        a->first->setMailbox(NULL);
+        delete a->second;
+    }
+
+    for (size_t i = 0; i < mRetired.size(); i++) {
+        delete mRetired[i];
+    }
+
+    cf_metric_remove(mLoopMetric);
+    cf_metric_remove(mActorMetric);
+
     CFRegistry::instance()->deregisterIfaces(this);
 }
 
@@ -74,50 +158,359 @@ CF_Scheduler::~CF_Scheduler()
 int 
 CF_Scheduler::add(CFComponent *obj)
 {
-    map<CFComponent*,ISchedulerClient*>::iterator i = mClients.find(obj);
+    lock_guard<mutex> lock(mClientLock);
+    ISchedulerClient* iFace = getClient(obj);
+
+    if (!iFace) {
+        return 1;
+    }
+
+    CF_S_Client& c = mClients[obj];
+
+    initClient(c, obj, iFace);
+    c.mTick = mSlice;
+    c.mDue = now_ms() + mSlice;
+
+    return 0;
+}
+
+int 
+CF_Scheduler::addPost(CFComponent *obj)
+{
+    lock_guard<mutex> lock(mClientLock);
+    ISchedulerClient* iFace = getClient(obj);
+
+    if (!iFace) {
+        return 0;
+    }
 
-    if (i != mClients.end()) {
+    // Store interface
+    initClient(mPostClients[obj], obj, iFace);
+
+    return 1;
+}
+
+// Returns the client interface of a component that can be added
+ISchedulerClient*
+CF_Scheduler::getClient(CFComponent *obj)
+{
+    if (mClients.find(obj) != mClients.end() ||
+        mPostClients.find(obj) != mPostClients.end()) {
         cf_error_log(__FILE__, __LINE__,
                      "Could not add component again to scheduler loop!\n");
-        return 1;
+        return NULL;
     }
 
-    ISchedulerClient* iFace =  (ISchedulerClient*)
-        CFRegistry::instance()->getIface(obj, "ISchedulerClient");
+    ISchedulerClient* iFace =
+        CFRegistry::instance()->getIface<ISchedulerClient>(obj);
 
     if (!iFace) {
         cf_error_log(__FILE__, __LINE__,
                      "Component does not implement S client interface!\n");
-        return 1;
+        return NULL;
     }
 
     cf_trace_log(__FILE__, __LINE__, CF_TRACE_INFO,
                  "Added %s to scheduler...\n", obj->getClassName().c_str());
 
-	
-    // Store interface
-    mClients[obj] = iFace;
+    return iFace;
+}
 
-    return 0;
+// Sets up a client, including its metrics
+void
+CF_Scheduler::initClient(CF_S_Client& c, CFComponent *obj,
+                         ISchedulerClient* iFace)
+{
+    string labels = "client=\"" + obj->getClassName() + "\"";
+
+    c.mIface = iFace;
+    c.mComp = obj;
+    c.mExecTime = cf_metric_add(CF_METRIC_HISTOGRAM, mName.c_str(),
+                                "execute_ns", labels.c_str(),
+                                "Time spent in execute() per turn");
+}
+
+// Executes a client and measures the time it takes
+void
+CF_Scheduler::run(CF_S_Client& c, uint32_t slice)
+{
+    uint64_t start = now_ns();
+
+    cf_watchdog_enter(CF_WATCH_EXECUTE, c.mComp, NULL);
+    c.mIface->execute(slice);
+    cf_watchdog_leave();
+
+    cf_metric_observe(c.mExecTime, now_ns() - start);
 }
 
 int 
-CF_Scheduler::remove(CFComponent *obj)
+CF_Scheduler::setTick(CFComponent *obj, int ms)
 {
-    map<CFComponent*,ISchedulerClient*>::iterator i = mClients.find(obj);
+    lock_guard<mutex> lock(mClientLock);
+    map<CFComponent*,CF_S_Client>::iterator i = mClients.find(obj);
 
-    if (i == mClients.end()) {
+    if (i == mClients.end() || ms < CF_S_TICK_NONE) {
         cf_error_log(__FILE__, __LINE__,
-                     "Could not find component in scheduler loop!\n");
-        return 1;
+                     "Could not set tick of component!\n");
+        return 0;
+    }
+
+    i->second.mTick = ms;
+    i->second.mDue = now_ms() + (ms > 0 ? ms : 0);
+
+    return 1;
+}
+
+int 
+CF_Scheduler::signal(CFComponent *obj)
+{
+    lock_guard<mutex> lock(mClientLock);
+    map<CFComponent*,CF_S_Client>::iterator i = mClients.find(obj);
+
+    if (i == mClients.end()) {
+        return 0;
+    }
+
+    i->second.mSignalled = true;
+
+    return 1;
+}
+
+// Returns how long the loop may wait for events, -1 for ever
+int
+CF_Scheduler::timeout()
+{
+    uint64_t now = now_ms();
+    int res = -1;
+
+    map<CFComponent*,CF_S_Client>::iterator i = mClients.begin();
+
+    for ( ; i != mClients.end(); ++i) {
+        CF_S_Client& c = i->second;
+        int t;
+
+        if (c.mSignalled) {
+            return 0;
+        }
+
+        if (c.mTick == CF_S_TICK_NONE) {
+            continue;
+        }
+
+        if (c.mTick == CF_S_TICK_EVERY_TURN) {
+            // As before ticks could be set
+            t = mSlice;
+        }
+        else {
+            t = c.mDue > now ? (int) (c.mDue - now) : 0;
+        }
+
+        if (res == -1 || t < res) {
+            res = t;
+        }
+    }
+
+    return res;
+}
+
+int 
+CF_Scheduler::remove(CFComponent *obj)
+{
+    CFMailbox* mb;
+
+    {
+        lock_guard<mutex> lock(mClientLock);
+        map<CFComponent*,CF_S_Client>::iterator i;
+
+        mb = removeActor(obj);
+
+        // Remove client from scheduling
+        if ((i = mClients.find(obj)) != mClients.end()) {
+            cf_metric_remove(i->second.mExecTime);
+            mClients.erase(i);
+        }
+        else if ((i = mPostClients.find(obj)) != mPostClients.end()) {
+            cf_metric_remove(i->second.mExecTime);
+            mPostClients.erase(i);
+        }
+        else if (!mb) {
+            cf_error_log(__FILE__, __LINE__,
+                         "Could not find component in scheduler loop!\n");
+            return 1;
+        }
     }
 
-    // Remove client from scheduling
-    mClients.erase(i);
+    // Wait for a worker thread that is delivering to the actor, without
+    // the lock, which the actor may need. An actor removing itself is not
+    // waited for.
+    if (mb && mb->mWorker != 0) {
+        CF_S_Worker* w = mWorkers[mb->mWorker];
+
+        if (w->mThread.get_id() != this_thread::get_id()) {
+            while (w->mCurrent.load() == mb) {
+                this_thread::yield();
+            }
+        }
+    }
 
     return 0;
 }
 
+int 
+CF_Scheduler::addActor(CFComponent *obj, int worker)
+{
+    lock_guard<mutex> lock(mClientLock);
+    if (!obj || mActors.find(obj) != mActors.end()) {
+        cf_error_log(__FILE__, __LINE__, "Could not add actor again!\n");
+        return 0;
+    }
+
+    if (worker < 0 || worker >= (int) mWorkers.size()) {
+        cf_error_log(__FILE__, __LINE__,
+                     "No worker thread %d for actor %s!\n",
+                     worker, obj->getClassName().c_str());
+        return 0;
+    }
+
+    IActor* iFace = CFRegistry::instance()->getIface<IActor>(obj);
+
+    if (!iFace) {
+        cf_error_log(__FILE__, __LINE__,
+                     "Component does not implement actor interface!\n");
+        return 0;
+    }
+
+    CFMailbox* mb = new CFMailbox(iFace, obj, worker);
+
+    mActors[obj] = mb;
+    obj->setMailbox(mb);
+
+    cf_trace_log(__FILE__, __LINE__, CF_TRACE_INFO,
+                 "Added actor %s on worker %d...\n",
+                 obj->getClassName().c_str(), worker);
+
+    return 1;
+}
+
+int 
+CF_Scheduler::post(CFComponent *obj, CFMessage *msg)
+{
+    CFMailbox* mb = obj ? obj->getMailbox() : NULL;
+
+    if (!mb || !msg) {
+        return 0;
+    }
+
+    mb->mQueue.push(msg);
+
+    // Only the first message makes the mailbox runnable
+    if (!mb->mScheduled.exchange(true)) {
+        CF_S_Worker* w = mWorkers[mb->mWorker];
+
+        w->mRunQueue.push(mb);
+        wake(w);
+    }
+
+    return 1;
+}
+
+// Takes a component out of the actors (lock held)
+CFMailbox*
+CF_Scheduler::removeActor(CFComponent *obj)
+{
+    map<CFComponent*,CFMailbox*>::iterator i = mActors.find(obj);
+
+    if (i == mActors.end()) {
+        return NULL;
+    }
+
+    CFMailbox* mb = i->second;
+
+    obj->setMailbox(NULL);
+    mb->mClosed.store(true);
+    mActors.erase(i);
+
+    // A thread may still be posting to the mailbox, or the worker be
+    // delivering from it, so it is kept until S is destroyed. What is
+    // posted to it from now on is deleted undelivered.
+    mRetired.push_back(mb);
+
+    return mb;
+}
+
+// Delivers messages from a mailbox, by its worker thread
+void
+CF_Scheduler::deliver(CFMailbox* mb)
+{
+    CF_S_Worker* w = mWorkers[mb->mWorker];
+    CFMessage* msg;
+
+    w->mCurrent.store(mb);
+
+    for (int n = 0; n < CF_S_ACTOR_BATCH; n++) {
+        if ((msg = mb->mQueue.pop()) == NULL) {
+            break;
+        }
+
+        if (!mb->mClosed.load()) {
+            if (mb->mWorker == 0) {
+                cf_watchdog_enter(CF_WATCH_ACTOR, mb->mOwner, NULL);
+            }
+            mb->mActor->receive(msg);
+            if (mb->mWorker == 0) {
+                cf_watchdog_leave();
+            }
+            cf_metric_inc(mActorMetric, 1);
+        }
+
+        delete msg;
+    }
+
+    w->mCurrent.store(NULL);
+
+    // A message posted after the last pop finds the mailbox scheduled,
+    // so check again once it is not
+    mb->mScheduled.store(false);
+
+    if (!mb->mQueue.empty() && !mb->mScheduled.exchange(true)) {
+        w->mRunQueue.push(mb);
+    }
+}
+
+// Body of a worker thread
+void
+CF_Scheduler::work(CF_S_Worker* w)
+{
+    while (!w->mStop.load()) {
+        CFMailbox* mb = w->mRunQueue.pop();
+
+        if (mb) {
+            deliver(mb);
+            continue;
+        }
+
+        uint64_t val;
+
+        if (read(w->mEventFd, &val, sizeof(val)) == -1 && errno != EINTR) {
+            cf_error_log(__FILE__, __LINE__,
+                         "Worker could not wait! (%s)\n", strerror(errno));
+            return;
+        }
+    }
+}
+
+// Signals a worker that its run queue is not empty
+void
+CF_Scheduler::wake(CF_S_Worker* w)
+{
+    uint64_t one = 1;
+
+    if (write(w->mEventFd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        cf_error_log(__FILE__, __LINE__,
+                     "Could not wake worker! (%s)\n", strerror(errno));
+    }
+}
+
 // 
 // CF_S_ControlIf methods
 int 
@@ -125,11 +518,28 @@ CF_Scheduler::loop()
 {
     mState = CF_S_RUNNING;
 
+    // Register our commands, C is created after S
+    ICommand* ifC =
+        (ICommand*) CFRegistry::instance()->getCompIface("C", "ICommand");
+
+    if (ifC) {
+        ifC->add(this, "s", s_cmd, S_CMD_USAGE);
+    }
+
+    if (!mWakeupPolled && mWorkers[0]->mEventFd != -1) {
+        mWakeupPolled = cf_socket_register(this, mWorkers[0]->mEventFd,
+                                           wakeup_handle, this);
+    }
+
     while (1) {
-        cf_sockets_poll();
+        // Sleep until something happens or a component is due
+        cf_watchdog_turn();
+        cf_sockets_wait(timeout());
         
         schedule();
 
+        cf_metric_inc(mLoopMetric, 1);
+
     }
 
     return 0;
@@ -147,10 +557,45 @@ CF_Scheduler::schedule()
     cf_trace_log(__FILE__, __LINE__, CF_TRACE_MASSIVE,
                  "Scheduling components...\n");
 
-    map<CFComponent*,ISchedulerClient*>::iterator i = mClients.begin();
+    uint64_t now = now_ms();
+    map<CFComponent*,CF_S_Client>::iterator i = mClients.begin();
     
     for ( ; i != mClients.end(); ++i) {
-        i->second->execute(mSlice);
+        CF_S_Client& c = i->second;
+
+        if (c.mSignalled || c.mTick == CF_S_TICK_EVERY_TURN ||
+            (c.mTick > 0 && c.mDue <= now)) {
+            c.mSignalled = false;
+
+            if (c.mTick > 0) {
+                // Skip ticks that were missed instead of catching up
+                c.mDue = c.mDue + c.mTick > now ? c.mDue + c.mTick
+                                                : now + c.mTick;
+            }
+
+            run(c, c.mTick > 0 ? c.mTick : mSlice);
+        }
+    }
+
+    // Deliver messages to the actors of the main loop
+    CF_S_Worker* w = mWorkers[0];
+    CFMailbox* mb;
+
+    for (int n = 0; n < CF_S_ACTOR_BATCH; n++) {
+        if ((mb = w->mRunQueue.pop()) == NULL) {
+            break;
+        }
+        deliver(mb);
+    }
+
+    if (!w->mRunQueue.empty()) {
+        wake(w);
+    }
+
+    map<CFComponent*,CF_S_Client>::iterator p = mPostClients.begin();
+
+    for ( ; p != mPostClients.end(); ++p) {
+        run(p->second, mSlice);
     }
 
     return 0;
@@ -176,6 +621,37 @@ CF_Scheduler::stop()
     return 0;
 }
 
+int 
+CF_Scheduler::setWorkers(int num)
+{
+    if (num < 0 || mWorkers.size() > 1 || !mActors.empty()) {
+        cf_error_log(__FILE__, __LINE__,
+                     "Worker threads can only be set once, before actors!\n");
+        return 0;
+    }
+
+    for (int i = 1; i <= num; i++) {
+        CF_S_Worker* w = new CF_S_Worker();
+
+        w->mEventFd = eventfd(0, EFD_CLOEXEC);
+
+        if (w->mEventFd == -1) {
+            cf_error_log(__FILE__, __LINE__,
+                         "Could not create worker event! (%s)\n",
+                         strerror(errno));
+            delete w;
+            return 0;
+        }
+
+        w->mThread = thread(&CF_Scheduler::work, this, w);
+        mWorkers.push_back(w);
+    }
+
+    cf_info_log("S using %d worker threads.\n", num);
+
+    return 1;
+}
+
 
 /** This function must reside in all component libraries.
     Here the component instance is 
@@ -214,6 +690,70 @@ destroy_me(CFComponent *comp)
     return 0;
 }
 
+/** Called when messages are posted to actors of the main loop. They are
+    delivered in the next schedule(), so the event is just cleared. */
+static int
+wakeup_handle(void *comp, int sd, void *userData, cf_sock_event_t ev)
+{
+    uint64_t val;
+
+    (void) comp;
+    (void) userData;
+    (void) ev;
+
+    if (read(sd, &val, sizeof(val)) == -1 && errno != EAGAIN) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/** Handles the s command
+    @param argc  Number of arguments
+    @param argv  Arguments
+    @return 0 if OK, 1 if not
+*/
+static int
+s_cmd(int argc, char **argv)
+{
+    if (argc != 2) {
+        cf_error_log(__FILE__, __LINE__, S_CMD_USAGE);
+        return 1;
+    }
+
+    /* -p */
+    if (!strcmp(argv[1], "-p")) {
+        cf_sockets_stats_t st;
+
+        cf_sockets_stats_get(&st);
+
+        fprintf(stdout,
+                "Polling with %s\n"
+                "  Blocking waits : %llu\n"
+                "  Busy polls     : %llu (%llu found something)\n"
+                "  Timer lateness (%llu samples):\n"
+                "    p50 %llu ns, p99 %llu ns, p999 %llu ns, max %llu ns\n",
+                cf_sockets_backend_get(),
+                (unsigned long long) st.blocks,
+                (unsigned long long) st.spins,
+                (unsigned long long) st.spinHits,
+                (unsigned long long) st.samples,
+                (unsigned long long) st.p50,
+                (unsigned long long) st.p99,
+                (unsigned long long) st.p999,
+                (unsigned long long) st.max);
+        return 0;
+    }
+    /* -z */
+    else if (!strcmp(argv[1], "-z")) {
+        cf_sockets_stats_reset();
+        return 0;
+    }
+
+    cf_error_log(__FILE__, __LINE__, S_CMD_USAGE);
+    return 1;
+}
+
 /** Function called after S has been created */
 static void
 set_me_up(CFComponent *comp)
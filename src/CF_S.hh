@@ -23,15 +23,24 @@
 //                        I N C L U D E S
 //=============================================================================
 #include "CFComponent.hh"
+#include "CFMailbox.hh"
 #include "IScheduler.hh"
+#include "compframe_metrics.h"
 
 #include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
 using namespace std;
 
 //=============================================================================
 //                          M A C R O S 
 //=============================================================================
 
+// Messages delivered to an actor, and mailboxes serviced by the main loop,
+// before moving on to the next
+#define CF_S_ACTOR_BATCH 64
+
 //=============================================================================
 //                           T Y P E S
 //=============================================================================
@@ -43,6 +52,45 @@ typedef enum {
     CF_S_STOPPED = 2
 } SchedulerState_t;
 
+// A component added with add()
+class CF_S_Client
+{
+public:
+    CF_S_Client() : mIface(NULL), mComp(NULL), mTick(0), mDue(0),
+                    mSignalled(false), mExecTime(NULL) {}
+
+    // Interface to execute
+    ISchedulerClient* mIface;
+    // The component
+    CFComponent* mComp;
+    // Milliseconds between executions, or CF_S_TICK_*
+    int mTick;
+    // When next execution is due (monotonic milliseconds)
+    uint64_t mDue;
+    // Set by signal()
+    bool mSignalled;
+    // Histogram of execution times (nanoseconds)
+    cf_metric_t* mExecTime;
+};
+
+// A thread that delivers messages to actors. Worker 0 is the main loop.
+class CF_S_Worker
+{
+public:
+    CF_S_Worker() : mEventFd(-1), mCurrent(NULL), mStop(false) {}
+
+    // Mailboxes with messages to deliver
+    CFMpscQueue<CFMailbox> mRunQueue;
+    // Signalled when a mailbox is put in the run queue
+    int mEventFd;
+    // Mailbox being serviced
+    atomic<CFMailbox*> mCurrent;
+    // Tells the thread to exit
+    atomic<bool> mStop;
+    // The thread (not used for worker 0)
+    thread mThread;
+};
+
 //=============================================================================
 //                     E N U M E R A T I O N S
 //=============================================================================
@@ -71,7 +119,12 @@ public:
     // 
     // ISchedulerServer methods
     int add(CFComponent *obj);
+    int addPost(CFComponent *obj);
     int remove(CFComponent *obj);
+    int addActor(CFComponent *obj, int worker);
+    int post(CFComponent *obj, CFMessage *msg);
+    int setTick(CFComponent *obj, int ms);
+    int signal(CFComponent *obj);
 
     // 
     // ISchedulerControl methods
@@ -82,8 +135,26 @@ public:
     int start();
     /** Stop scheduling loop  */
     int stop();
+    int setWorkers(int num);
 
 private:
+    // Delivers messages from a mailbox, by its worker thread
+    void deliver(CFMailbox* mb);
+    // Body of a worker thread
+    void work(CF_S_Worker* w);
+    // Signals a worker that its run queue is not empty
+    void wake(CF_S_Worker* w);
+    // Takes a component out of the actors, returns its mailbox or NULL
+    CFMailbox* removeActor(CFComponent *obj);
+
+    // Returns the client interface of a component that can be added
+    ISchedulerClient* getClient(CFComponent *obj);
+    // Sets up a client, including its metrics
+    void initClient(CF_S_Client& c, CFComponent *obj, ISchedulerClient* iFace);
+    // Executes a client and measures the time it takes
+    void run(CF_S_Client& c, uint32_t slice);
+    // Returns how long the loop may wait for events, -1 for ever
+    int timeout();
     // Instance name
     string mName;
     // State
@@ -91,7 +162,24 @@ private:
     // Time slice
     int mSlice;
     // Map of scheduled components
-    map<CFComponent*,ISchedulerClient*> mClients;
+    map<CFComponent*,CF_S_Client> mClients;
+    // Map of components scheduled after the others
+    map<CFComponent*,CF_S_Client> mPostClients;
+    // Mailboxes of actor components
+    map<CFComponent*,CFMailbox*> mActors;
+    // Protects the maps above when components are set up in parallel,
+    // before the main loop runs (Cfg with -P). The loop itself does not
+    // take it.
+    mutex mClientLock;
+    // Mailboxes of removed actors, kept since other threads may hold them
+    vector<CFMailbox*> mRetired;
+    // Main loop and worker threads
+    vector<CF_S_Worker*> mWorkers;
+    // True when the wakeup event is being polled
+    bool mWakeupPolled;
+    // Metrics: turns of the main loop and messages delivered to actors
+    cf_metric_t* mLoopMetric;
+    cf_metric_t* mActorMetric;
 };
 
 
@@ -19,6 +19,8 @@
    along with this program.  If not, see <http://www.gnu.or/licenses/>.
 */
 #include <string>
+#include <string_view>
+#include "CFUuid.hh"
 using namespace std;
 
 /** @addtogroup Interfaces
@@ -30,30 +32,45 @@ using namespace std;
 /** Interface ID string */
 #define IBASE_ID "00000000-0000-0000-0000-000000000000"
 
+/** Identity of an interface class: its name and its ID. Every interface
+    has one as the compile time constant IDENT, and objects only point
+    to it. */
+class CFIfaceIdent
+{
+public:
+  //! Constructor
+  constexpr CFIfaceIdent(const char *name, const char *id) :
+    mName(name), mId(CFUuid::fromLiteral(id)) {}
+
+  // Interface name
+  string_view mName;
+  // Interface ID
+  CFUuid mId;
+};
+
 /** Base Class used to represent an interface */
 class IBase
 {
 public:
+  /** Identity of the interface */
+  static constexpr CFIfaceIdent IDENT{"IBase", IBASE_ID};
+
   //! Constructor
-  IBase(string name, string id) {
-    mName = name;
-    mId = id;
-  }
+  IBase(const CFIfaceIdent& ident) : mIdent(&ident) {}
 
   // Destructor
   ~IBase() { }
 
   /** Returns interface name */
-  string getName() { return mName; }	
+  string_view getName() const { return mIdent->mName; }
   /** Returns interface ID */
-  string getId() { return mId; }
+  const CFUuid& getId() const { return mIdent->mId; }
+  /** Returns true if this is an interface of type T */
+  template <class T> bool is() const { return mIdent->mId == T::IDENT.mId; }
 
-	
 private:
-  // String representation of interface (i.e interface name)
-  string mName;
-  // Interface ID
-  string mId;
+  // Identity of the interface
+  const CFIfaceIdent *mIdent;
 };
 
 /** @} */
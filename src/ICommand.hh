@@ -41,8 +41,11 @@ typedef int (*cfc_func_t)(int argc, char** argv);
 class ICommand  : public IBase
 {
 public:
+  /** Identity of the interface */
+  static constexpr CFIfaceIdent IDENT{"ICommand", ICOMMAND_ID};
+
   /** Constructor */
-  ICommand() : IBase("ICommand", ICOMMAND_ID) {}
+  ICommand() : IBase(IDENT) {}
   /** Destructor */
   virtual ~ICommand() {};
 
@@ -52,8 +55,19 @@ public:
 	  cfc_func_t func, char* usage) = 0;
   /** Remove a command from the handler */
   virtual int remove(const char* name) = 0;
-  /** Handle a command, based on a command string */
+  /** Handle a command, based on a command string
+      @param cmdStr Command and its arguments, split in place
+      @return Result of the command (1 if OK, 0 if not), 0 if there is
+              no such command, 1 for an empty line
+  */
   virtual int handle(char* cmdStr) = 0;
+  /** Handle a command that is already split into arguments
+      @param argc Number of arguments, the command name included
+      @param argv Arguments, the command name first
+      @return Result of the command (1 if OK, 0 if not), 0 if there is
+              no such command
+  */
+  virtual int handle(int argc, char** argv) = 0;
 };
 
 /** @} */
@@ -33,8 +33,11 @@
 class IConfig  : public IBase
 {
   public:
+    /** Identity of the interface */
+    static constexpr CFIfaceIdent IDENT{"IConfig", ICONFIG_ID};
+
     /** Constructor */
-    IConfig() : IBase("IConfig",ICONFIG_ID) {}
+    IConfig() : IBase(IDENT) {}
     /** Destructor */
     virtual ~IConfig() {};
 
@@ -43,6 +46,14 @@ class IConfig  : public IBase
         @return 1 if OK, 0 if failure
     */
     virtual int parse(char* cfgFile) = 0;
+
+    /** Makes parse() create components in parallel. Components that
+        are connected are still created one at a time, in file order.
+        Then connect and config commands are run in file order.
+        @param on       1 for parallel, 0 for one at a time in file order
+        @return 1 if OK, 0 if failure
+    */
+    virtual int setParallel(int on) = 0;
 };
 
 
@@ -54,8 +65,11 @@ class IConfig  : public IBase
 class IConfigClient  : public IBase
 {
   public:
+    /** Identity of the interface */
+    static constexpr CFIfaceIdent IDENT{"IConfigClient", ICONFIG_CLIENT_ID};
+
     /** Constructor */
-    IConfigClient() : IBase("IConfigClient", ICONFIG_CLIENT_ID) {}
+    IConfigClient() : IBase(IDENT) {}
     /** Destructor */
     virtual ~IConfigClient() {};
 
@@ -36,8 +36,11 @@ class CFComponent;
 class IConnect  : public IBase
 {
   public:
+    /** Identity of the interface */
+    static constexpr CFIfaceIdent IDENT{"IConnect", ICONNECT_ID};
+
     /** Constructor */
-    IConnect() : IBase("IConnect", ICONNECT_ID) { }
+    IConnect() : IBase(IDENT) { }
 
     /** Connect function pointer */
     virtual int connect(CFComponent *other, char *iface,
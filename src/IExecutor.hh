@@ -0,0 +1,100 @@
+#ifndef IEXECUTOR_HH
+#define IEXECUTOR_HH
+/* Copyright (c) 2007-2011  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+   
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "IBase.hh"
+#include "CFMailbox.hh"
+
+class CFComponent;
+
+/** @addtogroup Interfaces
+ *  These are the public interfaces of CompFrame
+ *  @{
+ */
+
+/** A piece of work for IExecutor. When it has run, the task is posted as
+ *  a message to the component that submitted it, which gets it on its own
+ *  thread:
+ *  @code
+ *  void MyComp::receive(CFMessage *msg) {
+ *      if (MyTask* t = msg->as<MyTask>()) {
+ *          // use the result in t
+ *      }
+ *  }
+ *  @endcode
+ */
+class CFTask : public CFMessage
+{
+  public:
+    /** Message type of tasks */
+    static const uint32_t TYPE = CF_MSG_TASK;
+
+    /** Constructor */
+    CFTask() : CFMessage(TYPE), mOwner(NULL) {}
+    /** Destructor */
+    virtual ~CFTask() {}
+
+    /** Does the work. Called on a thread of the executor. */
+    virtual void run() = 0;
+
+    /** Component that the task is posted back to (set by submit) */
+    CFComponent* mOwner;
+};
+
+/** Textual name of the interface of E, the executor */
+#define IEXECUTOR_ID "4ade2066-df52-48eb-bba7-83b122512c42"
+
+/** Interface of E, which runs tasks on a pool of threads. Each thread has
+ *  a deque of its own, and idle threads steal from the others.
+ */
+class IExecutor : public IBase
+{
+  public:
+    /** Identity of the interface */
+    static constexpr CFIfaceIdent IDENT{"IExecutor", IEXECUTOR_ID};
+
+    /** Constructor */
+    IExecutor() : IBase(IDENT) {}
+    /** Destructor */
+    virtual ~IExecutor() {};
+
+    /** Runs a task on the pool. Can be called from any thread. A task
+     *  submitted by a task is first in line on the same pool thread.
+     *  @param task        Task allocated with new, owned by E from now on
+     *  @param comp        Actor that gets the task back when it has run
+     *                     (see ISchedulerServer::addActor()). If NULL, the
+     *                     task is just deleted. The actor may be removed
+     *                     from S while the task runs, and the task is then
+     *                     deleted, but it must not be destroyed until the
+     *                     task has been handed back.
+     *  @return 1 if OK, 0 if not.
+     */
+    virtual int submit(CFTask *task, CFComponent *comp) = 0;
+
+    /** Sets the number of pool threads. Default is one per CPU. Must be
+     *  done before the first task is submitted.
+     *  @param num         Number of threads
+     *  @return 1 if OK, 0 if not.
+     */
+    virtual int setThreads(int num) = 0;
+};
+
+/** @}   Doxygen end marker */
+
+#endif
@@ -37,8 +37,11 @@
 class IMClient : public IBase
 {
 public:
+	/** Identity of the interface */
+	static constexpr CFIfaceIdent IDENT{"IMClient", IMCLIENT_ID};
+
 	// Constructor
-	IMClient() : IBase("IMClient", IMCLIENT_ID) {}
+	IMClient() : IBase(IDENT) {}
 	// Destructor
 	virtual ~IMClient() {}
 
@@ -48,7 +51,7 @@ public:
         @param userData User's own data. (From mr_add())
         @return 1 if OK, 0 if failure
     */
-    virtual int connected(void *conn, uint8_t chan, void *userData) = 0;
+    virtual int connected(void *conn, uint32_t chan, void *userData) = 0;
 
     /** Called when a connection closed down for the message receiver  
         @param conn     Pointer to connection context
@@ -56,17 +59,17 @@ public:
         @param userData User's own data. (From mr_add())
         @return 1 if OK, 0 if failure
     */
-    virtual int disconnected(void *conn, uint8_t chan, void *userData) = 0;
+    virtual int disconnected(void *conn, uint32_t chan, void *userData) = 0;
 
     /** Called to send a message to a component
         @param conn     Pointer to connection context
         @param chan     Channel number
-        @param len      Length of message
-        @param msg      Pointer to message
+        @param len      Length of message body
+        @param msg      Pointer to message body
         @param userData User's own data. (From mr_add())
         @return 1 if OK, 0 if failure
     */
-    virtual int message(void *conn, uint8_t chan, int len, 
+    virtual int message(void *conn, uint32_t chan, int len, 
                         unsigned char *msg, void *userData) = 0;
 };
 
@@ -114,6 +117,28 @@ typedef int
 /** Maximum total length of an M message */
 #define CF_M_MAX_MESSAGE 2048
 
+/** Channel number used for M server to/from client communication when
+    protocol version 2 is used */
+#define CFM_M_CHANNEL_V2 0xFFFFFFFF
+
+/** Maximum number of channels per connection with protocol version 2 */
+#define CFM_MAX_CHANNELS_V2 0x100000
+
+/** Protocol version with 8-bit channel numbers. Used by default. */
+#define CF_M_VERSION_1 1
+/** Protocol version with 32-bit channel numbers */
+#define CF_M_VERSION_2 2
+/** Protocol version 2 with binary interface UUIDs */
+#define CF_M_VERSION_3 3
+
+/** Length of a binary UUID (protocol version 3) */
+#define CFM_UUID_BIN_LEN 16
+
+/** Frame header length with protocol version 1 */
+#define CFM_HDR_LEN_V1 3
+/** Frame header length with protocol version 2 */
+#define CFM_HDR_LEN_V2 6
+
 /*---- Commands used by clients towards M ----*/
 
 /** Message used for opening a channel towards a receiver
@@ -128,6 +153,9 @@ typedef int
     UUID   - 36 bytes
     NAME   - n  bytes
     @endverbatim
+
+    With protocol version 3, UUID is 16 bytes: the 32 hex digits of the
+    UUID as binary, most significant byte first.
 */
 #define CF_M_CHANNEL_OPEN  0
 
@@ -233,6 +261,71 @@ typedef int
 */
 #define CF_M_CHANNEL_ORDER_UNKNOWN 7
 
+/** Message used for selecting the protocol version of a connection.
+    It is always sent with version 1 framing, before any channel has been
+    opened. The response carries the accepted version in RESPONSE. Once
+    CF_M_VERSION_OK has been sent, both sides use the new framing.
+    @verbatim
+    +------+--------+--------+-------+---------+
+    | CHAN | LEN LB | LEN HB | ORDER | VERSION |
+    +------+--------+--------+-------+---------+
+    CHAN    - 1 byte (Here M command channel)
+    LEN LB  - 1 byte (Total length low byte)
+    LEN HB  - 1 byte (Total length high byte)
+    ORDER   - 1 byte (CF_M_VERSION)
+    VERSION - 1 byte (CF_M_VERSION_2)
+    @endverbatim
+
+    With version 2, all frames carry a 32-bit channel number (least
+    significant byte first) and the M command channel is CFM_M_CHANNEL_V2.
+    @verbatim
+    +----------+--------+--------+---------+
+    | CHAN 0-3 | LEN LB | LEN HB | MESSAGE |
+    +----------+--------+--------+---------+
+    @endverbatim
+
+    Channel numbers are then chosen by M, and all responses carry the
+    channel concerned. CF_M_CHANNEL_CLOSE takes a 32-bit channel number.
+    Version 3 uses the same framing as version 2, but CF_M_CHANNEL_OPEN
+    carries the interface UUID as CFM_UUID_BIN_LEN bytes.
+    @verbatim
+    +----------+--------+--------+-------+-----+----------+----------+------+---+
+    | CHAN 0-3 | LEN LB | LEN HB | ORDER | RES | RESPONSE | CHAN 0-3 | TEXT | 0 |
+    +----------+--------+--------+-------+-----+----------+----------+------+---+
+    @endverbatim
+*/
+#define CF_M_VERSION 8
+
+/** Response to CF_M_VERSION when the version was accepted */
+#define CF_M_VERSION_OK 9
+
+/** Response to CF_M_VERSION when the version was not accepted */
+#define CF_M_VERSION_FAIL 10
+
+/** Message used for subscribing to a topic. M answers with
+    CF_M_SUBSCRIBE_OK and a channel, just like for CF_M_CHANNEL_OPEN.
+    Everything published on the topic is then received on that channel.
+    The subscription ends when the channel is closed with
+    CF_M_CHANNEL_CLOSE.
+    @verbatim
+    +------+--------+--------+-------+-------+---+
+    | CHAN | LEN LB | LEN HB | ORDER | TOPIC | 0 |
+    +------+--------+--------+-------+-------+---+
+    CHAN   - 1 byte (Here M command channel)
+    LEN LB - 1 byte (Total length low byte)
+    LEN HB - 1 byte (Total length high byte)
+    ORDER  - 1 byte (CF_M_SUBSCRIBE)
+    TOPIC  - n bytes
+    @endverbatim
+*/
+#define CF_M_SUBSCRIBE 11
+
+/** Response to CF_M_SUBSCRIBE when the subscription was made */
+#define CF_M_SUBSCRIBE_OK 12
+
+/** Response to CF_M_SUBSCRIBE when the subscription failed */
+#define CF_M_SUBSCRIBE_FAIL 13
+
 /** Error code for 'component not found' */
 #define CF_M_COMP_NOT_FOUND  100
 /** Error code for 'Out of channels' */
@@ -36,8 +36,11 @@ class CFComponent;
 class IMServer : public IBase
 {
 public:
+	/** Identity of the interface */
+	static constexpr CFIfaceIdent IDENT{"IMServer", IMSERVER_ID};
+
 	// Constructor
-	IMServer() : IBase("IMServer", IMSERVER_ID) {}
+	IMServer() : IBase(IDENT) {}
 	// Destructor
 	virtual ~IMServer() {}
 
@@ -51,6 +54,21 @@ public:
     virtual int addReceiver(CFComponent *comp, const char *uuid,
 					   char *name, void *userData) = 0;
 
+    /** Add a streaming message receiver. Messages to this receiver are
+        handed over piece by piece, as they arrive, through the
+        IMStreamClient interface of the component, instead of through
+        IMClient::message(). The component must implement both interfaces.
+        @note A message is still at most 65535 bytes including its frame
+        header, see IMStreamClient.
+        @param comp     Pointer to own context
+        @param uuid     UUID string for the interface 
+        @param name     Name of message receiver
+        @param userData User's data
+        @return 1 if OK, 0 if failure
+    */
+    virtual int addStreamReceiver(CFComponent *comp, const char *uuid,
+                                  char *name, void *userData) = 0;
+
     /** Enable message receiver, i.e allow connections to this receiver.
         @note Receivers are enabled by default.
         @param uuid UUID string for the interface 
@@ -81,23 +99,69 @@ public:
 
     /** Returns a colon separated string with message receivers
         with specific names (name="M" will return all that start
-        with 'M')
+        with 'M'). The format is "UUID:NAME1,NAME2;UUID2:NAME3;".
         @param name String with name or prefix.
-        @return the port number of -1 if not started.
+        @return Allocated string (free() it) or NULL if none found.
     */
     virtual char* searchByName(char *name) = 0;
 
     /** Returns a colon separated string with message receivers
-        with a specific interface.
+        with a specific interface. Same format as searchByName().
         @param uuid UUID string of interface.
-        @return the port number of -1 if not started.
+        @return Allocated string (free() it) or NULL if none found.
     */
     virtual char *searchByIface(const char *uuid) = 0;
 
-    /** Send a message to a receiver */
-    virtual int sendToReceiver(void *conn, uint8_t chan, int len,
+    /** Same as searchByName() but puts the result in a string owned by
+        the caller. Reusing the string between calls avoids allocations.
+        @param name   String with name or prefix.
+        @param result Cleared and filled in with the result.
+        @return Number of receivers found
+    */
+    virtual int searchByName(const char *name, string& result) = 0;
+
+    /** Same as searchByIface() but puts the result in a string owned by
+        the caller.
+        @param uuid   UUID string of interface.
+        @param result Cleared and filled in with the result.
+        @return Number of receivers found
+    */
+    virtual int searchByIface(const char *uuid, string& result) = 0;
+
+    /** Publishes a message on a topic. The message is copied once and the
+        same copy is queued for all subscribers. It is written together
+        with other queued messages, see flush().
+        @param topic Name of topic
+        @param len   Length of message
+        @param msg   Message
+        @return Number of subscribers the message was sent to, -1 on error
+    */
+    virtual int publish(const char *topic, int len, unsigned char *msg) = 0;
+
+    /** Send a message to a receiver. The message is copied and queued
+        on the connection. Queued messages are written with as few system
+        calls as possible, once per turn of the scheduling loop, when
+        enough data has been queued, or when flush() is called. Receivers
+        that have batching turned off get their messages written at once.
+        @return 1 if OK, 0 if failure
+    */
+    virtual int sendToReceiver(void *conn, uint32_t chan, int len,
 					 unsigned char *msg) = 0;
 
+    /** Writes all queued messages on all connections
+        @return 1 if OK, 0 if any write failed
+    */
+    virtual int flush() = 0;
+
+    /** Turns batching of sent messages on or off for a receiver. It is
+        on by default. Turn it off for latency critical traffic.
+        @param uuid UUID string of the interface 
+        @param name Name of message receiver
+        @param on   1 for batching, 0 for writing at once
+        @return 1 if OK, 0 if failure
+    */
+    virtual int setBatching(const char *uuid, char *name, int on) = 0;
+
 };
 
 
@@ -0,0 +1,91 @@
+#ifndef IMSTREAMCLIENT_HH
+#define IMSTREAMCLIENT_HH
+/* Copyright (c) 2007-2011  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+#include "IBase.hh"
+#include <stdint.h>
+
+
+/** @addtogroup Interfaces
+ *  These are the public interfaces of CompFrame
+ *  @{
+ */
+
+/** Textual name of the M (Message Transport Component) streaming client
+    interface. It may be implemented by M client components that want
+    message bodies delivered piece by piece, as they arrive on the socket,
+    instead of as one assembled buffer. */
+#define IMSTREAMCLIENT_ID  "0b6f4d0e-8a4f-4c1e-9f3a-6e2d5c7b9a14"
+
+/** Streaming receiver interface.
+    A receiver that has been added with IMServer::addStreamReceiver() gets
+    begin(), zero or more chunk() and finally end() for every message,
+    instead of IMClient::message(). M never buffers the message body for
+    such a receiver.
+    @note The length of a frame is 16 bits in all protocol versions, so
+    a message is at most 65535 bytes including its frame header. A
+    sender of larger payloads must split them in several messages, and
+    the receiver put them together. */
+class IMStreamClient : public IBase
+{
+public:
+	/** Identity of the interface */
+	static constexpr CFIfaceIdent IDENT{"IMStreamClient", IMSTREAMCLIENT_ID};
+
+	// Constructor
+	IMStreamClient() : IBase(IDENT) {}
+	// Destructor
+	virtual ~IMStreamClient() {}
+
+    /** Called when the header of a new message has been received
+        @param conn     Pointer to connection context
+        @param chan     Channel number
+        @param len      Total length of the message body
+        @param userData User's own data. (From addStreamReceiver())
+        @return 1 if OK, 0 if failure
+    */
+    virtual int begin(void *conn, uint32_t chan, int len, void *userData) = 0;
+
+    /** Called for each part of the message body that has been received.
+        @note The data is only valid during the call.
+        @param conn     Pointer to connection context
+        @param chan     Channel number
+        @param len      Length of this part
+        @param data     Pointer to data
+        @param userData User's own data. (From addStreamReceiver())
+        @return 1 if OK, 0 if failure
+    */
+    virtual int chunk(void *conn, uint32_t chan, int len,
+                      unsigned char *data, void *userData) = 0;
+
+    /** Called when the message is complete, or has been aborted.
+        @param conn     Pointer to connection context
+        @param chan     Channel number
+        @param complete 1 if all of the message was delivered, 0 if the
+                        connection went down in the middle of it
+        @param userData User's own data. (From addStreamReceiver())
+        @return 1 if OK, 0 if failure
+    */
+    virtual int end(void *conn, uint32_t chan, int complete,
+                    void *userData) = 0;
+};
+
+/** @} */
+
+#endif
@@ -40,8 +40,11 @@ class IRegistry :
   public IBase
 {
 public:
+  /** Identity of the interface */
+  static constexpr CFIfaceIdent IDENT{"IRegistry", IREGISTRY_ID};
+
   /** Constructor */
-  IRegistry() : IBase("IRegistry", IREGISTRY_ID) {}
+  IRegistry() : IBase(IDENT) {}
 
   /** Returns pointer to Regigistry singleton */
   virtual IRegistry* getInstance() = 0;
@@ -102,6 +105,18 @@ public:
   */
   virtual IBase* getIface(CFComponent* comp, const char* iface_name) = 0;
 
+  /** Returns a pointer to an interface for a specific component
+      @param comp        Pointer to component instance
+      @param ident       Identity of interface (the interface's IDENT)
+  */
+  virtual IBase* getIface(CFComponent* comp, const CFIfaceIdent& ident) = 0;
+
+  /** Returns a pointer to the T interface of a component, or NULL.
+      Looks the interface up on its ID, e.g getIface<ICommand>(comp). */
+  template <class T> T* getIface(CFComponent* comp) {
+    return static_cast<T*>(getIface(comp, T::IDENT));
+  }
+
   /** Prints the active instances to stdout */
   virtual void listInstances(void) = 0;
   /** Prints the available classes to stdout */
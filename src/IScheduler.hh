@@ -21,6 +21,13 @@
 #include <stdint.h>
 
 class CFComponent;
+class CFMessage;
+
+/** Tick of a component that is executed in every turn of the loop */
+#define CF_S_TICK_EVERY_TURN 0
+
+/** Tick of a component that is only executed when signalled */
+#define CF_S_TICK_NONE (-1)
 
 /** @addtogroup Interfaces
  *  These are the public interfaces of CompFrame
@@ -36,8 +43,12 @@ class CFComponent;
 class ISchedulerControl  : public IBase
 {
   public:
+    /** Identity of the interface */
+    static constexpr CFIfaceIdent IDENT{
+        "ISchedulerControl", ISCHEDULER_CONTROL_ID};
+
     /** Constructor */
-    ISchedulerControl() : IBase("ISchedulerControl", ISCHEDULER_CONTROL_ID) {}
+    ISchedulerControl() : IBase(IDENT) {}
     /** Destructor */
     virtual ~ISchedulerControl() {};
 
@@ -49,6 +60,13 @@ class ISchedulerControl  : public IBase
     virtual int start() = 0;
     /** Stop scheduling loop  */
     virtual int stop() = 0;
+
+    /** Sets the number of worker threads that actors can run on, besides
+     *  the main loop. Must be done before any actor is added.
+     *  @param num         Number of worker threads
+     *  @return 1 if OK, 0 if not.
+     */
+    virtual int setWorkers(int num) = 0;
 };
 
 
@@ -65,22 +83,78 @@ class ISchedulerControl  : public IBase
 class ISchedulerServer : public IBase
 {
   public:
+    /** Identity of the interface */
+    static constexpr CFIfaceIdent IDENT{
+        "ISchedulerServer", ISCHEDULER_SERVER_ID};
+
     /** Constructor */
-    ISchedulerServer() : IBase("ISchedulerServer", ISCHEDULER_SERVER_ID) {}
+    ISchedulerServer() : IBase(IDENT) {}
     /** Destructor */
     virtual ~ISchedulerServer() {};
 
-    /** Register in S server.
+    /** Register in S server. The component is executed once per time
+     *  slice (10 ms), see setTick().
      *  @param obj         Pointer to scheduled component
      *  @return 1 if OK, 0 if not.
      */
     virtual int add(CFComponent *obj) = 0;
 
+    /** Register in S server as a client that is executed after all
+     *  ordinary clients, in each turn of the loop. Used for finishing
+     *  off what the ordinary clients have done, e.g. flushing output.
+     *  @param obj         Pointer to scheduled component
+     *  @return 1 if OK, 0 if not.
+     */
+    virtual int addPost(CFComponent *obj) = 0;
+
     /** Deregister in S server.
      *  @param obj         Pointer to scheduled component
      *  @return 1 if OK, 0 if not.
      */
     virtual int remove(CFComponent *obj) = 0;
+
+    /** Sets how often a component added with add() is executed. When no
+     *  component is due, the loop sleeps until a socket, timer or message
+     *  wakes it up, so idle components cost nothing.
+     *  @param obj         Pointer to scheduled component
+     *  @param ms          Milliseconds between executions,
+     *                     CF_S_TICK_EVERY_TURN for every turn of the loop,
+     *                     or CF_S_TICK_NONE for only when signalled
+     *  @return 1 if OK, 0 if not.
+     */
+    virtual int setTick(CFComponent *obj, int ms) = 0;
+
+    /** Makes S execute a component in the next turn of the loop, whatever
+     *  its tick. Called in the main loop, e.g. from a socket callback.
+     *  @param obj         Pointer to scheduled component
+     *  @return 1 if OK, 0 if not.
+     */
+    virtual int signal(CFComponent *obj) = 0;
+
+    /** Makes a component an actor. It gets a mailbox, and the messages
+     *  posted to it are delivered one at a time to its IActor interface,
+     *  always by the same thread. An actor on a worker thread may thus
+     *  keep its internals unlocked, as long as other components only talk
+     *  to it through messages. It is removed by remove(), which an actor
+     *  may call on itself from receive(). Otherwise remove() returns when
+     *  no message is being delivered to it. Messages not yet delivered,
+     *  and messages posted while it is removed, are deleted. The actor
+     *  must not be destroyed while another thread may still post to it.
+     *  @param obj         Pointer to component implementing IActor
+     *  @param worker      Thread delivering the messages: 0 for the main
+     *                     loop, or 1 up to the number of worker threads
+     *  @return 1 if OK, 0 if not.
+     */
+    virtual int addActor(CFComponent *obj, int worker) = 0;
+
+    /** Posts a message to an actor. Lock-free, and can be called from
+     *  any thread.
+     *  @param obj         Pointer to actor component
+     *  @param msg         Message allocated with new. If OK, S owns it and
+     *                     deletes it after delivery.
+     *  @return 1 if OK, 0 if obj is not an actor.
+     */
+    virtual int post(CFComponent *obj, CFMessage *msg) = 0;
 };
 
 /** Textual name of the S interface used by S to tell scheduled components
@@ -94,8 +168,12 @@ class ISchedulerServer : public IBase
 class ISchedulerClient : public IBase
 {
   public:
+    /** Identity of the interface */
+    static constexpr CFIfaceIdent IDENT{
+        "ISchedulerClient", ISCHEDULER_CLIENT_ID};
+
     /** Constructor */
-    ISchedulerClient() : IBase("ISchedulerClient", ISCHEDULER_CLIENT_ID) {}
+    ISchedulerClient() : IBase(IDENT) {}
     /** Destructor */
     virtual ~ISchedulerClient() {};
 
@@ -105,6 +183,30 @@ class ISchedulerClient : public IBase
     virtual void execute(uint32_t slice) = 0;
 };
 
+/** Textual name of the interface used by S to deliver messages to actors
+ */
+#define IACTOR_ID "d68611b1-fa9b-44f0-b857-0edecd6e8fce"
+
+/** Interface used by S to deliver messages posted to an actor
+ *  (see ISchedulerServer::addActor()).
+ */
+class IActor : public IBase
+{
+  public:
+    /** Identity of the interface */
+    static constexpr CFIfaceIdent IDENT{"IActor", IACTOR_ID};
+
+    /** Constructor */
+    IActor() : IBase(IDENT) {}
+    /** Destructor */
+    virtual ~IActor() {};
+
+    /** Handles a message. Called by the thread of the actor only.
+     *  @param msg         Message, deleted by S when this returns
+     */
+    virtual void receive(CFMessage *msg) = 0;
+};
+
 
 
 
@@ -0,0 +1,257 @@
+#ifndef CFBENCH_HH
+#define CFBENCH_HH
+
+/* Copyright (c) 2007-2014  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+/** @addtogroup bench
+ *  @{
+ */
+
+/** A small micro benchmark harness, in the style of Google Benchmark but
+    without the dependency:
+    @code
+    static void
+    bm_lookup(CFBenchState& state)
+    {
+        setup(state.arg());
+
+        while (state.keepRunning()) {
+            cfBenchKeep(lookup());
+        }
+    }
+    CF_BENCHMARK(bm_lookup)->arg(10)->arg(1000);
+
+    int main(int argc, char** argv) { return CFBench::main(argc, argv); }
+    @endcode
+    The loop is run with more and more iterations, until it takes long
+    enough to be timed reliably. The time per iteration is reported.
+    Runs are ordered on argument, so benchmarks that need the same set up
+    for an argument run after each other.
+*/
+class CFBenchState
+{
+public:
+    CFBenchState(int64_t arg, uint64_t iterations) :
+        mArg(arg), mIterations(iterations), mLeft(iterations),
+        mStarted(false), mPaused(0), mPauseStart(0), mStart(0), mStop(0),
+        mItems(0) {}
+
+    /** Returns true as long as the loop shall run */
+    bool keepRunning() {
+        if (!mStarted) {
+            mStarted = true;
+            mStart = now();
+        }
+
+        if (mLeft-- > 0) {
+            return true;
+        }
+
+        mStop = now();
+        return false;
+    }
+
+    /** Stops the clock, e.g. while setting up the next iteration */
+    void pauseTiming() { mPauseStart = now(); }
+
+    /** Starts the clock again */
+    void resumeTiming() { mPaused += now() - mPauseStart; }
+
+    /** Argument given with CFBench::arg() */
+    int64_t arg() const { return mArg; }
+
+    /** Number of iterations in this run */
+    uint64_t iterations() const { return mIterations; }
+
+    /** Sets how many items were handled in total, for items per second */
+    void setItemsProcessed(uint64_t items) { mItems = items; }
+
+    /** Time of the loop in nanoseconds */
+    uint64_t elapsed() const { return mStop - mStart - mPaused; }
+
+    /** Items handled in total */
+    uint64_t items() const { return mItems; }
+
+    /** Returns the monotonic time in nanoseconds */
+    static uint64_t now() {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+private:
+    int64_t mArg;
+    uint64_t mIterations;
+    int64_t mLeft;
+    bool mStarted;
+    uint64_t mPaused;
+    uint64_t mPauseStart;
+    uint64_t mStart;
+    uint64_t mStop;
+    uint64_t mItems;
+};
+
+/** Keeps the compiler from optimizing away a value */
+template <class T> inline void
+cfBenchKeep(const T& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/** A registered benchmark */
+class CFBench
+{
+public:
+    typedef void (*Func)(CFBenchState& state);
+
+    CFBench(const char* name, Func fp) : mName(name), mFunc(fp) {
+        all().push_back(this);
+    }
+
+    /** Adds an argument to run the benchmark with */
+    CFBench* arg(int64_t a) {
+        mArgs.push_back(a);
+        return this;
+    }
+
+    /** Runs the benchmarks whose names contain a filter.
+        Options: --filter=<text> --min-time=<seconds>
+    */
+    static int main(int argc, char** argv) {
+        const char* filter = "";
+        double minTime = 0.2;
+
+        for (int i = 1; i < argc; i++) {
+            if (!strncmp(argv[i], "--filter=", 9)) {
+                filter = argv[i] + 9;
+            }
+            else if (!strncmp(argv[i], "--min-time=", 11)) {
+                minTime = atof(argv[i] + 11);
+            }
+            else {
+                fprintf(stderr, "Usage: %s [--filter=<text>] "
+                        "[--min-time=<seconds>]\n", argv[0]);
+                return 1;
+            }
+        }
+
+        fprintf(stdout, "%-40s %14s %14s %14s\n",
+                "Benchmark", "Time (ns)", "Iterations", "Items/s");
+
+        // All runs with the same argument are done after each other, so
+        // that they can share an expensive set up
+        vector<pair<int64_t, pair<CFBench*, string>>> runs;
+
+        for (size_t i = 0; i < all().size(); i++) {
+            CFBench* b = all()[i];
+
+            if (b->mArgs.empty()) {
+                b->mArgs.push_back(0);
+            }
+
+            for (size_t j = 0; j < b->mArgs.size(); j++) {
+                string name = b->mName;
+
+                if (b->mArgs.size() > 1 || b->mArgs[j] != 0) {
+                    name += "/" + to_string(b->mArgs[j]);
+                }
+
+                if (strstr(name.c_str(), filter)) {
+                    runs.push_back(make_pair(b->mArgs[j], make_pair(b, name)));
+                }
+            }
+        }
+
+        stable_sort(runs.begin(), runs.end(),
+                    [](const pair<int64_t, pair<CFBench*, string>>& x,
+                       const pair<int64_t, pair<CFBench*, string>>& y) {
+                        return x.first < y.first;
+                    });
+
+        for (size_t i = 0; i < runs.size(); i++) {
+            runs[i].second.first->run(runs[i].second.second, runs[i].first,
+                                      minTime);
+        }
+
+        return 0;
+    }
+
+private:
+    void run(const string& name, int64_t a, double minTime) {
+        uint64_t n = 1;
+        uint64_t want = (uint64_t) (minTime * 1e9);
+
+        for (;;) {
+            CFBenchState st(a, n);
+
+            mFunc(st);
+
+            uint64_t t = st.elapsed();
+
+            if (t >= want || n >= 1000000000ULL) {
+                double perIter = (double) t / n;
+
+                fprintf(stdout, "%-40s %14.1f %14llu", name.c_str(), perIter,
+                        (unsigned long long) n);
+
+                if (st.items()) {
+                    fprintf(stdout, " %14.0f", st.items() * 1e9 / t);
+                }
+
+                fprintf(stdout, "\n");
+                fflush(stdout);
+                return;
+            }
+
+            // Aim a bit beyond the minimum time, at most 100 times more
+            uint64_t next = t ? (uint64_t) (n * 1.4 * want / t) : n * 100;
+
+            n = next > n * 100 ? n * 100 : (next > n ? next : n + 1);
+        }
+    }
+
+    static vector<CFBench*>& all() {
+        static vector<CFBench*> benches;
+        return benches;
+    }
+
+    string mName;
+    Func mFunc;
+    vector<int64_t> mArgs;
+};
+
+/** Registers a benchmark function */
+#define CF_BENCHMARK(fn) \
+    static CFBench* fn##_bench = (new CFBench(#fn, fn))
+
+/** @} */
+
+#endif
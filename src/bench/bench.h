@@ -0,0 +1,34 @@
+#ifndef BENCH_H
+#define BENCH_H
+/* Copyright (c) 2007-2014  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+/** @addtogroup bench Benchmarks
+ *  Things shared by the benchmark programs and components
+ *  @{
+ */
+
+/** Interface UUID of the M echo receiver */
+#define BENCH_ECHO_ID "2e6e6665-ab85-4665-bd44-3aeb1cb87f89"
+
+/** Name of the M echo receiver */
+#define BENCH_ECHO_NAME "BENCHECHO"
+
+/** @} */
+
+#endif /* BENCH_H */
@@ -0,0 +1,153 @@
+/* Copyright (c) 2007-2014  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+/** @addtogroup bench
+ *  @{
+ */
+
+/** An M receiver that sends every message straight back. It is what
+    bench_m measures against. */
+#include "compframe.h"
+#include <assert.h>
+#include "CFComponentLib.hh"
+#include "IRegistry.hh"
+#include "IMServer.hh"
+#include "IMClient.hh"
+#include "bench.h"
+
+
+/* Predeclaration of function used later on. */
+static CFComponent* create_me(const char* inst_name);
+static void         set_me_up(CFComponent* comp);
+static int          destroy_me(CFComponent* comp);
+
+// The library container
+static CFComponentLib theLib("BENCHECHO", create_me, set_me_up, destroy_me);
+
+// Echo component
+class BenchEcho :
+    public CFComponent,
+    public IMClient
+{
+public:
+    BenchEcho(const char* instName) :
+            CFComponent(instName),
+            mServer(NULL) {
+    }
+    virtual ~BenchEcho() { }
+
+    // IMClient methods
+    int connected(void *conn, uint32_t chan, void *userData);
+    int disconnected(void *conn, uint32_t chan, void *userData);
+    int message(void *conn, uint32_t chan, int len,
+                unsigned char *msg, void *userData);
+
+    // M, to send the answers through
+    IMServer* mServer;
+};
+
+
+/** This function must reside in all component libraries. */
+extern "C" void
+dlopen_this(void)
+{
+    cfGetRegistry()->registerLibrary(&theLib);
+}
+
+
+/** This function is used to create and initate a component.
+    @return Pointer to created instance or NULL
+*/
+static CFComponent*
+create_me(const char* inst_name)
+{
+    assert(inst_name!=NULL);
+
+    return new BenchEcho(inst_name);
+}
+
+static int
+destroy_me(CFComponent* comp)
+{
+    if (!comp) {
+        return 1;
+    }
+
+    BenchEcho* e = (BenchEcho*) comp;
+
+    if (e->mServer) {
+        e->mServer->rmReceiver(BENCH_ECHO_ID, (char*) BENCH_ECHO_NAME);
+    }
+
+    /* De-register our interfaces */
+    cfGetRegistry()->deregisterIfaces(comp);
+
+    delete e;
+
+    return 0;
+}
+
+
+static void
+set_me_up(CFComponent* comp)
+{
+    BenchEcho* e = (BenchEcho*) comp;
+
+    cfGetRegistry()->registerIface(comp, (IMClient*)e);
+
+    e->mServer = (IMServer*) cfGetRegistry()->getCompIface("M", "IMServer");
+
+    if (!e->mServer ||
+        !e->mServer->addReceiver(comp, BENCH_ECHO_ID,
+                                 (char*) BENCH_ECHO_NAME, NULL)) {
+        fprintf(stderr, "%s:%d Could not add M receiver\n",
+                __FILE__, __LINE__);
+    }
+}
+
+
+int
+BenchEcho::connected(void *conn, uint32_t chan, void *userData)
+{
+    (void) conn;
+    (void) chan;
+    (void) userData;
+
+    return 1;
+}
+
+int
+BenchEcho::disconnected(void *conn, uint32_t chan, void *userData)
+{
+    (void) conn;
+    (void) chan;
+    (void) userData;
+
+    return 1;
+}
+
+int
+BenchEcho::message(void *conn, uint32_t chan, int len,
+                   unsigned char *msg, void *userData)
+{
+    (void) userData;
+
+    return mServer->sendToReceiver(conn, chan, len, msg);
+}
+
+/** @} */
@@ -0,0 +1,577 @@
+/* Copyright (c) 2007-2014  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+/** M load generator. Opens connections and channels to the echo receiver
+    of bench_echo.so, sends fixed size messages and measures the round
+    trip time of each.
+
+    The M protocol (version 2) is spoken directly instead of through
+    libcompframe_m_client, so that the client side costs as little as
+    possible and what is measured is M.
+
+    Without a rate, each channel keeps a window of messages outstanding
+    (closed loop). With a rate, messages are sent on a fixed schedule
+    regardless of the answers (open loop), and the round trip time is
+    counted from when a message should have been sent. A server that
+    falls behind then shows up in the latency, instead of just slowing
+    down the sender.
+*/
+
+/*===========================================================================*/
+/* INCLUDES                                                                  */
+/*===========================================================================*/
+
+/* ppoll() */
+#define _GNU_SOURCE
+
+#include "compframe_m_lib.h"
+#include "compframe_metrics.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*===========================================================================*/
+/* MACROS                                                                    */
+/*===========================================================================*/
+
+/** Smallest message, it must hold the time stamp */
+#define MIN_SIZE ((int) sizeof(uint64_t))
+
+/** Largest message */
+#define MAX_SIZE (0xFFFF - CFM_HDR_LEN_V2)
+
+/** Size of the receive buffer of a connection */
+#define IN_SIZE (256 * 1024)
+
+/*===========================================================================*/
+/* TYPES                                                                     */
+/*===========================================================================*/
+
+/** A connection to M */
+typedef struct {
+    /** Socket descriptor */
+    int sd;
+    /** Channels opened on it */
+    uint32_t *chans;
+    /** Next channel to send on (open loop) */
+    int next;
+    /** Bytes waiting to be written */
+    unsigned char *out;
+    /** Number of bytes in out */
+    size_t outLen;
+    /** Size of out */
+    size_t outSize;
+    /** Bytes read but not yet handled */
+    unsigned char in[IN_SIZE];
+    /** Number of bytes in in */
+    size_t inLen;
+} bench_conn_t;
+
+/*===========================================================================*/
+/* VARIABLES                                                                 */
+/*===========================================================================*/
+
+static int numConns = 1;
+static int numChans = 1;
+static int msgSize = 64;
+static int rate = 0;
+static int window = 1;
+static int duration = 5;
+static int warmup = 1;
+
+/** Time stamps earlier than this are not counted (ns) */
+static uint64_t countFrom;
+
+/** Messages sent and received after countFrom */
+static uint64_t numSent;
+static uint64_t numReceived;
+
+/** Messages in flight */
+static uint64_t outstanding;
+
+/** Round trip times, see cf_metric_bucket() */
+static uint64_t latHist[CF_METRIC_BUCKETS];
+static uint64_t latMax;
+
+/** The message sent, apart from its time stamp */
+static unsigned char *payload;
+
+/*===========================================================================*/
+/* FUNCTION DEFINITIONS                                                      */
+/*===========================================================================*/
+
+static void
+print_usage(void)
+{
+    fprintf(stderr,
+            "Usage: bench_m [options] <host> <port>\n"
+            "Options:\n"
+            " -c <num>    Connections (1)\n"
+            " -n <num>    Channels per connection (1)\n"
+            " -s <bytes>  Message size, at least %d (64)\n"
+            " -r <num>    Messages per second in total, 0 for as fast as\n"
+            "             the answers come back (0)\n"
+            " -w <num>    Messages outstanding per channel when -r is 0 (1)\n"
+            " -d <sec>    Seconds to measure (5)\n"
+            " -W <sec>    Seconds of warm up before measuring (1)\n",
+            MIN_SIZE);
+}
+
+/** Returns the monotonic time in nanoseconds */
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Returns a percentile of the round trip times in microseconds
+    @param permille Percentile in per mille, e.g. 990 for the 99th
+*/
+static double
+lat_percentile(int permille)
+{
+    cf_metric_value_t v;
+
+    memset(&v, 0, sizeof(v));
+    v.type = CF_METRIC_HISTOGRAM;
+    v.count = numReceived;
+    v.max = latMax;
+    v.buckets = latHist;
+    v.numBuckets = CF_METRIC_BUCKETS;
+
+    return cf_metric_percentile(&v, permille) / 1000.0;
+}
+
+/** Writes a frame header (protocol version 2) */
+static void
+header_build(unsigned char *hdr, uint32_t chan, int len)
+{
+    len += CFM_HDR_LEN_V2;
+
+    hdr[0] = chan & 0xff;
+    hdr[1] = (chan >> 8) & 0xff;
+    hdr[2] = (chan >> 16) & 0xff;
+    hdr[3] = (chan >> 24) & 0xff;
+    hdr[4] = len & 0xff;
+    hdr[5] = (len >> 8) & 0xff;
+}
+
+/** Reads exactly len bytes from a blocking socket
+    @return 1 if OK, 0 if not
+*/
+static int
+read_all(int sd, unsigned char *buf, int len)
+{
+    int pos = 0;
+
+    while (pos < len) {
+        int res = read(sd, &buf[pos], len - pos);
+
+        if (res <= 0) {
+            return 0;
+        }
+        pos += res;
+    }
+
+    return 1;
+}
+
+/** Reads a control answer of M and checks it
+    @param hdrLen   Frame header length
+    @param ok       Expected answer, e.g. CF_M_CHANNEL_OPEN_OK
+    @param body     Message body (returned), at least CF_M_MAX_MESSAGE bytes
+    @return 1 if OK, 0 if not
+*/
+static int
+answer_read(int sd, int hdrLen, int ok, unsigned char *body)
+{
+    unsigned char hdr[CFM_HDR_LEN_V2];
+    int len;
+
+    if (!read_all(sd, hdr, hdrLen)) {
+        return 0;
+    }
+
+    len = (hdr[hdrLen - 2] | (hdr[hdrLen - 1] << 8)) - hdrLen;
+
+    if (len < 2 || len > CF_M_MAX_MESSAGE || !read_all(sd, body, len)) {
+        return 0;
+    }
+
+    if (body[1] != ok) {
+        fprintf(stderr, "M answered %u: %s\n", body[1],
+                len > 7 ? (char *) &body[7] : "");
+        return 0;
+    }
+
+    return 1;
+}
+
+/** Connects to M, switches to protocol version 2 and opens the channels
+    @return 1 if OK, 0 if not
+*/
+static int
+conn_open(bench_conn_t * c, struct addrinfo *ai)
+{
+    unsigned char msg[CF_M_MAX_MESSAGE];
+    int one = 1;
+
+    c->sd = socket(ai->ai_family, SOCK_STREAM, 0);
+
+    if (c->sd == -1 || connect(c->sd, ai->ai_addr, ai->ai_addrlen) != 0) {
+        perror("connect");
+        return 0;
+    }
+
+    setsockopt(c->sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    /* Version request, with version 1 framing */
+    msg[0] = CFM_M_CHANNEL;
+    msg[1] = CFM_HDR_LEN_V1 + 2;
+    msg[2] = 0;
+    msg[3] = CF_M_VERSION;
+    msg[4] = CF_M_VERSION_2;
+
+    if (write(c->sd, msg, 5) != 5 ||
+        !answer_read(c->sd, CFM_HDR_LEN_V1, CF_M_VERSION_OK, msg)) {
+        fprintf(stderr, "Could not select M protocol version 2\n");
+        return 0;
+    }
+
+    c->chans = malloc(numChans * sizeof(uint32_t));
+
+    for (int i = 0; i < numChans; i++) {
+        int len = 1 + 36 + strlen(BENCH_ECHO_NAME) + 1;
+
+        header_build(msg, CFM_M_CHANNEL_V2, len);
+        msg[CFM_HDR_LEN_V2] = CF_M_CHANNEL_OPEN;
+        memcpy(&msg[CFM_HDR_LEN_V2 + 1], BENCH_ECHO_ID, 36);
+        strcpy((char *) &msg[CFM_HDR_LEN_V2 + 1 + 36], BENCH_ECHO_NAME);
+
+        if (write(c->sd, msg, CFM_HDR_LEN_V2 + len) != CFM_HDR_LEN_V2 + len ||
+            !answer_read(c->sd, CFM_HDR_LEN_V2, CF_M_CHANNEL_OPEN_OK, msg)) {
+            fprintf(stderr, "Could not open channel to %s "
+                    "(is bench_echo.so loaded?)\n", BENCH_ECHO_NAME);
+            return 0;
+        }
+
+        c->chans[i] = msg[3] | (msg[4] << 8) | (msg[5] << 16) |
+            ((uint32_t) msg[6] << 24);
+    }
+
+    fcntl(c->sd, F_SETFL, fcntl(c->sd, F_GETFL) | O_NONBLOCK);
+
+    c->outSize = (size_t) (CFM_HDR_LEN_V2 + msgSize) * 64;
+    c->out = malloc(c->outSize);
+
+    return 1;
+}
+
+/** Queues a message on a channel
+    @param stamp    Time stamp carried by the message
+*/
+static void
+msg_queue(bench_conn_t * c, uint32_t chan, uint64_t stamp)
+{
+    size_t need = CFM_HDR_LEN_V2 + msgSize;
+
+    if (c->outLen + need > c->outSize) {
+        c->outSize = (c->outLen + need) * 2;
+        c->out = realloc(c->out, c->outSize);
+    }
+
+    unsigned char *p = &c->out[c->outLen];
+
+    header_build(p, chan, msgSize);
+    memcpy(&p[CFM_HDR_LEN_V2], &stamp, sizeof(stamp));
+    memcpy(&p[CFM_HDR_LEN_V2 + sizeof(stamp)], payload,
+           msgSize - sizeof(stamp));
+    c->outLen += need;
+
+    outstanding++;
+
+    if (stamp >= countFrom) {
+        numSent++;
+    }
+}
+
+/** Writes what can be written without blocking
+    @return 1 if OK, 0 if the connection failed
+*/
+static int
+conn_flush(bench_conn_t * c)
+{
+    size_t pos = 0;
+
+    while (pos < c->outLen) {
+        ssize_t res = write(c->sd, &c->out[pos], c->outLen - pos);
+
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+            perror("write");
+            return 0;
+        }
+        pos += res;
+    }
+
+    memmove(c->out, &c->out[pos], c->outLen - pos);
+    c->outLen -= pos;
+
+    return 1;
+}
+
+/** Reads and handles the answers on a connection
+    @param more     Non-zero to send a new message for each answer
+    @return 1 if OK, 0 if the connection failed
+*/
+static int
+conn_read(bench_conn_t * c, int more)
+{
+    ssize_t res = read(c->sd, &c->in[c->inLen], IN_SIZE - c->inLen);
+
+    if (res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR)) {
+        fprintf(stderr, "Connection to M lost\n");
+        return 0;
+    }
+
+    if (res < 0) {
+        return 1;
+    }
+
+    c->inLen += res;
+
+    uint64_t now = now_ns();
+    size_t pos = 0;
+
+    while (c->inLen - pos >= CFM_HDR_LEN_V2) {
+        unsigned char *p = &c->in[pos];
+        uint32_t chan = p[0] | (p[1] << 8) | (p[2] << 16) |
+            ((uint32_t) p[3] << 24);
+        size_t len = p[4] | (p[5] << 8);
+
+        if (len < CFM_HDR_LEN_V2) {
+            fprintf(stderr, "Bad frame from M\n");
+            return 0;
+        }
+
+        if (c->inLen - pos < len) {
+            break;
+        }
+
+        pos += len;
+
+        if (chan == CFM_M_CHANNEL_V2 || len < CFM_HDR_LEN_V2 + sizeof(uint64_t)) {
+            continue;
+        }
+
+        uint64_t stamp;
+
+        memcpy(&stamp, &p[CFM_HDR_LEN_V2], sizeof(stamp));
+        outstanding--;
+
+        if (stamp >= countFrom) {
+            uint64_t rtt = now - stamp;
+
+            latHist[cf_metric_bucket(rtt)]++;
+            numReceived++;
+
+            if (rtt > latMax) {
+                latMax = rtt;
+            }
+        }
+
+        if (more) {
+            msg_queue(c, chan, now);
+        }
+    }
+
+    memmove(c->in, &c->in[pos], c->inLen - pos);
+    c->inLen -= pos;
+
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:s:r:w:d:W:h")) != -1) {
+        switch (opt) {
+        case 'c': numConns = atoi(optarg); break;
+        case 'n': numChans = atoi(optarg); break;
+        case 's': msgSize = atoi(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'W': warmup = atoi(optarg); break;
+        default:
+            print_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (argc - optind != 2 || numConns < 1 || numChans < 1 ||
+        msgSize < MIN_SIZE || msgSize > MAX_SIZE || rate < 0 ||
+        window < 1 || duration < 1 || warmup < 0) {
+        print_usage();
+        return 1;
+    }
+
+    struct addrinfo hints, *ai;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(argv[optind], argv[optind + 1], &hints, &ai) != 0) {
+        fprintf(stderr, "Unknown host %s\n", argv[optind]);
+        return 1;
+    }
+
+    payload = malloc(msgSize);
+    memset(payload, 'x', msgSize);
+
+    bench_conn_t *conns = calloc(numConns, sizeof(bench_conn_t));
+    struct pollfd *fds = calloc(numConns, sizeof(struct pollfd));
+
+    for (int i = 0; i < numConns; i++) {
+        if (!conn_open(&conns[i], ai)) {
+            return 1;
+        }
+        fds[i].fd = conns[i].sd;
+    }
+
+    freeaddrinfo(ai);
+
+    uint64_t start = now_ns();
+    uint64_t end;
+    uint64_t interval = rate ? 1000000000ULL / rate : 0;
+    uint64_t nextSend = start;
+    int conn = 0;
+
+    countFrom = start + (uint64_t) warmup * 1000000000ULL;
+    end = countFrom + (uint64_t) duration * 1000000000ULL;
+
+    if (!rate) {
+        for (int i = 0; i < numConns; i++) {
+            for (int j = 0; j < numChans; j++) {
+                for (int k = 0; k < window; k++) {
+                    msg_queue(&conns[i], conns[i].chans[j], start);
+                }
+            }
+        }
+    }
+
+    for (;;) {
+        uint64_t now = now_ns();
+        uint64_t wait;
+        struct timespec ts;
+
+        if (now >= end) {
+            break;
+        }
+
+        /* Open loop: queue what is due, stamped with when it was due */
+        if (rate) {
+            while (nextSend <= now) {
+                bench_conn_t *c = &conns[conn];
+
+                msg_queue(c, c->chans[c->next], nextSend);
+                c->next = (c->next + 1) % numChans;
+                conn = (conn + 1) % numConns;
+                nextSend += interval;
+            }
+
+            wait = nextSend - now;
+        }
+        else {
+            wait = end - now;
+        }
+
+        ts.tv_sec = wait / 1000000000ULL;
+        ts.tv_nsec = wait % 1000000000ULL;
+
+        for (int i = 0; i < numConns; i++) {
+            if (!conn_flush(&conns[i])) {
+                return 1;
+            }
+            fds[i].events = POLLIN | (conns[i].outLen ? POLLOUT : 0);
+        }
+
+        if (ppoll(fds, numConns, &ts, NULL) < 0 && errno != EINTR) {
+            perror("ppoll");
+            return 1;
+        }
+
+        for (int i = 0; i < numConns; i++) {
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                !conn_read(&conns[i], rate == 0)) {
+                return 1;
+            }
+        }
+    }
+
+    double secs = duration;
+    double mb = (double) numReceived * msgSize / (1024.0 * 1024.0);
+
+    fprintf(stdout,
+            "M benchmark: %d connection(s) x %d channel(s), %d byte messages",
+            numConns, numChans, msgSize);
+
+    if (rate) {
+        fprintf(stdout, ", %d msgs/s\n", rate);
+    }
+    else {
+        fprintf(stdout, ", window %d\n", window);
+    }
+
+    fprintf(stdout,
+            "  Sent      : %llu\n"
+            "  Received  : %llu (%.0f msgs/s, %.2f MB/s each way)\n"
+            "  In flight : %llu at end\n",
+            (unsigned long long) numSent,
+            (unsigned long long) numReceived, numReceived / secs, mb / secs,
+            (unsigned long long) outstanding);
+
+    if (numReceived) {
+        fprintf(stdout,
+                "  Round trip: p50 %.1f us, p99 %.1f us, p999 %.1f us, "
+                "max %.1f us\n",
+                lat_percentile(500), lat_percentile(990), lat_percentile(999),
+                latMax / 1000.0);
+    }
+
+    return numReceived ? 0 : 1;
+}
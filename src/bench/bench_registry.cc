@@ -0,0 +1,289 @@
+/* Copyright (c) 2007-2014  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+/** @addtogroup bench
+ *  @{
+ */
+
+/** Micro benchmarks of the registry, with 10, 1000 and 100000 instances
+    that implement three interfaces each. The registry is linked in, so
+    no CompFrame process is needed. */
+#include "CFBench.hh"
+#include "CFRegistry.hh"
+#include "CFComponentLib.hh"
+#include "IScheduler.hh"
+#include "IConnect.hh"
+#include "IConfig.hh"
+#include <assert.h>
+
+
+/* Predeclaration of function used later on. */
+static CFComponent* create_me(const char* inst_name);
+static void         set_me_up(CFComponent* comp);
+static int          destroy_me(CFComponent* comp);
+
+// The library container
+static CFComponentLib theLib("BENCHCOMP", create_me, set_me_up, destroy_me);
+
+// Component with a few interfaces to look up
+class BenchComp :
+    public CFComponent,
+    public ISchedulerClient,
+    public IConnect,
+    public IConfigClient
+{
+public:
+    BenchComp(const char* instName) :
+            CFComponent(instName), mTicks(0) {
+    }
+    virtual ~BenchComp() { }
+
+    // ISchedulerClient methods
+    void execute(uint32_t slice) { mTicks += slice; }
+
+    // IConnect methods
+    int connect(CFComponent *other, char *iface, int argc, char **argv) {
+        (void) other; (void) iface; (void) argc; (void) argv;
+        return 0;
+    }
+    int disconnect(CFComponent *other, char *iface) {
+        (void) other; (void) iface;
+        return 0;
+    }
+
+    // IConfigClient methods
+    int set(char* varName, char* varValue) {
+        (void) varName; (void) varValue;
+        return 1;
+    }
+
+    // Sum of the slices executed
+    uint64_t mTicks;
+};
+
+
+static CFComponent*
+create_me(const char* inst_name)
+{
+    assert(inst_name!=NULL);
+
+    return new BenchComp(inst_name);
+}
+
+static int
+destroy_me(CFComponent* comp)
+{
+    if (!comp) {
+        return 1;
+    }
+
+    CFRegistry::instance()->deregisterIfaces(comp);
+
+    delete (BenchComp*)comp;
+
+    return 0;
+}
+
+static void
+set_me_up(CFComponent* comp)
+{
+    BenchComp* b = (BenchComp*) comp;
+
+    CFRegistry::instance()->registerIface(comp, (ISchedulerClient*)b);
+    CFRegistry::instance()->registerIface(comp, (IConnect*)b);
+    CFRegistry::instance()->registerIface(comp, (IConfigClient*)b);
+}
+
+//=============================================================================
+//                           P O P U L A T I O N
+//=============================================================================
+
+// Instances in the registry, and their names
+static vector<CFComponent*> sComps;
+static vector<string> sNames;
+
+// Makes the registry hold exactly num instances of BENCHCOMP
+static void
+populate(int64_t num)
+{
+    static bool registered = false;
+
+    if (!registered) {
+        CFRegistry::instance()->registerLibrary(&theLib);
+        registered = true;
+    }
+
+    while ((int64_t) sComps.size() < num) {
+        string name = "b" + to_string(sComps.size());
+        CFComponent* c =
+            CFRegistry::instance()->createComp("BENCHCOMP", name.c_str());
+
+        if (!c) {
+            fprintf(stderr, "Could not create %s\n", name.c_str());
+            exit(1);
+        }
+
+        sComps.push_back(c);
+        sNames.push_back(name);
+    }
+
+    while ((int64_t) sComps.size() > num) {
+        CFRegistry::instance()->destroyComp(sNames.back().c_str());
+        sComps.pop_back();
+        sNames.pop_back();
+    }
+}
+
+// Returns the next index of a walk through all instances. A stride
+// that is coprime with the number of instances visits them all, in an
+// order that does not follow the maps.
+static inline size_t
+next_index(size_t i)
+{
+    i += 7919;
+
+    return i >= sComps.size() ? i % sComps.size() : i;
+}
+
+//=============================================================================
+//                           B E N C H M A R K S
+//=============================================================================
+
+static void
+bm_getIface(CFBenchState& state)
+{
+    populate(state.arg());
+
+    size_t i = 0;
+
+    while (state.keepRunning()) {
+        cfBenchKeep(CFRegistry::instance()->getIface<ISchedulerClient>(sComps[i]));
+        i = next_index(i);
+    }
+}
+CF_BENCHMARK(bm_getIface)->arg(10)->arg(1000)->arg(100000);
+
+static void
+bm_getIfaceByName(CFBenchState& state)
+{
+    populate(state.arg());
+
+    size_t i = 0;
+
+    while (state.keepRunning()) {
+        cfBenchKeep(CFRegistry::instance()->getIface(sComps[i],
+                                                     "IConfigClient"));
+        i = next_index(i);
+    }
+}
+CF_BENCHMARK(bm_getIfaceByName)->arg(10)->arg(1000)->arg(100000);
+
+static void
+bm_getCompIface(CFBenchState& state)
+{
+    populate(state.arg());
+
+    size_t i = 0;
+
+    while (state.keepRunning()) {
+        cfBenchKeep(CFRegistry::instance()->getCompIface(sNames[i],
+                                                         "ISchedulerClient"));
+        i = next_index(i);
+    }
+}
+CF_BENCHMARK(bm_getCompIface)->arg(10)->arg(1000)->arg(100000);
+
+static void
+bm_getCompObject(CFBenchState& state)
+{
+    populate(state.arg());
+
+    size_t i = 0;
+
+    while (state.keepRunning()) {
+        cfBenchKeep(CFRegistry::instance()->getCompObject(sNames[i].c_str()));
+        i = next_index(i);
+    }
+}
+CF_BENCHMARK(bm_getCompObject)->arg(10)->arg(1000)->arg(100000);
+
+// One more instance created and destroyed, with arg() others around
+static void
+bm_createDestroy(CFBenchState& state)
+{
+    populate(state.arg());
+
+    while (state.keepRunning()) {
+        CFRegistry::instance()->createComp("BENCHCOMP", "extra");
+        CFRegistry::instance()->destroyComp("extra");
+    }
+}
+CF_BENCHMARK(bm_createDestroy)->arg(10)->arg(1000)->arg(100000);
+
+// What S does per client and turn: a virtual call through the interface
+static void
+bm_execute(CFBenchState& state)
+{
+    populate(state.arg());
+
+    vector<ISchedulerClient*> clients;
+
+    for (size_t i = 0; i < sComps.size(); i++) {
+        clients.push_back(
+            CFRegistry::instance()->getIface<ISchedulerClient>(sComps[i]));
+    }
+
+    size_t i = 0;
+
+    while (state.keepRunning()) {
+        clients[i]->execute(1);
+
+        if (++i == clients.size()) {
+            i = 0;
+        }
+    }
+
+    state.setItemsProcessed(state.iterations());
+}
+CF_BENCHMARK(bm_execute)->arg(10)->arg(1000)->arg(100000);
+
+// The same, but looking up the interface every time
+static void
+bm_lookupExecute(CFBenchState& state)
+{
+    populate(state.arg());
+
+    size_t i = 0;
+
+    while (state.keepRunning()) {
+        CFRegistry::instance()->getIface<ISchedulerClient>(sComps[i])->execute(1);
+        i = next_index(i);
+    }
+
+    state.setItemsProcessed(state.iterations());
+}
+CF_BENCHMARK(bm_lookupExecute)->arg(10)->arg(1000)->arg(100000);
+
+
+int
+main(int argc, char** argv)
+{
+    return CFBench::main(argc, argv);
+}
+
+/** @} */
@@ -0,0 +1,423 @@
+/* Copyright (c) 2007-2014  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+/** Scaling benchmark of the socket polling. A number of eventfds (or
+    socketpairs) are registered with cf_socket_register(). In each turn a
+    part of them is made readable, and cf_sockets_poll() is called until
+    all their callbacks have been run. The time spent in cf_sockets_poll()
+    divided by the number of callbacks is the dispatch cost per event.
+
+    Registration churn is measured by deregistering and registering
+    descriptors again, with cf_sockets_poll() in between so that the
+    backend gets to finish what it queued.
+
+    The backend can only be selected once per process, so each backend
+    is run in a process of its own.
+*/
+
+/*===========================================================================*/
+/* INCLUDES                                                                  */
+/*===========================================================================*/
+
+#include "compframe.h"
+#include "compframe_sockets.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+
+/*===========================================================================*/
+/* MACROS                                                                    */
+/*===========================================================================*/
+
+/** Most entries in a list option */
+#define MAX_LIST 16
+
+/** Descriptors deregistered and registered between two polls (churn) */
+#define CHURN_BATCH 64
+
+/*===========================================================================*/
+/* TYPES                                                                     */
+/*===========================================================================*/
+
+/** A registered descriptor */
+typedef struct {
+    /** Descriptor that is polled */
+    int sd;
+    /** Descriptor written to make sd readable (same as sd for eventfd) */
+    int wr;
+} bench_fd_t;
+
+/*===========================================================================*/
+/* VARIABLES                                                                 */
+/*===========================================================================*/
+
+static const char *backendNames[MAX_LIST] = { "uring", "epoll", "poll" };
+static int numBackends = 3;
+
+static int fdCounts[MAX_LIST] = { 100, 1000, 10000, 50000 };
+static int numFdCounts = 4;
+
+/** Ready descriptors per turn, in per mille of the registered */
+static int readyPm[MAX_LIST] = { 10, 100, 1000 };
+static int numReadyPm = 3;
+
+static int useSocketpair = 0;
+static double minTime = 0.5;
+
+static bench_fd_t *fds;
+
+/** Callbacks run */
+static uint64_t numEvents;
+
+/*===========================================================================*/
+/* FUNCTION DEFINITIONS                                                      */
+/*===========================================================================*/
+
+static void
+print_usage(void)
+{
+    fprintf(stderr,
+            "Usage: bench_sockets [options]\n"
+            "Options:\n"
+            " -p <list>   Backends (uring,epoll,poll)\n"
+            " -n <list>   Registered descriptors (100,1000,10000,50000)\n"
+            " -r <list>   Percent readable per turn (1,10,100)\n"
+            " -s          Socketpairs instead of eventfds\n"
+            " -t <sec>    Least time per measurement (0.5)\n");
+}
+
+/** Returns the monotonic time in nanoseconds */
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Parses a comma separated list of numbers.
+    @param scale  Each number is multiplied with this
+    @return Number of entries, 0 if faulty
+*/
+static int
+parse_numbers(char *arg, int *list, double scale)
+{
+    int num = 0;
+
+    for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        double v = atof(tok) * scale;
+
+        if (num == MAX_LIST || v <= 0) {
+            return 0;
+        }
+        list[num++] = (int) (v + 0.5);
+    }
+
+    return num;
+}
+
+/** Parses a comma separated list of names
+    @return Number of entries, 0 if faulty
+*/
+static int
+parse_names(char *arg, const char **list)
+{
+    int num = 0;
+
+    for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        if (num == MAX_LIST) {
+            return 0;
+        }
+        list[num++] = tok;
+    }
+
+    return num;
+}
+
+/** Callback of the registered descriptors. Empties it, so that it is not
+    readable anymore. */
+static int
+fd_readable(void *comp, int sd, void *userData, cf_sock_event_t ev)
+{
+    uint64_t val;
+
+    (void) comp;
+    (void) userData;
+
+    if (ev != CF_SOCKET_STUFF_TO_READ ||
+        read(sd, &val, sizeof(val)) <= 0) {
+        fprintf(stderr, "Descriptor %d not readable\n", sd);
+        exit(1);
+    }
+
+    numEvents++;
+
+    return 0;
+}
+
+/** Makes a descriptor readable */
+static void
+fd_trigger(bench_fd_t * f)
+{
+    uint64_t val = 1;
+
+    if (write(f->wr, &val, sizeof(val)) != sizeof(val)) {
+        fprintf(stderr, "Could not write to %d (%s)\n", f->wr,
+                strerror(errno));
+        exit(1);
+    }
+}
+
+/** Opens and registers descriptors until there are num */
+static int
+fds_open(int *numOpen, int num)
+{
+    for (; *numOpen < num; (*numOpen)++) {
+        bench_fd_t *f = &fds[*numOpen];
+
+        if (useSocketpair) {
+            int sv[2];
+
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+                fprintf(stderr, "socketpair failed (%s)\n", strerror(errno));
+                return 0;
+            }
+            f->sd = sv[0];
+            f->wr = sv[1];
+        }
+        else {
+            f->sd = eventfd(0, EFD_NONBLOCK);
+
+            if (f->sd < 0) {
+                fprintf(stderr, "eventfd failed (%s)\n", strerror(errno));
+                return 0;
+            }
+            f->wr = f->sd;
+        }
+
+        if (!cf_socket_register(NULL, f->sd, fd_readable, NULL)) {
+            fprintf(stderr, "Could not register %d\n", f->sd);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/** Makes ready descriptors readable in each turn, and returns the time in
+    cf_sockets_poll() per callback, in nanoseconds */
+static double
+measure_dispatch(int num, int ready)
+{
+    uint64_t want = (uint64_t) (minTime * 1e9);
+    uint64_t spent = 0;
+    uint64_t events = 0;
+    int next = 0;
+
+    while (spent < want) {
+        /* Consecutive descriptors, a new part of them in each turn */
+        for (int i = 0; i < ready; i++) {
+            fd_trigger(&fds[next]);
+            next = next + 1 == num ? 0 : next + 1;
+        }
+
+        uint64_t start = now_ns();
+
+        numEvents = 0;
+
+        while (numEvents < (uint64_t) ready) {
+            cf_sockets_poll();
+        }
+
+        spent += now_ns() - start;
+        events += numEvents;
+    }
+
+    return (double) spent / events;
+}
+
+/** Deregisters and registers descriptors again, and returns the time per
+    pair, in nanoseconds */
+static double
+measure_churn(int num)
+{
+    uint64_t want = (uint64_t) (minTime * 1e9);
+    uint64_t start = now_ns();
+    uint64_t ops = 0;
+    int next = 0;
+
+    while (now_ns() - start < want) {
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            bench_fd_t *f = &fds[next];
+
+            cf_socket_deregister(f->sd);
+
+            if (!cf_socket_register(NULL, f->sd, fd_readable, NULL)) {
+                fprintf(stderr, "Could not register %d again\n", f->sd);
+                exit(1);
+            }
+            next = next + 1 == num ? 0 : next + 1;
+        }
+
+        /* Lets the backend finish the removals (io_uring) */
+        cf_sockets_wait(0);
+        ops += CHURN_BATCH;
+    }
+
+    return (double) (now_ns() - start) / ops;
+}
+
+/** Runs all measurements with one backend */
+static int
+run_backend(const char *name)
+{
+    int max = 0;
+    int numOpen = 0;
+
+    if (!cf_sockets_backend_set(name)) {
+        printf("%-6s not available\n", name);
+        return 1;
+    }
+
+    for (int i = 0; i < numFdCounts; i++) {
+        if (fdCounts[i] > max) {
+            max = fdCounts[i];
+        }
+    }
+
+    fds = calloc(max, sizeof(bench_fd_t));
+
+    /* Counts in ascending order, so descriptors are only added */
+    for (int i = 0; i < numFdCounts; i++) {
+        int num = fdCounts[i];
+
+        if (!fds_open(&numOpen, num)) {
+            printf("%-6s %7d not possible, see ulimit -n\n", name, num);
+            break;
+        }
+
+        double churn = measure_churn(num);
+
+        for (int j = 0; j < numReadyPm; j++) {
+            int ready = (int) ((int64_t) num * readyPm[j] / 1000);
+
+            if (ready < 1) {
+                ready = 1;
+            }
+
+            double perEvent = measure_dispatch(num, ready);
+
+            printf("%-6s %7d %7d %12.1f %12.0f %12.1f\n", name, num, ready,
+                   perEvent, 1e9 / perEvent, churn);
+            fflush(stdout);
+        }
+    }
+
+    return 0;
+}
+
+static int
+int_cmp(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:n:r:st:h")) != -1) {
+        switch (opt) {
+        case 'p': numBackends = parse_names(optarg, backendNames); break;
+        case 'n': numFdCounts = parse_numbers(optarg, fdCounts, 1); break;
+        case 'r': numReadyPm = parse_numbers(optarg, readyPm, 10); break;
+        case 's': useSocketpair = 1; break;
+        case 't': minTime = atof(optarg); break;
+        default:
+            print_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc || !numBackends || !numFdCounts || !numReadyPm ||
+        minTime <= 0) {
+        print_usage();
+        return 1;
+    }
+
+    for (int i = 0; i < numReadyPm; i++) {
+        if (readyPm[i] > 1000) {
+            print_usage();
+            return 1;
+        }
+    }
+
+    qsort(fdCounts, numFdCounts, sizeof(int), int_cmp);
+
+    /* Room for the largest count, as far as allowed */
+    struct rlimit rl;
+    rlim_t need = (rlim_t) fdCounts[numFdCounts - 1] * 2 + 64;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < need) {
+        rl.rlim_cur = need;
+
+        if (rl.rlim_max < need) {
+            rl.rlim_max = need;
+        }
+
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+            getrlimit(RLIMIT_NOFILE, &rl);
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+
+    printf("%-6s %7s %7s %12s %12s %12s\n", "poll", "fds", "ready",
+           "ns/event", "events/s", "churn ns");
+    fflush(stdout);
+
+    /* The backend is selected once per process */
+    for (int i = 0; i < numBackends; i++) {
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            return run_backend(backendNames[i]);
+        }
+
+        if (pid < 0) {
+            fprintf(stderr, "fork failed (%s)\n", strerror(errno));
+            return 1;
+        }
+
+        waitpid(pid, NULL, 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+#  Copyright (c) 2007-2014  Peter R. Torpman (peter at torpman dot se)
+#
+#  This file is part of CompFrame (http://compframe.sourceforge.net)
+#
+#  CompFrame is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  Runs bench_m against a CompFrame started with the echo receiver.
+#  Usage: run_m.sh [bench_m options]
+#  CF_ARGS may hold extra compframe options, e.g. CF_ARGS="-b 50 -a 2"
+
+cd "$(dirname "$0")" || exit 1
+
+LOG=$(mktemp)
+
+# Keep stdin open, or C stops reading commands
+sleep 1000000 | ../compframe -d ..:. $CF_ARGS -f bench.cfg >/dev/null 2>"$LOG" &
+CF_PID=$!
+
+PORT=
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    PORT=$(sed -n 's/.*M server started on [^:]*:\([0-9]*\).*/\1/p' "$LOG")
+    [ -n "$PORT" ] && break
+    sleep 0.2
+done
+
+if [ -z "$PORT" ]; then
+    echo "CompFrame did not start:" >&2
+    cat "$LOG" >&2
+    RES=1
+else
+    ./bench_m "$@" localhost "$PORT"
+    RES=$?
+fi
+
+pkill -P $$ sleep 2>/dev/null
+kill $CF_PID 2>/dev/null
+wait 2>/dev/null
+rm -f "$LOG"
+exit $RES
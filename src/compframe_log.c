@@ -30,6 +30,9 @@
 /** This variable holds the trace level of CompFrame */
 static CfTraceLevel cfTraceLevel = CF_TRACE_OFF;
 
+/** Lines logged, updated atomically since any thread may log */
+static cf_log_stats_t logStats;
+
 /** This variable holds the names of the trace levels of CompFrame */
 static char *cf_trace_level_names[] = {
     "OFF",
@@ -42,6 +45,21 @@ static char *cf_trace_level_names[] = {
 /* FUNCTION DEFINITIONS                                                       */
 /*============================================================================*/
 
+/** Counts a line, and if it could not be written
+    @param counter  Counter of the kind of line
+    @param res      Result of writing the line prefix
+    @param resMsg   Result of writing the message
+*/
+static void
+cf_log_count(uint64_t * counter, int res, int resMsg)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+
+    if (res < 0 || resMsg < 0) {
+        __atomic_fetch_add(&logStats.dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
 void
 cf_info_log(const char *format, ...)
 {
@@ -49,10 +67,12 @@ cf_info_log(const char *format, ...)
 
     va_start(ap, format);
 
-    fprintf(stderr, "*** INFO # ");
-    vfprintf(stderr, format, ap);
+    int res = fprintf(stderr, "*** INFO # ");
+    int resMsg = vfprintf(stderr, format, ap);
 
     va_end(ap);
+
+    cf_log_count(&logStats.infos, res, resMsg);
 }
 
 void
@@ -62,10 +82,12 @@ cf_error_log(const char *file, int line, const char *format, ...)
 
     va_start(ap, format);
 
-    fprintf(stderr, "*** ERROR %s:%d # ", file, line);
-    vfprintf(stderr, format, ap);
+    int res = fprintf(stderr, "*** ERROR %s:%d # ", file, line);
+    int resMsg = vfprintf(stderr, format, ap);
 
     va_end(ap);
+
+    cf_log_count(&logStats.errors, res, resMsg);
 }
 
 void
@@ -81,11 +103,13 @@ cf_trace_log(const char *file,
 
     va_start(ap, format);
 
-    fprintf(stderr,
-            "***[%-7s] %-20s:%-5d # ", cf_trace_level_names[level], file, line);
-    vfprintf(stderr, format, ap);
+    int res = fprintf(stderr, "***[%-7s] %-20s:%-5d # ",
+                      cf_trace_level_names[level], file, line);
+    int resMsg = vfprintf(stderr, format, ap);
 
     va_end(ap);
+
+    cf_log_count(&logStats.traces, res, resMsg);
 }
 
 void
@@ -93,3 +117,18 @@ cf_trace_level_set(int level)
 {
     cfTraceLevel = (CfTraceLevel) level;
 }
+
+int
+cf_trace_level_get(void)
+{
+    return cfTraceLevel;
+}
+
+void
+cf_log_stats_get(cf_log_stats_t * stats)
+{
+    stats->infos = __atomic_load_n(&logStats.infos, __ATOMIC_RELAXED);
+    stats->errors = __atomic_load_n(&logStats.errors, __ATOMIC_RELAXED);
+    stats->traces = __atomic_load_n(&logStats.traces, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&logStats.dropped, __ATOMIC_RELAXED);
+}
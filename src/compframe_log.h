@@ -24,6 +24,7 @@
 /*============================================================================*/
 
 #include <stdio.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -52,6 +53,14 @@ typedef enum {
     CF_TRACE_MASSIVE = 3
 } CfTraceLevel;
 
+/** Number of lines logged, see cf_log_stats_get() */
+typedef struct {
+    uint64_t infos;             /**< Lines from cf_info_log() */
+    uint64_t errors;            /**< Lines from cf_error_log() */
+    uint64_t traces;            /**< Lines from cf_trace_log() */
+    uint64_t dropped;           /**< Lines that could not be written */
+} cf_log_stats_t;
+
 /*============================================================================*/
 /* PUBLIC FUNCTION DECLARATIONS                                               */
 /*============================================================================*/
@@ -89,6 +98,20 @@ cf_trace_log(const char *file, int line,
 void
 cf_trace_level_set(int level);
 
+/** Returns the trace level. Used for skipping work that is only done
+ *  for a trace.
+ *  @return Current trace level
+ */
+int
+cf_trace_level_get(void);
+
+/** Returns the number of lines logged so far. Lines that are filtered out
+    by the trace level are not counted.
+ *  @param stats  Filled in
+ */
+void
+cf_log_stats_get(cf_log_stats_t *stats);
+
 /** @} */
 
 #ifdef __cplusplus
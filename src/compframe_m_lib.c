@@ -30,6 +30,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 
 /*===========================================================================*/
 /* MACROS                                                                    */
@@ -42,11 +43,8 @@
     connection */
 typedef enum {
     CFM_CONN_INIT = 0,
-    CFM_CONN_CHANNEL = 1,
-    CFM_CONN_LENGTH1 = 2,
-    CFM_CONN_LENGTH2 = 3,
-    CFM_CONN_MSGBODY = 4,
-    CFM_CONN_MSGREADY = 5
+    CFM_CONN_MSGBODY = 1,
+    CFM_CONN_MSGREADY = 2
 } cfm_conn_state_t;
 
 /** Used for keeping track of users of a specified connection */
@@ -83,10 +81,18 @@ struct cfm_conn_t {
 
     /** Socket descriptor  */
     int socket_fd;
-    /** Number of used channels (Range 0..255) */
-    uint8_t num_used;
-    /** Peers on this connection  */
-    cfm_peer_t *peer[CFM_MAX_PEERS];
+    /** Protocol version used */
+    int version;
+    /** Frame header length for the protocol version */
+    int hdr_len;
+    /** Header bytes received so far */
+    unsigned char hdr[CFM_HDR_LEN_V2];
+    /** Number of header bytes received */
+    int hdr_pos;
+    /** Number of peer slots allocated */
+    int num_peers;
+    /** Peers on this connection, indexed on channel  */
+    cfm_peer_t **peer;
     /** State of buffer  */
     cfm_conn_state_t state;
 
@@ -94,7 +100,7 @@ struct cfm_conn_t {
     int isM;
     /** Current channel handled  */
     int channel;
-    /** message length */
+    /** message length (including header) */
     int msg_len;
     /** Message buffer  */
     unsigned char *msg_buff;
@@ -124,6 +130,16 @@ static int channel_being_closed = -1;
 static int
 cfm_control_msg_handle(void *conn);
 
+static cfm_peer_t *
+cfm_peer_get(cfm_conn_t * conn, int chan);
+
+static int
+cfm_header_build(cfm_conn_t * conn, unsigned char *hdr, uint32_t chan,
+                 int len);
+
+static int
+cfm_uuid_to_bytes(const char *uuid, unsigned char *bytes);
+
 /*===========================================================================*/
 /* FUNCTION DEFINITIONS                                                      */
 /*===========================================================================*/
@@ -196,6 +212,8 @@ cfm_connection_open(char *host, int port)
     c->socket_fd = sd;
     c->host = strdup(host);
     c->port = port;
+    c->version = CF_M_VERSION_1;
+    c->hdr_len = CFM_HDR_LEN_V1;
 
     /* Add connection to our list */
     CF_LIST_ADD(connHead, c);
@@ -223,6 +241,119 @@ cfm_connection_find(int sd)
     return NULL;
 }
 
+/** Reads a given number of bytes from a socket
+    @param sd  Socket descriptor
+    @param buf Buffer to fill
+    @param len Number of bytes to read
+    @return 1 if OK, 0 if not.
+*/
+static int
+cfm_read_all(int sd, unsigned char *buf, int len)
+{
+    int pos = 0;
+
+    while (pos < len) {
+        int res = read(sd, &buf[pos], len - pos);
+
+        if (res <= 0) {
+            return 0;
+        }
+
+        pos += res;
+    }
+
+    return 1;
+}
+
+int
+cfm_connection_version_set(void *c, int version)
+{
+    cfm_conn_t *conn = (cfm_conn_t *) c;
+    unsigned char newMsg[CF_M_MAX_MESSAGE];
+    unsigned char hdr[CFM_HDR_LEN_V2];
+    int control;
+    int len;
+
+    if (!conn ||
+        (version != CF_M_VERSION_1 && version != CF_M_VERSION_2 &&
+         version != CF_M_VERSION_3)) {
+        fprintf(stderr, "ERROR: Bad parameters\n");
+        return 0;
+    }
+
+    if (conn->version == version) {
+        return 1;
+    }
+
+    /* The reply to an open in progress would come before ours */
+    if (callback_open) {
+        fprintf(stderr, "Error: Cannot change version while a channel "
+                "is being opened!\n");
+        return 0;
+    }
+
+    for (int i = 0; i < conn->num_peers; i++) {
+        if (conn->peer[i] != NULL) {
+            fprintf(stderr,
+                    "Error: Cannot change version with channels open!\n");
+            return 0;
+        }
+    }
+
+    /* The request is sent with the current framing */
+    len = cfm_header_build(conn, newMsg, CFM_M_CHANNEL_V2, 2);
+    newMsg[len++] = CF_M_VERSION;
+    newMsg[len++] = version;
+
+    if (write(conn->socket_fd, newMsg, len) != len) {
+        return 0;
+    }
+
+    /* Wait for the response before anything else is sent. No channel is
+       open or being opened, so other frames are stray and skipped. */
+    for (;;) {
+        if (!cfm_read_all(conn->socket_fd, hdr, conn->hdr_len)) {
+            return 0;
+        }
+
+        if (conn->version == CF_M_VERSION_1) {
+            control = (hdr[0] == CFM_M_CHANNEL);
+        }
+        else {
+            control = ((hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) |
+                        ((uint32_t) hdr[3] << 24)) == CFM_M_CHANNEL_V2);
+        }
+
+        len = hdr[conn->hdr_len - 2] | (hdr[conn->hdr_len - 1] << 8);
+
+        if (len < conn->hdr_len || len > CF_M_MAX_MESSAGE ||
+            !cfm_read_all(conn->socket_fd, newMsg, len - conn->hdr_len)) {
+            return 0;
+        }
+
+        if (control && len >= conn->hdr_len + 3 &&
+            newMsg[0] == CF_M_VERSION) {
+            break;
+        }
+
+        fprintf(stderr, "DEBUG: Skipped frame while waiting for "
+                "CF_M_VERSION.\n");
+    }
+
+    if (newMsg[0] != CF_M_VERSION || newMsg[1] != CF_M_VERSION_OK) {
+        fprintf(stderr, "Error: M did not accept version %d\n", version);
+        return 0;
+    }
+
+    conn->version = version;
+    conn->hdr_len =
+        (version == CF_M_VERSION_1) ? CFM_HDR_LEN_V1 : CFM_HDR_LEN_V2;
+
+    fprintf(stderr, "DEBUG: Using M protocol version %d\n", version);
+
+    return 1;
+}
+
 int
 cfm_connection_close(void *c)
 {
@@ -234,7 +365,7 @@ cfm_connection_close(void *c)
 
     CF_LIST_REMOVE(connHead, conn);
 
-    for (int i = 0; i < CFM_MAX_PEERS; i++) {
+    for (int i = 0; i < conn->num_peers; i++) {
         if (conn->peer[i] == NULL) {
             continue;
         }
@@ -251,6 +382,9 @@ cfm_connection_close(void *c)
     /* Finally, shut down the socket */
     shutdown(conn->socket_fd, SHUT_RDWR);
 
+    free(conn->peer);
+    free(conn->msg_buff);
+    free(conn->host);
     free(conn);
 
     return 1;
@@ -286,18 +420,33 @@ cfm_channel_open(void *cx,
         if (c == conn) {
 
             /* Send an open channel request to the other side */
-            unsigned char newMsg[2048];
+            unsigned char newMsg[CF_M_MAX_MESSAGE];
+
+            int idLen = (conn->version == CF_M_VERSION_3) ?
+                CFM_UUID_BIN_LEN : 36;
+            int len = 1 + idLen + strlen(name) + 1;
+
+            if (conn->hdr_len + len > CF_M_MAX_MESSAGE) {
+                fprintf(stderr, "Error: Name too long!\n");
+                return 0;
+            }
+
+            int pos = cfm_header_build(conn, newMsg, CFM_M_CHANNEL_V2, len);
 
-            int len = 4 + 36 + strlen(name) + 1;
+            newMsg[pos] = CF_M_CHANNEL_OPEN;
 
-            newMsg[0] = CFM_M_CHANNEL;
-            newMsg[1] = len & 0xFF;
-            newMsg[2] = ((len >> 8) & 0xFF);
-            newMsg[3] = CF_M_CHANNEL_OPEN;
-            memcpy(&newMsg[4], uiid, 36);
-            memcpy(&newMsg[40], name, strlen(name) + 1);
+            if (idLen == CFM_UUID_BIN_LEN) {
+                if (!cfm_uuid_to_bytes(uiid, &newMsg[pos + 1])) {
+                    fprintf(stderr, "Error: Bad UUID!\n");
+                    return 0;
+                }
+            }
+            else {
+                memcpy(&newMsg[pos + 1], uiid, 36);
+            }
+            memcpy(&newMsg[pos + 1 + idLen], name, strlen(name) + 1);
 
-            len = write(conn->socket_fd, newMsg, len);
+            len = write(conn->socket_fd, newMsg, pos + len);
 
             if (len <= 0) {
                 /* Socket does not feel OK... */
@@ -321,6 +470,57 @@ cfm_channel_open(void *cx,
     return 0;
 }
 
+int
+cfm_topic_subscribe(void *c,
+                    const char *topic,
+                    cfm_callback_open_t openCB,
+                    cfm_callback_close_t closeCB,
+                    cfm_callback_msg_t msgCB,
+                    cfm_callback_error_t errorCB, void *userData)
+{
+    cfm_conn_t *conn = (cfm_conn_t *) c;
+    unsigned char newMsg[CF_M_MAX_MESSAGE];
+
+    /* Valid parameters? */
+    if (!connHead || !conn || !topic) {
+        return 0;
+    }
+
+    if (callback_open) {
+        /* Connection in progress... Cannot open yet */
+        fprintf(stderr, "Error: Connection in progress. Please, try later..\n");
+        return 0;
+    }
+
+    int len = 1 + strlen(topic) + 1;
+
+    if (conn->hdr_len + len > CF_M_MAX_MESSAGE) {
+        fprintf(stderr, "Error: Topic too long!\n");
+        return 0;
+    }
+
+    int pos = cfm_header_build(conn, newMsg, CFM_M_CHANNEL_V2, len);
+
+    newMsg[pos] = CF_M_SUBSCRIBE;
+    memcpy(&newMsg[pos + 1], topic, strlen(topic) + 1);
+
+    if (write(conn->socket_fd, newMsg, pos + len) <= 0) {
+        /* Socket does not feel OK... */
+        return 0;
+    }
+
+    /*  Remember callbacks */
+    callback_open = openCB;
+    callback_close = closeCB;
+    callback_msg = msgCB;
+    callback_error = errorCB;
+    curr_user_data = userData;
+
+    fprintf(stderr, "DEBUG: Sent CF_M_SUBSCRIBE (%s)!\n", topic);
+
+    return 1;
+}
+
 int
 cfm_channel_close(void *c, int chan)
 {
@@ -341,22 +541,28 @@ cfm_channel_close(void *c, int chan)
 
     fprintf(stderr, "DEBUG: Close channel %d\n", chan);
 
-    if (conn->peer[chan] == NULL) {
+    if (cfm_peer_get(conn, chan) == NULL) {
         fprintf(stderr, "Error: Could not close channel. It was not open!\n");
+        channel_being_closed = -1;
         return 0;
     }
 
-    unsigned char newMsg[5];
+    unsigned char newMsg[CFM_HDR_LEN_V2 + 5];
 
     int len;
 
-    newMsg[0] = CFM_M_CHANNEL;
-    newMsg[1] = 5;
-    newMsg[2] = 0;
-    newMsg[3] = CF_M_CHANNEL_CLOSE;
-    newMsg[4] = chan;
+    len = cfm_header_build(conn, newMsg, CFM_M_CHANNEL_V2,
+                           conn->version == CF_M_VERSION_1 ? 2 : 5);
+    newMsg[len++] = CF_M_CHANNEL_CLOSE;
+    newMsg[len++] = chan & 0xFF;
 
-    len = write(conn->socket_fd, newMsg, 5);
+    if (conn->version != CF_M_VERSION_1) {
+        newMsg[len++] = (chan >> 8) & 0xFF;
+        newMsg[len++] = (chan >> 16) & 0xFF;
+        newMsg[len++] = (chan >> 24) & 0xFF;
+    }
+
+    len = write(conn->socket_fd, newMsg, len);
 
     if (len <= 0) {
         /* Socket does not feel OK... */
@@ -373,17 +579,16 @@ int
 cfm_message_send(void *c, int chan, int len, unsigned char *msg)
 {
     cfm_conn_t *conn = (cfm_conn_t *) c;
-    unsigned char newMsg[3];
-    int tot_len = 3 + len;
+    unsigned char newMsg[CFM_HDR_LEN_V2];
 
-    newMsg[0] = chan;
-    newMsg[1] = tot_len & 0xFF;
-    newMsg[2] = (tot_len >> 8) & 0xFF;
+    if (!conn || len < 0 || conn->hdr_len + len > 0xFFFF) {
+        return 0;
+    }
 
     struct iovec io[2];
 
     io[0].iov_base = newMsg;
-    io[0].iov_len = 3;
+    io[0].iov_len = cfm_header_build(conn, newMsg, chan, len);
 
     io[1].iov_base = msg;
     io[1].iov_len = len;
@@ -396,90 +601,246 @@ cfm_message_send(void *c, int chan, int len, unsigned char *msg)
     }
 }
 
+/** Writes the frame header for a message on a connection. The M command
+    channel is given as CFM_M_CHANNEL_V2 and is translated for version 1.
+    @param conn Pointer to connection
+    @param hdr  Buffer of at least CFM_HDR_LEN_V2 bytes
+    @param chan Channel number
+    @param len  Length of message body
+    @return Header length
+*/
+static int
+cfm_header_build(cfm_conn_t * conn, unsigned char *hdr, uint32_t chan,
+                 int len)
+{
+    int tot_len = conn->hdr_len + len;
+    int i = 0;
+
+    if (conn->version == CF_M_VERSION_1) {
+        hdr[i++] = (chan == CFM_M_CHANNEL_V2) ? CFM_M_CHANNEL : chan;
+    }
+    else {
+        hdr[i++] = chan & 0xFF;
+        hdr[i++] = (chan >> 8) & 0xFF;
+        hdr[i++] = (chan >> 16) & 0xFF;
+        hdr[i++] = (chan >> 24) & 0xFF;
+    }
+
+    hdr[i++] = tot_len & 0xFF;
+    hdr[i++] = (tot_len >> 8) & 0xFF;
+
+    return i;
+}
+
+/** Converts a UUID string to the binary form used with protocol version 3
+    @param uuid  UUID on the form xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx
+    @param bytes Buffer of CFM_UUID_BIN_LEN bytes (returned)
+    @return 1 if OK, 0 if not a valid UUID
+*/
+static int
+cfm_uuid_to_bytes(const char *uuid, unsigned char *bytes)
+{
+    int n = 0;
+
+    if (!uuid) {
+        return 0;
+    }
+
+    for (int i = 0; i < 36; i++) {
+        char c = uuid[i];
+        int d;
+
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (c != '-') {
+                return 0;
+            }
+            continue;
+        }
+
+        if (c >= '0' && c <= '9')      d = c - '0';
+        else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') d = c - 'A' + 10;
+        else return 0;
+
+        if (n % 2 == 0) {
+            bytes[n / 2] = d << 4;
+        }
+        else {
+            bytes[n / 2] |= d;
+        }
+        n++;
+    }
+
+    return 1;
+}
+
+/** Returns the peer on a channel
+    @param conn Pointer to connection
+    @param chan Channel number
+    @return Pointer to peer or NULL
+*/
+static cfm_peer_t *
+cfm_peer_get(cfm_conn_t * conn, int chan)
+{
+    if (chan < 0 || chan >= conn->num_peers) {
+        return NULL;
+    }
+
+    return conn->peer[chan];
+}
+
+/** Returns the channel a response is about. With version 1 the
+    lowest free channel is used, just like M does.
+    @param conn Pointer to connection
+    @return Channel number or -1
+*/
+static int
+cfm_response_channel(cfm_conn_t * conn)
+{
+    int chan;
+
+    if (conn->version != CF_M_VERSION_1) {
+        if (conn->msg_len - conn->hdr_len < 7) {
+            return -1;
+        }
+
+        return conn->msg_buff[3] | (conn->msg_buff[4] << 8) |
+            (conn->msg_buff[5] << 16) | (conn->msg_buff[6] << 24);
+    }
+
+    for (chan = 0; chan < conn->num_peers; chan++) {
+        if (conn->peer[chan] == NULL) {
+            break;
+        }
+    }
+
+    return chan < CFM_MAX_PEERS ? chan : -1;
+}
+
+/** Resets the callbacks remembered for the channel being opened */
+static void
+cfm_pending_open_reset(void)
+{
+    callback_open = NULL;
+    callback_close = NULL;
+    callback_msg = NULL;
+    callback_error = NULL;
+    curr_user_data = NULL;
+}
+
 static int
 cfm_control_msg_handle(void *c)
 {
     cfm_conn_t *conn = (cfm_conn_t *) c;
+    cfm_peer_t *p;
     int res;
     int slot = 0;
 
     switch (conn->msg_buff[1]) {
     case CF_M_CHANNEL_OPEN_OK:
+    case CF_M_SUBSCRIBE_OK:
         fprintf(stderr, "DEBUG: CF_M_CHANNEL_OPEN_OK.\n");
 
-        /* Find open peer slot */
-        for (slot = 0; slot < CFM_MAX_PEERS; slot++) {
-            if (conn->peer[slot] == NULL) {
-                conn->peer[slot] = malloc(sizeof(cfm_peer_t));
-
-                /* Take this one! */
-                conn->peer[slot]->callback_open = callback_open;
-                conn->peer[slot]->callback_close = callback_close;
-                conn->peer[slot]->callback_msg = callback_msg;
-                conn->peer[slot]->callback_error = callback_error;
-                conn->peer[slot]->channel = slot;
-                conn->peer[slot]->userData = curr_user_data;
+        slot = cfm_response_channel(conn);
 
-                /* No connection establishment is going on... Reset static data */
+        if (slot >= conn->num_peers) {
+            /* Make room for the new channel */
+            int num = conn->num_peers ? conn->num_peers : 8;
 
-                res = callback_open(conn, slot, curr_user_data);
+            while (num <= slot) {
+                num *= 2;
+            }
 
-                callback_open = NULL;
-                callback_close = NULL;
-                callback_msg = NULL;
-                callback_error = NULL;
-                curr_user_data = NULL;
+            cfm_peer_t **tmp = realloc(conn->peer, num * sizeof(cfm_peer_t *));
 
-                return res;
+            if (tmp) {
+                memset(&tmp[conn->num_peers], 0,
+                       (num - conn->num_peers) * sizeof(cfm_peer_t *));
+                conn->peer = tmp;
+                conn->num_peers = num;
             }
         }
 
+        if (slot >= 0 && slot < conn->num_peers && conn->peer[slot] == NULL) {
+            conn->peer[slot] = malloc(sizeof(cfm_peer_t));
+
+            /* Take this one! */
+            conn->peer[slot]->callback_open = callback_open;
+            conn->peer[slot]->callback_close = callback_close;
+            conn->peer[slot]->callback_msg = callback_msg;
+            conn->peer[slot]->callback_error = callback_error;
+            conn->peer[slot]->channel = slot;
+            conn->peer[slot]->userData = curr_user_data;
+
+            /* No connection establishment is going on... Reset static data */
+
+            res = callback_open(conn, slot, curr_user_data);
+
+            cfm_pending_open_reset();
+
+            return res;
+        }
+
         /* Could not open */
         res = callback_error(conn, "FAILED!", curr_user_data);
 
-        callback_open = NULL;
-        callback_close = NULL;
-        callback_msg = NULL;
-        callback_error = NULL;
-        curr_user_data = NULL;
+        cfm_pending_open_reset();
 
         return res;
 
     case CF_M_CHANNEL_OPEN_FAIL:
+    case CF_M_SUBSCRIBE_FAIL:
         fprintf(stderr, "DEBUG: CF_M_CHANNEL_OPEN_FAIL.\n");
 
         res = callback_error(conn, "FAILED!", curr_user_data);
 
-        callback_open = NULL;
-        callback_close = NULL;
-        callback_msg = NULL;
-        callback_error = NULL;
-        curr_user_data = NULL;
+        cfm_pending_open_reset();
 
         return res;
 
     case CF_M_CHANNEL_CLOSE_OK:
-        res = conn->peer[channel_being_closed]->callback_close(conn,
-                                                               channel_being_closed,
-                                                               conn->
-                                                               peer
-                                                               [channel_being_closed]->
-                                                               userData);
+        fprintf(stderr, "DEBUG: CF_M_CHANNEL_CLOSE_OK.\n");
+
+        slot = (conn->version == CF_M_VERSION_1) ?
+            channel_being_closed : cfm_response_channel(conn);
 
         /* Reset... */
         channel_being_closed = -1;
 
-        fprintf(stderr, "DEBUG: CF_M_CHANNEL_CLOSE_OK.\n");
+        p = cfm_peer_get(conn, slot);
+
+        if (!p) {
+            return 0;
+        }
+
+        res = p->callback_close(conn, slot, p->userData);
+
+        conn->peer[slot] = NULL;
+        free(p);
+
         return res;
 
     case CF_M_CHANNEL_CLOSE_FAIL:
         fprintf(stderr, "DEBUG: CF_M_CHANNEL_CLOSE_FAIL.\n");
-        return conn->peer[conn->channel]->callback_close(conn,
-                                                         conn->channel,
-                                                         conn->peer[conn->
-                                                                    channel]->
-                                                         userData);
-        break;
+
+        slot = (conn->version == CF_M_VERSION_1) ?
+            channel_being_closed : cfm_response_channel(conn);
+
+        channel_being_closed = -1;
+
+        p = cfm_peer_get(conn, slot);
+
+        if (!p) {
+            return 0;
+        }
+
+        /* M has removed the channel anyway */
+        res = p->callback_close(conn, slot, p->userData);
+
+        conn->peer[slot] = NULL;
+        free(p);
+
+        return res;
     case CF_M_CHANNEL_ORDER_UNKNOWN:
         fprintf(stderr, "DEBUG: CF_M_CHANNEL_ORDER_UNKNOWN.\n");
         break;
@@ -506,6 +867,7 @@ cfm_sockets_handle(int fd)
         /* Found it! */
         int res;
         int handled = 0;
+        int result = 1;
 
         res = read(fd, buf, 0xFFFF);
 
@@ -517,36 +879,59 @@ cfm_sockets_handle(int fd)
         while (handled < res) {
             switch (conn->state) {
             case CFM_CONN_INIT:
-                conn->channel = buf[handled++];
-                conn->state = CFM_CONN_CHANNEL;
+                conn->hdr[conn->hdr_pos++] = buf[handled++];
 
-                fprintf(stderr, "DEBUG: M message: Channel (%d)\n",
-                        conn->channel);
+                if (conn->hdr_pos < conn->hdr_len) {
+                    break;
+                }
 
-                break;
-            case CFM_CONN_CHANNEL:
-                conn->msg_len = buf[handled++];
-                conn->state = CFM_CONN_LENGTH1;
-                break;
-            case CFM_CONN_LENGTH1:
-                conn->msg_len = (buf[handled++] << 8) + conn->msg_len;
-                conn->state = CFM_CONN_LENGTH2;
+                conn->hdr_pos = 0;
 
-                fprintf(stderr, "DEBUG: M message: Length (%d)\n",
-                        conn->msg_len);
+                if (conn->version == CF_M_VERSION_1) {
+                    conn->channel = conn->hdr[0];
 
-                break;
-            case CFM_CONN_LENGTH2:
-                conn->msg_buff = malloc(conn->msg_len * sizeof(unsigned char));
-                /* NULL terminate just to be safe */
+                    if (conn->channel == CFM_M_CHANNEL) {
+                        conn->channel = -1;
+                    }
+                }
+                else {
+                    uint32_t chan = conn->hdr[0] | (conn->hdr[1] << 8) |
+                        (conn->hdr[2] << 16) | ((uint32_t) conn->hdr[3] << 24);
+
+                    conn->channel = (chan == CFM_M_CHANNEL_V2) ? -1 : (int) chan;
+                }
+
+                conn->msg_len = conn->hdr[conn->hdr_len - 2] +
+                    (conn->hdr[conn->hdr_len - 1] << 8);
+
+                fprintf(stderr, "DEBUG: M message: Channel (%d) Length (%d)\n",
+                        conn->channel, conn->msg_len);
+
+                if (conn->msg_len < conn->hdr_len) {
+                    fprintf(stderr, "Error in message handling!\n");
+                    return -1;
+                }
+
+                free(conn->msg_buff);
+                /* One extra byte to NULL terminate just to be safe */
+                conn->msg_buff = malloc(conn->msg_len - conn->hdr_len + 1);
                 conn->msg_buff[0] = 0;
                 conn->msg_pos = 0;
-                conn->state = CFM_CONN_MSGBODY;
+                conn->state = (conn->msg_len == conn->hdr_len) ?
+                    CFM_CONN_MSGREADY : CFM_CONN_MSGBODY;
 
                 break;
             case CFM_CONN_MSGBODY:
-                conn->msg_buff[conn->msg_pos++] = buf[handled++];
-                if ((conn->msg_pos + 3) == conn->msg_len) {
+            {
+                int need = conn->msg_len - conn->hdr_len - conn->msg_pos;
+                int avail = res - handled;
+                int n = avail < need ? avail : need;
+
+                memcpy(&conn->msg_buff[conn->msg_pos], &buf[handled], n);
+                conn->msg_pos += n;
+                handled += n;
+
+                if (n == need) {
                     /* All bytes are in there! */
                     fprintf(stderr, "DEBUG: M message: All bytes there (%d)\n",
                             conn->msg_pos);
@@ -555,6 +940,7 @@ cfm_sockets_handle(int fd)
                 }
 
                 break;
+            }
             default:
                 fprintf(stderr, "Error in message handling!\n");
                 break;
@@ -566,22 +952,30 @@ cfm_sockets_handle(int fd)
 
             /* Re-init... */
             conn->state = CFM_CONN_INIT;
+            conn->msg_buff[conn->msg_pos] = 0;
 
-            if (conn->channel == CFM_M_CHANNEL) {
+            if (conn->channel == -1) {
                 /* Got a message on the control channel. Handle it here... */
 
-                return cfm_control_msg_handle(conn);
+                result = cfm_control_msg_handle(conn);
+                continue;
             }
 
             /* Message for the client... */
-            return conn->peer[conn->channel]->callback_msg(conn,
-                                                           conn->channel,
-                                                           conn->msg_len,
-                                                           conn->msg_buff,
-                                                           conn->peer[conn->
-                                                                      channel]->
-                                                           userData);
+            cfm_peer_t *p = cfm_peer_get(conn, conn->channel);
+
+            if (!p) {
+                fprintf(stderr, "Error: Message on closed channel %d\n",
+                        conn->channel);
+                continue;
+            }
+
+            result = p->callback_msg(conn, conn->channel,
+                                     conn->msg_pos, conn->msg_buff,
+                                     p->userData);
         }
+
+        return result;
     }
 
     return 0;
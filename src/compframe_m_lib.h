@@ -41,6 +41,28 @@ extern "C" {
 /** Maximum total length of an M message */
 #define CF_M_MAX_MESSAGE 2048
 
+/** Channel number used for M server to/from client communication when
+    protocol version 2 is used */
+#define CFM_M_CHANNEL_V2 0xFFFFFFFF
+
+/** Maximum number of channels per connection with protocol version 2 */
+#define CFM_MAX_CHANNELS_V2 0x100000
+
+/** Protocol version with 8-bit channel numbers. Used by default. */
+#define CF_M_VERSION_1 1
+/** Protocol version with 32-bit channel numbers */
+#define CF_M_VERSION_2 2
+/** Protocol version 2 with binary interface UUIDs */
+#define CF_M_VERSION_3 3
+
+/** Length of a binary UUID (protocol version 3) */
+#define CFM_UUID_BIN_LEN 16
+
+/** Frame header length with protocol version 1 */
+#define CFM_HDR_LEN_V1 3
+/** Frame header length with protocol version 2 */
+#define CFM_HDR_LEN_V2 6
+
 /*---- Commands used by clients towards M ----*/
 
 /** Message used for opening a channel towards a receiver
@@ -55,6 +77,9 @@ extern "C" {
     UUID   - 36 bytes
     NAME   - n  bytes
     @endverbatim
+
+    With protocol version 3, UUID is 16 bytes: the 32 hex digits of the
+    UUID as binary, most significant byte first.
 */
 #define CF_M_CHANNEL_OPEN  0
 
@@ -160,6 +185,72 @@ extern "C" {
 */
 #define CF_M_CHANNEL_ORDER_UNKNOWN 7
 
+/** Message used for selecting the protocol version of a connection.
+    It is always sent with version 1 framing, before any channel has been
+    opened. It is refused with CF_M_VERSION_FAIL while channels are open.
+    The response carries the accepted version in RESPONSE. Once
+    CF_M_VERSION_OK has been sent, both sides use the new framing.
+    @verbatim
+    +------+--------+--------+-------+---------+
+    | CHAN | LEN LB | LEN HB | ORDER | VERSION |
+    +------+--------+--------+-------+---------+
+    CHAN    - 1 byte (Here M command channel)
+    LEN LB  - 1 byte (Total length low byte)
+    LEN HB  - 1 byte (Total length high byte)
+    ORDER   - 1 byte (CF_M_VERSION)
+    VERSION - 1 byte (CF_M_VERSION_2)
+    @endverbatim
+
+    With version 2, all frames carry a 32-bit channel number (least
+    significant byte first) and the M command channel is CFM_M_CHANNEL_V2.
+    @verbatim
+    +----------+--------+--------+---------+
+    | CHAN 0-3 | LEN LB | LEN HB | MESSAGE |
+    +----------+--------+--------+---------+
+    @endverbatim
+
+    Channel numbers are then chosen by M, and all responses carry the
+    channel concerned. CF_M_CHANNEL_CLOSE takes a 32-bit channel number.
+    Version 3 uses the same framing as version 2, but CF_M_CHANNEL_OPEN
+    carries the interface UUID as CFM_UUID_BIN_LEN bytes.
+    @verbatim
+    +----------+--------+--------+-------+-----+----------+----------+------+---+
+    | CHAN 0-3 | LEN LB | LEN HB | ORDER | RES | RESPONSE | CHAN 0-3 | TEXT | 0 |
+    +----------+--------+--------+-------+-----+----------+----------+------+---+
+    @endverbatim
+*/
+#define CF_M_VERSION 8
+
+/** Response to CF_M_VERSION when the version was accepted */
+#define CF_M_VERSION_OK 9
+
+/** Response to CF_M_VERSION when the version was not accepted */
+#define CF_M_VERSION_FAIL 10
+
+/** Message used for subscribing to a topic. M answers with
+    CF_M_SUBSCRIBE_OK and a channel, just like for CF_M_CHANNEL_OPEN.
+    Everything published on the topic is then received on that channel.
+    The subscription ends when the channel is closed with
+    CF_M_CHANNEL_CLOSE.
+    @verbatim
+    +------+--------+--------+-------+-------+---+
+    | CHAN | LEN LB | LEN HB | ORDER | TOPIC | 0 |
+    +------+--------+--------+-------+-------+---+
+    CHAN   - 1 byte (Here M command channel)
+    LEN LB - 1 byte (Total length low byte)
+    LEN HB - 1 byte (Total length high byte)
+    ORDER  - 1 byte (CF_M_SUBSCRIBE)
+    TOPIC  - n bytes
+    @endverbatim
+*/
+#define CF_M_SUBSCRIBE 11
+
+/** Response to CF_M_SUBSCRIBE when the subscription was made */
+#define CF_M_SUBSCRIBE_OK 12
+
+/** Response to CF_M_SUBSCRIBE when the subscription failed */
+#define CF_M_SUBSCRIBE_FAIL 13
+
 /** Error code for 'component not found' */
 #define CF_M_COMP_NOT_FOUND  100
 /** Error code for 'Out of channels' */
@@ -216,6 +307,16 @@ void *cfm_connection_open(char *host, int port);
 int
 cfm_connection_sd_get(void *conn);
 
+/** Selects the M protocol version used on a connection. Must be called
+    before any channel is opened, and not while one is being opened. The
+    call blocks until M has answered.
+    @param conn    Pointer to connection
+    @param version CF_M_VERSION_1, CF_M_VERSION_2 or CF_M_VERSION_3
+    @return 1 if OK, 0 if not.
+*/
+int
+cfm_connection_version_set(void *conn, int version);
+
 /** Closes a connection to an M server
     @param conn Pointer to connection
     @return 1 if OK, 0 if not.
@@ -243,7 +344,27 @@ cfm_channel_open(void *conn,
                  cfm_callback_msg_t msgCB,
                  cfm_callback_error_t errorCB, void *userData);
 
-/** Opens a channel to an M receiver
+/** Subscribes to a topic. When M has answered, openCB is called with the
+    channel on which published messages will arrive. Close the channel to
+    end the subscription.
+    @param conn Pointer to connection
+    @param topic Name of topic
+    @param openCB  Callback that is called when subscription is made
+    @param closeCB Callback that is called when subscription is ended
+    @param msgCB   Callback that is called when a message is published
+    @param errorCB Callback that is called when an error occurs
+    @param userData User specific data.
+    @return 1 if OK, 0 if not
+*/
+int
+cfm_topic_subscribe(void *conn,
+                    const char *topic,
+                    cfm_callback_open_t openCB,
+                    cfm_callback_close_t closeCB,
+                    cfm_callback_msg_t msgCB,
+                    cfm_callback_error_t errorCB, void *userData);
+
+/** Closes a channel to an M receiver
     @param conn Pointer to connection
     @param chan Channel number
     @return 1 if OK, 0 if not
@@ -0,0 +1,651 @@
+/* Copyright (c) 2007  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+/*============================================================================*/
+/* INCLUDES                                                                   */
+/*============================================================================*/
+
+#include "compframe.h"
+#include "compframe_util.h"
+#include "compframe_metrics.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+/*============================================================================*/
+/* MACROS                                                                     */
+/*============================================================================*/
+
+/* The values of counters and histograms are kept in cells, one or more
+   per metric. Each thread has its own cells, so an update is an add to
+   memory that no other thread writes. A reader sums the cells of all
+   threads. The cells of a thread are allocated in chunks, when the
+   thread first updates a metric in the chunk. */
+
+/** log2 of the number of cells in a chunk */
+#define CF_METRIC_CHUNK_BITS 12
+
+/** Number of cells in a chunk */
+#define CF_METRIC_CHUNK (1 << CF_METRIC_CHUNK_BITS)
+
+/** Most chunks per thread */
+#define CF_METRIC_CHUNKS 256
+
+/** Cells of a histogram: count, sum, max and the buckets */
+#define CF_METRIC_HIST_CELLS (3 + CF_METRIC_BUCKETS)
+
+/*============================================================================*/
+/* TYPES                                                                      */
+/*============================================================================*/
+
+/** A metric */
+struct cf_metric_t {
+    /** Pointer to next  */
+    struct cf_metric_t *next;
+    /** Pointer to previous  */
+    struct cf_metric_t *prev;
+    /** Kind of metric */
+    cf_metric_type_t type;
+    /** Instance it belongs to */
+    char *comp;
+    /** Name */
+    char *name;
+    /** Labels, "" if none */
+    char *labels;
+    /** Description, "" if none */
+    char *help;
+    /** Number of times added */
+    int refs;
+    /** First cell (counters and histograms) */
+    uint32_t cell;
+    /** Number of cells */
+    uint32_t numCells;
+    /** Value of a gauge */
+    int64_t value;
+};
+
+/** The cells of a thread */
+typedef struct cf_metric_cells_t {
+    /** Pointer to next  */
+    struct cf_metric_cells_t *next;
+    /** Pointer to previous  */
+    struct cf_metric_cells_t *prev;
+    /** Chunks of cells, allocated when used */
+    uint64_t *chunks[CF_METRIC_CHUNKS];
+} cf_metric_cells_t;
+
+/** Cells of a removed metric, to be used again */
+typedef struct cf_metric_free_t {
+    /** Pointer to next  */
+    struct cf_metric_free_t *next;
+    /** First cell */
+    uint32_t cell;
+    /** Number of cells */
+    uint32_t numCells;
+} cf_metric_free_t;
+
+/*============================================================================*/
+/* VARIABLES                                                                  */
+/*============================================================================*/
+
+/** Protects everything but the updates */
+static pthread_mutex_t metricLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** List of metrics  */
+static cf_metric_t *metricHead = NULL;
+
+/** Number of metrics */
+static int numMetrics = 0;
+
+/** Cells of the running threads */
+static cf_metric_cells_t *cellsHead = NULL;
+
+/** What threads that have exited had counted */
+static cf_metric_cells_t retiredCells;
+
+/** Cells of the own thread */
+static __thread cf_metric_cells_t *ownCells = NULL;
+
+/** Used to fold the cells of a thread into retiredCells when it exits */
+static pthread_key_t cellsKey;
+static pthread_once_t cellsKeyOnce = PTHREAD_ONCE_INIT;
+
+/** Next cell never used */
+static uint32_t nextCell = 0;
+
+/** Cells of removed metrics */
+static cf_metric_free_t *freeCells = NULL;
+
+/*============================================================================*/
+/* FUNCTION DECLARATIONS                                                      */
+/*============================================================================*/
+
+static void
+cf_metric_cells_exit(void *arg);
+
+/*============================================================================*/
+/* FUNCTION DEFINITIONS                                                       */
+/*============================================================================*/
+
+static void
+cf_metric_key_init(void)
+{
+    pthread_key_create(&cellsKey, cf_metric_cells_exit);
+}
+
+/** Returns a chunk of a thread's cells, allocating it if needed.
+    Only the owning thread calls this, or any thread with metricLock held
+    for retiredCells. */
+static uint64_t *
+cf_metric_chunk(cf_metric_cells_t * c, uint32_t cell)
+{
+    uint64_t **slot = &c->chunks[cell >> CF_METRIC_CHUNK_BITS];
+    uint64_t *chunk = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    if (!chunk) {
+        chunk = calloc(CF_METRIC_CHUNK, sizeof(uint64_t));
+
+        if (!chunk) {
+            return NULL;
+        }
+
+        /* Readers may look at the chunk as soon as it is there */
+        __atomic_store_n(slot, chunk, __ATOMIC_RELEASE);
+    }
+
+    return &chunk[cell & (CF_METRIC_CHUNK - 1)];
+}
+
+/** Returns the cells of a metric in the own thread */
+static uint64_t *
+cf_metric_own(cf_metric_t * m)
+{
+    cf_metric_cells_t *c = ownCells;
+
+    if (!c) {
+        c = calloc(1, sizeof(cf_metric_cells_t));
+
+        if (!c) {
+            return NULL;
+        }
+
+        pthread_once(&cellsKeyOnce, cf_metric_key_init);
+        pthread_setspecific(cellsKey, c);
+
+        pthread_mutex_lock(&metricLock);
+        CF_LIST_ADD(cellsHead, c);
+        pthread_mutex_unlock(&metricLock);
+
+        ownCells = c;
+    }
+
+    return cf_metric_chunk(c, m->cell);
+}
+
+/** Adds to a cell that only the own thread writes */
+static inline void
+cf_metric_cell_add(uint64_t * cell, uint64_t n)
+{
+    __atomic_store_n(cell, __atomic_load_n(cell, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+/** Returns the cells of a metric in a thread, or NULL if the thread never
+    has updated anything near it (metricLock held) */
+static uint64_t *
+cf_metric_peek(cf_metric_cells_t * c, cf_metric_t * m)
+{
+    uint64_t *chunk =
+        __atomic_load_n(&c->chunks[m->cell >> CF_METRIC_CHUNK_BITS],
+                        __ATOMIC_ACQUIRE);
+
+    return chunk ? &chunk[m->cell & (CF_METRIC_CHUNK - 1)] : NULL;
+}
+
+/** Folds the cells of an exiting thread into retiredCells */
+static void
+cf_metric_cells_exit(void *arg)
+{
+    cf_metric_cells_t *c = arg;
+
+    pthread_mutex_lock(&metricLock);
+
+    for (cf_metric_t * m = metricHead; m != NULL; m = m->next) {
+        uint64_t *from = cf_metric_peek(c, m);
+        uint64_t *to;
+
+        if (!from || !m->numCells ||
+            (to = cf_metric_chunk(&retiredCells, m->cell)) == NULL) {
+            continue;
+        }
+
+        for (uint32_t i = 0; i < m->numCells; i++) {
+            if (m->type == CF_METRIC_HISTOGRAM && i == 2) {
+                /* The highest sample */
+                to[i] = from[i] > to[i] ? from[i] : to[i];
+            }
+            else {
+                to[i] += from[i];
+            }
+        }
+    }
+
+    CF_LIST_REMOVE(cellsHead, c);
+
+    pthread_mutex_unlock(&metricLock);
+
+    /* Should the thread update a metric after this, it gets new cells */
+    ownCells = NULL;
+
+    for (int i = 0; i < CF_METRIC_CHUNKS; i++) {
+        free(c->chunks[i]);
+    }
+
+    free(c);
+}
+
+/** Allocates cells for a metric (metricLock held)
+    @return 1 if OK, 0 if there are no more cells
+*/
+static int
+cf_metric_cells_alloc(cf_metric_t * m, uint32_t num)
+{
+    cf_metric_free_t **pf = &freeCells;
+
+    m->numCells = num;
+
+    /* Reuse cells of a removed metric of the same size */
+    for (; *pf != NULL; pf = &(*pf)->next) {
+        if ((*pf)->numCells == num) {
+            cf_metric_free_t *f = *pf;
+
+            m->cell = f->cell;
+            *pf = f->next;
+            free(f);
+            return 1;
+        }
+    }
+
+    /* The cells of a metric are kept in one chunk */
+    if ((nextCell & (CF_METRIC_CHUNK - 1)) + num > CF_METRIC_CHUNK) {
+        nextCell = (nextCell + CF_METRIC_CHUNK) & ~(CF_METRIC_CHUNK - 1);
+    }
+
+    if (nextCell + num > (uint32_t) CF_METRIC_CHUNKS * CF_METRIC_CHUNK) {
+        return 0;
+    }
+
+    m->cell = nextCell;
+    nextCell += num;
+
+    return 1;
+}
+
+/** Clears the cells of a removed metric in all threads, and keeps them
+    for reuse (metricLock held). The metric is not updated anymore, so no
+    thread writes the cells meanwhile. */
+static void
+cf_metric_cells_free(cf_metric_t * m)
+{
+    cf_metric_free_t *f = malloc(sizeof(cf_metric_free_t));
+    uint64_t *cells;
+
+    if (!f) {
+        /* The cells are lost */
+        return;
+    }
+
+    for (cf_metric_cells_t * c = cellsHead; c != NULL; c = c->next) {
+        if ((cells = cf_metric_peek(c, m)) != NULL) {
+            for (uint32_t i = 0; i < m->numCells; i++) {
+                __atomic_store_n(&cells[i], 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    if ((cells = cf_metric_peek(&retiredCells, m)) != NULL) {
+        memset(cells, 0, m->numCells * sizeof(uint64_t));
+    }
+
+    f->cell = m->cell;
+    f->numCells = m->numCells;
+    f->next = freeCells;
+    freeCells = f;
+}
+
+static void
+cf_metric_free(cf_metric_t * m)
+{
+    free(m->comp);
+    free(m->name);
+    free(m->labels);
+    free(m->help);
+    free(m);
+}
+
+cf_metric_t *
+cf_metric_add(cf_metric_type_t type, const char *comp, const char *name,
+              const char *labels, const char *help)
+{
+    cf_metric_t *m;
+
+    if (!comp || !name) {
+        cf_error_log(__FILE__, __LINE__, "Bad parameters!\n");
+        return NULL;
+    }
+
+    if (!labels) {
+        labels = "";
+    }
+
+    pthread_mutex_lock(&metricLock);
+
+    for (m = metricHead; m != NULL; m = m->next) {
+        if (!strcmp(m->comp, comp) && !strcmp(m->name, name) &&
+            !strcmp(m->labels, labels)) {
+            break;
+        }
+    }
+
+    if (m) {
+        if (m->type != type) {
+            cf_error_log(__FILE__, __LINE__,
+                         "Metric %s of %s already exists!\n", name, comp);
+            m = NULL;
+        }
+        else {
+            m->refs++;
+        }
+
+        pthread_mutex_unlock(&metricLock);
+        return m;
+    }
+
+    m = calloc(1, sizeof(cf_metric_t));
+
+    if (!m) {
+        pthread_mutex_unlock(&metricLock);
+        return NULL;
+    }
+
+    m->type = type;
+    m->comp = strdup(comp);
+    m->name = strdup(name);
+    m->labels = strdup(labels);
+    m->help = strdup(help ? help : "");
+    m->refs = 1;
+
+    if (!m->comp || !m->name || !m->labels || !m->help ||
+        (type != CF_METRIC_GAUGE &&
+         !cf_metric_cells_alloc(m, type == CF_METRIC_HISTOGRAM ?
+                                CF_METRIC_HIST_CELLS : 1))) {
+        cf_error_log(__FILE__, __LINE__,
+                     "Could not add metric %s of %s!\n", name, comp);
+        cf_metric_free(m);
+        pthread_mutex_unlock(&metricLock);
+        return NULL;
+    }
+
+    CF_LIST_ADD(metricHead, m);
+    numMetrics++;
+
+    pthread_mutex_unlock(&metricLock);
+
+    return m;
+}
+
+void
+cf_metric_remove(cf_metric_t * m)
+{
+    if (!m) {
+        return;
+    }
+
+    pthread_mutex_lock(&metricLock);
+
+    if (--m->refs > 0) {
+        pthread_mutex_unlock(&metricLock);
+        return;
+    }
+
+    CF_LIST_REMOVE(metricHead, m);
+    numMetrics--;
+
+    if (m->numCells) {
+        cf_metric_cells_free(m);
+    }
+
+    pthread_mutex_unlock(&metricLock);
+
+    cf_metric_free(m);
+}
+
+void
+cf_metric_inc(cf_metric_t * m, uint64_t n)
+{
+    uint64_t *cell;
+
+    if (m && (cell = cf_metric_own(m)) != NULL) {
+        cf_metric_cell_add(cell, n);
+    }
+}
+
+void
+cf_metric_set(cf_metric_t * m, int64_t value)
+{
+    if (m) {
+        __atomic_store_n(&m->value, value, __ATOMIC_RELAXED);
+    }
+}
+
+void
+cf_metric_add_to(cf_metric_t * m, int64_t n)
+{
+    if (m) {
+        __atomic_fetch_add(&m->value, n, __ATOMIC_RELAXED);
+    }
+}
+
+int
+cf_metric_bucket(uint64_t value)
+{
+    if (value < CF_METRIC_SUB) {
+        return (int) value;
+    }
+
+    int e = 63 - __builtin_clzll(value);
+
+    if (e >= CF_METRIC_MAX_EXP) {
+        return CF_METRIC_BUCKETS - 1;
+    }
+
+    return (e - CF_METRIC_SUB_BITS + 1) * CF_METRIC_SUB +
+        (int) ((value >> (e - CF_METRIC_SUB_BITS)) & (CF_METRIC_SUB - 1));
+}
+
+uint64_t
+cf_metric_bucket_limit(int idx)
+{
+    if (idx < CF_METRIC_SUB) {
+        return (uint64_t) idx;
+    }
+
+    if (idx >= CF_METRIC_BUCKETS - 1) {
+        return UINT64_MAX;
+    }
+
+    int shift = idx / CF_METRIC_SUB - 1;
+    uint64_t lowest = (uint64_t) (CF_METRIC_SUB + idx % CF_METRIC_SUB) << shift;
+
+    return lowest + (1ULL << shift) - 1;
+}
+
+void
+cf_metric_observe(cf_metric_t * m, uint64_t value)
+{
+    uint64_t *cells;
+
+    if (!m || (cells = cf_metric_own(m)) == NULL) {
+        return;
+    }
+
+    cf_metric_cell_add(&cells[0], 1);
+    cf_metric_cell_add(&cells[1], value);
+
+    if (value > cells[2]) {
+        __atomic_store_n(&cells[2], value, __ATOMIC_RELAXED);
+    }
+
+    cf_metric_cell_add(&cells[3 + cf_metric_bucket(value)], 1);
+}
+
+uint64_t
+cf_metric_percentile(const cf_metric_value_t * value, int permille)
+{
+    uint64_t want;
+    uint64_t seen = 0;
+
+    if (value->count == 0 || value->buckets == NULL) {
+        return 0;
+    }
+
+    want = (value->count * permille + 999) / 1000;
+
+    if (want == 0) {
+        want = 1;
+    }
+
+    for (int i = 0; i < value->numBuckets; i++) {
+        seen += value->buckets[i];
+
+        if (seen >= want) {
+            uint64_t limit = cf_metric_bucket_limit(i);
+
+            return limit < value->max ? limit : value->max;
+        }
+    }
+
+    return value->max;
+}
+
+/** Sums the cells of a metric in one thread into a value */
+static void
+cf_metric_sum(cf_metric_t * m, cf_metric_cells_t * c, cf_metric_value_t * v,
+              uint64_t * buckets)
+{
+    uint64_t *cells = cf_metric_peek(c, m);
+
+    if (!cells) {
+        return;
+    }
+
+    v->count += __atomic_load_n(&cells[0], __ATOMIC_RELAXED);
+
+    if (m->type != CF_METRIC_HISTOGRAM) {
+        return;
+    }
+
+    uint64_t max = __atomic_load_n(&cells[2], __ATOMIC_RELAXED);
+
+    v->sum += __atomic_load_n(&cells[1], __ATOMIC_RELAXED);
+
+    if (max > v->max) {
+        v->max = max;
+    }
+
+    for (int i = 0; i < CF_METRIC_BUCKETS; i++) {
+        buckets[i] += __atomic_load_n(&cells[3 + i], __ATOMIC_RELAXED);
+    }
+}
+
+/** Orders metrics on instance, name and labels */
+static int
+cf_metric_cmp(const void *a, const void *b)
+{
+    const cf_metric_t *x = *(const cf_metric_t * const *) a;
+    const cf_metric_t *y = *(const cf_metric_t * const *) b;
+    int res;
+
+    if ((res = strcmp(x->comp, y->comp)) != 0 ||
+        (res = strcmp(x->name, y->name)) != 0) {
+        return res;
+    }
+
+    return strcmp(x->labels, y->labels);
+}
+
+void
+cf_metrics_foreach(const char *comp, cf_metric_visit_t fp, void *userData)
+{
+    uint64_t buckets[CF_METRIC_BUCKETS];
+    cf_metric_t **sorted;
+    int num = 0;
+
+    pthread_mutex_lock(&metricLock);
+
+    sorted = malloc((numMetrics + 1) * sizeof(cf_metric_t *));
+
+    if (!sorted) {
+        pthread_mutex_unlock(&metricLock);
+        return;
+    }
+
+    for (cf_metric_t * m = metricHead; m != NULL; m = m->next) {
+        if (!comp || !strcmp(comp, m->comp)) {
+            sorted[num++] = m;
+        }
+    }
+
+    qsort(sorted, num, sizeof(cf_metric_t *), cf_metric_cmp);
+
+    for (int i = 0; i < num; i++) {
+        cf_metric_t *m = sorted[i];
+        cf_metric_value_t v;
+
+        memset(&v, 0, sizeof(v));
+        v.type = m->type;
+        v.comp = m->comp;
+        v.name = m->name;
+        v.labels = m->labels;
+        v.help = m->help;
+
+        if (m->type == CF_METRIC_GAUGE) {
+            v.value = __atomic_load_n(&m->value, __ATOMIC_RELAXED);
+        }
+        else {
+            if (m->type == CF_METRIC_HISTOGRAM) {
+                memset(buckets, 0, sizeof(buckets));
+                v.buckets = buckets;
+                v.numBuckets = CF_METRIC_BUCKETS;
+            }
+
+            for (cf_metric_cells_t * c = cellsHead; c != NULL; c = c->next) {
+                cf_metric_sum(m, c, &v, buckets);
+            }
+
+            cf_metric_sum(m, &retiredCells, &v, buckets);
+        }
+
+        fp(&v, userData);
+    }
+
+    pthread_mutex_unlock(&metricLock);
+
+    free(sorted);
+}
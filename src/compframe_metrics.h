@@ -0,0 +1,153 @@
+/* Copyright (c) 2007  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+#ifndef COMPFRAME_METRICS_H
+#define COMPFRAME_METRICS_H
+
+/*===========================================================================*/
+/* INCLUDES                                                                  */
+/*===========================================================================*/
+
+#include "compframe_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif                          /* __cplusplus */
+#if 0
+}
+#endif
+/*===========================================================================*/
+/* MACROS                                                                    */
+/*===========================================================================*/
+/** Buckets per power of two in histograms */
+#define CF_METRIC_SUB 16
+
+/** log2 of CF_METRIC_SUB */
+#define CF_METRIC_SUB_BITS 4
+
+/** Samples from 2^CF_METRIC_MAX_EXP and up go in the last bucket */
+#define CF_METRIC_MAX_EXP 40
+
+/** Number of buckets in a histogram, see cf_metric_bucket() */
+#define CF_METRIC_BUCKETS ((CF_METRIC_MAX_EXP - CF_METRIC_SUB_BITS + 1) * \
+                           CF_METRIC_SUB)
+
+/*===========================================================================*/
+/* PUBLIC FUNCTION DECLARATIONS                                              */
+/*===========================================================================*/
+/** @addtogroup Public API
+ *  These functions are part of the public API of CompFrame
+ *  @{
+ */
+/*---------------------------------------------------------------------------*/
+/* METRICS FUNCTIONS                                                         */
+/*---------------------------------------------------------------------------*/
+
+/* Counters and histograms are kept per thread, so updating them is a
+   plain add to memory of the own thread. They are summed over all
+   threads when read. All update functions accept NULL, so a component
+   does not have to check that its metrics could be added. */
+
+/** Adds a metric. If the same metric already exists, it is returned and
+    has to be removed as many times as it was added.
+    @param type     Kind of metric
+    @param comp     Instance (or part of CompFrame) it belongs to
+    @param name     Name, e.g. "msgs_in"
+    @param labels   Labels telling metrics of the same name apart, in the
+                    form name="value",... or NULL
+    @param help     Description, or NULL
+    @return The metric, or NULL if failure
+*/
+cf_metric_t *
+cf_metric_add(cf_metric_type_t type, const char *comp, const char *name,
+              const char *labels, const char *help);
+
+/** Removes a metric. It is freed when removed as many times as it was
+    added, so no other thread may update it by then, and it must not be
+    updated after this.
+    @param m        Metric from cf_metric_add()
+*/
+void
+cf_metric_remove(cf_metric_t *m);
+
+/** Adds to a counter
+    @param m        Counter
+    @param n        Amount to add
+*/
+void
+cf_metric_inc(cf_metric_t *m, uint64_t n);
+
+/** Sets a gauge
+    @param m        Gauge
+    @param value    New value
+*/
+void
+cf_metric_set(cf_metric_t *m, int64_t value);
+
+/** Adds to a gauge
+    @param m        Gauge
+    @param n        Amount to add, may be negative
+*/
+void
+cf_metric_add_to(cf_metric_t *m, int64_t n);
+
+/** Adds a sample to a histogram. Samples are kept in buckets that are
+    at most 1/16 of their value wide, from 0 to 2^40.
+    @param m        Histogram
+    @param value    Sample, e.g. a time in nanoseconds
+*/
+void
+cf_metric_observe(cf_metric_t *m, uint64_t value);
+
+/** Calls a function for every metric, sorted on instance, name and
+    labels. The function must not add or remove metrics.
+    @param comp     Only metrics of this instance, or NULL for all
+    @param fp       Function to call
+    @param userData Passed to fp
+*/
+void
+cf_metrics_foreach(const char *comp, cf_metric_visit_t fp, void *userData);
+
+/** Returns a percentile of a histogram
+    @param value    Histogram value, from cf_metrics_foreach()
+    @param permille Percentile in per mille, e.g. 990 for the 99th
+    @return The percentile, 0 if there are no samples
+*/
+uint64_t
+cf_metric_percentile(const cf_metric_value_t *value, int permille);
+
+/** Returns the bucket a histogram sample is counted in. Also for
+    histograms kept outside the metrics, as an array of CF_METRIC_BUCKETS
+    counts that cf_metric_percentile() can read.
+    @param value    Sample
+    @return Bucket index, 0 to CF_METRIC_BUCKETS - 1
+*/
+int
+cf_metric_bucket(uint64_t value);
+
+/** Returns the highest value that is counted in a histogram bucket
+    @param idx      Bucket index
+*/
+uint64_t
+cf_metric_bucket_limit(int idx);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* COMPFRAME_METRICS_H */
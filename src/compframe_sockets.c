@@ -22,8 +22,12 @@
 
 #include "compframe.h"
 #include "compframe_util.h"
+#include "compframe_sockets.h"
+#include "compframe_metrics.h"
+#include "compframe_watchdog.h"
 #include <sys/poll.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
@@ -33,13 +37,43 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#ifdef CF_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#endif
 
 /*============================================================================*/
 /* MACROS                                                                     */
 /*============================================================================*/
 
-/** Maximum sockets to poll */
-#define CF_MAX_SD 1024
+/** Entries in the io_uring submission queue. Not a limit on the number
+    of sockets; a full queue is submitted before more is queued. */
+#define CF_RING_ENTRIES 1024
+
+/** Entries in the io_uring completion queue. The kernel also sizes the
+    table it looks up poll requests in by this, which matters when many
+    sockets are deregistered. */
+#define CF_RING_CQ_ENTRIES 32768
+
+/** Poll timeout in milliseconds */
+#define CF_POLL_TIMEOUT 10
+
+/** Maximum events handled per call to cf_sockets_poll() (epoll) */
+#define CF_MAX_EVENTS 64
+
+/** Key used by epoll and io_uring to find a socket. The generation makes
+    sure that an event for a socket that has been deregistered is not
+    delivered to a new socket that got the same descriptor. */
+#define CF_SOCKET_KEY(s) (((uint64_t) (s)->gen << 32) | (uint32_t) (s)->sd)
 
 /*============================================================================*/
 /* TYPES                                                                      */
@@ -59,8 +93,42 @@ typedef struct cf_socket_t {
     void *comp;
     /** User data */
     void *userData;
+    /** Generation, see CF_SOCKET_KEY */
+    uint32_t gen;
+    /** Set if the descriptor cannot be waited for (epoll and regular
+        files). It is then always considered readable, as with poll(). */
+    int alwaysReady;
+    /** Index in pollFD (poll) */
+    int pollIdx;
 } cf_socket_t;
 
+/** A timer, see cf_timer_add() */
+typedef struct cf_timer_t {
+    /** When it expires (CLOCK_MONOTONIC, nanoseconds) */
+    uint64_t expires;
+    /** Identity given to the user */
+    uint64_t id;
+    /** Timer callback */
+    cf_timer_callback_t fp;
+    /** User data */
+    void *userData;
+} cf_timer_t;
+
+/** A polling backend */
+typedef struct cf_sock_backend_t {
+    /** Name, as given to cf_sockets_backend_set() */
+    const char *name;
+    /** Sets up the backend. Returns 1 if OK, 0 if not available. */
+    int (*init) (void);
+    /** Starts waiting for a socket. Returns 1 if OK, 0 if failure. */
+    int (*add) (cf_socket_t * s);
+    /** Stops waiting for a socket. Called when it has been removed from
+        the list, before it is freed. */
+    void (*del) (cf_socket_t * s);
+    /** Waits for events and calls the callbacks. */
+    int (*wait) (int timeout);
+} cf_sock_backend_t;
+
 /*============================================================================*/
 /* VARIABLES                                                                  */
 /*============================================================================*/
@@ -71,41 +139,707 @@ static cf_socket_t *socketHead = NULL;
 /** Number of registered sockets  */
 static int numRegistered = 0;
 
+/** Registered sockets indexed on descriptor */
+static cf_socket_t **socketTable = NULL;
+
+/** Size of socketTable */
+static int socketTableSize = 0;
+
+/** Last generation given to a socket */
+static uint32_t socketGen = 0;
+
+/** Backend in use, NULL until the first socket is registered */
+static const cf_sock_backend_t *backend = NULL;
+
 /** Poll array used for polling  */
-static struct pollfd pollFD[CF_MAX_SD];
+static struct pollfd *pollFD = NULL;
+
+/** Number of used entries in pollFD */
+static int numPollFD = 0;
+
+/** Generation of the sockets in pollFD */
+static uint32_t *pollGen = NULL;
+
+/** Allocated entries in pollFD and pollGen */
+static int pollFDSize = 0;
+
+/** Pending timers, a binary heap with the first to expire on top */
+static cf_timer_t *timerHeap = NULL;
+
+/** Number of pending timers */
+static int numTimers = 0;
+
+/** Size of timerHeap */
+static int timerHeapSize = 0;
+
+/** Last identity given to a timer */
+static uint64_t timerId = 0;
+
+/** Microseconds to busy poll after the last event, 0 if not busy polling */
+static int busyPollUs = 0;
+
+/** When the last event was handled (nanoseconds) */
+static uint64_t lastActive = 0;
+
+/** Polling statistics, lateness percentiles are taken from latHist */
+static cf_sockets_stats_t pollStats;
+
+/** Histogram of the timer lateness, see cf_metric_bucket() */
+static uint64_t latHist[CF_METRIC_BUCKETS];
+
+/** Metrics: socket events dispatched and sockets registered */
+static cf_metric_t *eventMetric = NULL;
+static cf_metric_t *regMetric = NULL;
+
+#ifdef __linux__
+/** The epoll descriptor */
+static int epollFD = -1;
+
+/** Number of sockets that epoll cannot wait for */
+static int numAlwaysReady = 0;
+#endif
 
 /*============================================================================*/
 /* FUNCTION DECLARATIONS                                                      */
 /*============================================================================*/
 
+static int
+cf_socket_dispatch(int sd, uint32_t gen, int readable);
+
+static int
+cf_sockets_init(void);
+
+static void
+cf_sockets_use(const cf_sock_backend_t * b);
+
+static int
+cf_timers_timeout(int max);
+
+static uint64_t
+cf_time_now(void);
+
+static void
+cf_timers_run(void);
+
+static int
+cf_sockets_spin(int timeout);
+
+/*============================================================================*/
+/* POLL BACKEND                                                               */
+/*============================================================================*/
+
+static int
+poll_init(void)
+{
+    return 1;
+}
+
+/* Sockets are added last in the polling array, and a removed socket is
+   replaced by the last one. This may be done while poll_wait() is going
+   through the array. A socket moved to a place already passed is then
+   not called this time, but since poll() reports a socket as long as
+   there is something to read, it is called in the next turn. */
+
+static int
+poll_add(cf_socket_t * s)
+{
+    if (numPollFD == pollFDSize) {
+        int size = pollFDSize ? pollFDSize * 2 : 64;
+        struct pollfd *fds = realloc(pollFD, size * sizeof(struct pollfd));
+        uint32_t *gens = realloc(pollGen, size * sizeof(uint32_t));
+
+        if (fds) {
+            pollFD = fds;
+        }
+        if (gens) {
+            pollGen = gens;
+        }
+        if (!fds || !gens) {
+            cf_error_log(__FILE__, __LINE__, "Out of memory!\n");
+            return 0;
+        }
+        pollFDSize = size;
+    }
+
+    pollFD[numPollFD].fd = s->sd;
+    pollFD[numPollFD].events = POLLIN;
+    pollFD[numPollFD].revents = 0;
+    pollGen[numPollFD] = s->gen;
+    s->pollIdx = numPollFD++;
+
+    return 1;
+}
+
+static void
+poll_del(cf_socket_t * s)
+{
+    int i = s->pollIdx;
+
+    if (i < 0) {
+        /* Never added */
+        return;
+    }
+
+    numPollFD--;
+
+    if (i != numPollFD) {
+        pollFD[i] = pollFD[numPollFD];
+        pollGen[i] = pollGen[numPollFD];
+        socketTable[pollFD[i].fd]->pollIdx = i;
+    }
+}
+
+static int
+poll_wait(int timeout)
+{
+    int res;
+
+    res = poll(pollFD, numPollFD, timeout);
+
+    if (res <= 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < numPollFD; i++) {
+        if (pollFD[i].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) {
+            cf_socket_dispatch(pollFD[i].fd, pollGen[i],
+                               pollFD[i].revents & POLLIN);
+        }
+    }
+
+    return res;
+}
+
+static const cf_sock_backend_t pollBackend = {
+    "poll", poll_init, poll_add, poll_del, poll_wait
+};
+
+/*============================================================================*/
+/* EPOLL BACKEND                                                              */
+/*============================================================================*/
+
+#ifdef __linux__
+
+static int
+epoll_init(void)
+{
+    epollFD = epoll_create1(EPOLL_CLOEXEC);
+
+    return epollFD != -1;
+}
+
+static int
+epoll_add(cf_socket_t * s)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = CF_SOCKET_KEY(s);
+
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, s->sd, &ev) == 0) {
+        return 1;
+    }
+
+    if (errno == EPERM) {
+        /* Regular file, e.g. stdin redirected from a file */
+        s->alwaysReady = 1;
+        numAlwaysReady++;
+        return 1;
+    }
+
+    cf_error_log(__FILE__, __LINE__, "epoll_ctl failed for %d (%s)\n",
+                 s->sd, strerror(errno));
+    return 0;
+}
+
+static void
+epoll_del(cf_socket_t * s)
+{
+    if (s->alwaysReady) {
+        numAlwaysReady--;
+        return;
+    }
+
+    /* Fails if the descriptor already is closed, which is fine */
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, s->sd, NULL);
+}
+
+static int
+epoll_wait_events(int timeout)
+{
+    struct epoll_event ev[CF_MAX_EVENTS];
+    int res;
+
+    res = epoll_wait(epollFD, ev, CF_MAX_EVENTS,
+                     numAlwaysReady ? 0 : timeout);
+
+    if (res < 0) {
+        res = 0;
+    }
+
+    for (int i = 0; i < res; i++) {
+        cf_socket_dispatch((int) (uint32_t) ev[i].data.u64,
+                           (uint32_t) (ev[i].data.u64 >> 32),
+                           ev[i].events & EPOLLIN);
+    }
+
+    if (numAlwaysReady) {
+        /* Collect them first, the callbacks may change the list */
+        int n = 0;
+
+        for (cf_socket_t * s = socketHead;
+             s != NULL && n < CF_MAX_EVENTS; s = s->next) {
+            if (s->alwaysReady) {
+                ev[n].data.u64 = CF_SOCKET_KEY(s);
+                n++;
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            cf_socket_dispatch((int) (uint32_t) ev[i].data.u64,
+                               (uint32_t) (ev[i].data.u64 >> 32), 1);
+        }
+
+        res += n;
+    }
+
+    return res ? res : -1;
+}
+
+static const cf_sock_backend_t epollBackend = {
+    "epoll", epoll_init, epoll_add, epoll_del, epoll_wait_events
+};
+
+#endif /* __linux__ */
+
+/*============================================================================*/
+/* IO_URING BACKEND                                                           */
+/*============================================================================*/
+
+#ifdef CF_HAVE_IO_URING
+
+/* One poll request per socket is kept in the ring. The requests are
+   one-shot and are re-armed after each completion: a multishot poll only
+   completes on new wakeups (edge-triggered), but the socket callbacks
+   expect to be called again as long as there is data left to read.
+   Re-arming costs no extra system call, since the new requests are
+   submitted by the same io_uring_enter() that waits for completions. */
+
+/** user_data for requests whose completion is not interesting */
+#define CF_RING_IGNORE (~(uint64_t) 0)
+
+/** The ring descriptor */
+static int ringFD = -1;
+
+/** Submission queue */
+static unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+static unsigned sqEntries;
+static struct io_uring_sqe *sqes;
+
+/** Number of queued, not yet submitted, requests */
+static unsigned sqPending = 0;
+
+/** Completion queue */
+static unsigned *cqHead, *cqTail, *cqMask;
+static struct io_uring_cqe *cqes;
+
+static int
+ring_enter(unsigned toSubmit, unsigned minComplete, unsigned flags,
+           void *arg, size_t argSize)
+{
+    return (int) syscall(__NR_io_uring_enter, ringFD, toSubmit, minComplete,
+                         flags, arg, argSize);
+}
+
+static void
+ring_submit(void)
+{
+    while (sqPending) {
+        int res = ring_enter(sqPending, 0, 0, NULL, 0);
+
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cf_error_log(__FILE__, __LINE__, "io_uring_enter failed (%s)\n",
+                         strerror(errno));
+            return;
+        }
+        sqPending -= res;
+    }
+}
+
+/** Returns a cleared submission queue entry */
+static struct io_uring_sqe *
+ring_sqe_get(void)
+{
+    unsigned tail = *sqTail;
+
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries) {
+        /* Full. Let the kernel consume what is there. */
+        ring_submit();
+    }
+
+    unsigned idx = tail & *sqMask;
+    struct io_uring_sqe *sqe = &sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[idx] = idx;
+
+    return sqe;
+}
+
+/** Makes the entry from ring_sqe_get() visible to the kernel */
+static void
+ring_sqe_push(void)
+{
+    __atomic_store_n(sqTail, *sqTail + 1, __ATOMIC_RELEASE);
+    sqPending++;
+}
+
+static int
+uring_init(void)
+{
+    struct io_uring_params p;
+    size_t sqSize, cqSize;
+    void *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = CF_RING_CQ_ENTRIES;
+
+    ringFD = (int) syscall(__NR_io_uring_setup, CF_RING_ENTRIES, &p);
+
+    if (ringFD < 0) {
+        return 0;
+    }
+
+    /* The timeout is passed to io_uring_enter() (Linux 5.11) */
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        close(ringFD);
+        ringFD = -1;
+        return 0;
+    }
+
+    sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqSize > sqSize) {
+            sqSize = cqSize;
+        }
+        cqSize = sqSize;
+    }
+
+    sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_SQ_RING);
+
+    if (sq == MAP_FAILED) {
+        close(ringFD);
+        ringFD = -1;
+        return 0;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    }
+    else {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_CQ_RING);
+    }
+
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFD,
+                IORING_OFF_SQES);
+
+    if (cq == MAP_FAILED || sqes == MAP_FAILED) {
+        /* The mappings go away with the process; just do not use them */
+        close(ringFD);
+        ringFD = -1;
+        return 0;
+    }
+
+    sqHead = (unsigned *) ((char *) sq + p.sq_off.head);
+    sqTail = (unsigned *) ((char *) sq + p.sq_off.tail);
+    sqMask = (unsigned *) ((char *) sq + p.sq_off.ring_mask);
+    sqArray = (unsigned *) ((char *) sq + p.sq_off.array);
+    sqEntries = p.sq_entries;
+
+    cqHead = (unsigned *) ((char *) cq + p.cq_off.head);
+    cqTail = (unsigned *) ((char *) cq + p.cq_off.tail);
+    cqMask = (unsigned *) ((char *) cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) ((char *) cq + p.cq_off.cqes);
+
+    return 1;
+}
+
+static int
+uring_add(cf_socket_t * s)
+{
+    struct io_uring_sqe *sqe = ring_sqe_get();
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s->sd;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    sqe->poll32_events = __builtin_bswap32(POLLIN);
+#else
+    sqe->poll32_events = POLLIN;
+#endif
+    sqe->user_data = CF_SOCKET_KEY(s);
+
+    ring_sqe_push();
+    return 1;
+}
+
+static void
+uring_del(cf_socket_t * s)
+{
+    struct io_uring_sqe *sqe = ring_sqe_get();
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = CF_SOCKET_KEY(s);
+    sqe->user_data = CF_RING_IGNORE;
+
+    ring_sqe_push();
+
+    /* Submit now. The poll request holds a reference to the socket, so
+       it would not be shut down by close() until the request is gone. */
+    ring_submit();
+}
+
+static int
+uring_wait(int timeout)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    int res;
+    int num = 0;
+
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000LL;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+
+    /* No timeout means waiting until something completes */
+    if (timeout >= 0) {
+        arg.ts = (uint64_t) (uintptr_t) & ts;
+    }
+
+    /* Submit re-armed polls and wait in the same call */
+    res = ring_enter(sqPending, 1,
+                     IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                     &arg, sizeof(arg));
+
+    if (res > 0) {
+        sqPending -= res;
+    }
+
+    unsigned head = *cqHead;
+
+    while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+        uint64_t key = cqe->user_data;
+        int events = cqe->res;
+
+        __atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+
+        if (key == CF_RING_IGNORE) {
+            continue;
+        }
+
+        int sd = (int) (uint32_t) key;
+        uint32_t gen = (uint32_t) (key >> 32);
+
+        if (sd >= socketTableSize || socketTable[sd] == NULL ||
+            socketTable[sd]->gen != gen) {
+            /* Deregistered; this is the cancelled request */
+            continue;
+        }
+
+        /* Re-arm first, the callback may deregister the socket */
+        uring_add(socketTable[sd]);
+
+        cf_socket_dispatch(sd, gen, events > 0 && (events & POLLIN));
+        num++;
+    }
+
+    return num ? num : -1;
+}
+
+static const cf_sock_backend_t uringBackend = {
+    "uring", uring_init, uring_add, uring_del, uring_wait
+};
+
+#endif /* CF_HAVE_IO_URING */
+
+/** Available backends, in order of preference */
+static const cf_sock_backend_t *backends[] = {
+#ifdef CF_HAVE_IO_URING
+    &uringBackend,
+#endif
+#ifdef __linux__
+    &epollBackend,
+#endif
+    &pollBackend,
+    NULL
+};
+
 /*============================================================================*/
 /* FUNCTION DEFINITIONS                                                       */
 /*============================================================================*/
 
+/** Calls the callback of a socket.
+    @param sd       Socket descriptor
+    @param gen      Generation the event was for
+    @param readable Non-zero if there is something to read, else closed
+    @return 1 if called, 0 if the socket no longer is registered
+*/
+static int
+cf_socket_dispatch(int sd, uint32_t gen, int readable)
+{
+    if (sd < 0 || sd >= socketTableSize) {
+        return 0;
+    }
+
+    cf_socket_t *s = socketTable[sd];
+
+    if (s == NULL || s->gen != gen) {
+        return 0;
+    }
+
+    cf_metric_inc(eventMetric, 1);
+
+    cf_watchdog_enter(CF_WATCH_SOCKET, s->comp, (void *) s->fp);
+    s->fp(s->comp, s->sd, s->userData,
+          readable ? CF_SOCKET_STUFF_TO_READ : CF_SOCKET_CLOSED);
+    cf_watchdog_leave();
+
+    return 1;
+}
+
+/** Selects the first backend that works, unless one already is selected.
+    @return 1 if OK, 0 if failure
+*/
+static int
+cf_sockets_init(void)
+{
+    if (backend) {
+        return 1;
+    }
+
+    for (int i = 0; backends[i] != NULL; i++) {
+        if (backends[i]->init()) {
+            cf_sockets_use(backends[i]);
+            cf_trace_log(__FILE__, __LINE__, CF_TRACE_INFO,
+                         "Using %s for socket polling.\n", backend->name);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/** Makes a backend the one used, and adds the metrics of the polling */
+static void
+cf_sockets_use(const cf_sock_backend_t * b)
+{
+    backend = b;
+
+    eventMetric = cf_metric_add(CF_METRIC_COUNTER, "sockets", "events",
+                                NULL, "Socket events dispatched");
+    regMetric = cf_metric_add(CF_METRIC_GAUGE, "sockets", "registered",
+                              NULL, "Sockets registered for polling");
+}
+
+int
+cf_sockets_backend_set(const char *name)
+{
+    if (backend) {
+        cf_error_log(__FILE__, __LINE__,
+                     "Socket polling already set up (%s)!\n", backend->name);
+        return 0;
+    }
+
+    for (int i = 0; backends[i] != NULL; i++) {
+        if (strcmp(backends[i]->name, name)) {
+            continue;
+        }
+
+        if (!backends[i]->init()) {
+            cf_error_log(__FILE__, __LINE__,
+                         "Socket polling with %s not available!\n", name);
+            return 0;
+        }
+
+        cf_sockets_use(backends[i]);
+        return 1;
+    }
+
+    cf_error_log(__FILE__, __LINE__, "Unknown socket polling (%s)!\n", name);
+    return 0;
+}
+
+const char *
+cf_sockets_backend_get(void)
+{
+    return backend ? backend->name : NULL;
+}
+
 int
 cf_socket_register(void *comp, int sd, cf_sock_callback_t fp, void *userData)
 {
-    if ((numRegistered + 1) == CF_MAX_SD) {
-        /* Maximum number reached */
-        cf_error_log(__FILE__, __LINE__, "Max number of sockets reached!\n");
+    if (sd < 0 || !cf_sockets_init()) {
         return 0;
     }
 
+    if (sd < socketTableSize && socketTable[sd] != NULL) {
+        cf_error_log(__FILE__, __LINE__, "Socket already registered (%d)!\n",
+                     sd);
+        return 0;
+    }
+
+    if (sd >= socketTableSize) {
+        int size = socketTableSize ? socketTableSize * 2 : 64;
+
+        while (size <= sd) {
+            size *= 2;
+        }
+
+        socketTable = realloc(socketTable, size * sizeof(cf_socket_t *));
+        memset(&socketTable[socketTableSize], 0,
+               (size - socketTableSize) * sizeof(cf_socket_t *));
+        socketTableSize = size;
+    }
+
     cf_socket_t *s = malloc(sizeof(cf_socket_t));
 
     s->sd = sd;
     s->comp = comp;
     s->userData = userData;
     s->fp = fp;
+    s->gen = ++socketGen;
+    s->alwaysReady = 0;
+    s->pollIdx = -1;
+
+#ifdef SO_BUSY_POLL
+    if (busyPollUs > 0) {
+        /* Only works for sockets, and may need CAP_NET_ADMIN */
+        (void) setsockopt(sd, SOL_SOCKET, SO_BUSY_POLL,
+                          &busyPollUs, sizeof(busyPollUs));
+    }
+#endif
 
     /* Add it to list */
     CF_LIST_ADD(socketHead, s);
+    socketTable[sd] = s;
+    numRegistered++;
+    cf_metric_set(regMetric, numRegistered);
 
-    /* Rebuild the polling array */
-    for (s = socketHead; s != NULL; s = s->next) {
-        pollFD[numRegistered].fd = s->sd;
-        pollFD[numRegistered].events = POLLIN;
-        numRegistered++;
+    if (!backend->add(s)) {
+        cf_socket_deregister(sd);
+        return 0;
     }
 
     return 1;
@@ -114,34 +848,25 @@ cf_socket_register(void *comp, int sd, cf_sock_callback_t fp, void *userData)
 int
 cf_socket_deregister(int sd)
 {
-    int found = 0;
-
-    for (cf_socket_t * s = socketHead; s != NULL; s = s->next) {
-        if (s->sd == sd) {
-            cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
-                         "Removed socket %d.\n", sd);
-            CF_LIST_REMOVE(socketHead, s);
-            /* Free used memory */
-            free(s);
-            found = 1;
-            break;
-        }
-    }
-
-    if (!found) {
+    if (sd < 0 || sd >= socketTableSize || socketTable[sd] == NULL) {
         cf_error_log(__FILE__, __LINE__, "Socket not found (%d)!\n", sd);
         return 0;
     }
 
-    numRegistered = 0;
-    /* Rebuild the polling array */
-    for (cf_socket_t * s = socketHead; s != NULL; s = s->next) {
-        cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
-                     "Socket %d is in list.\n", s->sd);
-        pollFD[numRegistered].fd = s->sd;
-        pollFD[numRegistered].events = POLLIN;
-        numRegistered++;
-    }
+    cf_socket_t *s = socketTable[sd];
+
+    cf_trace_log(__FILE__, __LINE__, CF_TRACE_DEBUG,
+                 "Removed socket %d.\n", sd);
+
+    socketTable[sd] = NULL;
+    CF_LIST_REMOVE(socketHead, s);
+    numRegistered--;
+    cf_metric_set(regMetric, numRegistered);
+
+    backend->del(s);
+
+    /* Free used memory */
+    free(s);
 
     return 1;
 }
@@ -149,35 +874,312 @@ cf_socket_deregister(int sd)
 int
 cf_sockets_poll(void)
 {
-    int res;
+    return cf_sockets_wait(CF_POLL_TIMEOUT);
+}
 
-    res = poll(pollFD, numRegistered, 10);
+int
+cf_sockets_wait(int timeout)
+{
+    int res;
 
-    if (res <= 0) {
+    if (!cf_sockets_init()) {
         return -1;
     }
 
-    for (int i = 0; i < numRegistered; i++) {
-        if (pollFD[i].revents == POLLIN || pollFD[i].revents == POLLHUP) {
-            for (cf_socket_t * s = socketHead; s != NULL; s = s->next) {
-                if (s->sd == pollFD[i].fd) {
-                    /* Found the one! Call its callback */
-                    if (pollFD[i].revents == POLLIN) {
-                        s->fp(s->comp, s->sd, s->userData,
-                              CF_SOCKET_STUFF_TO_READ);
-                    }
-                    else {
-                        s->fp(s->comp, s->sd, s->userData, CF_SOCKET_CLOSED);
-                    }
-                    break;
-                }
-            }
+    timeout = cf_timers_timeout(timeout);
+
+    if (busyPollUs > 0 && timeout != 0) {
+        res = cf_sockets_spin(timeout);
+    }
+    else {
+        if (timeout != 0) {
+            pollStats.blocks++;
         }
+
+        res = backend->wait(timeout);
     }
 
+    cf_timers_run();
+
     return res;
 }
 
+/** Polls without timeout as long as something has happened within the
+    last busyPollUs microseconds, and then blocks.
+    @param timeout  Longest wait in milliseconds, -1 for no limit
+    @return As backend->wait()
+*/
+static int
+cf_sockets_spin(int timeout)
+{
+    uint64_t start = cf_time_now();
+    uint64_t now = start;
+    uint64_t spin = (uint64_t) busyPollUs * 1000;
+    int res;
+
+    while (now - lastActive < spin) {
+        pollStats.spins++;
+
+        res = backend->wait(0);
+        now = cf_time_now();
+
+        if (res > 0) {
+            pollStats.spinHits++;
+            lastActive = now;
+            return res;
+        }
+
+        if ((timeout >= 0 && now - start >= (uint64_t) timeout * 1000000) ||
+            cf_timers_timeout(-1) == 0) {
+            return -1;
+        }
+    }
+
+    if (timeout > 0) {
+        uint64_t spent = (now - start) / 1000000;
+
+        timeout = spent < (uint64_t) timeout ? timeout - (int) spent : 0;
+    }
+
+    pollStats.blocks++;
+
+    res = backend->wait(cf_timers_timeout(timeout));
+
+    if (res > 0) {
+        lastActive = cf_time_now();
+    }
+
+    return res;
+}
+
+int
+cf_sockets_busy_poll_set(int us)
+{
+    if (us < 0) {
+        cf_error_log(__FILE__, __LINE__, "Bad busy poll time! (%d)\n", us);
+        return 0;
+    }
+
+    busyPollUs = us;
+    lastActive = cf_time_now();
+
+    return 1;
+}
+
+/** Returns a percentile of the timer lateness
+    @param permille Percentile in per mille, e.g. 990 for the 99th
+*/
+static uint64_t
+cf_lat_percentile(int permille)
+{
+    cf_metric_value_t v;
+
+    memset(&v, 0, sizeof(v));
+    v.type = CF_METRIC_HISTOGRAM;
+    v.count = pollStats.samples;
+    v.max = pollStats.max;
+    v.buckets = latHist;
+    v.numBuckets = CF_METRIC_BUCKETS;
+
+    return cf_metric_percentile(&v, permille);
+}
+
+void
+cf_sockets_stats_get(cf_sockets_stats_t *stats)
+{
+    *stats = pollStats;
+    stats->p50 = cf_lat_percentile(500);
+    stats->p99 = cf_lat_percentile(990);
+    stats->p999 = cf_lat_percentile(999);
+}
+
+void
+cf_sockets_stats_reset(void)
+{
+    memset(&pollStats, 0, sizeof(pollStats));
+    memset(latHist, 0, sizeof(latHist));
+}
+
+/*============================================================================*/
+/* TIMERS                                                                     */
+/*============================================================================*/
+
+/** Returns the monotonic time in nanoseconds */
+static uint64_t
+cf_time_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Swaps two entries of the timer heap */
+static void
+cf_timer_swap(int a, int b)
+{
+    cf_timer_t tmp = timerHeap[a];
+
+    timerHeap[a] = timerHeap[b];
+    timerHeap[b] = tmp;
+}
+
+/** Moves a timer towards the top of the heap until it is in place */
+static void
+cf_timer_up(int i)
+{
+    while (i > 0 && timerHeap[(i - 1) / 2].expires > timerHeap[i].expires) {
+        cf_timer_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/** Moves a timer towards the bottom of the heap until it is in place */
+static void
+cf_timer_down(int i)
+{
+    for (;;) {
+        int first = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+
+        if (l < numTimers && timerHeap[l].expires < timerHeap[first].expires) {
+            first = l;
+        }
+
+        if (r < numTimers && timerHeap[r].expires < timerHeap[first].expires) {
+            first = r;
+        }
+
+        if (first == i) {
+            return;
+        }
+
+        cf_timer_swap(i, first);
+        i = first;
+    }
+}
+
+/** Removes a timer from the heap */
+static void
+cf_timer_remove(int i)
+{
+    numTimers--;
+
+    if (i == numTimers) {
+        return;
+    }
+
+    timerHeap[i] = timerHeap[numTimers];
+    cf_timer_up(i);
+    cf_timer_down(i);
+}
+
+uint64_t
+cf_timer_add(int ms, cf_timer_callback_t fp, void *userData)
+{
+    if (!fp || ms < 0) {
+        return 0;
+    }
+
+    if (numTimers == timerHeapSize) {
+        int size = timerHeapSize ? timerHeapSize * 2 : 64;
+        cf_timer_t *heap = realloc(timerHeap, size * sizeof(cf_timer_t));
+
+        if (!heap) {
+            cf_error_log(__FILE__, __LINE__, "Could not add timer!\n");
+            return 0;
+        }
+
+        timerHeap = heap;
+        timerHeapSize = size;
+    }
+
+    cf_timer_t *t = &timerHeap[numTimers];
+
+    t->expires = cf_time_now() + (uint64_t) ms * 1000000ULL;
+    t->id = ++timerId;
+    t->fp = fp;
+    t->userData = userData;
+
+    cf_timer_up(numTimers++);
+
+    return timerId;
+}
+
+int
+cf_timer_cancel(uint64_t id)
+{
+    for (int i = 0; i < numTimers; i++) {
+        if (timerHeap[i].id == id) {
+            cf_timer_remove(i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/** Returns how long to wait for sockets, so that the first timer to
+    expire is not missed.
+    @param max  Longest wait in milliseconds, -1 for no limit
+    @return Milliseconds, -1 for no limit
+*/
+static int
+cf_timers_timeout(int max)
+{
+    if (numTimers == 0) {
+        return max;
+    }
+
+    uint64_t now = cf_time_now();
+
+    if (timerHeap[0].expires <= now) {
+        return 0;
+    }
+
+    /* Round up, since waking up early just means another turn */
+    uint64_t ms = (timerHeap[0].expires - now + 999999) / 1000000;
+
+    if (max >= 0 && ms >= (uint64_t) max) {
+        return max;
+    }
+
+    return ms < INT_MAX ? (int) ms : INT_MAX;
+}
+
+/** Runs the timers that have expired */
+static void
+cf_timers_run(void)
+{
+    if (numTimers == 0) {
+        return;
+    }
+
+    uint64_t now = cf_time_now();
+    uint64_t last = timerId;
+
+    /* Timers added by the callbacks wait for the next turn */
+    while (numTimers > 0 && timerHeap[0].expires <= now &&
+           timerHeap[0].id <= last) {
+        cf_timer_t t = timerHeap[0];
+        uint64_t late = cf_time_now() - t.expires;
+
+        latHist[cf_metric_bucket(late)]++;
+        pollStats.samples++;
+
+        if (late > pollStats.max) {
+            pollStats.max = late;
+        }
+
+        cf_timer_remove(0);
+        cf_watchdog_enter(CF_WATCH_TIMER, NULL, (void *) t.fp);
+        t.fp(t.userData);
+        cf_watchdog_leave();
+    }
+}
+
 /*** Utility functions */
 
 int
@@ -110,10 +110,77 @@ cf_socket_bytes_to_read(int sd);
 int
 cf_socket_reusable(int sd);
 
-/** Polls all the sockets  */
+/** Polls all the sockets, and runs the timers that have expired  */
 int
 cf_sockets_poll(void);
 
+/** Same as cf_sockets_poll(), but with a timeout of choice.
+    @param timeout  Longest wait in milliseconds, -1 to wait until a
+                    socket is readable or a timer expires
+*/
+int
+cf_sockets_wait(int timeout);
+
+/** Turns on busy polling. After something has happened, the sockets are
+    polled without timeout for a while before the main loop blocks in the
+    kernel again. This costs a CPU core, but removes the wakeup latency
+    while there is traffic. Sockets registered from now on also get
+    SO_BUSY_POLL, if the kernel allows it.
+    @param us   Microseconds to spin after the last event, 0 to turn off
+    @return 1 if OK, 0 if failure
+*/
+int
+cf_sockets_busy_poll_set(int us);
+
+/** Returns statistics of the socket polling. The lateness is how late the
+    timers are run, since a timer is the one event whose due time is
+    known. It is the wakeup latency of the main loop plus the time spent
+    in components before the timer could be run.
+    @param stats    Statistics (returned)
+*/
+void
+cf_sockets_stats_get(cf_sockets_stats_t *stats);
+
+/** Clears the statistics returned by cf_sockets_stats_get() */
+void
+cf_sockets_stats_reset(void);
+
+/** Selects how sockets are polled. Must be called before any socket is
+    registered. If not called, the first available of "uring" (io_uring),
+    "epoll" and "poll" is used.
+    @param name Name of the polling backend
+    @return 1 if OK, 0 if unknown or not available on this system
+*/
+int
+cf_sockets_backend_set(const char *name);
+
+/** Returns the name of the polling backend in use
+    @return The name, or NULL if none is selected yet
+*/
+const char *
+cf_sockets_backend_get(void);
+
+/*---------------------------------------------------------------------------*/
+/* TIMER FUNCTIONS                                                           */
+/*---------------------------------------------------------------------------*/
+
+/** Starts a one-shot timer. Timers are run by cf_sockets_poll(), so the
+    callback is called in the main loop, as soon as it is not busy.
+    @param ms       Milliseconds until the timer expires
+    @param fp       Function pointer to callback
+    @param userData User data that will be passed in the callback
+    @return Timer identity, or 0 if failure
+*/
+uint64_t
+cf_timer_add(int ms, cf_timer_callback_t fp, void *userData);
+
+/** Cancels a timer.
+    @param id   Timer identity from cf_timer_add()
+    @return 1 if OK, 0 if it has expired or was not found
+*/
+int
+cf_timer_cancel(uint64_t id);
+
 /** @} */
 
 #ifdef __cplusplus
@@ -52,6 +52,50 @@ typedef enum {
 typedef int (*cf_sock_callback_t) (void *comp, int sd, void *userData,
                                    cf_sock_event_t ev);
 
+/** Type used for timer callbacks */
+typedef void (*cf_timer_callback_t) (void *userData);
+
+/** Statistics of the socket polling, see cf_sockets_stats_get() */
+typedef struct {
+    uint64_t blocks;            /**< Waits that blocked in the kernel */
+    uint64_t spins;             /**< Polls without timeout when busy polling */
+    uint64_t spinHits;          /**< Busy polls that found something */
+    uint64_t samples;           /**< Number of timers run */
+    uint64_t p50;               /**< Median timer lateness (ns) */
+    uint64_t p99;               /**< 99th percentile lateness (ns) */
+    uint64_t p999;              /**< 99.9th percentile lateness (ns) */
+    uint64_t max;               /**< Highest lateness (ns) */
+} cf_sockets_stats_t;
+
+/** Kinds of metrics, see cf_metric_add() */
+typedef enum {
+    CF_METRIC_COUNTER = 0,      /**< Only goes up, e.g. messages received */
+    CF_METRIC_GAUGE = 1,        /**< Goes up and down, e.g. connections */
+    CF_METRIC_HISTOGRAM = 2     /**< Distribution, e.g. execution times */
+} cf_metric_type_t;
+
+/** A metric, see cf_metric_add() */
+typedef struct cf_metric_t cf_metric_t;
+
+/** Value of a metric, summed over all threads. See cf_metrics_foreach(). */
+typedef struct {
+    cf_metric_type_t type;      /**< Kind of metric */
+    const char *comp;           /**< Instance (or part) it belongs to */
+    const char *name;           /**< Name of the metric */
+    const char *labels;         /**< Labels, e.g. conn="5", or "" */
+    const char *help;           /**< Description */
+    uint64_t count;             /**< Counter value, or histogram samples */
+    int64_t value;              /**< Gauge value */
+    uint64_t sum;               /**< Sum of the histogram samples */
+    uint64_t max;               /**< Highest histogram sample */
+    const uint64_t *buckets;    /**< Histogram samples per bucket */
+    int numBuckets;             /**< Number of buckets */
+} cf_metric_value_t;
+
+/** Type used for visiting metrics, see cf_metrics_foreach() */
+typedef void (*cf_metric_visit_t) (const cf_metric_value_t *value,
+                                   void *userData);
+
 /** Type used when registering interfaces */
 typedef struct CfIfaceToReg {
     char *name;                 /**< Name of interface */
@@ -0,0 +1,357 @@
+/* Copyright (c) 2007  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+/*============================================================================*/
+/* INCLUDES                                                                   */
+/*============================================================================*/
+
+#define _GNU_SOURCE             /* dladdr() */
+#include "compframe.h"
+#include "compframe_metrics.h"
+#include "compframe_watchdog.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <unistd.h>
+
+/*============================================================================*/
+/* MACROS                                                                     */
+/*============================================================================*/
+
+/** Most stack frames printed */
+#define CF_WATCH_FRAMES 64
+
+/** Signal that makes the main loop print its stack */
+#define CF_WATCH_SIGNAL (SIGRTMIN + 1)
+
+/*============================================================================*/
+/* TYPES                                                                      */
+/*============================================================================*/
+
+/** A consistent copy of cfWatchState */
+typedef struct {
+    uint64_t seq;
+    uint64_t turns;
+    int kind;
+    void *comp;
+    void *fp;
+} cf_watch_snap_t;
+
+/*============================================================================*/
+/* VARIABLES                                                                  */
+/*============================================================================*/
+
+cf_watch_state_t cfWatchState;
+
+/** Stalls at least this long are reported (milliseconds) */
+static int watchMs = 0;
+
+/** Set if the stack of the main loop is printed */
+static int watchStack = 0;
+
+/** The thread running the main loop */
+static pthread_t mainThread;
+
+/** Names components */
+static cf_watch_namer_t watchNamer = NULL;
+
+/** Stalls reported */
+static cf_metric_t *stallMetric = NULL;
+
+/** What the main loop is doing, by cf_watch_kind_t */
+static const char *kindNames[] = {
+    "idle", "scheduler", "execute", "socket callback", "timer callback",
+    "actor"
+};
+
+/*============================================================================*/
+/* FUNCTION DECLARATIONS                                                      */
+/*============================================================================*/
+
+static void *
+cf_watchdog_run(void *arg);
+
+static void
+cf_watchdog_snap(cf_watch_snap_t * snap);
+
+static void
+cf_watchdog_describe(const cf_watch_snap_t * snap, char *buf, size_t len);
+
+static void
+cf_watchdog_stack(int sig);
+
+static uint64_t
+cf_watchdog_now(void);
+
+/*============================================================================*/
+/* FUNCTION DEFINITIONS                                                       */
+/*============================================================================*/
+
+int
+cf_watchdog_start(int ms, int stack)
+{
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    if (cfWatchState.on || ms <= 0) {
+        return 0;
+    }
+
+    watchMs = ms;
+    watchStack = stack;
+    mainThread = pthread_self();
+
+    if (stack) {
+        struct sigaction sa;
+        void *frames[1];
+
+        /* The first backtrace() loads libgcc, which must not be done in
+           the signal handler */
+        backtrace(frames, 1);
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = cf_watchdog_stack;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+
+        if (sigaction(CF_WATCH_SIGNAL, &sa, NULL) != 0) {
+            cf_error_log(__FILE__, __LINE__,
+                         "Could not set stack signal handler! (%s)\n",
+                         strerror(errno));
+            return 0;
+        }
+    }
+
+    stallMetric = cf_metric_add(CF_METRIC_COUNTER, "watchdog", "stalls",
+                                NULL, "Stalls of the main loop reported");
+
+    cfWatchState.on = 1;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&tid, &attr, cf_watchdog_run, NULL) != 0) {
+        cf_error_log(__FILE__, __LINE__,
+                     "Could not start watchdog thread!\n");
+        cfWatchState.on = 0;
+        pthread_attr_destroy(&attr);
+        return 0;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    cf_info_log("Reporting main loop stalls longer than %d ms.\n", ms);
+
+    return 1;
+}
+
+void
+cf_watchdog_namer_set(cf_watch_namer_t fp)
+{
+    watchNamer = fp;
+}
+
+/** Body of the watchdog thread. It looks at the main loop four times per
+    threshold, so a stall is reported at most a quarter late. */
+static void *
+cf_watchdog_run(void *arg)
+{
+    (void) arg;
+
+    int period = watchMs / 4;
+    struct timespec ts;
+
+    if (period < 1) {
+        period = 1;
+    }
+    if (period > 100) {
+        period = 100;
+    }
+
+    ts.tv_sec = period / 1000;
+    ts.tv_nsec = (period % 1000) * 1000000L;
+
+    cf_watch_snap_t last;
+    uint64_t since = cf_watchdog_now();
+    uint64_t turnSince = since;
+    uint64_t lastTurns;
+    int reported = 0;
+    int turnReported = 0;
+    char what[256];
+
+    cf_watchdog_snap(&last);
+    lastTurns = last.turns;
+
+    while (1) {
+        cf_watch_snap_t now;
+        uint64_t t;
+
+        nanosleep(&ts, NULL);
+
+        cf_watchdog_snap(&now);
+        t = cf_watchdog_now();
+
+        /* One thing taking too long */
+        if (now.seq != last.seq) {
+            if (reported) {
+                cf_watchdog_describe(&last, what, sizeof(what));
+                cf_error_log(__FILE__, __LINE__,
+                             "Main loop stall in %s ended after %llu ms.\n",
+                             what, (unsigned long long) (t - since));
+            }
+            last = now;
+            since = t;
+            reported = 0;
+        }
+        else if (now.kind != CF_WATCH_IDLE && !reported &&
+                 t - since >= (uint64_t) watchMs) {
+            cf_watchdog_describe(&now, what, sizeof(what));
+            cf_error_log(__FILE__, __LINE__,
+                         "Main loop stalled for %llu ms in %s!\n",
+                         (unsigned long long) (t - since), what);
+            cf_metric_inc(stallMetric, 1);
+            reported = 1;
+
+            if (watchStack) {
+                pthread_kill(mainThread, CF_WATCH_SIGNAL);
+            }
+        }
+
+        /* Many things taking too long together. If the current one has
+           taken long, wait and see if it is the culprit. */
+        if (now.turns != lastTurns || now.kind == CF_WATCH_IDLE) {
+            if (turnReported) {
+                cf_error_log(__FILE__, __LINE__,
+                             "Slow main loop turn ended after %llu ms.\n",
+                             (unsigned long long) (t - turnSince));
+            }
+            lastTurns = now.turns;
+            turnSince = t;
+            turnReported = 0;
+        }
+        else if (!turnReported && !reported &&
+                 t - turnSince >= (uint64_t) watchMs &&
+                 t - since < (uint64_t) watchMs / 2) {
+            cf_error_log(__FILE__, __LINE__,
+                         "Main loop turn has taken %llu ms, without a "
+                         "single culprit!\n",
+                         (unsigned long long) (t - turnSince));
+            cf_metric_inc(stallMetric, 1);
+            turnReported = 1;
+        }
+    }
+
+    return NULL;
+}
+
+/** Takes a consistent copy of the state of the main loop */
+static void
+cf_watchdog_snap(cf_watch_snap_t * snap)
+{
+    uint64_t seq;
+
+    do {
+        while ((seq = __atomic_load_n(&cfWatchState.seq, __ATOMIC_ACQUIRE))
+               & 1) {
+            sched_yield();
+        }
+
+        snap->seq = seq;
+        snap->turns = __atomic_load_n(&cfWatchState.turns, __ATOMIC_RELAXED);
+        snap->kind = __atomic_load_n(&cfWatchState.kind, __ATOMIC_RELAXED);
+        snap->comp = __atomic_load_n(&cfWatchState.comp, __ATOMIC_RELAXED);
+        snap->fp = __atomic_load_n(&cfWatchState.fp, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&cfWatchState.seq, __ATOMIC_RELAXED) != seq);
+}
+
+/** Describes what the main loop is doing, e.g.
+    "socket callback of M (handle_socket)" */
+static void
+cf_watchdog_describe(const cf_watch_snap_t * snap, char *buf, size_t len)
+{
+    const char *kind = "?";
+    const char *name = NULL;
+    const char *func = NULL;
+    Dl_info info;
+    int n;
+
+    if (snap->kind >= 0 &&
+        snap->kind < (int) (sizeof(kindNames) / sizeof(kindNames[0]))) {
+        kind = kindNames[snap->kind];
+    }
+
+    /* The name lives as long as the instance, which is the one stalling */
+    if (snap->comp && watchNamer) {
+        name = watchNamer(snap->comp);
+    }
+
+    if (snap->fp && dladdr(snap->fp, &info) && info.dli_sname) {
+        func = info.dli_sname;
+    }
+
+    n = snprintf(buf, len, "%s", kind);
+
+    if (name && n >= 0 && (size_t) n < len) {
+        n += snprintf(buf + n, len - n, " of %s", name);
+    }
+
+    if (n >= 0 && (size_t) n < len) {
+        if (func) {
+            snprintf(buf + n, len - n, " (%s)", func);
+        }
+        else if (snap->fp) {
+            snprintf(buf + n, len - n, " (%p)", snap->fp);
+        }
+    }
+}
+
+/** Prints the stack of the main loop, run by it when signalled */
+static void
+cf_watchdog_stack(int sig)
+{
+    (void) sig;
+
+    void *frames[CF_WATCH_FRAMES];
+    int n = backtrace(frames, CF_WATCH_FRAMES);
+    static const char head[] = "Stack of stalled main loop:\n";
+
+    if (write(STDERR_FILENO, head, sizeof(head) - 1) < 0) {
+        return;
+    }
+
+    backtrace_symbols_fd(frames, n, STDERR_FILENO);
+}
+
+/** Returns monotonic milliseconds */
+static uint64_t
+cf_watchdog_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,149 @@
+/* Copyright (c) 2007  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+#ifndef COMPFRAME_WATCHDOG_H
+#define COMPFRAME_WATCHDOG_H
+
+/*===========================================================================*/
+/* INCLUDES                                                                  */
+/*===========================================================================*/
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif                          /* __cplusplus */
+#if 0
+}
+#endif
+/*===========================================================================*/
+/* TYPES                                                                     */
+/*===========================================================================*/
+
+/** What the main loop is doing */
+typedef enum {
+    CF_WATCH_IDLE = 0,          /**< Waiting for something to happen */
+    CF_WATCH_LOOP = 1,          /**< Between the things below */
+    CF_WATCH_EXECUTE = 2,       /**< Executing a component */
+    CF_WATCH_SOCKET = 3,        /**< In a socket callback */
+    CF_WATCH_TIMER = 4,         /**< In a timer callback */
+    CF_WATCH_ACTOR = 5          /**< Delivering a message to an actor */
+} cf_watch_kind_t;
+
+/** Returns the instance name of a component, or NULL */
+typedef const char *(*cf_watch_namer_t) (void *comp);
+
+/** What the main loop is doing, written by the main loop and read by the
+    watchdog thread. Use the functions below. */
+typedef struct {
+    int on;                     /**< Set when the watchdog runs */
+    uint64_t seq;               /**< Bumped by every change */
+    uint64_t turns;             /**< Bumped at the end of each loop turn */
+    int kind;                   /**< A cf_watch_kind_t */
+    void *comp;                 /**< Component, if any */
+    void *fp;                   /**< Callback, if any */
+} cf_watch_state_t;
+
+/** State of the main loop */
+extern cf_watch_state_t cfWatchState;
+
+/*===========================================================================*/
+/* PUBLIC FUNCTION DECLARATIONS                                              */
+/*===========================================================================*/
+/** @addtogroup Public API
+ *  These functions are part of the public API of CompFrame
+ *  @{
+ */
+/*---------------------------------------------------------------------------*/
+/* WATCHDOG FUNCTIONS                                                        */
+/*---------------------------------------------------------------------------*/
+
+/* The main loop tells what it is doing with the inline functions below,
+   which are a couple of stores to memory. A thread looks at it a few
+   times per threshold. If the main loop has been busy with the same
+   thing, or in the same turn, for longer than the threshold, it is
+   reported with what it was doing. */
+
+/** Starts watching the calling thread, which runs the main loop
+    @param ms        Stalls at least this long are reported
+    @param stack     If not 0, the stack of the main loop is printed too
+    @return 1 if OK, 0 if failure
+*/
+int
+cf_watchdog_start(int ms, int stack);
+
+/** Sets the function used for naming components in reports
+    @param fp        Function
+*/
+void
+cf_watchdog_namer_set(cf_watch_namer_t fp);
+
+/** Publishes a change (main loop only). seq is odd while the change is
+    written, so the watchdog thread never sees half of one. */
+static inline void
+cf_watchdog_set(int kind, void *comp, void *fp)
+{
+    uint64_t seq = cfWatchState.seq;
+
+    __atomic_store_n(&cfWatchState.seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&cfWatchState.kind, kind, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfWatchState.comp, comp, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfWatchState.fp, fp, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfWatchState.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/** Tells that the main loop starts doing something
+    @param kind      What it is
+    @param comp      Component, or NULL
+    @param fp        Callback, or NULL
+*/
+static inline void
+cf_watchdog_enter(cf_watch_kind_t kind, void *comp, void *fp)
+{
+    if (cfWatchState.on) {
+        cf_watchdog_set(kind, comp, fp);
+    }
+}
+
+/** Tells that the main loop is done with what it entered */
+static inline void
+cf_watchdog_leave(void)
+{
+    if (cfWatchState.on) {
+        cf_watchdog_set(CF_WATCH_LOOP, 0, 0);
+    }
+}
+
+/** Tells that a turn of the main loop is done, and that it is going to
+    wait for something to happen */
+static inline void
+cf_watchdog_turn(void)
+{
+    if (cfWatchState.on) {
+        __atomic_store_n(&cfWatchState.turns, cfWatchState.turns + 1,
+                         __ATOMIC_RELAXED);
+        cf_watchdog_set(CF_WATCH_IDLE, 0, 0);
+    }
+}
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* COMPFRAME_WATCHDOG_H */
@@ -31,8 +31,11 @@
 class ITest : public IBase
 {
   public:
+    /** Identity of the interface */
+    static constexpr CFIfaceIdent IDENT{"ITest", TESTIFACE_ID};
+
     /** Constructor */
-    ITest() : IBase("ITest", TESTIFACE_ID) {}
+    ITest() : IBase(IDENT) {}
     /** Destructor */
     virtual ~ITest() {};
 
@@ -48,8 +51,11 @@ class ITest : public IBase
 class ITest2 : public IBase
 {
   public:
+    /** Identity of the interface */
+    static constexpr CFIfaceIdent IDENT{"ITest2", TEST2IFACE_ID};
+
     /** Constructor */
-    ITest2() : IBase("ITest2", TEST2IFACE_ID) {}
+    ITest2() : IBase(IDENT) {}
     /** Destructor */
     virtual ~ITest2() {};
 
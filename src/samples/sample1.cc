@@ -156,7 +156,7 @@ TestComp::connect(CFComponent* other, char* iface, int argc, char** argv)
     return 1;
   }
 
-  mConnection = (ITest2*) cfGetRegistry()->getIface(other,iface);
+  mConnection = cfGetRegistry()->getIface<ITest2>(other);
 
   if (!mConnection) {
     fprintf(stderr,
@@ -172,7 +172,7 @@ TestComp::connect(CFComponent* other, char* iface, int argc, char** argv)
   }
 
   /* Just call a function in the interface to show that it is possible */
-  if (mConnection->getId() == TEST2IFACE_ID) {
+  if (mConnection->is<ITest2>()) {
     mConnection->printGoodbye();
   }
 
@@ -0,0 +1,250 @@
+/* Copyright (c) 2007-2011  Peter R. Torpman (peter at torpman dot se)
+
+   This file is part of CompFrame (http://compframe.sourceforge.net)
+
+   CompFrame is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   CompFrame is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.or/licenses/>.
+*/
+
+/** @addtogroup samplecoro Sample Coroutine Component
+ *  @{
+ */
+
+/** This is a sample component, written with coroutines. It echoes what
+    M clients send to its receiver, and counts ticks that it sends itself
+    through a pipe. */
+#include "compframe.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <list>
+#include "IConfig.hh"
+#include "IMServer.hh"
+#include "CFComponentLib.hh"
+#include "IRegistry.hh"
+#include "CFCoro.hh"
+
+/** Interface of the receiver */
+#define CORO_UUID "5b7f6c1e-3d2a-4e8b-9f10-6a2c4d8e1b37"
+
+/** Name of the receiver */
+#define CORO_NAME "CORO_ECHO"
+
+/** Default milliseconds between ticks */
+#define CORO_INTERVAL 1000
+
+
+/* Predeclaration of function used later on. */
+static CFComponent* create_me(const char* inst_name);
+static void         set_me_up(CFComponent* comp);
+static int          destroy_me(CFComponent* comp);
+
+// The library container
+static CFComponentLib theLib("CORO", create_me, set_me_up, destroy_me);
+
+// Test component
+class CoroComp :
+  public CFComponent,
+  public CFMCoroClient,
+  public IConfigClient
+{
+public:
+  CoroComp(const char* instName) :
+    CFComponent(instName),
+    mName(instName), mServer(NULL), mInterval(CORO_INTERVAL), mTicks(0) {
+    mPipe[0] = mPipe[1] = -1;
+  }
+  virtual ~CoroComp();
+
+  // Starts the coroutines
+  void start(IMServer* srv);
+
+  // IConfigClient methods
+  int set(char* varName, char* varValue);
+
+private:
+  // Accepts channels, one session each
+  CFCoro server();
+  // Echoes the messages of a channel
+  CFCoro session(CFMChannel ch);
+  // Writes to the pipe once per interval
+  CFCoro ticker();
+  // Counts what comes through the pipe
+  CFCoro counter();
+
+  string mName;
+  IMServer* mServer;
+  int mInterval;
+  long mTicks;
+  int mPipe[2];
+  // The coroutines, freed before the pipe is closed
+  CFCoro mServerCoro;
+  CFCoro mTickerCoro;
+  CFCoro mCounterCoro;
+  list<CFCoro> mSessions;
+};
+
+
+/** This function must reside in all component libraries.
+    Here the component instance is
+*/
+extern "C" void
+dlopen_this(void)
+{
+  /* Use this function to get CORO into the Registry  */
+  cfGetRegistry()->registerLibrary(&theLib);
+}
+
+
+/** This function is used to create and initate a component.
+    @return Pointer to created instance or NULL
+*/
+static CFComponent*
+create_me(const char* inst_name)
+{
+  assert(inst_name!=NULL);
+
+  return new CoroComp(inst_name);
+}
+
+static int
+destroy_me(CFComponent* comp)
+{
+  if (!comp) {
+    return 1;
+  }
+
+  /* De-register our interfaces */
+  cfGetRegistry()->deregisterIfaces(comp);
+
+  delete (CoroComp*)comp;
+
+  return 0;
+}
+
+
+static void
+set_me_up(CFComponent* comp)
+{
+  CoroComp* t = (CoroComp*) comp;
+
+  cfGetRegistry()->registerIface(comp, (IMClient*)t);
+  cfGetRegistry()->registerIface(comp, (IConfigClient*)t);
+
+  t->start((IMServer*) cfGetRegistry()->getCompIface("M", "IMServer"));
+}
+
+
+CoroComp::~CoroComp()
+{
+  if (mServer) {
+    mServer->rmReceiver(CORO_UUID, (char*) CORO_NAME);
+  }
+
+  // Waiting coroutines give back their timers, sockets and channels
+  mSessions.clear();
+  mServerCoro.reset();
+  mTickerCoro.reset();
+  mCounterCoro.reset();
+
+  if (mPipe[0] != -1) {
+    close(mPipe[0]);
+    close(mPipe[1]);
+  }
+}
+
+void
+CoroComp::start(IMServer* srv)
+{
+  mServer = srv;
+
+  if (mServer &&
+      mServer->addReceiver(this, CORO_UUID, (char*) CORO_NAME, NULL)) {
+    mServerCoro = server();
+  }
+
+  if (pipe2(mPipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+    fprintf(stderr, "%s:%d Could not create pipe\n", __FILE__, __LINE__);
+    mPipe[0] = mPipe[1] = -1;
+    return;
+  }
+
+  mCounterCoro = counter();
+  mTickerCoro = ticker();
+}
+
+int
+CoroComp::set(char* varName, char* varValue)
+{
+  if (!strcmp(varName, "interval")) {
+    mInterval = atoi(varValue);
+    return 1;
+  }
+
+  return 0;
+}
+
+CFCoro
+CoroComp::server()
+{
+  for (;;) {
+    CFMChannel ch = co_await accept();
+
+    // Sessions that have ended are freed here
+    mSessions.remove_if([](const CFCoro& c) { return c.done(); });
+    mSessions.push_back(session(ch));
+  }
+}
+
+CFCoro
+CoroComp::session(CFMChannel ch)
+{
+  CFMMessage m;
+
+  while ((m = co_await receive(ch)).mLen >= 0) {
+    mServer->sendToReceiver(ch.mConn, ch.mChan, m.mLen, m.mMsg);
+  }
+}
+
+CFCoro
+CoroComp::ticker()
+{
+  for (;;) {
+    co_await CFSleep(mInterval);
+
+    if (write(mPipe[1], "t", 1) != 1) {
+      fprintf(stderr, "%s:%d Could not write to pipe\n", __FILE__, __LINE__);
+    }
+  }
+}
+
+CFCoro
+CoroComp::counter()
+{
+  char buf[64];
+  ssize_t n;
+
+  while (co_await CFReadable(mPipe[0]) == CF_SOCKET_STUFF_TO_READ) {
+    while ((n = read(mPipe[0], buf, sizeof(buf))) > 0) {
+      mTicks += n;
+    }
+
+    cf_trace_log(__FILE__, __LINE__, CF_TRACE_INFO,
+		 "%s: %ld ticks\n", mName.c_str(), mTicks);
+  }
+}
+
+
+/** @} */
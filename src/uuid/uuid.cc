@@ -38,9 +38,8 @@
 
 uuid::uuid()
 {
-  s_uuid = 0;
   uuid_create(&i_uuid, &e);
-  uuid_to_string(&i_uuid, (unsigned char **)&s_uuid, &e);
+  make_string();
 }
 
 //
@@ -55,13 +54,13 @@ uuid::uuid(const char * uuid_string)
 {
   if (uuid_string && strlen(uuid_string))
     {
-      s_uuid = strdup(uuid_string);      
-      uuid_from_string((unsigned char *)s_uuid, &i_uuid, &e);
+      uuid_from_string((unsigned char *)uuid_string, &i_uuid, &e);
+      if (e == uuid_s_ok) make_string();
     }
   else
     {
       uuid_create(&i_uuid, &e);
-      uuid_to_string(&i_uuid, (unsigned char **)&s_uuid, &e);
+      make_string();
     }
   if (e != uuid_s_ok) make_nil();
 }
@@ -74,7 +73,7 @@ uuid::uuid(const uuid_t c_uuid)
 {
   i_uuid = c_uuid;
 
-  uuid_to_string(&i_uuid, (unsigned char **)&s_uuid, &e);
+  make_string();
 
   if (e != uuid_s_ok) make_nil();
 }
@@ -86,8 +85,8 @@ uuid::uuid(const uuid_t c_uuid)
 uuid::uuid(const uuid& x)
 {
   i_uuid = x.i_uuid;
-  if (x.s_uuid)
-    s_uuid = strdup(x.s_uuid);
+  e = x.e;
+  memcpy(s_uuid, x.s_uuid, sizeof(s_uuid));
 }
 
 //
@@ -98,16 +97,10 @@ uuid&
 uuid::operator = (const uuid& rhs)
 {
   i_uuid = rhs.i_uuid;
-  if (s_uuid)
-    {
-      free(s_uuid);
-      s_uuid = strdup(rhs.s_uuid);
-    }
-  else {
-    s_uuid = NULL;
-  }
+  e = rhs.e;
+  memcpy(s_uuid, rhs.s_uuid, sizeof(s_uuid));
 
-  return (uuid&) rhs;
+  return *this;
 }
 
 
@@ -117,7 +110,6 @@ uuid::operator = (const uuid& rhs)
 
 uuid::~uuid()
 {
-  if (s_uuid) free(s_uuid);
 }
 
 //
@@ -260,7 +252,27 @@ void
 uuid::make_nil()
 {
   uuid_create_nil(&i_uuid, &e);
-  if (s_uuid) strcpy(s_uuid, "");
+  s_uuid[0] = 0;
+}
+
+//
+// make_string():    Fills in the string form. The string is kept in the
+//                   object, so copies do not allocate.
+//
+
+void
+uuid::make_string()
+{
+  char *tmp = 0;
+
+  uuid_to_string(&i_uuid, (unsigned char **)&tmp, &e);
+
+  if (e == uuid_s_ok && tmp)
+    strcpy(s_uuid, tmp);
+  else
+    s_uuid[0] = 0;
+
+  free(tmp);
 }
 
 
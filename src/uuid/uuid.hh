@@ -47,10 +47,11 @@ class uuid {
 private:
 
   uuid_t i_uuid;
-  char * s_uuid;
+  char   s_uuid[UUID_C_UUID_STRING_MAX];
   unsigned32 e;
 
   void make_nil();
+  void make_string();
 
 public:
 